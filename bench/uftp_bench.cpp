@@ -0,0 +1,678 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <uftp_defs.h>
+#include <uftp_utils.h>
+
+#include "uftp_netem.h"
+
+namespace {
+
+// Datagrams that haven't reached the server yet when the first request goes
+// out are just retransmitted, this only saves the wait.
+constexpr auto kServerStartup = std::chrono::milliseconds(100);
+constexpr uint64_t kGB = 1000000000ull;
+
+///////////////////////////////////////////////////////////////////////////////
+struct BenchOptions {
+  std::string out = "bench_results.json";
+  std::string dir = "bench_data";
+  std::string server_bin = "../server/uftp_server";
+  std::string client_bin = "../client/uftp_client";
+  std::vector<std::string> server_opts;
+  std::vector<std::string> client_opts;
+  uint16_t port = 9400;
+  std::vector<UftpImpairment> profiles;
+  std::vector<uint64_t> sizes;
+  std::vector<unsigned> counts;
+  std::vector<std::string> workloads;
+  // Get and put repeat until they've moved this much, up to max_ops times.
+  uint64_t case_bytes = 16 << 20;
+  unsigned max_ops = 50;
+  unsigned stat_ops = 100;
+  unsigned multi_ops = 3;
+  uint64_t multi_file_size = 4 << 10;
+  double op_timeout_s = 600.0;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+struct BenchCase {
+  std::string workload;
+  UftpImpairment impairment;
+  uint64_t file_size = 0;
+  unsigned file_count = 1;
+  unsigned ops = 1;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+struct BenchResult {
+  BenchCase bench_case;
+  bool ok = true;
+  std::string error;
+  double connect_ms = 0.0;
+  // Per operation, in the order run.
+  std::vector<double> latencies_ms;
+  uint64_t bytes = 0;
+  double seconds = 0.0;
+  double server_cpu_s = 0.0;
+  double client_cpu_s = 0.0;
+  UftpNetem::Stats netem;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+double Seconds(const timeval& time) {
+  return time.tv_sec + time.tv_usec / 1e6;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+double CpuSeconds(const rusage& usage) {
+  return Seconds(usage.ru_utime) + Seconds(usage.ru_stime);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+std::vector<std::string> Split(const std::string& list, char separator) {
+  std::vector<std::string> items;
+  std::istringstream stream(list);
+  std::string item;
+  while (std::getline(stream, item, separator)) {
+    if (!item.empty()) {
+      items.push_back(item);
+    }
+  }
+  return items;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// "1K", "16M", "10G" and so on, in powers of 1024.
+bool ParseSize(const std::string& text, uint64_t& size) {
+  char* end = nullptr;
+  size = std::strtoull(text.c_str(), &end, 10);
+  switch (*end) {
+    case 'K': size <<= 10; ++end; break;
+    case 'M': size <<= 20; ++end; break;
+    case 'G': size <<= 30; ++end; break;
+  }
+  return end != text.c_str() && *end == '\0' && size > 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+std::string SizeName(uint64_t size) {
+  const char* const suffixes[] = {"", "K", "M", "G"};
+  unsigned suffix = 0;
+  while (suffix < 3 && size % 1024 == 0 && size >= 1024) {
+    size /= 1024;
+    ++suffix;
+  }
+  return std::to_string(size) + suffixes[suffix];
+}
+
+///////////////////////////////////////////////////////////////////////////////
+double Percentile(std::vector<double> values, double percentile) {
+  if (values.empty()) {
+    return 0.0;
+  }
+  std::sort(values.begin(), values.end());
+  // Nearest rank.
+  std::size_t rank = (std::size_t)(percentile / 100.0 * values.size() + 0.999);
+  rank = std::min(std::max(rank, (std::size_t)1), values.size());
+  return values[rank - 1];
+}
+
+///////////////////////////////////////////////////////////////////////////////
+uint64_t FileSize(const std::string& filename) {
+  struct stat file_stat;
+  return stat(filename.c_str(), &file_stat) == 0 ? file_stat.st_size : 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// Fills filename with size incompressible bytes, unless it's already there.
+void MakeFile(const std::string& filename, uint64_t size) {
+  if (FileSize(filename) == size) {
+    return;
+  }
+  std::ofstream file(filename, std::ios::out | std::ios::binary);
+  std::vector<uint64_t> block((1 << 20) / sizeof(uint64_t));
+  uint64_t state = 0x9e3779b97f4a7c15ull ^ size;
+  for (uint64_t written = 0; written < size;) {
+    for (auto& word : block) {
+      // xorshift64
+      state ^= state << 13;
+      state ^= state >> 7;
+      state ^= state << 17;
+      word = state;
+    }
+    const uint64_t length =
+        std::min<uint64_t>(size - written, block.size() * sizeof(uint64_t));
+    file.write(reinterpret_cast<const char*>(block.data()), length);
+    written += length;
+  }
+  if (!file) {
+    std::cerr << "Couldn't write " << filename << "\n";
+    std::exit(1);
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+pid_t Spawn(const std::string& dir, const std::vector<std::string>& args,
+            int stdin_fd, int stdout_fd) {
+  const pid_t pid = UftpUtils::CheckErr(fork(), "Error forking");
+  if (pid == 0) {
+    if (chdir(dir.c_str()) != 0) {
+      std::_Exit(127);
+    }
+    const int null_fd = open("/dev/null", O_RDWR);
+    dup2(stdin_fd >= 0 ? stdin_fd : null_fd, STDIN_FILENO);
+    dup2(stdout_fd >= 0 ? stdout_fd : null_fd, STDOUT_FILENO);
+    dup2(null_fd, STDERR_FILENO);
+    std::vector<char*> argv;
+    for (const auto& arg : args) {
+      argv.push_back(const_cast<char*>(arg.c_str()));
+    }
+    argv.push_back(nullptr);
+    execv(argv[0], argv.data());
+    std::_Exit(127);
+  }
+  return pid;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// Drives uftp_client through its stdin the way a script would, and times
+/// each command from sending it until the client prompts for the next.
+class ScriptedClient {
+ public:
+  ScriptedClient(const BenchOptions& options, const std::string& dir,
+                 uint16_t port) {
+    int to_client[2], from_client[2];
+    UftpUtils::CheckErr(pipe(to_client), "Error creating pipe");
+    UftpUtils::CheckErr(pipe(from_client), "Error creating pipe");
+    std::vector<std::string> args = {options.client_bin, "127.0.0.1",
+                                     std::to_string(port)};
+    args.insert(args.end(), options.client_opts.begin(),
+                options.client_opts.end());
+    pid_ = Spawn(dir, args, to_client[0], from_client[1]);
+    close(to_client[0]);
+    close(from_client[1]);
+    stdin_fd_ = to_client[1];
+    stdout_fd_ = from_client[0];
+    timeout_ms_ = options.op_timeout_s * 1000;
+  }
+
+  ~ScriptedClient() {
+    if (stdin_fd_ >= 0) close(stdin_fd_);
+    if (stdout_fd_ >= 0) close(stdout_fd_);
+    if (pid_ > 0) {
+      kill(pid_, SIGKILL);
+      waitpid(pid_, nullptr, 0);
+    }
+  }
+
+  ///
+  /// \brief WaitForPrompt reads the client's output up to its next prompt.
+  /// \return false if the client exited or timed out first.
+  ///
+  bool WaitForPrompt(std::string& output) {
+    output.clear();
+    const auto deadline =
+        UftpClock::now() + std::chrono::milliseconds(timeout_ms_);
+    char buffer[4096];
+    while (output.size() < 3 ||
+           output.compare(output.size() - 3, 3, ">> ") != 0) {
+      const auto now = UftpClock::now();
+      if (now >= deadline) {
+        return false;
+      }
+      pollfd poll_fd = {stdout_fd_, POLLIN, 0};
+      const int wait_ms =
+          std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now)
+              .count();
+      if (poll(&poll_fd, 1, std::min(wait_ms, INT_MAX)) <= 0) {
+        continue;
+      }
+      const ssize_t length = read(stdout_fd_, buffer, sizeof(buffer));
+      if (length <= 0) {
+        return false;
+      }
+      output.append(buffer, length);
+    }
+    return true;
+  }
+
+  bool Send(const std::string& line) {
+    const std::string input = line + "\n";
+    return write(stdin_fd_, input.data(), input.size()) ==
+           (ssize_t)input.size();
+  }
+
+  /// Sends exit and reaps the client.
+  /// \return its CPU time.
+  double Exit() {
+    Send("exit");
+    close(stdin_fd_);
+    stdin_fd_ = -1;
+    return Reap();
+  }
+
+  double Reap() {
+    rusage usage;
+    std::memset(&usage, 0, sizeof(usage));
+    const auto deadline = UftpClock::now() + std::chrono::seconds(10);
+    while (wait4(pid_, nullptr, WNOHANG, &usage) == 0) {
+      if (UftpClock::now() >= deadline) {
+        kill(pid_, SIGKILL);
+        wait4(pid_, nullptr, 0, &usage);
+        break;
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    pid_ = -1;
+    return CpuSeconds(usage);
+  }
+
+ private:
+  pid_t pid_ = -1;
+  int stdin_fd_ = -1;
+  int stdout_fd_ = -1;
+  int64_t timeout_ms_ = 0;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+std::string GetName(uint64_t size) { return "get_" + SizeName(size) + ".bin"; }
+std::string PutName(uint64_t size) { return "put_" + SizeName(size) + ".bin"; }
+std::string MultiName(unsigned count, unsigned index) {
+  return "m" + std::to_string(count) + "_" + std::to_string(index) + ".bin";
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// Lays out the files a case needs, and clears away what an earlier case
+/// transferred.
+void PrepareCase(const BenchOptions& options, const BenchCase& bench_case,
+                 const std::string& server_dir,
+                 const std::string& client_dir) {
+  if (bench_case.workload == "get" || bench_case.workload == "stat") {
+    MakeFile(server_dir + "/" + GetName(bench_case.file_size),
+             bench_case.file_size);
+    std::remove((client_dir + "/" + GetName(bench_case.file_size)).c_str());
+  } else if (bench_case.workload == "put") {
+    MakeFile(client_dir + "/" + PutName(bench_case.file_size),
+             bench_case.file_size);
+    std::remove((server_dir + "/" + PutName(bench_case.file_size)).c_str());
+  } else if (bench_case.workload == "mget") {
+    for (unsigned index = 0; index < bench_case.file_count; ++index) {
+      MakeFile(server_dir + "/" + MultiName(bench_case.file_count, index),
+               bench_case.file_size);
+      std::remove(
+          (client_dir + "/" + MultiName(bench_case.file_count, index)).c_str());
+    }
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// Checks what a case transferred arrived whole, and removes it.
+bool CheckCase(const BenchCase& bench_case, const std::string& server_dir,
+               const std::string& client_dir) {
+  bool ok = true;
+  if (bench_case.workload == "get") {
+    const std::string filename =
+        client_dir + "/" + GetName(bench_case.file_size);
+    ok = FileSize(filename) == bench_case.file_size;
+    std::remove(filename.c_str());
+  } else if (bench_case.workload == "put") {
+    const std::string filename =
+        server_dir + "/" + PutName(bench_case.file_size);
+    ok = FileSize(filename) == bench_case.file_size;
+    std::remove(filename.c_str());
+  } else if (bench_case.workload == "mget") {
+    for (unsigned index = 0; index < bench_case.file_count; ++index) {
+      const std::string filename =
+          client_dir + "/" + MultiName(bench_case.file_count, index);
+      ok = ok && FileSize(filename) == bench_case.file_size;
+      std::remove(filename.c_str());
+    }
+  }
+  return ok;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+std::string CommandFor(const BenchCase& bench_case) {
+  if (bench_case.workload == "stat") {
+    return "stat " + GetName(bench_case.file_size);
+  } else if (bench_case.workload == "get") {
+    return "get " + GetName(bench_case.file_size);
+  } else if (bench_case.workload == "put") {
+    return "put " + PutName(bench_case.file_size);
+  }
+  return "mget m" + std::to_string(bench_case.file_count) + "_*";
+}
+
+///////////////////////////////////////////////////////////////////////////////
+BenchResult RunCase(const BenchOptions& options, const BenchCase& bench_case) {
+  BenchResult result;
+  result.bench_case = bench_case;
+  const std::string server_dir = options.dir + "/server";
+  const std::string client_dir = options.dir + "/client";
+  PrepareCase(options, bench_case, server_dir, client_dir);
+
+  // Client -> proxy on port + 1 -> server on port.
+  std::vector<std::string> server_args = {options.server_bin,
+                                          std::to_string(options.port)};
+  server_args.insert(server_args.end(), options.server_opts.begin(),
+                     options.server_opts.end());
+  const pid_t server_pid = Spawn(server_dir, server_args, -1, -1);
+  UftpNetem netem(options.port + 1, options.port, bench_case.impairment);
+  netem.Open();
+  netem.Start();
+  std::this_thread::sleep_for(kServerStartup);
+
+  const auto start = UftpClock::now();
+  ScriptedClient client(options, client_dir, options.port + 1);
+  std::string output;
+  if (!client.WaitForPrompt(output)) {
+    result.ok = false;
+    result.error = "client didn't start";
+  }
+  result.connect_ms =
+      std::chrono::duration<double, std::milli>(UftpClock::now() - start)
+          .count();
+
+  const std::string command = CommandFor(bench_case);
+  for (unsigned op = 0; result.ok && op < bench_case.ops; ++op) {
+    const auto op_start = UftpClock::now();
+    if (!client.Send(command) || !client.WaitForPrompt(output)) {
+      result.ok = false;
+      result.error = "timed out on: " + command;
+      break;
+    }
+    result.latencies_ms.push_back(
+        std::chrono::duration<double, std::milli>(UftpClock::now() - op_start)
+            .count());
+    if (output.find("File not found") != std::string::npos ||
+        output.find("Unknown") != std::string::npos) {
+      result.ok = false;
+      result.error = "failed: " + command;
+    }
+  }
+  result.client_cpu_s = result.ok ? client.Exit() : client.Reap();
+
+  rusage usage;
+  std::memset(&usage, 0, sizeof(usage));
+  kill(server_pid, SIGTERM);
+  wait4(server_pid, nullptr, 0, &usage);
+  result.server_cpu_s = CpuSeconds(usage);
+  netem.Stop();
+  result.netem = netem.GetStats();
+
+  if (!CheckCase(bench_case, server_dir, client_dir) && result.ok) {
+    result.ok = false;
+    result.error = "transferred file is incomplete";
+  }
+  for (const double latency_ms : result.latencies_ms) {
+    result.seconds += latency_ms / 1000;
+  }
+  if (bench_case.workload != "stat") {
+    result.bytes = bench_case.file_size * bench_case.file_count *
+                   result.latencies_ms.size();
+  }
+  return result;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+std::vector<BenchCase> PlanCases(const BenchOptions& options) {
+  std::vector<BenchCase> cases;
+  for (const auto& impairment : options.profiles) {
+    for (const auto& workload : options.workloads) {
+      BenchCase bench_case;
+      bench_case.workload = workload;
+      bench_case.impairment = impairment;
+      if (workload == "stat") {
+        bench_case.file_size = options.sizes.front();
+        bench_case.ops = options.stat_ops;
+        cases.push_back(bench_case);
+      } else if (workload == "get" || workload == "put") {
+        for (const uint64_t size : options.sizes) {
+          bench_case.file_size = size;
+          bench_case.ops = std::max<uint64_t>(
+              1,
+              std::min<uint64_t>(options.max_ops, options.case_bytes / size));
+          cases.push_back(bench_case);
+        }
+      } else if (workload == "mget") {
+        for (const unsigned count : options.counts) {
+          bench_case.file_size = options.multi_file_size;
+          bench_case.file_count = count;
+          bench_case.ops = options.multi_ops;
+          cases.push_back(bench_case);
+        }
+      }
+    }
+  }
+  return cases;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void WriteJson(const BenchOptions& options,
+               const std::vector<BenchResult>& results, std::ostream& out) {
+  out << std::fixed << std::setprecision(3);
+  out << "{\n  \"schema\": 1,\n  \"timestamp\": " << std::time(nullptr)
+      << ",\n  \"server_opts\": \"";
+  for (const auto& opt : options.server_opts) out << opt << " ";
+  out << "\",\n  \"client_opts\": \"";
+  for (const auto& opt : options.client_opts) out << opt << " ";
+  out << "\",\n  \"cases\": [";
+  for (std::size_t index = 0; index < results.size(); ++index) {
+    const BenchResult& result = results[index];
+    const BenchCase& bench_case = result.bench_case;
+    const UftpImpairment& impairment = bench_case.impairment;
+    const double gigabytes = (double)result.bytes / kGB;
+    out << (index == 0 ? "\n" : ",\n") << "    {\"workload\": \""
+        << bench_case.workload << "\", \"profile\": \"" << impairment.name
+        << "\",\n     \"impairment\": {\"delay_ms\": " << impairment.delay_ms
+        << ", \"jitter_ms\": " << impairment.jitter_ms
+        << ", \"loss\": " << impairment.loss
+        << ", \"reorder\": " << impairment.reorder
+        << ", \"duplicate\": " << impairment.duplicate << "},\n"
+        << "     \"file_size\": " << bench_case.file_size
+        << ", \"file_count\": " << bench_case.file_count
+        << ", \"ops\": " << result.latencies_ms.size()
+        << ", \"ok\": " << (result.ok ? "true" : "false")
+        << ", \"error\": \"" << result.error << "\",\n"
+        << "     \"bytes\": " << result.bytes
+        << ", \"seconds\": " << result.seconds << ", \"goodput_mbps\": "
+        << (result.seconds > 0 ? result.bytes * 8 / result.seconds / 1e6 : 0.0)
+        << ",\n     \"latency_ms\": {\"connect\": " << result.connect_ms
+        << ", \"p50\": " << Percentile(result.latencies_ms, 50)
+        << ", \"p99\": " << Percentile(result.latencies_ms, 99)
+        << ", \"p999\": " << Percentile(result.latencies_ms, 99.9)
+        << ", \"max\": " << Percentile(result.latencies_ms, 100) << "},\n"
+        << "     \"wire\": {\"datagrams\": " << result.netem.datagrams
+        << ", \"bytes\": " << result.netem.bytes
+        << ", \"data_chunks\": " << result.netem.data_chunks
+        << ", \"retransmits\": " << result.netem.retransmits
+        << ", \"dropped\": " << result.netem.dropped
+        << ", \"duplicated\": " << result.netem.duplicated
+        << ", \"reordered\": " << result.netem.reordered << "},\n"
+        << "     \"cpu_s\": {\"server\": " << result.server_cpu_s
+        << ", \"client\": " << result.client_cpu_s << "}"
+        << ", \"cpu_s_per_gb\": {\"server\": "
+        << (gigabytes > 0 ? result.server_cpu_s / gigabytes : 0.0)
+        << ", \"client\": "
+        << (gigabytes > 0 ? result.client_cpu_s / gigabytes : 0.0) << "}}";
+  }
+  out << "\n  ]\n}\n";
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void PrintSummary(const BenchResult& result) {
+  const BenchCase& bench_case = result.bench_case;
+  std::cout << std::left << std::setw(10) << bench_case.impairment.name
+            << std::setw(5) << bench_case.workload << std::right
+            << std::setw(6) << SizeName(bench_case.file_size) << " x"
+            << std::setw(5) << bench_case.file_count << std::fixed
+            << std::setprecision(2) << "  ops " << std::setw(4)
+            << result.latencies_ms.size() << "  p50 " << std::setw(9)
+            << Percentile(result.latencies_ms, 50) << " ms  p99 "
+            << std::setw(9) << Percentile(result.latencies_ms, 99)
+            << " ms  " << std::setw(9)
+            << (result.seconds > 0 ? result.bytes * 8 / result.seconds / 1e6
+                                   : 0.0)
+            << " Mbit/s  retx " << result.netem.retransmits
+            << (result.ok ? "" : "  FAILED: " + result.error) << std::endl;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void PrintUsage() {
+  std::cout
+      << "uftp_bench: bad argument\n\tUsage: uftp_bench [--out <file>] "
+         "[--dir <scratch dir>] [--port <port>] [--profiles "
+         "clean,lan,wan,lossy,satellite,custom] [--sizes 1K,64K,1M,...] "
+         "[--counts 100,1000] [--workloads stat,get,put,mget] "
+         "[--case-bytes <bytes>] [--max-ops <count>] [--timeout <s>] "
+         "[--delay <ms>] [--jitter <ms>] [--loss <p>] [--reorder <p>] "
+         "[--duplicate <p>] [--server-bin <path>] [--client-bin <path>] "
+         "[--server-opts \"<opts>\"] [--client-opts \"<opts>\"]\n";
+  std::exit(1);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+std::string AbsolutePath(const std::string& path) {
+  char resolved[PATH_MAX];
+  if (realpath(path.c_str(), resolved) == nullptr) {
+    std::cerr << "Couldn't find " << path << "\n";
+    std::exit(1);
+  }
+  return resolved;
+}
+
+}  // namespace
+
+///////////////////////////////////////////////////////////////////////////////
+int main(int argc, char** argv) {
+  if (argc % 2 != 1) {
+    PrintUsage();
+  }
+
+  BenchOptions options;
+  std::string profiles = "clean,lan,wan";
+  std::string sizes = "1K,64K,1M,16M";
+  std::string counts = "100,1000";
+  std::string workloads = "stat,get,put,mget";
+  UftpImpairment custom;
+  custom.name = "custom";
+  for (int arg = 1; arg < argc; arg += 2) {
+    const std::string option = argv[arg];
+    const std::string value = argv[arg + 1];
+    if (option == "--out") {
+      options.out = value;
+    } else if (option == "--dir") {
+      options.dir = value;
+    } else if (option == "--port") {
+      options.port = std::strtoul(value.c_str(), nullptr, 10);
+    } else if (option == "--profiles") {
+      profiles = value;
+    } else if (option == "--sizes") {
+      sizes = value;
+    } else if (option == "--counts") {
+      counts = value;
+    } else if (option == "--workloads") {
+      workloads = value;
+    } else if (option == "--case-bytes") {
+      if (!ParseSize(value, options.case_bytes)) PrintUsage();
+    } else if (option == "--max-ops") {
+      options.max_ops = std::max(1ul, std::strtoul(value.c_str(), nullptr, 10));
+    } else if (option == "--timeout") {
+      options.op_timeout_s = std::strtod(value.c_str(), nullptr);
+    } else if (option == "--delay") {
+      custom.delay_ms = std::strtod(value.c_str(), nullptr);
+    } else if (option == "--jitter") {
+      custom.jitter_ms = std::strtod(value.c_str(), nullptr);
+    } else if (option == "--loss") {
+      custom.loss = std::strtod(value.c_str(), nullptr);
+    } else if (option == "--reorder") {
+      custom.reorder = std::strtod(value.c_str(), nullptr);
+    } else if (option == "--duplicate") {
+      custom.duplicate = std::strtod(value.c_str(), nullptr);
+    } else if (option == "--server-bin") {
+      options.server_bin = value;
+    } else if (option == "--client-bin") {
+      options.client_bin = value;
+    } else if (option == "--server-opts") {
+      options.server_opts = Split(value, ' ');
+    } else if (option == "--client-opts") {
+      options.client_opts = Split(value, ' ');
+    } else {
+      PrintUsage();
+    }
+  }
+
+  for (const auto& name : Split(profiles, ',')) {
+    UftpImpairment impairment;
+    if (name == "custom") {
+      impairment = custom;
+    } else if (!UftpImpairment::FromName(name, impairment)) {
+      PrintUsage();
+    }
+    options.profiles.push_back(impairment);
+  }
+  for (const auto& name : Split(sizes, ',')) {
+    uint64_t size = 0;
+    if (!ParseSize(name, size)) PrintUsage();
+    options.sizes.push_back(size);
+  }
+  for (const auto& name : Split(counts, ',')) {
+    options.counts.push_back(std::strtoul(name.c_str(), nullptr, 10));
+  }
+  options.workloads = Split(workloads, ',');
+  for (const auto& workload : options.workloads) {
+    if (workload != "stat" && workload != "get" && workload != "put" &&
+        workload != "mget") {
+      PrintUsage();
+    }
+  }
+  if (options.profiles.empty() || options.sizes.empty()) {
+    PrintUsage();
+  }
+
+  options.server_bin = AbsolutePath(options.server_bin);
+  options.client_bin = AbsolutePath(options.client_bin);
+  mkdir(options.dir.c_str(), 0755);
+  mkdir((options.dir + "/server").c_str(), 0755);
+  mkdir((options.dir + "/client").c_str(), 0755);
+  options.dir = AbsolutePath(options.dir);
+  // A client that dies mid-case mustn't take the bench with it.
+  signal(SIGPIPE, SIG_IGN);
+
+  std::vector<BenchResult> results;
+  bool all_ok = true;
+  for (const auto& bench_case : PlanCases(options)) {
+    results.push_back(RunCase(options, bench_case));
+    PrintSummary(results.back());
+    all_ok = all_ok && results.back().ok;
+  }
+
+  std::ofstream out(options.out);
+  WriteJson(options, results, out);
+  // exit() skips destructors, so flush the file here.
+  out.close();
+  std::cout << "Wrote " << results.size() << " cases to " << options.out
+            << std::endl;
+  std::exit(all_ok ? 0 : 1);
+}
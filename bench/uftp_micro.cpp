@@ -0,0 +1,568 @@
+#include <arpa/inet.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <new>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include <uftp_buffer_pool.h>
+#include <uftp_defs.h>
+#include <uftp_listing.h>
+#include <uftp_meta.h>
+#include <uftp_trace.h>
+#include <uftp_utils.h>
+
+#include "../server/uftp_dir_index.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Every operator new in the process is counted, along with the blocks
+// UftpBufferPool has to get from malloc, so a benchmark can report what each
+// operation allocates. The socket benchmarks' peer thread is included, since
+// it's half of every exchange.
+static std::atomic<uint64_t> new_count{0};
+
+void* operator new(std::size_t size) {
+  new_count.fetch_add(1, std::memory_order_relaxed);
+  void* block = std::malloc(size == 0 ? 1 : size);
+  if (block == nullptr) {
+    throw std::bad_alloc();
+  }
+  return block;
+}
+
+void operator delete(void* block) noexcept { std::free(block); }
+void operator delete(void* block, std::size_t) noexcept { std::free(block); }
+
+namespace {
+
+constexpr double kDefaultThreshold = 0.2;
+
+///////////////////////////////////////////////////////////////////////////////
+uint64_t Allocations() {
+  return new_count.load(std::memory_order_relaxed) +
+         UftpBufferPool::GetStats().allocations;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void ReportAllocations(benchmark::State& state, uint64_t start) {
+  state.counters["allocs/op"] = benchmark::Counter(
+      (double)(Allocations() - start), benchmark::Counter::kAvgIterations);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+std::string ScratchDir() {
+  static const std::string dir = [] {
+    char path[] = "/tmp/uftp_micro.XXXXXX";
+    if (mkdtemp(path) == nullptr) {
+      std::cerr << "Couldn't make a scratch directory\n";
+      std::exit(1);
+    }
+    return std::string(path);
+  }();
+  return dir;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+UftpMessage MakeRequest(uint8_t version) {
+  UftpMessage message;
+  message.command = "get";
+  message.argument = "some_directory/some_file.bin";
+  message.opcode = UftpOpcodeFor(message.command);
+  message.version = version;
+  message.header.range_offset = 1 << 20;
+  message.header.file_length = 1 << 30;
+  return message;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// ConstructUftpHeader and the serialisation of the meta, which together are
+/// BuildMeta, the fixed cost every transfer starts with.
+void BM_BuildMeta(benchmark::State& state) {
+  UftpMessage message = MakeRequest(state.range(0));
+  UftpPooledBuffer meta;
+  const uint64_t allocations = Allocations();
+  for (auto _ : state) {
+    meta.clear();
+    UftpUtils::BuildMeta(message, meta);
+    benchmark::DoNotOptimize(meta.data());
+  }
+  ReportAllocations(state, allocations);
+  state.SetBytesProcessed(state.iterations() * meta.size());
+}
+BENCHMARK(BM_BuildMeta)->Arg(UftpProtocolV1)->Arg(UftpProtocolV2);
+
+///////////////////////////////////////////////////////////////////////////////
+void BM_ParseMeta(benchmark::State& state) {
+  UftpMessage request = MakeRequest(state.range(0));
+  UftpPooledBuffer meta;
+  UftpUtils::BuildMeta(request, meta);
+  UftpMessage message;
+  const uint64_t allocations = Allocations();
+  for (auto _ : state) {
+    uint64_t message_length = 0;
+    if (!UftpMeta::Parse(meta.data(), meta.size(), message_length, message)) {
+      state.SkipWithError("Couldn't parse meta");
+      break;
+    }
+    benchmark::DoNotOptimize(message_length);
+  }
+  ReportAllocations(state, allocations);
+  state.SetBytesProcessed(state.iterations() * meta.size());
+}
+BENCHMARK(BM_ParseMeta)->Arg(UftpProtocolV1)->Arg(UftpProtocolV2);
+
+///////////////////////////////////////////////////////////////////////////////
+/// Two socket handles on loopback that address each other, like a client and
+/// the server's session for it. A socketpair() would be connected, which the
+/// batched sendmmsg() with an address doesn't allow, so it's two UDP sockets.
+/// The peer thread receives every message sent to it and answers "echo"s.
+class SocketPair {
+ public:
+  SocketPair() {
+    local_ = UftpUtils::GetSocketHandle("127.0.0.1", 0);
+    peer_ = UftpUtils::GetSocketHandle("127.0.0.1", 0);
+    Bind(local_);
+    Bind(peer_);
+    std::swap(local_.addr, peer_.addr);
+    thread_ = std::thread([this] { RunPeer(); });
+  }
+
+  ~SocketPair() {
+    UftpMessage message;
+    message.command = "exit";
+    message.opcode = OP_EXIT;
+    UftpUtils::SendMessage(local_, message);
+    thread_.join();
+    close(local_.sockfd);
+    close(peer_.sockfd);
+  }
+
+  UftpSocketHandle& Local() { return local_; }
+
+ private:
+  /// Binds to an ephemeral port and leaves its address in addr.
+  static void Bind(UftpSocketHandle& sock_handle) {
+    UftpUtils::CheckErr(bind(sock_handle.sockfd, (sockaddr*)&sock_handle.addr,
+                             sizeof(sock_handle.addr)),
+                        "Error binding socket");
+    socklen_t length = sizeof(sock_handle.addr);
+    getsockname(sock_handle.sockfd, (sockaddr*)&sock_handle.addr, &length);
+  }
+
+  void RunPeer() {
+    UftpMessage request;
+    UftpMessage response;
+    while (true) {
+      if (!UftpUtils::ReceiveMessage(peer_, request)) {
+        continue;
+      }
+      if (request.opcode == OP_EXIT) {
+        break;
+      }
+      if (request.command == "echo") {
+        response.Reset();
+        response.command = request.command;
+        response.header.sequence_num = request.header.sequence_num;
+        response.message.swap(request.message);
+        UftpUtils::SendMessage(peer_, response);
+      }
+    }
+  }
+
+  UftpSocketHandle local_;
+  UftpSocketHandle peer_;
+  std::thread thread_;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+/// One message of range(0) bytes to the peer, through to its final ack.
+void BM_SendMessage(benchmark::State& state) {
+  SocketPair sockets;
+  UftpMessage message;
+  message.command = "put";
+  message.opcode = OP_PUT;
+  message.argument = "file";
+  message.message.assign(state.range(0), 'x');
+  const uint64_t allocations = Allocations();
+  for (auto _ : state) {
+    if (!UftpUtils::SendMessage(sockets.Local(), message)) {
+      state.SkipWithError("SendMessage failed");
+      break;
+    }
+  }
+  ReportAllocations(state, allocations);
+  state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_SendMessage)
+    ->Arg(0)
+    ->Arg(1 << 10)
+    ->Arg(64 << 10)
+    ->Arg(1 << 20)
+    ->UseRealTime();
+
+///////////////////////////////////////////////////////////////////////////////
+/// A request and its response of range(0) bytes each, what a small command
+/// costs end to end minus the network.
+void BM_Exchange(benchmark::State& state) {
+  SocketPair sockets;
+  UftpMessage request;
+  UftpMessage response;
+  request.command = "echo";
+  request.message.assign(state.range(0), 'x');
+  const uint64_t allocations = Allocations();
+  for (auto _ : state) {
+    if (!UftpUtils::SendMessage(sockets.Local(), request) ||
+        !UftpUtils::ReceiveMessage(sockets.Local(), response)) {
+      state.SkipWithError("Exchange failed");
+      break;
+    }
+  }
+  ReportAllocations(state, allocations);
+  state.SetBytesProcessed(state.iterations() * state.range(0) * 2);
+}
+BENCHMARK(BM_Exchange)->Arg(0)->Arg(1 << 10)->UseRealTime();
+
+///////////////////////////////////////////////////////////////////////////////
+void BM_ReadFile(benchmark::State& state) {
+  const std::string filename = ScratchDir() + "/read_file";
+  UftpUtils::WriteFile(filename, std::vector<uint8_t>(state.range(0), 'x'));
+  std::vector<uint8_t> buffer;
+  const uint64_t allocations = Allocations();
+  for (auto _ : state) {
+    if (UftpUtils::ReadFile(filename, buffer) != UftpStatusCode::NO_ERR) {
+      state.SkipWithError("ReadFile failed");
+      break;
+    }
+    benchmark::DoNotOptimize(buffer.data());
+  }
+  ReportAllocations(state, allocations);
+  state.SetBytesProcessed(state.iterations() * state.range(0));
+  std::remove(filename.c_str());
+}
+BENCHMARK(BM_ReadFile)->Arg(4 << 10)->Arg(64 << 10)->Arg(1 << 20)->Arg(
+    16 << 20);
+
+///////////////////////////////////////////////////////////////////////////////
+void BM_WriteFile(benchmark::State& state) {
+  const std::string filename = ScratchDir() + "/write_file";
+  const std::vector<uint8_t> buffer(state.range(0), 'x');
+  const uint64_t allocations = Allocations();
+  for (auto _ : state) {
+    if (UftpUtils::WriteFile(filename, buffer) != UftpStatusCode::NO_ERR) {
+      state.SkipWithError("WriteFile failed");
+      break;
+    }
+  }
+  ReportAllocations(state, allocations);
+  state.SetBytesProcessed(state.iterations() * state.range(0));
+  std::remove(filename.c_str());
+}
+BENCHMARK(BM_WriteFile)->Arg(4 << 10)->Arg(64 << 10)->Arg(1 << 20)->Arg(
+    16 << 20);
+
+///////////////////////////////////////////////////////////////////////////////
+/// A directory of num_files empty files, made once and kept for the run.
+std::string SyntheticDir(int64_t num_files) {
+  const std::string dir = ScratchDir() + "/ls_" + std::to_string(num_files);
+  if (mkdir(dir.c_str(), 0755) == 0) {
+    for (int64_t file = 0; file < num_files; ++file) {
+      std::ofstream(dir + "/file_" + std::to_string(file));
+    }
+  }
+  return dir;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// What UftpServer::HandleLsRequest does for a page of the listing, against
+/// an index that's already built, as the server has after its first ls.
+/// range(1) is the page size.
+void BM_LsPage(benchmark::State& state) {
+  UftpDirIndex dir_index(SyntheticDir(state.range(0)));
+  std::vector<uint8_t> request;
+  UftpListing::SerializeRequest("", state.range(1), request);
+  std::vector<UftpListEntry> entries;
+  std::vector<uint8_t> page;
+  bool more = false;
+  dir_index.List("", "", 1, entries, more);
+  const uint64_t allocations = Allocations();
+  for (auto _ : state) {
+    std::string cursor;
+    uint32_t max_entries = 0;
+    entries.clear();
+    page.clear();
+    if (!UftpListing::DeserializeRequest(request, cursor, max_entries) ||
+        !dir_index.List("", cursor, max_entries, entries, more)) {
+      state.SkipWithError("Listing failed");
+      break;
+    }
+    UftpListing::SerializePage(entries, more, page);
+    benchmark::DoNotOptimize(page.data());
+  }
+  ReportAllocations(state, allocations);
+  state.SetBytesProcessed(state.iterations() * page.size());
+}
+BENCHMARK(BM_LsPage)->Args({10000, 100})->Args({10000, 1000})->Args(
+    {100000, 1000});
+
+///////////////////////////////////////////////////////////////////////////////
+/// The first ls of a directory, which scans and stats all of it.
+void BM_LsScan(benchmark::State& state) {
+  const std::string dir = SyntheticDir(state.range(0));
+  std::vector<UftpListEntry> entries;
+  bool more = false;
+  const uint64_t allocations = Allocations();
+  for (auto _ : state) {
+    UftpDirIndex dir_index(dir);
+    entries.clear();
+    dir_index.List("", "", UftpListPageSize, entries, more);
+  }
+  ReportAllocations(state, allocations);
+  state.counters["files/s"] = benchmark::Counter(
+      state.iterations() * state.range(0), benchmark::Counter::kIsRate);
+}
+BENCHMARK(BM_LsScan)->Arg(10000)->Arg(100000)->Unit(benchmark::kMillisecond);
+
+///////////////////////////////////////////////////////////////////////////////
+/// The operator<< DEBUG_LOG uses for messages, with a small message body.
+void BM_FormatMessage(benchmark::State& state) {
+  UftpMessage message = MakeRequest(UftpProtocolVersion);
+  message.message.assign(state.range(0), 'x');
+  std::ostringstream stream;
+  const uint64_t allocations = Allocations();
+  for (auto _ : state) {
+    stream.str("");
+    stream << message;
+    benchmark::DoNotOptimize(stream);
+  }
+  ReportAllocations(state, allocations);
+  state.SetBytesProcessed(state.iterations() * stream.str().size());
+}
+BENCHMARK(BM_FormatMessage)->Arg(0)->Arg(256);
+
+///////////////////////////////////////////////////////////////////////////////
+void BM_FormatHeader(benchmark::State& state) {
+  UftpMessage message = MakeRequest(UftpProtocolVersion);
+  std::ostringstream stream;
+  const uint64_t allocations = Allocations();
+  for (auto _ : state) {
+    stream.str("");
+    stream << message.header;
+    benchmark::DoNotOptimize(stream);
+  }
+  ReportAllocations(state, allocations);
+}
+BENCHMARK(BM_FormatHeader);
+
+///////////////////////////////////////////////////////////////////////////////
+/// UFTP_TRACE with no arguments and with as many as it takes, what the
+/// per-datagram paths pay to leave tracing on.
+void BM_Trace(benchmark::State& state) {
+  uint32_t chunk_num = 0;
+  const uint64_t allocations = Allocations();
+  for (auto _ : state) {
+    if (state.range(0) == 0) {
+      UFTP_TRACE("Micro trace");
+    } else {
+      UFTP_TRACE("Micro trace, transfer: {}, chunk: {}, length: {}, "
+                 "retransmit: {}, rate: {}, nacks: {}",
+                 7u, ++chunk_num, (uint64_t)UftpChunkSize, false, 1.5, -1);
+    }
+  }
+  ReportAllocations(state, allocations);
+}
+BENCHMARK(BM_Trace)->Arg(0)->Arg(UftpTrace::kMaxArgs);
+
+///////////////////////////////////////////////////////////////////////////////
+struct Result {
+  double ns_per_op = 0.0;
+  double allocs_per_op = 0.0;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+/// The console output, plus each benchmark's time and allocations kept for
+/// comparing against the baseline. With --benchmark_repetitions it's the
+/// median of the repetitions that's kept, which is much steadier.
+class BaselineReporter : public benchmark::ConsoleReporter {
+ public:
+  void ReportRuns(const std::vector<Run>& reports) override {
+    ConsoleReporter::ReportRuns(reports);
+    for (const Run& run : reports) {
+      if (run.error_occurred) {
+        continue;
+      }
+      if (run.run_type == Run::RT_Iteration) {
+        results_[run.run_name.str()] = ResultOf(run);
+      } else if (run.aggregate_name == "median") {
+        medians_[run.run_name.str()] = ResultOf(run);
+      }
+    }
+  }
+
+  std::map<std::string, Result> Results() const {
+    std::map<std::string, Result> results = results_;
+    for (const auto& median : medians_) {
+      results[median.first] = median.second;
+    }
+    return results;
+  }
+
+ private:
+  static Result ResultOf(const Run& run) {
+    Result result;
+    result.ns_per_op = run.GetAdjustedRealTime() * 1e9 /
+                       benchmark::GetTimeUnitMultiplier(run.time_unit);
+    const auto allocs = run.counters.find("allocs/op");
+    if (allocs != run.counters.end()) {
+      result.allocs_per_op = allocs->second.value;
+    }
+    return result;
+  }
+
+  std::map<std::string, Result> results_;
+  std::map<std::string, Result> medians_;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+/// The baseline is a line per benchmark: name, ns/op and allocs/op.
+bool LoadBaseline(const std::string& filename,
+                  std::map<std::string, Result>& baseline) {
+  std::ifstream file(filename);
+  if (!file.good()) {
+    return false;
+  }
+  std::string line;
+  while (std::getline(file, line)) {
+    std::istringstream fields(line);
+    std::string name;
+    Result result;
+    if (line.empty() || line[0] == '#' ||
+        !(fields >> name >> result.ns_per_op >> result.allocs_per_op)) {
+      continue;
+    }
+    baseline[name] = result;
+  }
+  return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void SaveBaseline(const std::string& filename,
+                  const std::map<std::string, Result>& results) {
+  std::ofstream file(filename);
+  file << "# name ns/op allocs/op\n" << std::fixed;
+  for (const auto& result : results) {
+    file << result.first << " " << std::setprecision(1)
+         << result.second.ns_per_op << " " << std::setprecision(2)
+         << result.second.allocs_per_op << "\n";
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// Prints how each benchmark moved against the baseline.
+/// \return the number that regressed: slower by more than threshold, or
+/// allocating more per operation.
+int CompareBaseline(const std::map<std::string, Result>& baseline,
+                    const std::map<std::string, Result>& results,
+                    double threshold) {
+  int regressions = 0;
+  std::cout << "\nAgainst baseline (threshold " << threshold * 100 << "%):\n"
+            << std::fixed;
+  for (const auto& result : results) {
+    const auto base = baseline.find(result.first);
+    if (base == baseline.end()) {
+      std::cout << "  " << std::left << std::setw(36) << result.first
+                << std::right << "  new\n";
+      continue;
+    }
+    const double change =
+        result.second.ns_per_op / base->second.ns_per_op - 1.0;
+    // Allocation counts are exact, but averaged over a run of iterations.
+    const bool more_allocs = std::round(result.second.allocs_per_op) >
+                             std::round(base->second.allocs_per_op);
+    const bool regressed = change > threshold || more_allocs;
+    regressions += regressed;
+    std::cout << "  " << std::left << std::setw(36) << result.first
+              << std::right << std::setprecision(1) << std::setw(12)
+              << base->second.ns_per_op << " -> " << std::setw(12)
+              << result.second.ns_per_op << " ns  " << std::showpos
+              << std::setw(7) << change * 100 << "%" << std::noshowpos
+              << std::setprecision(2) << std::setw(11)
+              << base->second.allocs_per_op << " -> " << std::setw(11)
+              << result.second.allocs_per_op << " allocs"
+              << (regressed ? "  REGRESSED" : "") << "\n";
+  }
+  return regressions;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void PrintUsage() {
+  std::cout << "uftp_micro: bad argument\n\tUsage: uftp_micro "
+               "[--baseline <file>] [--save-baseline <file>] "
+               "[--threshold <fraction>] [--benchmark_filter=<regex>] "
+               "[other --benchmark_ flags]\n";
+  std::exit(1);
+}
+
+}  // namespace
+
+///////////////////////////////////////////////////////////////////////////////
+int main(int argc, char** argv) {
+  benchmark::Initialize(&argc, argv);
+  if (argc % 2 != 1) {
+    PrintUsage();
+  }
+
+  std::string baseline_file;
+  std::string save_file;
+  double threshold = kDefaultThreshold;
+  for (int arg = 1; arg < argc; arg += 2) {
+    const std::string option = argv[arg];
+    if (option == "--baseline") {
+      baseline_file = argv[arg + 1];
+    } else if (option == "--save-baseline") {
+      save_file = argv[arg + 1];
+    } else if (option == "--threshold") {
+      threshold = std::strtod(argv[arg + 1], nullptr);
+    } else {
+      PrintUsage();
+    }
+  }
+
+  BaselineReporter reporter;
+  benchmark::RunSpecifiedBenchmarks(&reporter);
+  benchmark::Shutdown();
+
+  const std::string command = "rm -rf " + ScratchDir();
+  if (std::system(command.c_str()) != 0) {
+    std::cerr << "Couldn't remove " << ScratchDir() << "\n";
+  }
+
+  if (!save_file.empty()) {
+    SaveBaseline(save_file, reporter.Results());
+    std::cout << "Saved baseline to " << save_file << std::endl;
+  }
+
+  int regressions = 0;
+  if (!baseline_file.empty()) {
+    std::map<std::string, Result> baseline;
+    if (!LoadBaseline(baseline_file, baseline)) {
+      std::cerr << "Couldn't read baseline " << baseline_file << "\n";
+      return 1;
+    }
+    regressions = CompareBaseline(baseline, reporter.Results(), threshold);
+    std::cout << regressions << " regression(s)" << std::endl;
+  }
+  return regressions == 0 ? 0 : 1;
+}
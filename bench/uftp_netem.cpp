@@ -0,0 +1,284 @@
+#include "uftp_netem.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstring>
+
+namespace {
+
+// Longest the loop sleeps with nothing due, which bounds how long Stop()
+// takes.
+constexpr auto kIdleWait = std::chrono::milliseconds(50);
+constexpr std::size_t kMaxDatagramSize = 65536;
+constexpr int kMaxEvents = 16;
+
+///////////////////////////////////////////////////////////////////////////////
+uint64_t AddressKey(const sockaddr_in& addr) {
+  return ((uint64_t)addr.sin_addr.s_addr << 16) | addr.sin_port;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int OpenUdpSocket(uint16_t port) {
+  const int fd = UftpUtils::CheckErr(socket(AF_INET, SOCK_DGRAM, 0),
+                                     "Error creating UDP socket.");
+  sockaddr_in addr;
+  std::memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  UftpUtils::CheckErr(bind(fd, (sockaddr*)&addr, sizeof(addr)),
+                      "Error binding proxy socket");
+
+  // The proxy holds a window's worth of datagrams like either end does.
+  const int buff_size = 4 * UftpWindowSize * UftpChunkSize;
+  setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &buff_size, sizeof(buff_size));
+  setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &buff_size, sizeof(buff_size));
+  UftpUtils::CheckErr(fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK),
+                      "Error making socket non-blocking");
+  return fd;
+}
+
+}  // namespace
+
+///////////////////////////////////////////////////////////////////////////////
+bool UftpImpairment::FromName(const std::string& name,
+                              UftpImpairment& impairment) {
+  impairment = UftpImpairment();
+  impairment.name = name;
+  if (name == "lan") {
+    impairment.delay_ms = 0.25;
+    impairment.jitter_ms = 0.05;
+    impairment.loss = 0.001;
+  } else if (name == "wan") {
+    impairment.delay_ms = 25.0;
+    impairment.jitter_ms = 2.0;
+    impairment.loss = 0.01;
+    impairment.reorder = 0.01;
+    impairment.duplicate = 0.005;
+  } else if (name == "lossy") {
+    impairment.delay_ms = 10.0;
+    impairment.jitter_ms = 1.0;
+    impairment.loss = 0.05;
+    impairment.reorder = 0.02;
+    impairment.duplicate = 0.01;
+  } else if (name == "satellite") {
+    impairment.delay_ms = 300.0;
+    impairment.jitter_ms = 5.0;
+    impairment.loss = 0.005;
+  } else if (name != "clean") {
+    return false;
+  }
+  return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+UftpNetem::UftpNetem(uint16_t listen_port, uint16_t server_port,
+                     const UftpImpairment& impairment)
+    : listen_port_(listen_port),
+      server_port_(server_port),
+      impairment_(impairment),
+      random_(std::random_device()()) {}
+
+///////////////////////////////////////////////////////////////////////////////
+UftpNetem::~UftpNetem() {
+  Stop();
+  for (auto& flow : flows_) {
+    close(flow.second->server_fd);
+  }
+  if (epoll_fd_ >= 0) close(epoll_fd_);
+  if (listen_fd_ >= 0) close(listen_fd_);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void UftpNetem::Open() {
+  std::memset(&server_addr_, 0, sizeof(server_addr_));
+  server_addr_.sin_family = AF_INET;
+  server_addr_.sin_port = htons(server_port_);
+  server_addr_.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  listen_fd_ = OpenUdpSocket(listen_port_);
+  epoll_fd_ = UftpUtils::CheckErr(epoll_create1(0), "Error creating epoll");
+  epoll_event event;
+  event.events = EPOLLIN;
+  event.data.fd = listen_fd_;
+  UftpUtils::CheckErr(epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, listen_fd_, &event),
+                      "Error adding socket to epoll");
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void UftpNetem::Start() {
+  running_ = true;
+  thread_ = std::thread([this] { Run(); });
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void UftpNetem::Stop() {
+  running_ = false;
+  if (thread_.joinable()) {
+    thread_.join();
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+UftpNetem::Stats UftpNetem::GetStats() {
+  std::lock_guard<std::mutex> lock(stats_mutex_);
+  return stats_;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+UftpNetem::Flow& UftpNetem::FlowFor(const sockaddr_in& client_addr) {
+  std::unique_ptr<Flow>& flow = flows_[AddressKey(client_addr)];
+  if (flow == nullptr) {
+    flow.reset(new Flow);
+    flow->client_addr = client_addr;
+    flow->server_fd = OpenUdpSocket(0);
+    epoll_event event;
+    event.events = EPOLLIN;
+    event.data.fd = flow->server_fd;
+    UftpUtils::CheckErr(
+        epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, flow->server_fd, &event),
+        "Error adding socket to epoll");
+    flows_by_fd_[flow->server_fd] = flow.get();
+  }
+  return *flow;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void UftpNetem::CountChunk(Flow& flow, int direction, const uint8_t* datagram,
+                           std::size_t length) {
+  UftpChunkHeader header;
+  if (length < sizeof(header)) {
+    return;
+  }
+  std::memcpy(&header, datagram, sizeof(header));
+  if (header.sync != UftpSyncWord || header.type != DATAGRAM_DATA) {
+    return;
+  }
+
+  ++stats_.data_chunks;
+  if (!flow.seen[direction] ||
+      flow.transfer_id[direction] != header.transfer_id) {
+    flow.seen[direction] = true;
+    flow.transfer_id[direction] = header.transfer_id;
+    flow.max_chunk[direction] = header.chunk_num;
+  } else if (header.chunk_num <= flow.max_chunk[direction]) {
+    ++stats_.retransmits;
+  } else {
+    flow.max_chunk[direction] = header.chunk_num;
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void UftpNetem::Forward(int fd, const sockaddr_in& to, const uint8_t* datagram,
+                        std::size_t length) {
+  // A full socket buffer is loss like any other.
+  sendto(fd, datagram, length, 0, (const sockaddr*)&to, sizeof(to));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void UftpNetem::Schedule(int fd, const sockaddr_in& to,
+                         const uint8_t* datagram, std::size_t length,
+                         double delay_ms) {
+  if (delay_ms <= 0.0) {
+    Forward(fd, to, datagram, length);
+    return;
+  }
+  Pending pending;
+  pending.due = UftpClock::now() +
+                std::chrono::duration_cast<UftpClock::duration>(
+                    std::chrono::duration<double, std::milli>(delay_ms));
+  pending.order = next_order_++;
+  pending.fd = fd;
+  pending.to = to;
+  pending.datagram.assign(datagram, datagram + length);
+  pending_.push(std::move(pending));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void UftpNetem::SendDue(UftpClock::time_point now) {
+  while (!pending_.empty() && pending_.top().due <= now) {
+    const Pending& pending = pending_.top();
+    Forward(pending.fd, pending.to, pending.datagram.data(),
+            pending.datagram.size());
+    pending_.pop();
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void UftpNetem::Run() {
+  std::vector<uint8_t> datagram(kMaxDatagramSize);
+  epoll_event events[kMaxEvents];
+  while (running_) {
+    const UftpClock::time_point now = UftpClock::now();
+    SendDue(now);
+    UftpClock::time_point wake_time = now + kIdleWait;
+    if (!pending_.empty()) {
+      wake_time = std::min(wake_time, pending_.top().due);
+    }
+    const timespec wait = UftpUtils::TimeUntil(wake_time, now);
+    const int ret = epoll_pwait2(epoll_fd_, events, kMaxEvents, &wait, nullptr);
+    if (ret < 0 && errno != EINTR) {
+      UftpUtils::CheckErr(ret, "epoll_wait failed");
+    }
+
+    for (int event = 0; event < ret; ++event) {
+      const int fd = events[event].data.fd;
+      while (true) {
+        sockaddr_in from;
+        socklen_t from_length = sizeof(from);
+        const ssize_t length =
+            recvfrom(fd, datagram.data(), datagram.size(), 0,
+                     (sockaddr*)&from, &from_length);
+        if (length < 0) {
+          break;
+        }
+
+        // Client to server is direction 0, server to client 1.
+        Flow* flow = nullptr;
+        int out_fd = -1;
+        sockaddr_in to;
+        int direction = 0;
+        if (fd == listen_fd_) {
+          flow = &FlowFor(from);
+          out_fd = flow->server_fd;
+          to = server_addr_;
+        } else {
+          flow = flows_by_fd_[fd];
+          out_fd = listen_fd_;
+          to = flow->client_addr;
+          direction = 1;
+        }
+
+        std::lock_guard<std::mutex> lock(stats_mutex_);
+        ++stats_.datagrams;
+        stats_.bytes += length;
+        CountChunk(*flow, direction, datagram.data(), length);
+        if (uniform_(random_) < impairment_.loss) {
+          ++stats_.dropped;
+          continue;
+        }
+
+        const int copies =
+            uniform_(random_) < impairment_.duplicate ? 2 : 1;
+        stats_.duplicated += copies - 1;
+        for (int copy = 0; copy < copies; ++copy) {
+          double delay_ms = impairment_.delay_ms;
+          if (impairment_.jitter_ms > 0.0) {
+            delay_ms += impairment_.jitter_ms * (2 * uniform_(random_) - 1);
+          }
+          if (uniform_(random_) < impairment_.reorder) {
+            ++stats_.reordered;
+            delay_ms += impairment_.reorder_gap_ms;
+          }
+          Schedule(out_fd, to, datagram.data(), length,
+                   std::max(delay_ms, 0.0));
+        }
+      }
+    }
+  }
+}
@@ -0,0 +1,131 @@
+#pragma once
+
+#include <netinet/in.h>
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <uftp_defs.h>
+#include <uftp_utils.h>
+
+///////////////////////////////////////////////////////////////////////////////
+/// What the path between client and server does to each datagram, in either
+/// direction. Probabilities are 0 to 1.
+struct UftpImpairment {
+  std::string name = "clean";
+  double delay_ms = 0.0;
+  // Each datagram is delayed by delay_ms plus up to jitter_ms either way,
+  // which reorders datagrams sent closer together than the jitter.
+  double jitter_ms = 0.0;
+  double loss = 0.0;
+  // Held back another reorder_gap_ms, so the datagrams behind it overtake.
+  double reorder = 0.0;
+  double reorder_gap_ms = 1.0;
+  double duplicate = 0.0;
+
+  ///
+  /// \brief FromName
+  /// \return false if name isn't one of "clean", "lan", "wan", "lossy" or
+  /// "satellite".
+  ///
+  static bool FromName(const std::string& name, UftpImpairment& impairment);
+};
+
+///////////////////////////////////////////////////////////////////////////////
+/// A UDP proxy on loopback that impairs the traffic between uftp clients and
+/// a server, in the spirit of netem but without needing root. Clients send
+/// to the proxy's port. Each client address gets a socket of its own towards
+/// the server, so the server still sees one peer per client socket.
+///
+/// It also reads the chunk headers going past and counts, for each
+/// direction, the data chunks sent again. Senders number a transfer's
+/// chunks in order and only ever go back to resend, so a chunk numbered at
+/// or below the highest one seen on the transfer is a retransmit.
+class UftpNetem {
+ public:
+  struct Stats {
+    uint64_t datagrams = 0;
+    uint64_t bytes = 0;
+    uint64_t dropped = 0;
+    uint64_t duplicated = 0;
+    uint64_t reordered = 0;
+    uint64_t data_chunks = 0;
+    uint64_t retransmits = 0;
+  };
+
+  UftpNetem(uint16_t listen_port, uint16_t server_port,
+            const UftpImpairment& impairment);
+  ~UftpNetem();
+
+  /// Binds the proxy's port. Exits on failure, like the server.
+  void Open();
+
+  /// Runs the proxy on a thread of its own until Stop().
+  void Start();
+  void Stop();
+
+  /// Counts since the proxy was opened.
+  Stats GetStats();
+
+ private:
+  struct Flow {
+    sockaddr_in client_addr;
+    int server_fd = -1;
+    // Per direction, the transfer last seen and its highest chunk.
+    uint32_t transfer_id[2] = {0, 0};
+    uint32_t max_chunk[2] = {0, 0};
+    bool seen[2] = {false, false};
+  };
+
+  struct Pending {
+    UftpClock::time_point due;
+    uint64_t order;
+    int fd;
+    sockaddr_in to;
+    std::vector<uint8_t> datagram;
+
+    bool operator>(const Pending& other) const {
+      return due != other.due ? due > other.due : order > other.order;
+    }
+  };
+
+  void Run();
+  Flow& FlowFor(const sockaddr_in& client_addr);
+  void CountChunk(Flow& flow, int direction, const uint8_t* datagram,
+                  std::size_t length);
+  void Forward(int fd, const sockaddr_in& to, const uint8_t* datagram,
+               std::size_t length);
+  void Schedule(int fd, const sockaddr_in& to, const uint8_t* datagram,
+                std::size_t length, double delay_ms);
+  void SendDue(UftpClock::time_point now);
+
+  const uint16_t listen_port_;
+  const uint16_t server_port_;
+  const UftpImpairment impairment_;
+
+  int listen_fd_ = -1;
+  int epoll_fd_ = -1;
+  sockaddr_in server_addr_;
+  // Keyed by the client's address and port.
+  std::map<uint64_t, std::unique_ptr<Flow>> flows_;
+  std::map<int, Flow*> flows_by_fd_;
+
+  std::priority_queue<Pending, std::vector<Pending>, std::greater<Pending>>
+      pending_;
+  uint64_t next_order_ = 0;
+  std::mt19937_64 random_;
+  std::uniform_real_distribution<double> uniform_{0.0, 1.0};
+
+  std::mutex stats_mutex_;
+  Stats stats_;
+
+  std::atomic<bool> running_{false};
+  std::thread thread_;
+};
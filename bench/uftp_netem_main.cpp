@@ -0,0 +1,71 @@
+#include <signal.h>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+#include "uftp_netem.h"
+
+///////////////////////////////////////////////////////////////////////////////
+static void PrintUsage() {
+  std::cout << "uftp_netem: missing argument\n\tUsage: uftp_netem "
+               "<listen_port> <server_port> "
+               "[--profile clean|lan|wan|lossy|satellite] [--delay <ms>] "
+               "[--jitter <ms>] [--loss <p>] [--reorder <p>] "
+               "[--duplicate <p>]\n";
+  std::exit(1);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int main(int argc, char** argv) {
+  if (argc < 3 || argc % 2 != 1) {
+    PrintUsage();
+  }
+
+  const uint16_t listen_port = atoi(argv[1]);
+  const uint16_t server_port = atoi(argv[2]);
+  UftpImpairment impairment;
+  for (int arg = 3; arg < argc; arg += 2) {
+    const std::string option = argv[arg];
+    const double value = std::strtod(argv[arg + 1], nullptr);
+    if (option == "--profile") {
+      if (!UftpImpairment::FromName(argv[arg + 1], impairment)) {
+        PrintUsage();
+      }
+    } else if (option == "--delay") {
+      impairment.delay_ms = value;
+    } else if (option == "--jitter") {
+      impairment.jitter_ms = value;
+    } else if (option == "--loss") {
+      impairment.loss = value;
+    } else if (option == "--reorder") {
+      impairment.reorder = value;
+    } else if (option == "--duplicate") {
+      impairment.duplicate = value;
+    } else {
+      PrintUsage();
+    }
+  }
+
+  // Runs until interrupted, then reports what went past.
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+  UftpNetem netem(listen_port, server_port, impairment);
+  netem.Open();
+  netem.Start();
+  int signal_num = 0;
+  sigwait(&signals, &signal_num);
+  netem.Stop();
+
+  const UftpNetem::Stats stats = netem.GetStats();
+  std::cout << "datagrams: " << stats.datagrams << ", bytes: " << stats.bytes
+            << ", data chunks: " << stats.data_chunks
+            << ", retransmits: " << stats.retransmits
+            << ", dropped: " << stats.dropped
+            << ", duplicated: " << stats.duplicated
+            << ", reordered: " << stats.reordered << std::endl;
+  std::exit(0);
+}
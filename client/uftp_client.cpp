@@ -2,7 +2,11 @@
 
 #include <arpa/inet.h>
 #include <errno.h>
+#include <fnmatch.h>
+#include <glob.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #include <algorithm>
 #include <chrono>
@@ -10,31 +14,77 @@
 #include <cstdlib>
 #include <cstring>
 #include <ctime>
+#include <fstream>
+#include <iomanip>
 #include <ios>
 #include <iostream>
+#include <memory>
 #include <sstream>
 #include <string>
 #include <thread>
 #include <vector>
 
+#include <uftp_checkpoint.h>
+#include <uftp_compression.h>
+#include <uftp_congestion.h>
 #include <uftp_defs.h>
+#include <uftp_delta.h>
+#include <uftp_fec.h>
+#include <uftp_meta.h>
+#include <uftp_payload.h>
+#include <uftp_trace.h>
 #include <uftp_utils.h>
 
+///////////////////////////////////////////////////////////////////////////////
+UftpSocketHandle UftpClient::OpenSocket() const {
+  UftpSocketHandle sock_handle =
+      UftpUtils::GetSocketHandle(server_addr_str_, server_port_);
+  sock_handle.congestion = UftpCongestionControl::Create(congestion_control_);
+  if (fec_) {
+    sock_handle.fec = std::make_shared<UftpFecController>();
+  }
+  if (codec_ != CODEC_NONE) {
+    sock_handle.wake_fd = UftpUtils::CheckErr(
+        eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC), "Error creating eventfd");
+  }
+  return sock_handle;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void UftpClient::CloseSocket(UftpSocketHandle& sock_handle) {
+  if (sock_handle.wake_fd >= 0) {
+    close(sock_handle.wake_fd);
+  }
+  UftpUtils::CheckErr(close(sock_handle.sockfd), "Error closing udp socket");
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 void UftpClient::Open() {
-  sock_handle_ = UftpUtils::GetSocketHandle(server_addr_str_, server_port_);
+  sock_handle_ = OpenSocket();
+  if (codec_ != CODEC_NONE) {
+    sock_handle_.workers = std::make_shared<UftpWorkerPool>();
+  }
   DEBUG_LOG("Opened socket to host: ", server_addr_str_, ", port: ",
             server_port_);
 
-  // Set receive timeout
-  timeval receive_tv;
-  receive_tv.tv_sec = 2;
-  receive_tv.tv_usec = 0;
-  UftpUtils::CheckErr(setsockopt(sock_handle_.sockfd, SOL_SOCKET, SO_RCVTIMEO,
-                                 &receive_tv, sizeof(receive_tv)),
-                      "Failed to set receive timeout");
-
   open_ = true;
+  if (max_protocol_version_ > UftpProtocolV1) {
+    NegotiateVersion();
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void UftpClient::NegotiateVersion() {
+  // Asked in v1, which every server reads. One that only speaks v1 doesn't
+  // know the command.
+  UftpMessage request, response;
+  request.command = UftpCommandName(OP_VERSION);
+  Exchange(request, response);
+  if (response.header.status_code == UftpStatusCode::NO_ERR &&
+      response.message.size() == 1) {
+    protocol_version_ = std::min(response.message[0], max_protocol_version_);
+  }
+  DEBUG_LOG("Speaking protocol version: ", (int)protocol_version_);
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -42,7 +92,7 @@ void UftpClient::Close() {
   if (!open_) {
     return;
   }
-  UftpUtils::CheckErr(close(sock_handle_.sockfd), "Error closing udp socket");
+  CloseSocket(sock_handle_);
   DEBUG_LOG("Closed socket to host: ", server_addr_str_, ", port: ",
             server_port_);
   open_ = false;
@@ -57,18 +107,23 @@ bool UftpClient::HandleResponse(const UftpMessage& response) {
     std::cout << "Closing connection with server...\n";
     return false;
 
-  } else if (response.command == "ls") {
-    for (const auto byte : response.message) {
-      std::cout << byte;
-    }
-
   } else if (response.command == "get") {
     if (response.header.status_code == UftpStatusCode::ERR_FILE_NOT_FOUND) {
       std::cout << "File not found: " << response.argument << "\n";
-    } else {
-      UftpUtils::WriteFile(response.argument, response.message);
+    } else if (response_code != UftpStatusCode::NO_ERR) {
+      std::cout << UftpUtils::StatusCodeToString(response_code) << "\n";
+    } else if (response.message_sink->Status() != UftpStatusCode::NO_ERR) {
+      std::cout << "Couldn't write " << response.argument << ": "
+                << UftpUtils::StatusCodeToString(
+                       response.message_sink->Status())
+                << "\n";
     }
 
+  } else if (response.command == "stats" &&
+             response_code == UftpStatusCode::NO_ERR) {
+    std::cout.write(reinterpret_cast<const char*>(response.message.data()),
+                    response.message.size());
+
   } else if (response.header.status_code == UftpStatusCode::ERR_BAD_COMMAND) {
     std::cout << UftpUtils::StatusCodeToString(response_code) << "\n";
 
@@ -80,50 +135,749 @@ bool UftpClient::HandleResponse(const UftpMessage& response) {
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-bool UftpClient::SendCommand(const std::string& command,
-                             const std::string& argument) {
-  UftpMessage request, response;
+void UftpClient::Exchange(UftpMessage& request, UftpMessage& response) {
+  Exchange(sock_handle_, current_sequence_num_, request, response);
+  if (response.header.status_code != UftpStatusCode::ERR_NO_RESPONSE) {
+    server_codecs_ = response.header.codecs;
+  }
+}
 
-  if (command == "put") {  // need to check argument and try to read in file.
-    const auto status = UftpUtils::ReadFile(argument, request.message);
-    if (status == UftpStatusCode::ERR_FILE_NOT_FOUND) {
-      std::cout << "Unknown file: " << argument << "\n";
-      return true;
+///////////////////////////////////////////////////////////////////////////////
+void UftpClient::Exchange(UftpSocketHandle& sock_handle,
+                          uint32_t& sequence_num, UftpMessage& request,
+                          UftpMessage& response) {
+  // A successful get is streamed straight to disk.
+  const auto select_sink = [&](const UftpMessage& response)
+      -> std::shared_ptr<UftpPayloadSink> {
+    if (response.opcode != OP_GET ||
+        response.header.status_code != UftpStatusCode::NO_ERR ||
+        response.header.sequence_num != sequence_num) {
+      return nullptr;
     }
-  }
+    auto file_sink = std::make_shared<UftpFileSink>(stream_buffer_size_);
+    file_sink->Open(response.argument, response.header.file_length,
+                    response.header.range_offset,
+                    response.header.message_length, response.file_mtime_ns);
+    return file_sink;
+  };
 
+  request.version = protocol_version_;
   request.header.status_code = UftpStatusCode::NO_ERR;
-  request.command = command;
-  request.argument = argument;
-  request.header.sequence_num = current_sequence_num_;
+  request.header.sequence_num = sequence_num;
+  const uint8_t codecs = codec_ != CODEC_NONE ? 1 << codec_ : 0;
+  request.header.codecs = codecs;
+  // File payloads only. Until the server has answered once we don't know
+  // what it takes, so the first put of a session goes raw.
+  if (request.message_source) {
+    request.codec = UftpPickCodec(codecs & server_codecs_);
+    request.file_mtime_ns = request.message_source->MtimeNs();
+  }
   bool response_received = false;
   bool matching_seq_nums = false;
+  // An attempt only fails after an idle timeout without progress, so one
+  // more timeout's worth of retries is plenty for a server that's only slow.
+  const auto idle_timeout = std::chrono::milliseconds(UftpIdleTimeoutMs);
+  auto give_up_time = UftpClock::time_point::max();
+  bool retrying = false;
 
   do {
+    if (retrying) {
+      const auto now = UftpClock::now();
+      if (give_up_time == UftpClock::time_point::max()) {
+        give_up_time = now + idle_timeout;
+      } else if (now >= give_up_time) {
+        UFTP_TRACE("Giving up on request, sequence: {}",
+                   request.header.sequence_num);
+        response.Reset();
+        response.command = request.command;
+        response.argument = request.argument;
+        response.header.sequence_num = request.header.sequence_num;
+        response.header.status_code = UftpStatusCode::ERR_NO_RESPONSE;
+        break;
+      }
+    }
+    retrying = true;
+
     // Try sending message. Don't expect errors.
-    if (!UftpUtils::SendMessage(sock_handle_, request)) {
-      std::cout << "Error sending message to: " << server_addr_str_;
+    if (!UftpUtils::SendMessage(sock_handle, request)) {
+      std::cerr << "Error sending message to: " << server_addr_str_ << "\n";
       continue;
     }
 
-    response_received = UftpUtils::ReceiveMessage(sock_handle_, response);
+    response_received =
+        UftpUtils::ReceiveMessage(sock_handle, response, select_sink);
     if (!response_received) {
-      DEBUG_LOG("No Response Received!");
+      UFTP_TRACE("No response received, sequence: {}",
+                 request.header.sequence_num);
     }
 
     matching_seq_nums =
         response.header.sequence_num == request.header.sequence_num;
     if (!matching_seq_nums) {
-      DEBUG_LOG("Mismatched Sequence numbers.");
+      UFTP_TRACE("Mismatched sequence numbers, sent: {}, received: {}",
+                 request.header.sequence_num, response.header.sequence_num);
     }
 
   } while (!response_received || !matching_seq_nums);
 
-  ++current_sequence_num_;
+  ++sequence_num;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+UftpStatusCode UftpClient::OpenFileSource(
+    const std::string& filename, std::shared_ptr<UftpPayloadSource>& source) {
+  auto file_source = std::make_shared<UftpFileSource>(stream_buffer_size_);
+  const auto status = file_source->Open(filename);
+  if (status == UftpStatusCode::ERR_FILE_NOT_FOUND) {
+    std::cout << "Unknown file: " << filename << "\n";
+  } else if (status != UftpStatusCode::NO_ERR) {
+    std::cout << UftpUtils::StatusCodeToString(status) << "\n";
+  } else {
+    source = file_source;
+  }
+  return status;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bool UftpClient::SendCommand(const std::string& command,
+                             const std::string& argument) {
+  if (command == "ls") {
+    return List(argument);
+  } else if (command == "resume get") {
+    return ResumeGet(argument);
+  } else if (command == "resume put") {
+    return ResumePut(argument);
+  } else if (command == "delta get") {
+    return DeltaGet(argument);
+  } else if (command == "delta put") {
+    return DeltaPut(argument);
+  } else if (command == "mget" || command == "mput") {
+    return MultiTransfer(command, argument);
+  } else if (num_streams_ > 1 && (command == "get" || command == "put")) {
+    return StripedTransfer(command, argument);
+  }
+  return SendSingleCommand(command, argument);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bool UftpClient::SendSingleCommand(const std::string& command,
+                                   const std::string& argument) {
+  UftpMessage request, response;
+  request.command = command;
+  request.argument = argument;
+
+  if (command == "put") {  // need to check argument and try to open file.
+    if (OpenFileSource(argument, request.message_source) !=
+        UftpStatusCode::NO_ERR) {
+      return true;
+    }
+    request.header.file_length = request.message_source->Length();
+  }
+
+  Exchange(request, response);
+  return HandleResponse(response);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bool UftpClient::ForEachListEntry(
+    const std::string& prefix,
+    const std::function<void(const UftpListEntry&)>& on_entry) {
+  std::string cursor;
+  bool more = true;
+  while (more) {
+    UftpMessage request, response;
+    request.command = "ls";
+    request.argument = prefix;
+    UftpListing::SerializeRequest(cursor, UftpListPageSize, request.message);
+    Exchange(request, response);
+    if (response.header.status_code != UftpStatusCode::NO_ERR) {
+      HandleResponse(response);
+      return false;
+    }
+
+    std::vector<UftpListEntry> entries;
+    if (!UftpListing::DeserializePage(response.message, entries, more)) {
+      std::cout << "Unreadable listing from the server\n";
+      return false;
+    }
+    for (const auto& entry : entries) {
+      on_entry(entry);
+    }
+    if (!entries.empty()) {
+      cursor = entries.back().name;
+    }
+  }
+  return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bool UftpClient::List(const std::string& prefix) {
+  ForEachListEntry(prefix, [](const UftpListEntry& entry) {
+    static const char kTypeChars[] = "?-dl?";
+    const time_t mtime = entry.mtime_ns / 1000000000;
+    char mtime_str[32];
+    std::strftime(mtime_str, sizeof(mtime_str), "%Y-%m-%d %H:%M",
+                  std::localtime(&mtime));
+    std::cout << kTypeChars[entry.type <= FILE_TYPE_OTHER ? entry.type : 0]
+              << " " << std::setw(12) << entry.size << " " << mtime_str << " "
+              << entry.name << "\n";
+  });
+  return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bool UftpClient::ResumeGet(const std::string& filename) {
+  UftpCheckpoint checkpoint;
+  if (!checkpoint.Load(filename) || checkpoint.Complete()) {
+    std::cout << "Nothing to resume for " << filename
+              << ", getting all of it\n";
+    return SendCommand("get", filename);
+  }
+  if (checkpoint.SourceMtimeNs() == 0) {
+    // Left by a server, or a client, that didn't say which version of the
+    // file it was.
+    std::cout << "Can't tell which version of " << filename
+              << " was being got, getting all of it\n";
+    return SendSingleCommand("get", filename);
+  }
+
+  // One ranged get per hole. Each one adds to the part file and its
+  // checkpoint, and the last one puts the file in place. The server
+  // refuses them if the file isn't the version the checkpoint was of.
+  for (const auto& range : checkpoint.MissingRanges()) {
+    UftpMessage request, response;
+    request.command = "get";
+    request.argument = filename;
+    request.header.range_offset = range.first;
+    request.header.range_length = range.second;
+    request.file_mtime_ns = checkpoint.SourceMtimeNs();
+    Exchange(request, response);
+
+    const bool received =
+        response.header.status_code == UftpStatusCode::NO_ERR;
+    if (response.header.status_code == UftpStatusCode::ERR_FILE_CHANGED ||
+        (received && response.message_sink->Status() ==
+                         UftpStatusCode::ERR_FILE_CHANGED) ||
+        (received && response.header.file_length != checkpoint.FileLength())) {
+      std::cout << filename << " changed on the server, getting all of it\n";
+      return SendSingleCommand("get", filename);
+    }
+    if (!received ||
+        response.message_sink->Status() != UftpStatusCode::NO_ERR) {
+      return HandleResponse(response);
+    }
+  }
+  return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bool UftpClient::ResumePut(const std::string& filename) {
+  std::shared_ptr<UftpPayloadSource> file_source;
+  if (OpenFileSource(filename, file_source) != UftpStatusCode::NO_ERR) {
+    return true;
+  }
+
+  // Ask the server what it already has.
+  UftpMessage checkpoint_request, checkpoint_response;
+  checkpoint_request.command = "checkpoint";
+  checkpoint_request.argument = filename;
+  Exchange(checkpoint_request, checkpoint_response);
+
+  UftpCheckpoint checkpoint;
+  if (checkpoint_response.header.status_code != UftpStatusCode::NO_ERR ||
+      !checkpoint.Deserialize(checkpoint_response.message) ||
+      checkpoint.FileLength() != file_source->Length()) {
+    std::cout << "Nothing to resume for " << filename
+              << ", putting all of it\n";
+    return SendCommand("put", filename);
+  }
+  if (checkpoint.SourceMtimeNs() != file_source->MtimeNs()) {
+    std::cout << filename << " changed since, putting all of it\n";
+    return SendSingleCommand("put", filename);
+  }
+
+  for (const auto& range : checkpoint.MissingRanges()) {
+    UftpMessage request, response;
+    request.command = "put";
+    request.argument = filename;
+    request.header.range_offset = range.first;
+    request.header.file_length = file_source->Length();
+    request.message_source =
+        std::make_shared<UftpRangeSource>(file_source, range.first,
+                                          range.second);
+    Exchange(request, response);
+
+    if (response.header.status_code == UftpStatusCode::ERR_FILE_CHANGED) {
+      // Another version of the file has been put since we asked.
+      std::cout << filename << " changed on the server, putting all of it\n";
+      return SendSingleCommand("put", filename);
+    }
+    if (response.header.status_code != UftpStatusCode::NO_ERR) {
+      return HandleResponse(response);
+    }
+  }
+  return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bool UftpClient::DeltaGet(const std::string& filename) {
+  UftpMessage request, response;
+  request.command = "diff";
+  request.argument = filename;
+  if (UftpDelta::ComputeSignature(filename, request.message) !=
+      UftpStatusCode::NO_ERR) {
+    std::cout << "No copy of " << filename << " here, getting all of it\n";
+    return SendCommand("get", filename);
+  }
+
+  Exchange(request, response);
+  const auto status = static_cast<UftpStatusCode>(response.header.status_code);
+  if (status == UftpStatusCode::ERR_DELTA_TOO_LARGE) {
+    std::cout << filename << " changed too much, getting all of it\n";
+    return SendCommand("get", filename);
+  } else if (status != UftpStatusCode::NO_ERR) {
+    std::cout << UftpUtils::StatusCodeToString(status) << "\n";
+    return true;
+  }
+
+  DEBUG_LOG("Received ", response.message.size(), " byte delta");
+  const auto apply_status =
+      UftpDelta::ApplyDelta(filename, response.message, stream_buffer_size_);
+  if (apply_status != UftpStatusCode::NO_ERR) {
+    std::cout << "Couldn't apply delta to " << filename << ": "
+              << UftpUtils::StatusCodeToString(apply_status) << "\n";
+  }
+  return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bool UftpClient::DeltaPut(const std::string& filename) {
+  // Ask the server what its copy looks like.
+  UftpMessage signature_request, signature_response;
+  signature_request.command = "signature";
+  signature_request.argument = filename;
+  Exchange(signature_request, signature_response);
+  if (signature_response.header.status_code != UftpStatusCode::NO_ERR) {
+    std::cout << "No copy of " << filename
+              << " on the server, putting all of it\n";
+    return SendCommand("put", filename);
+  }
 
+  UftpMessage request, response;
+  request.command = "patch";
+  request.argument = filename;
+  const auto status = UftpDelta::ComputeDelta(
+      filename, signature_response.message, request.message);
+  if (status == UftpStatusCode::ERR_DELTA_TOO_LARGE) {
+    std::cout << filename << " changed too much, putting all of it\n";
+    return SendCommand("put", filename);
+  } else if (status == UftpStatusCode::ERR_FILE_NOT_FOUND) {
+    std::cout << "Unknown file: " << filename << "\n";
+    return true;
+  } else if (status != UftpStatusCode::NO_ERR) {
+    std::cout << UftpUtils::StatusCodeToString(status) << "\n";
+    return true;
+  }
+
+  DEBUG_LOG("Sending ", request.message.size(), " byte delta");
+  Exchange(request, response);
   return HandleResponse(response);
 }
 
+///////////////////////////////////////////////////////////////////////////////
+bool UftpClient::StripedTransfer(const std::string& command,
+                                 const std::string& filename) {
+  // Find out how big the file is, at whichever end it's on.
+  uint64_t file_length = 0;
+  if (command == "put") {
+    std::shared_ptr<UftpPayloadSource> file_source;
+    if (OpenFileSource(filename, file_source) != UftpStatusCode::NO_ERR) {
+      return true;
+    }
+    file_length = file_source->Length();
+  } else {
+    UftpMessage request, response;
+    request.command = "stat";
+    request.argument = filename;
+    Exchange(request, response);
+    if (response.header.status_code == UftpStatusCode::ERR_FILE_NOT_FOUND) {
+      std::cout << "File not found: " << filename << "\n";
+      return true;
+    } else if (response.header.status_code != UftpStatusCode::NO_ERR) {
+      return HandleResponse(response);
+    }
+    file_length = response.header.file_length;
+  }
+
+  const uint64_t num_streams =
+      std::min<uint64_t>(num_streams_, file_length / UftpMinStripeSize);
+  if (num_streams < 2) {
+    return SendSingleCommand(command, filename);
+  }
+
+  // Whole chunks per stripe, the last one takes what's left.
+  const uint64_t stripe_length =
+      (file_length / num_streams + UftpChunkSize - 1) / UftpChunkSize *
+      UftpChunkSize;
+  std::vector<Stripe> stripes(num_streams);
+  std::vector<std::thread> threads;
+  const auto start_time = UftpClock::now();
+  for (uint64_t index = 0; index < num_streams; ++index) {
+    Stripe& stripe = stripes[index];
+    stripe.offset = index * stripe_length;
+    stripe.length = (index + 1 == num_streams)
+                        ? file_length - stripe.offset
+                        : stripe_length;
+    threads.emplace_back([this, &command, &filename, file_length, &stripe] {
+      TransferStripe(command, filename, file_length, stripe);
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  const double seconds =
+      std::chrono::duration<double>(UftpClock::now() - start_time).count();
+
+  UftpStatusCode status = UftpStatusCode::NO_ERR;
+  std::ostringstream report;
+  report << std::fixed << std::setprecision(2);
+  for (std::size_t index = 0; index < stripes.size(); ++index) {
+    const Stripe& stripe = stripes[index];
+    report << "  stream " << index << ": " << stripe.length << " bytes in "
+           << stripe.seconds << " s";
+    // A stripe that failed straight away, or was too short to time, has no
+    // rate worth printing.
+    if (stripe.seconds > 0) {
+      report << ", " << stripe.length / stripe.seconds / 1e6 << " MB/s";
+    }
+    report << "\n";
+    if (stripe.status != UftpStatusCode::NO_ERR) {
+      status = stripe.status;
+    }
+  }
+  report << command << " " << filename << ": " << num_streams
+         << " streams, " << file_length << " bytes in " << seconds << " s, "
+         << file_length / seconds / 1e6 << " MB/s\n";
+  std::cout << report.str();
+
+  if (status == UftpStatusCode::ERR_FILE_CHANGED) {
+    // The file changed between stripes, or the receiving end holds part of
+    // another version of it. Either way the stripes can't be pieced together.
+    std::cout << filename << " changed, " << command
+              << "ting all of it over one stream\n";
+    return SendSingleCommand(command, filename);
+  }
+  if (status != UftpStatusCode::NO_ERR) {
+    std::cout << "Couldn't " << command << " " << filename << ": "
+              << UftpUtils::StatusCodeToString(status) << ", \"resume "
+              << command << "\" picks up from there\n";
+  }
+  return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void UftpClient::TransferStripe(const std::string& command,
+                                const std::string& filename,
+                                uint64_t file_length, Stripe& stripe) {
+  UftpSocketHandle sock_handle = OpenSocket();
+  sock_handle.workers = sock_handle_.workers;
+  uint32_t sequence_num = 0;
+  const auto start_time = UftpClock::now();
+
+  UftpMessage request, response;
+  request.command = command;
+  request.argument = filename;
+  request.header.range_offset = stripe.offset;
+  if (command == "get") {
+    request.header.range_length = stripe.length;
+  } else {
+    // Sources aren't thread safe, every stripe reads through its own.
+    std::shared_ptr<UftpPayloadSource> file_source;
+    stripe.status = OpenFileSource(filename, file_source);
+    if (stripe.status != UftpStatusCode::NO_ERR) {
+      CloseSocket(sock_handle);
+      return;
+    }
+    request.header.file_length = file_length;
+    request.message_source = std::make_shared<UftpRangeSource>(
+        file_source, stripe.offset, stripe.length);
+  }
+  Exchange(sock_handle, sequence_num, request, response);
+  stripe.seconds =
+      std::chrono::duration<double>(UftpClock::now() - start_time).count();
+
+  stripe.status = static_cast<UftpStatusCode>(response.header.status_code);
+  if (stripe.status == UftpStatusCode::NO_ERR && command == "get") {
+    stripe.status = (response.header.file_length == file_length)
+                        ? response.message_sink->Status()
+                        : UftpStatusCode::ERR_UNKNOWN;
+  }
+
+  // Let the server drop the session now rather than when it times out.
+  UftpMessage exit_request, exit_response;
+  exit_request.command = "exit";
+  Exchange(sock_handle, sequence_num, exit_request, exit_response);
+  CloseSocket(sock_handle);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bool UftpClient::ExpandPatterns(const std::string& command,
+                                const std::string& patterns,
+                                std::vector<std::string>& filenames) {
+  std::istringstream pattern_stream(patterns);
+  std::string pattern;
+  while (pattern_stream >> pattern) {
+    const std::size_t num_matched = filenames.size();
+    if (command == "mget") {
+      // Only list the part of the server's directory the pattern can match.
+      const std::string prefix =
+          pattern.substr(0, pattern.find_first_of("*?[\\"));
+      const bool listed = ForEachListEntry(
+          prefix, [&](const UftpListEntry& entry) {
+            if (entry.type == FILE_TYPE_REGULAR &&
+                fnmatch(pattern.c_str(), entry.name.c_str(), FNM_PERIOD) ==
+                    0) {
+              filenames.push_back(entry.name);
+            }
+          });
+      if (!listed) {
+        return false;
+      }
+    } else {
+      glob_t matches;
+      if (glob(pattern.c_str(), 0, nullptr, &matches) == 0) {
+        for (std::size_t index = 0; index < matches.gl_pathc; ++index) {
+          struct stat file_stat;
+          if (stat(matches.gl_pathv[index], &file_stat) == 0 &&
+              S_ISREG(file_stat.st_mode)) {
+            filenames.push_back(matches.gl_pathv[index]);
+          }
+        }
+      }
+      globfree(&matches);
+    }
+    if (filenames.size() == num_matched) {
+      std::cout << "No match for " << pattern << "\n";
+    }
+  }
+
+  // Overlapping patterns shouldn't send a file twice.
+  std::vector<std::string> unique_filenames;
+  for (const auto& filename : filenames) {
+    if (std::find(unique_filenames.begin(), unique_filenames.end(),
+                  filename) == unique_filenames.end()) {
+      unique_filenames.push_back(filename);
+    }
+  }
+  filenames.swap(unique_filenames);
+  return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bool UftpClient::MultiTransfer(const std::string& command,
+                               const std::string& patterns) {
+  MultiTransferState state;
+  if (!ExpandPatterns(command, patterns, state.filenames) ||
+      state.filenames.empty()) {
+    return true;
+  }
+  state.commands.assign(state.filenames.size(), command.substr(1));
+  const double seconds = RunLanes(state);
+
+  const std::size_t num_failed =
+      state.statuses.size() - std::count(state.statuses.begin(),
+                                         state.statuses.end(),
+                                         UftpStatusCode::NO_ERR);
+  std::ostringstream report;
+  report << std::fixed << std::setprecision(2) << command << ": "
+         << state.filenames.size() - num_failed << " of "
+         << state.filenames.size() << " files, " << state.num_bytes
+         << " bytes in " << seconds << " s, "
+         << state.num_bytes / seconds / 1e6 << " MB/s\n";
+  std::cout << report.str();
+  return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+double UftpClient::RunLanes(MultiTransferState& state) {
+  state.statuses.assign(state.filenames.size(), UftpStatusCode::NO_ERR);
+
+  const std::size_t num_lanes =
+      std::min<std::size_t>(pipeline_depth_, state.filenames.size());
+  std::vector<std::thread> lanes;
+  const auto start_time = UftpClock::now();
+  for (std::size_t lane = 0; lane < num_lanes; ++lane) {
+    lanes.emplace_back([this, &state] { RunLane(state); });
+  }
+  for (auto& lane : lanes) {
+    lane.join();
+  }
+  return std::chrono::duration<double>(UftpClock::now() - start_time).count();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void UftpClient::RunLane(MultiTransferState& state) {
+  UftpSocketHandle sock_handle = OpenSocket();
+  sock_handle.workers = sock_handle_.workers;
+  // The lane's own session, numbered from 0 like a stripe's.
+  uint32_t sequence_num = 0;
+
+  std::size_t file_index = 0;
+  while ((file_index = state.next_file++) < state.filenames.size()) {
+    const std::string& command = state.commands[file_index];
+    const std::string& filename = state.filenames[file_index];
+    const auto start_time = UftpClock::now();
+    UftpMessage request, response;
+    request.command = command;
+    request.argument = filename;
+    if (command == "put") {
+      auto file_source = std::make_shared<UftpFileSource>(stream_buffer_size_);
+      const auto status = file_source->Open(filename);
+      if (status != UftpStatusCode::NO_ERR) {
+        state.statuses[file_index] = status;
+        std::lock_guard<std::mutex> lock(state.output_mutex);
+        ReportResult(state, file_index, 0, 0, 0.0);
+        continue;
+      }
+      request.message_source = file_source;
+      request.header.file_length = file_source->Length();
+    }
+
+    Exchange(sock_handle, sequence_num, request, response);
+
+    auto status = static_cast<UftpStatusCode>(response.header.status_code);
+    if (status == UftpStatusCode::NO_ERR && command == "get") {
+      status = response.message_sink->Status();
+    }
+    state.statuses[file_index] = status;
+    uint64_t num_bytes = 0;
+    if (status == UftpStatusCode::NO_ERR) {
+      num_bytes = response.header.message_length +
+                  request.header.message_length;
+      state.num_bytes += num_bytes;
+    }
+    const double seconds =
+        std::chrono::duration<double>(UftpClock::now() - start_time).count();
+    std::lock_guard<std::mutex> lock(state.output_mutex);
+    ReportResult(state, file_index, num_bytes,
+                 command == "put" ? request.header.file_length
+                                  : response.header.file_length,
+                 seconds);
+  }
+
+  // Let the server drop the session now rather than when it times out.
+  UftpMessage exit_request, exit_response;
+  exit_request.command = "exit";
+  Exchange(sock_handle, sequence_num, exit_request, exit_response);
+  CloseSocket(sock_handle);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// text as a JSON string literal.
+static std::string JsonString(const std::string& text) {
+  std::string json = "\"";
+  for (const char character : text) {
+    if (character == '"' || character == '\\') {
+      json.push_back('\\');
+      json.push_back(character);
+    } else if ((unsigned char)character < 0x20) {
+      char escaped[8];
+      std::snprintf(escaped, sizeof(escaped), "\\u%04x", character);
+      json += escaped;
+    } else {
+      json.push_back(character);
+    }
+  }
+  json.push_back('"');
+  return json;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void UftpClient::ReportResult(const MultiTransferState& state,
+                              std::size_t file_index, uint64_t num_bytes,
+                              uint64_t file_length, double seconds) {
+  const UftpStatusCode status = state.statuses[file_index];
+  if (state.batch) {
+    std::ostringstream record;
+    record << std::fixed << std::setprecision(6)
+           << "{\"line\": " << state.line_nums[file_index]
+           << ", \"command\": " << JsonString(state.commands[file_index])
+           << ", \"argument\": " << JsonString(state.filenames[file_index])
+           << ", \"status\": " << status << ", \"error\": "
+           << JsonString(UftpUtils::StatusCodeToString(status))
+           << ", \"bytes\": " << num_bytes
+           << ", \"file_length\": " << file_length
+           << ", \"seconds\": " << seconds << "}\n";
+    std::cout << record.str() << std::flush;
+  } else if (status != UftpStatusCode::NO_ERR) {
+    std::cout << "Couldn't " << state.commands[file_index] << " "
+              << state.filenames[file_index] << ": "
+              << UftpUtils::StatusCodeToString(status) << "\n";
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bool UftpClient::Batch(std::istream& manifest) {
+  MultiTransferState state;
+  state.batch = true;
+  std::string line;
+  std::size_t line_num = 0;
+  bool parsed = true;
+  while (parsed && std::getline(manifest, line)) {
+    ++line_num;
+    const std::size_t command_start = line.find_first_not_of(" \t\r");
+    if (command_start == std::string::npos || line[command_start] == '#') {
+      continue;
+    }
+    // Trailing blanks, and the \r of a manifest written on Windows, aren't
+    // part of the name.
+    line.erase(line.find_last_not_of(" \t\r") + 1);
+    const std::size_t command_end = line.find_first_of(" \t", command_start);
+    const std::string command =
+        line.substr(command_start, command_end - command_start);
+    const std::size_t argument_start =
+        command_end == std::string::npos
+            ? std::string::npos
+            : line.find_first_not_of(" \t", command_end);
+    if ((command != "get" && command != "put" && command != "stat" &&
+         command != "delete") ||
+        argument_start == std::string::npos) {
+      std::cerr << "Manifest line " << line_num
+                << ": expected get, put, stat or delete and a file name\n";
+      parsed = false;
+      break;
+    }
+    state.commands.push_back(command);
+    state.filenames.push_back(line.substr(argument_start));
+    state.line_nums.push_back(line_num);
+  }
+  if (manifest.bad()) {
+    std::cerr << "Couldn't read the manifest\n";
+    parsed = false;
+  }
+
+  std::size_t num_failed = 0;
+  if (parsed && !state.filenames.empty()) {
+    const double seconds = RunLanes(state);
+    num_failed = state.statuses.size() -
+                 std::count(state.statuses.begin(), state.statuses.end(),
+                            UftpStatusCode::NO_ERR);
+    std::ostringstream report;
+    report << std::fixed << std::setprecision(2) << "batch: "
+           << state.filenames.size() - num_failed << " of "
+           << state.filenames.size() << " operations, " << state.num_bytes
+           << " bytes in " << seconds << " s, "
+           << state.num_bytes / seconds / 1e6 << " MB/s\n";
+    std::cerr << report.str();
+  }
+
+  // Let the server drop this session too, output is only the results.
+  UftpMessage exit_request, exit_response;
+  exit_request.command = "exit";
+  Exchange(exit_request, exit_response);
+  return parsed && num_failed == 0;
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 static bool ReadCLIInput(std::string& command, std::string& argument) {
   // Empty out command and argument.
@@ -135,22 +889,22 @@ static bool ReadCLIInput(std::string& command, std::string& argument) {
 
   // Buffer for user input.
   std::string user_input;
-  // Read next line of user input.
-  std::getline(std::cin, user_input);
+  // Read next line of user input. Running out of input means we're done.
+  if (!std::getline(std::cin, user_input)) {
+    command = "exit";
+    return true;
+  }
 
   enum class ParserState {
     LOOKING_FOR_COMMAND,
     READING_COMMAND,
     LOOKING_FOR_ARG,
     READING_ARG,
-    DONE,
   };
 
   ParserState parser_state = ParserState::LOOKING_FOR_COMMAND;
 
   for (const auto character : user_input) {
-    if (parser_state == ParserState::DONE) break;
-
     switch (parser_state) {
       case ParserState::LOOKING_FOR_COMMAND:
         if (character != ' ') {
@@ -161,6 +915,10 @@ static bool ReadCLIInput(std::string& command, std::string& argument) {
       case ParserState::READING_COMMAND:
         if (character != ' ') {
           command.push_back(character);
+        } else if (command == "resume" || command == "delta") {
+          // "resume get", "delta put" and so on are two word commands.
+          command.push_back(' ');
+          parser_state = ParserState::LOOKING_FOR_COMMAND;
         } else {
           parser_state = ParserState::LOOKING_FOR_ARG;
         }
@@ -172,14 +930,13 @@ static bool ReadCLIInput(std::string& command, std::string& argument) {
         }
         break;
       case ParserState::READING_ARG:
-        if (character != ' ') {
-          argument.push_back(character);
-        } else {
-          parser_state = ParserState::DONE;
-        }
+        // The argument is the rest of the line, so file names can have
+        // spaces in them. mget and mput split theirs into patterns.
+        argument.push_back(character);
         break;
     }
   }
+  argument.erase(argument.find_last_not_of(" \r") + 1);
 
   DEBUG_LOG("next_command: <", command, ">");
   DEBUG_LOG("next_argument: <", argument, ">");
@@ -187,23 +944,80 @@ static bool ReadCLIInput(std::string& command, std::string& argument) {
   return (command.size() > 0);
 }
 
+///////////////////////////////////////////////////////////////////////////////
+static void PrintUsage() {
+  std::cout << "uftp_client: missing argument\n\tUsage: uftp_client "
+               "<ip_address> <port_number> [--buffer-size <bytes>] "
+               "[--cc cubic|bbr] [--fec on|off] [--compress deflate|none] "
+               "[--streams <count>] [--pipeline <depth>] [--protocol 1|2|3] "
+               "[--trace-file <path>] [--batch <manifest>|-]";
+  std::exit(1);
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 int main(int argc, char** argv) {
-  if (argc != 3) {
-    std::cout << "uftp_client: missing argument\n\tUsage: uftp_client "
-                 "<ip_address> <port_number>";
-    std::exit(1);
+  if (argc < 3 || argc % 2 != 1) {
+    PrintUsage();
   }
 
   const std::string server_address = argv[1];
   const uint16_t server_port_number = atoi(argv[2]);
 
   UftpClient uftp_client(server_address, server_port_number);
+  UftpCodec codec = CODEC_NONE;
+  std::string trace_file = UftpTrace::DefaultFilename("uftp_client");
+  std::string manifest_file;
+  for (int arg = 3; arg < argc; arg += 2) {
+    const std::string option = argv[arg];
+    if (option == "--buffer-size") {
+      uftp_client.SetStreamBufferSize(
+          std::strtoull(argv[arg + 1], nullptr, 10));
+    } else if (option == "--cc" &&
+               UftpCongestionControl::Create(argv[arg + 1])) {
+      uftp_client.SetCongestionControl(argv[arg + 1]);
+    } else if (option == "--fec") {
+      uftp_client.SetFec(std::string(argv[arg + 1]) == "on");
+    } else if (option == "--compress") {
+      if (!UftpCodecFromName(argv[arg + 1], codec)) {
+        PrintUsage();
+      }
+      uftp_client.SetCompression(codec);
+    } else if (option == "--streams") {
+      uftp_client.SetStreams(std::strtoul(argv[arg + 1], nullptr, 10));
+    } else if (option == "--pipeline") {
+      uftp_client.SetPipelineDepth(std::strtoul(argv[arg + 1], nullptr, 10));
+    } else if (option == "--protocol") {
+      uftp_client.SetProtocolVersion(std::strtoul(argv[arg + 1], nullptr, 10));
+    } else if (option == "--trace-file") {
+      trace_file = argv[arg + 1];
+    } else if (option == "--batch") {
+      manifest_file = argv[arg + 1];
+    } else {
+      PrintUsage();
+    }
+  }
+  UftpTrace::InstallDumpHandlers(trace_file);
   uftp_client.Open();
 
+  // Runs the manifest instead of prompting, "-" reads it from stdin. Exits 1
+  // if anything in it failed.
+  if (!manifest_file.empty()) {
+    std::ifstream manifest_stream;
+    if (manifest_file != "-") {
+      manifest_stream.open(manifest_file);
+      if (!manifest_stream) {
+        std::cerr << "Couldn't open manifest: " << manifest_file << "\n";
+        std::exit(1);
+      }
+    }
+    const bool succeeded = uftp_client.Batch(
+        manifest_file == "-" ? std::cin : manifest_stream);
+    uftp_client.Close();
+    std::exit(succeeded ? 0 : 1);
+  }
+
   std::string next_command, next_argument;
   do {
-    std::this_thread::sleep_for(std::chrono::milliseconds(100));
     while (!ReadCLIInput(next_command, next_argument)) {
     }
   } while (uftp_client.SendCommand(next_command, next_argument));
@@ -2,9 +2,18 @@
 
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <istream>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <vector>
 
 #include <uftp_defs.h>
+#include <uftp_listing.h>
+#include <uftp_payload.h>
 
 class UftpClient {
  public:
@@ -15,20 +24,178 @@ class UftpClient {
   void Open();
   void Close();
 
+  /// Size of the buffer used to stream each file through, see
+  /// UftpStreamBufferSize.
+  void SetStreamBufferSize(std::size_t size) { stream_buffer_size_ = size; }
+
+  /// See UftpCongestionControl::Create(). Must be set before Open().
+  void SetCongestionControl(const std::string& name) {
+    congestion_control_ = name;
+  }
+
+  /// Sends parity with every transfer so lost chunks can be rebuilt without
+  /// a retransmit, see UftpFecController. Must be set before Open().
+  void SetFec(bool fec) { fec_ = fec; }
+
+  /// Offers codec to the server for compressing file payloads both ways,
+  /// see UftpChunkCompressor. Must be set before Open().
+  void SetCompression(UftpCodec codec) { codec_ = codec; }
+
+  /// Splits each get and put into num_streams ranges, each sent over a
+  /// socket of its own at the same time, see StripedTransfer().
+  void SetStreams(unsigned num_streams) {
+    num_streams_ =
+        std::min(std::max(num_streams, 1u), (unsigned)UftpMaxStreams);
+  }
+
+  /// Number of parallel sessions mget and mput run their files over, each
+  /// with a socket of its own, see MultiTransfer().
+  void SetPipelineDepth(unsigned depth) {
+    pipeline_depth_ =
+        std::min(std::max(depth, 1u), (unsigned)UftpMaxPipelineDepth);
+  }
+
+  /// Highest protocol version to speak, see UftpMeta. Open() settles on the
+  /// highest the server speaks too. Must be set before Open().
+  void SetProtocolVersion(unsigned version) {
+    max_protocol_version_ =
+        std::min(std::max(version, (unsigned)UftpProtocolV1),
+                 (unsigned)UftpProtocolVersion);
+  }
+
   ///
   /// \brief SendCommand
-  /// \param command
+  /// \param command one of the server's commands, "resume get" and
+  /// "resume put" to finish an interrupted transfer of argument,
+  /// "delta get" and "delta put" to send only what changed in it, or
+  /// "mget" and "mput" to transfer every file matching the globs in
+  /// argument.
   /// \param argument
   /// \return true if the connection is remaining open, false otherwise.
   ///
   bool SendCommand(const std::string& command, const std::string& argument);
 
+  ///
+  /// \brief Batch runs every operation in manifest, a line each of a command
+  /// and its argument, e.g. "put some file.bin". The argument is the rest of
+  /// the line, so it may have spaces in it. Blank lines and lines starting
+  /// with # are skipped. Commands are get, put, stat and delete, run over
+  /// pipeline depth parallel sessions like mput. Each result is printed as it
+  /// comes in, as a line of JSON with the manifest line number, command,
+  /// argument, status code, bytes and seconds. Ends the session after.
+  /// \return true if every operation succeeded, false if any failed or the
+  /// manifest couldn't be read, in which case nothing is run.
+  ///
+  bool Batch(std::istream& manifest);
+
  private:
+  /// Sends request until a response with its sequence number comes back.
+  /// Gives up an idle timeout after the first attempt fails, leaving
+  /// ERR_NO_RESPONSE in response.
+  void Exchange(UftpMessage& request, UftpMessage& response);
+  void Exchange(UftpSocketHandle& sock_handle, uint32_t& sequence_num,
+                UftpMessage& request, UftpMessage& response);
+  UftpSocketHandle OpenSocket() const;
+  static void CloseSocket(UftpSocketHandle& sock_handle);
+  /// Asks the server which protocol versions it speaks.
+  void NegotiateVersion();
+  bool SendSingleCommand(const std::string& command,
+                         const std::string& argument);
   bool HandleResponse(const UftpMessage& response);
+  UftpStatusCode OpenFileSource(const std::string& filename,
+                                std::shared_ptr<UftpPayloadSource>& source);
+
+  ///
+  /// \brief ForEachListEntry pages through the server's entries whose names
+  /// start with prefix, a page in memory at a time.
+  /// \return false, having reported why, if the listing failed.
+  ///
+  bool ForEachListEntry(
+      const std::string& prefix,
+      const std::function<void(const UftpListEntry&)>& on_entry);
+  /// Prints the server's entries whose names start with prefix.
+  bool List(const std::string& prefix);
+
+  /// Gets the ranges of filename missing from the local checkpoint.
+  bool ResumeGet(const std::string& filename);
+  /// Puts the ranges of filename missing from the server's checkpoint.
+  bool ResumePut(const std::string& filename);
+
+  /// Brings the local copy of filename up to date with the server's.
+  bool DeltaGet(const std::string& filename);
+  /// Brings the server's copy of filename up to date with the local one.
+  bool DeltaPut(const std::string& filename);
+
+  ///
+  /// \brief StripedTransfer gets or puts filename as up to num_streams_
+  /// ranges at once. Each range goes over its own socket, so the server
+  /// gives it a session, windows and congestion state of its own, and the
+  /// receiving side writes every range straight into one part file. Falls
+  /// back to a single stream for small files.
+  ///
+  bool StripedTransfer(const std::string& command,
+                       const std::string& filename);
+
+  struct Stripe {
+    uint64_t offset = 0;
+    uint64_t length = 0;
+    UftpStatusCode status = UftpStatusCode::NO_ERR;
+    double seconds = 0.0;
+  };
+  /// Moves one stripe over a socket of its own. Runs on its own thread.
+  void TransferStripe(const std::string& command, const std::string& filename,
+                      uint64_t file_length, Stripe& stripe);
+
+  ///
+  /// \brief MultiTransfer gets or puts every file matching patterns, a
+  /// whitespace separated list of globs. mget matches them against the
+  /// server's ls, mput against local files. Files are handed out to
+  /// pipeline_depth_ lanes, each a session of its own on its own socket
+  /// that exchanges one file at a time. Running them side by side is what
+  /// keeps many small files from costing a round trip each.
+  ///
+  bool MultiTransfer(const std::string& command, const std::string& patterns);
+  bool ExpandPatterns(const std::string& command, const std::string& patterns,
+                      std::vector<std::string>& filenames);
+
+  // One mget, mput or batch, shared by its lanes. File i is requested with
+  // commands[i] and its result goes in statuses[i].
+  struct MultiTransferState {
+    std::vector<std::string> commands;
+    std::vector<std::string> filenames;
+    std::vector<UftpStatusCode> statuses;
+    std::atomic<std::size_t> next_file{0};
+    std::atomic<uint64_t> num_bytes{0};
+    std::mutex output_mutex;
+    // Batch results are printed as JSON, with line_nums[i] for file i.
+    bool batch = false;
+    std::vector<std::size_t> line_nums;
+  };
+  /// Runs state's files over up to pipeline_depth_ lanes.
+  /// \return how long it took, in seconds.
+  double RunLanes(MultiTransferState& state);
+  /// Runs requests for state's files until there are none left, one at a
+  /// time over a session of its own. Runs on its own thread.
+  void RunLane(MultiTransferState& state);
+  /// Prints how file_index went. Called with state.output_mutex held.
+  void ReportResult(const MultiTransferState& state, std::size_t file_index,
+                    uint64_t num_bytes, uint64_t file_length, double seconds);
 
   bool open_ = false;
 
   uint32_t current_sequence_num_ = 0;
+  std::size_t stream_buffer_size_ = UftpStreamBufferSize;
+  std::string congestion_control_ = UftpDefaultCongestionControl;
+  bool fec_ = false;
+  UftpCodec codec_ = CODEC_NONE;
+  // Codecs the server offered in its last response.
+  uint8_t server_codecs_ = 0;
+  unsigned num_streams_ = 1;
+  unsigned pipeline_depth_ = UftpDefaultPipelineDepth;
+  uint8_t max_protocol_version_ = UftpProtocolVersion;
+  // What requests are sent in. Settled in Open() and only read after, so
+  // lanes and stripes can use it from their own threads.
+  uint8_t protocol_version_ = UftpProtocolV1;
 
   uint16_t server_port_ = 0;
   UftpSocketHandle sock_handle_;
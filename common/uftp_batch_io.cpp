@@ -0,0 +1,206 @@
+#include <uftp_batch_io.h>
+
+#include <errno.h>
+#include <setjmp.h>
+#include <cstring>
+
+#include <uftp_defs.h>
+#include <uftp_payload.h>
+#include <uftp_trace.h>
+#include <uftp_utils.h>
+
+constexpr std::size_t UftpBatchIo::kMaxDatagramSize;
+constexpr std::size_t UftpBatchIo::kHeaderBuffSize;
+constexpr int UftpBatchIo::kMaxIovs;
+
+///////////////////////////////////////////////////////////////////////////////
+UftpBatchIo::UftpBatchIo(int sockfd, std::size_t batch_size)
+    : sockfd_(sockfd),
+      batch_size_(batch_size),
+      send_msgs_(batch_size),
+      send_iovs_(batch_size * kMaxIovs),
+      send_addrs_(batch_size),
+      send_headers_(batch_size * kHeaderBuffSize),
+      send_scratch_(batch_size * UftpChunkSize),
+      recv_msgs_(batch_size),
+      recv_iovs_(batch_size),
+      recv_addrs_(batch_size),
+      recv_buffs_(batch_size * kMaxDatagramSize) {
+  std::memset(send_msgs_.data(), 0, send_msgs_.size() * sizeof(mmsghdr));
+  std::memset(recv_msgs_.data(), 0, recv_msgs_.size() * sizeof(mmsghdr));
+
+  for (std::size_t slot = 0; slot < batch_size_; ++slot) {
+    msghdr& send_hdr = send_msgs_[slot].msg_hdr;
+    send_hdr.msg_name = &send_addrs_[slot];
+    send_hdr.msg_namelen = sizeof(sockaddr_in);
+    send_hdr.msg_iov = &send_iovs_[slot * kMaxIovs];
+
+    recv_iovs_[slot].iov_base = &recv_buffs_[slot * kMaxDatagramSize];
+    recv_iovs_[slot].iov_len = kMaxDatagramSize;
+    msghdr& recv_hdr = recv_msgs_[slot].msg_hdr;
+    recv_hdr.msg_name = &recv_addrs_[slot];
+    recv_hdr.msg_iov = &recv_iovs_[slot];
+    recv_hdr.msg_iovlen = 1;
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bool UftpBatchIo::NextSendSlot(SendSlot& send_slot) {
+  if (SendFull()) {
+    FlushSends();
+    if (SendFull()) {
+      return false;
+    }
+  }
+
+  const std::size_t slot = num_pending_sends_;
+  send_slot = SendSlot{&send_headers_[slot * kHeaderBuffSize],
+                       &send_scratch_[slot * UftpChunkSize],
+                       &send_iovs_[slot * kMaxIovs]};
+  return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void UftpBatchIo::CommitSend(const sockaddr_in& addr, int iovcnt) {
+  const std::size_t slot = num_pending_sends_++;
+  send_addrs_[slot] = addr;
+  send_msgs_[slot].msg_hdr.msg_iovlen = iovcnt;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int UftpBatchIo::FlushSends() {
+  std::size_t next_send = first_pending_send_;
+  std::size_t num_sent = 0;
+  while (next_send < num_pending_sends_) {
+    const int ret = sendmmsg(sockfd_, &send_msgs_[next_send],
+                             num_pending_sends_ - next_send, 0);
+    if (ret < 0) {
+      if (errno == EINTR) continue;
+      if (errno == EFAULT) {
+        // The next datagram's payload is a mapping of a file that's been
+        // truncated since it was checksummed. It's lost like any other, and
+        // its retransmit faults in BuildChunk(), failing the transfer.
+        UFTP_TRACE("sendmmsg faulted, dropping datagram: {}", next_send);
+        ++next_send;
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) {
+        UFTP_TRACE("sendmmsg pushed back, errno: {}, queued: {}", errno,
+                   num_pending_sends_ - next_send);
+        // Only copy once, a datagram already detached stays that way.
+        for (std::size_t slot = std::max(next_send, detached_sends_);
+             slot < num_pending_sends_; ++slot) {
+          if (!DetachSend(slot)) {
+            // Goes out empty, which every receiver drops.
+            send_msgs_[slot].msg_hdr.msg_iovlen = 0;
+          }
+        }
+        detached_sends_ = num_pending_sends_;
+        first_pending_send_ = next_send;
+        return num_sent;
+      }
+      UFTP_TRACE("sendmmsg failed, errno: {}", errno);
+      num_pending_sends_ = 0;
+      first_pending_send_ = 0;
+      detached_sends_ = 0;
+      return -1;
+    }
+    ++stats_.send_calls;
+    stats_.datagrams_sent += ret;
+    next_send += ret;
+    num_sent += ret;
+  }
+
+  num_pending_sends_ = 0;
+  first_pending_send_ = 0;
+  detached_sends_ = 0;
+  return num_sent;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bool UftpBatchIo::DetachSend(std::size_t slot) {
+  msghdr& send_hdr = send_msgs_[slot].msg_hdr;
+  uint8_t* scratch = &send_scratch_[slot * UftpChunkSize];
+  // The first iov is always the header in the slot, the payload follows.
+  uint8_t payload[UftpChunkSize];
+  std::size_t length = 0;
+
+  sigjmp_buf jump;
+  if (sigsetjmp(jump, 0) != 0) {
+    return false;
+  }
+  UftpMappedFileSource::CatchFaults(&jump);
+  for (std::size_t index = 1; index < send_hdr.msg_iovlen; ++index) {
+    std::memcpy(payload + length, send_hdr.msg_iov[index].iov_base,
+                send_hdr.msg_iov[index].iov_len);
+    length += send_hdr.msg_iov[index].iov_len;
+  }
+  UftpMappedFileSource::CatchFaults(nullptr);
+
+  if (length > 0) {
+    std::memcpy(scratch, payload, length);
+    send_hdr.msg_iov[1].iov_base = scratch;
+    send_hdr.msg_iov[1].iov_len = length;
+    send_hdr.msg_iovlen = 2;
+  }
+  return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int UftpBatchIo::Receive(int flags) {
+  for (std::size_t slot = 0; slot < batch_size_; ++slot) {
+    recv_msgs_[slot].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+  }
+
+  int ret = 0;
+  do {
+    ret = recvmmsg(sockfd_, recv_msgs_.data(), batch_size_, flags, nullptr);
+  } while (ret < 0 && errno == EINTR);
+
+  if (ret > 0) {
+    ++stats_.recv_calls;
+    stats_.datagrams_received += ret;
+  }
+  return (ret > 0) ? ret : -1;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void UftpBatchIo::Requeue(int index) {
+  if (requeued_.size() >= batch_size_ || Length(index) == 0) {
+    return;
+  }
+  const uint8_t* datagram = Datagram(index);
+  requeued_.push_back(RequeuedDatagram{
+      From(index),
+      std::vector<uint8_t>(datagram, datagram + Length(index))});
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int UftpBatchIo::TakeRequeued() {
+  int num_datagrams = 0;
+  while (!requeued_.empty() && num_datagrams < (int)batch_size_) {
+    const RequeuedDatagram& requeued = requeued_.front();
+    recv_addrs_[num_datagrams] = requeued.addr;
+    std::memcpy(&recv_buffs_[num_datagrams * kMaxDatagramSize],
+                requeued.data.data(), requeued.data.size());
+    recv_msgs_[num_datagrams].msg_len = requeued.data.size();
+    recv_msgs_[num_datagrams].msg_hdr.msg_flags = 0;
+    requeued_.pop_front();
+    ++num_datagrams;
+  }
+  return num_datagrams;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+double UftpBatchIo::AverageSendBatch() const {
+  return stats_.send_calls
+             ? (double)stats_.datagrams_sent / stats_.send_calls
+             : 0.0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+double UftpBatchIo::AverageReceiveBatch() const {
+  return stats_.recv_calls
+             ? (double)stats_.datagrams_received / stats_.recv_calls
+             : 0.0;
+}
@@ -0,0 +1,145 @@
+#pragma once
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <algorithm>
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+#include <uftp_defs.h>
+
+///////////////////////////////////////////////////////////////////////////////
+/// Batched datagram I/O. Sends are queued into preallocated mmsghdr slots and
+/// go out together with one sendmmsg(), receives pull up to batch_size
+/// datagrams per recvmmsg(). The arrays are allocated once and reused for
+/// the life of the socket. Datagrams the kernel pushes back on stay queued,
+/// with their payloads copied into their slots, until a later flush gets
+/// them out. Nothing more is queued until then.
+class UftpBatchIo {
+ public:
+  // Largest datagram the transport produces, a full chunk or a full ack.
+  static constexpr std::size_t kMaxDatagramSize =
+      std::max(sizeof(UftpChunkHeader) + UftpChunkSize,
+               sizeof(UftpAckHeader) + UftpWindowSize / 8);
+  // Room in each send slot for a datagram header or a whole ack.
+  static constexpr std::size_t kHeaderBuffSize =
+      std::max(sizeof(UftpChunkHeader), sizeof(UftpAckHeader) +
+                                            UftpWindowSize / 8);
+  static constexpr int kMaxIovs = 4;
+
+  struct SendSlot {
+    uint8_t* header;   // kHeaderBuffSize bytes
+    uint8_t* scratch;  // UftpChunkSize bytes for payloads without a home
+    iovec* iov;        // kMaxIovs entries
+  };
+
+  struct Stats {
+    uint64_t send_calls = 0;
+    uint64_t datagrams_sent = 0;
+    uint64_t recv_calls = 0;
+    uint64_t datagrams_received = 0;
+  };
+
+  explicit UftpBatchIo(int sockfd, std::size_t batch_size = UftpBatchSize);
+
+  ///
+  /// \brief NextSendSlot hands out the next free send slot, flushing first if
+  /// the batch is full. Fill it in and call CommitSend().
+  /// \return false if the batch is still full, the socket is pushing back.
+  ///
+  bool NextSendSlot(SendSlot& slot);
+  void CommitSend(const sockaddr_in& addr, int iovcnt);
+
+  ///
+  /// \brief FlushSends puts queued datagrams on the wire. If the socket
+  /// buffer is full (EAGAIN) or the device queue is (ENOBUFS), the rest stay
+  /// queued, see SendBlocked().
+  /// \return the number of datagrams sent, or -1 if the socket failed and
+  /// the batch was dropped.
+  ///
+  int FlushSends();
+
+  bool SendFull() const { return num_pending_sends_ == batch_size_; }
+  std::size_t PendingSends() const {
+    return num_pending_sends_ - first_pending_send_;
+  }
+  /// Whether the last flush left datagrams queued. Wait for the socket to
+  /// be writable, or UftpSendRetryUs, before flushing again.
+  bool SendBlocked() const { return PendingSends() > 0; }
+
+  ///
+  /// \brief Receive reads as many datagrams as are waiting, up to the batch
+  /// size. With MSG_WAITFORONE it blocks for the first one, with
+  /// MSG_DONTWAIT it never blocks.
+  /// \return the number of datagrams received, or -1 if there were none.
+  ///
+  int Receive(int flags);
+
+  const uint8_t* Datagram(int index) const {
+    return recv_buffs_.data() + index * kMaxDatagramSize;
+  }
+  /// 0 for datagrams that didn't fit in kMaxDatagramSize.
+  std::size_t Length(int index) const {
+    return (recv_msgs_[index].msg_hdr.msg_flags & MSG_TRUNC)
+               ? 0
+               : recv_msgs_[index].msg_len;
+  }
+  const sockaddr_in& From(int index) const { return recv_addrs_[index]; }
+
+  ///
+  /// \brief Requeue keeps a received datagram around to be handed out again
+  /// by TakeRequeued(). Used for data that shows up before anyone is ready for
+  /// it, e.g. a response racing the ack for its request.
+  ///
+  void Requeue(int index);
+
+  ///
+  /// \brief TakeRequeued puts requeued datagrams back in the receive slots,
+  /// as if Receive() had just read them.
+  /// \return the number of datagrams, 0 if nothing was requeued.
+  ///
+  int TakeRequeued();
+  bool HasRequeued() const { return !requeued_.empty(); }
+
+  const Stats& GetStats() const { return stats_; }
+  double AverageSendBatch() const;
+  double AverageReceiveBatch() const;
+
+ private:
+  const int sockfd_;
+  const std::size_t batch_size_;
+
+  std::vector<mmsghdr> send_msgs_;
+  std::vector<iovec> send_iovs_;
+  std::vector<sockaddr_in> send_addrs_;
+  std::vector<uint8_t> send_headers_;
+  std::vector<uint8_t> send_scratch_;
+  std::size_t num_pending_sends_ = 0;
+  // Slots before this were sent by a flush the socket cut short.
+  std::size_t first_pending_send_ = 0;
+  // Slots before this have had their payloads copied in.
+  std::size_t detached_sends_ = 0;
+
+  std::vector<mmsghdr> recv_msgs_;
+  std::vector<iovec> recv_iovs_;
+  std::vector<sockaddr_in> recv_addrs_;
+  std::vector<uint8_t> recv_buffs_;
+
+  struct RequeuedDatagram {
+    sockaddr_in addr;
+    std::vector<uint8_t> data;
+  };
+  std::deque<RequeuedDatagram> requeued_;
+
+  Stats stats_;
+
+  ///
+  /// \brief DetachSend copies the payload of a queued datagram into its
+  /// slot, so it no longer points into a transfer that may end before it's
+  /// sent.
+  /// \return false if the payload faulted, a mapped file was truncated.
+  ///
+  bool DetachSend(std::size_t slot);
+};
@@ -0,0 +1,150 @@
+#include <uftp_buffer_pool.h>
+
+#include <atomic>
+#include <cstdlib>
+
+#include <uftp_defs.h>
+
+namespace {
+
+// Blocks of kMinBlock << size_class bytes, up to UftpMaxPooledBlock.
+constexpr std::size_t kMinBlock = 64;
+constexpr unsigned kNumSizeClasses = 18;
+static_assert((kMinBlock << (kNumSizeClasses - 1)) == UftpMaxPooledBlock,
+              "Size classes must end at UftpMaxPooledBlock");
+constexpr uint32_t kUnpooled = ~0u;
+
+// In front of every block. Keeps the block aligned like malloc's.
+struct alignas(alignof(std::max_align_t)) BlockHeader {
+  uint32_t size_class;
+  // Usable bytes after the header.
+  uint64_t size;
+};
+
+// A free block, reusing the block's own bytes as the link.
+struct FreeBlock {
+  FreeBlock* next;
+};
+
+std::atomic<uint64_t> blocks_in_use{0};
+std::atomic<uint64_t> bytes_in_use{0};
+std::atomic<uint64_t> blocks_free{0};
+std::atomic<uint64_t> bytes_free{0};
+std::atomic<uint64_t> allocations{0};
+std::atomic<uint64_t> reuses{0};
+
+void Add(std::atomic<uint64_t>& counter, uint64_t value) {
+  counter.fetch_add(value, std::memory_order_relaxed);
+}
+void Sub(std::atomic<uint64_t>& counter, uint64_t value) {
+  counter.fetch_sub(value, std::memory_order_relaxed);
+}
+
+// One per thread, the free lists are only ever touched by their owner.
+struct FreeLists {
+  ~FreeLists();
+
+  FreeBlock* heads[kNumSizeClasses] = {};
+  std::size_t free_bytes = 0;
+};
+
+// Set once the thread's lists are gone, blocks freed during thread or
+// program exit after that go straight back to malloc.
+thread_local bool lists_destroyed = false;
+thread_local FreeLists free_lists;
+
+///////////////////////////////////////////////////////////////////////////////
+FreeLists::~FreeLists() {
+  for (unsigned size_class = 0; size_class < kNumSizeClasses; ++size_class) {
+    while (heads[size_class] != nullptr) {
+      FreeBlock* block = heads[size_class];
+      heads[size_class] = block->next;
+      BlockHeader* header = reinterpret_cast<BlockHeader*>(block) - 1;
+      Sub(blocks_free, 1);
+      Sub(bytes_free, header->size);
+      std::free(header);
+    }
+  }
+  lists_destroyed = true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+uint32_t SizeClassFor(std::size_t size) {
+  if (size <= kMinBlock) {
+    return 0;
+  }
+  if (size > UftpMaxPooledBlock) {
+    return kUnpooled;
+  }
+  // Round up to the next power of two.
+  const unsigned bits = 64 - __builtin_clzll((unsigned long long)size - 1);
+  return bits - __builtin_ctzll(kMinBlock);
+}
+
+}  // namespace
+
+///////////////////////////////////////////////////////////////////////////////
+void* UftpBufferPool::Allocate(std::size_t size) {
+  const uint32_t size_class = SizeClassFor(size);
+  if (size_class != kUnpooled && !lists_destroyed &&
+      free_lists.heads[size_class] != nullptr) {
+    FreeBlock* block = free_lists.heads[size_class];
+    free_lists.heads[size_class] = block->next;
+    const std::size_t block_size = kMinBlock << size_class;
+    free_lists.free_bytes -= block_size;
+    Sub(blocks_free, 1);
+    Sub(bytes_free, block_size);
+    Add(blocks_in_use, 1);
+    Add(bytes_in_use, block_size);
+    Add(reuses, 1);
+    return block;
+  }
+
+  const std::size_t block_size =
+      size_class == kUnpooled ? size : kMinBlock << size_class;
+  BlockHeader* header = static_cast<BlockHeader*>(
+      std::malloc(sizeof(BlockHeader) + block_size));
+  if (header == nullptr) {
+    throw std::bad_alloc();
+  }
+  header->size_class = size_class;
+  header->size = block_size;
+  Add(blocks_in_use, 1);
+  Add(bytes_in_use, block_size);
+  Add(allocations, 1);
+  return header + 1;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void UftpBufferPool::Free(void* block) {
+  if (block == nullptr) {
+    return;
+  }
+  BlockHeader* header = static_cast<BlockHeader*>(block) - 1;
+  Sub(blocks_in_use, 1);
+  Sub(bytes_in_use, header->size);
+  if (header->size_class == kUnpooled || lists_destroyed ||
+      free_lists.free_bytes + header->size > UftpBufferPoolCacheSize) {
+    std::free(header);
+    return;
+  }
+
+  FreeBlock* free_block = static_cast<FreeBlock*>(block);
+  free_block->next = free_lists.heads[header->size_class];
+  free_lists.heads[header->size_class] = free_block;
+  free_lists.free_bytes += header->size;
+  Add(blocks_free, 1);
+  Add(bytes_free, header->size);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+UftpBufferPool::Stats UftpBufferPool::GetStats() {
+  Stats stats;
+  stats.blocks_in_use = blocks_in_use.load(std::memory_order_relaxed);
+  stats.bytes_in_use = bytes_in_use.load(std::memory_order_relaxed);
+  stats.blocks_free = blocks_free.load(std::memory_order_relaxed);
+  stats.bytes_free = bytes_free.load(std::memory_order_relaxed);
+  stats.allocations = allocations.load(std::memory_order_relaxed);
+  stats.reuses = reuses.load(std::memory_order_relaxed);
+  return stats;
+}
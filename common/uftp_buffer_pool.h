@@ -0,0 +1,87 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <new>
+#include <vector>
+
+#include <uftp_defs.h>
+
+///////////////////////////////////////////////////////////////////////////////
+/// Recycles the memory every transfer churns through: the windows, their
+/// per-chunk state and chunk copies, meta buffers and small sinks. Blocks are
+/// rounded up to a power of two and handed out from a free list of that size
+/// kept by the calling thread, so once a thread has run a transfer the next
+/// one like it is served without touching malloc or its locks, and the pages
+/// are already faulted in. A block freed on another thread joins that
+/// thread's lists. Each thread keeps at most UftpBufferPoolCacheSize bytes
+/// free, beyond that, and for blocks over UftpMaxPooledBlock, it's malloc.
+class UftpBufferPool {
+ public:
+  /// Occupancy across every thread.
+  struct Stats {
+    uint64_t blocks_in_use;
+    uint64_t bytes_in_use;
+    uint64_t blocks_free;
+    uint64_t bytes_free;
+    // Blocks that had to come from malloc, and that came off a free list.
+    uint64_t allocations;
+    uint64_t reuses;
+  };
+
+  /// \return a block of at least size bytes, aligned like malloc's.
+  static void* Allocate(std::size_t size);
+  static void Free(void* block);
+
+  static Stats GetStats();
+};
+
+///////////////////////////////////////////////////////////////////////////////
+/// Standard allocator over UftpBufferPool, for containers rebuilt with every
+/// transfer.
+template <typename T>
+class UftpPoolAllocator {
+ public:
+  using value_type = T;
+
+  UftpPoolAllocator() noexcept {}
+  template <typename U>
+  UftpPoolAllocator(const UftpPoolAllocator<U>&) noexcept {}
+
+  T* allocate(std::size_t count) {
+    return static_cast<T*>(UftpBufferPool::Allocate(count * sizeof(T)));
+  }
+  void deallocate(T* block, std::size_t) noexcept {
+    UftpBufferPool::Free(block);
+  }
+};
+
+template <typename T, typename U>
+bool operator==(const UftpPoolAllocator<T>&, const UftpPoolAllocator<U>&) {
+  return true;
+}
+template <typename T, typename U>
+bool operator!=(const UftpPoolAllocator<T>&, const UftpPoolAllocator<U>&) {
+  return false;
+}
+
+template <typename T>
+using UftpPooledVector = std::vector<T, UftpPoolAllocator<T>>;
+template <typename T>
+using UftpPooledDeque = std::deque<T, UftpPoolAllocator<T>>;
+template <typename K, typename V>
+using UftpPooledMap =
+    std::map<K, V, std::less<K>, UftpPoolAllocator<std::pair<const K, V>>>;
+using UftpPooledBuffer = UftpPooledVector<uint8_t>;
+
+///////////////////////////////////////////////////////////////////////////////
+/// Base for objects made and dropped with every transfer, so new and delete
+/// go through the pool.
+struct UftpPooled {
+  static void* operator new(std::size_t size) {
+    return UftpBufferPool::Allocate(size);
+  }
+  static void operator delete(void* block) { UftpBufferPool::Free(block); }
+};
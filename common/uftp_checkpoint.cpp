@@ -0,0 +1,185 @@
+#include <uftp_checkpoint.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <iterator>
+
+#include <uftp_defs.h>
+#include <uftp_utils.h>
+
+namespace {
+
+// Version 1 had no source_mtime_ns, it loads as 0.
+constexpr uint64_t kCheckpointMagicV1 = 0x31504b4350544655;  // "UFTPCKP1"
+constexpr uint64_t kCheckpointMagic = 0x32504b4350544655;    // "UFTPCKP2"
+
+struct __attribute__((packed)) CheckpointHeaderV1 {
+  uint64_t magic = kCheckpointMagicV1;
+  uint64_t file_length = 0;
+  uint32_t num_ranges = 0;
+};
+
+struct __attribute__((packed)) CheckpointHeader {
+  uint64_t magic = kCheckpointMagic;
+  uint64_t file_length = 0;
+  uint32_t num_ranges = 0;
+  uint64_t source_mtime_ns = 0;
+};
+
+struct __attribute__((packed)) CheckpointRange {
+  uint64_t offset;
+  uint64_t length;
+};
+
+}  // namespace
+
+///////////////////////////////////////////////////////////////////////////////
+void UftpCheckpoint::Reset(uint64_t file_length, uint64_t source_mtime_ns) {
+  file_length_ = file_length;
+  source_mtime_ns_ = source_mtime_ns;
+  ranges_.clear();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void UftpCheckpoint::AddRange(uint64_t offset, uint64_t length) {
+  if (length == 0) {
+    return;
+  }
+  uint64_t start = offset;
+  uint64_t end = offset + length;
+
+  // Swallow every range that overlaps or touches [start, end).
+  auto range_it = ranges_.upper_bound(start);
+  if (range_it != ranges_.begin()) {
+    auto prev_it = std::prev(range_it);
+    if (prev_it->second >= start) {
+      range_it = prev_it;
+    }
+  }
+  while (range_it != ranges_.end() && range_it->first <= end) {
+    start = std::min(start, range_it->first);
+    end = std::max(end, range_it->second);
+    range_it = ranges_.erase(range_it);
+  }
+  ranges_[start] = end;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bool UftpCheckpoint::Complete() const {
+  if (file_length_ == 0) {
+    return true;
+  }
+  return ranges_.size() == 1 && ranges_.begin()->first == 0 &&
+         ranges_.begin()->second >= file_length_;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+std::vector<UftpCheckpoint::Range> UftpCheckpoint::MissingRanges() const {
+  std::vector<Range> missing;
+  uint64_t next = 0;
+  for (const auto& range : ranges_) {
+    if (range.first > next) {
+      missing.emplace_back(next, range.first - next);
+    }
+    next = std::max(next, range.second);
+  }
+  if (next < file_length_) {
+    missing.emplace_back(next, file_length_ - next);
+  }
+  return missing;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void UftpCheckpoint::Serialize(std::vector<uint8_t>& buffer) const {
+  CheckpointHeader header;
+  header.file_length = file_length_;
+  header.num_ranges = ranges_.size();
+  header.source_mtime_ns = source_mtime_ns_;
+
+  buffer.resize(sizeof(header) + ranges_.size() * sizeof(CheckpointRange));
+  std::memcpy(buffer.data(), &header, sizeof(header));
+  uint8_t* next = buffer.data() + sizeof(header);
+  for (const auto& range : ranges_) {
+    const CheckpointRange entry{range.first, range.second - range.first};
+    std::memcpy(next, &entry, sizeof(entry));
+    next += sizeof(entry);
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bool UftpCheckpoint::Deserialize(const std::vector<uint8_t>& buffer) {
+  CheckpointHeader header;
+  std::size_t header_length = sizeof(header);
+  if (buffer.size() >= sizeof(CheckpointHeaderV1)) {
+    std::memcpy(&header, buffer.data(), sizeof(CheckpointHeaderV1));
+  }
+  if (header.magic == kCheckpointMagicV1) {
+    header_length = sizeof(CheckpointHeaderV1);
+    header.source_mtime_ns = 0;
+  } else if (header.magic != kCheckpointMagic ||
+             buffer.size() < sizeof(header)) {
+    return false;
+  } else {
+    std::memcpy(&header, buffer.data(), sizeof(header));
+  }
+  const uint64_t ranges_length =
+      (uint64_t)header.num_ranges * sizeof(CheckpointRange);
+  if (buffer.size() != header_length + ranges_length) {
+    return false;
+  }
+
+  Reset(header.file_length, header.source_mtime_ns);
+  const uint8_t* next = buffer.data() + header_length;
+  for (uint32_t index = 0; index < header.num_ranges; ++index) {
+    CheckpointRange entry;
+    std::memcpy(&entry, next, sizeof(entry));
+    next += sizeof(entry);
+    if (entry.offset > file_length_ ||
+        entry.length > file_length_ - entry.offset) {
+      return false;
+    }
+    AddRange(entry.offset, entry.length);
+  }
+  return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bool UftpCheckpoint::Load(const std::string& filename) {
+  std::vector<uint8_t> buffer;
+  if (UftpUtils::ReadFile(PathFor(filename), buffer) !=
+      UftpStatusCode::NO_ERR) {
+    return false;
+  }
+  return Deserialize(buffer);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bool UftpCheckpoint::Save(const std::string& filename) const {
+  std::vector<uint8_t> buffer;
+  Serialize(buffer);
+
+  const std::string path = PathFor(filename);
+  const std::string tmp_path = path + ".tmp";
+  const int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    DEBUG_LOG("Couldn't open checkpoint: ", tmp_path);
+    return false;
+  }
+  const bool written =
+      write(fd, buffer.data(), buffer.size()) == (ssize_t)buffer.size();
+  close(fd);
+
+  if (!written || std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+    unlink(tmp_path.c_str());
+    return false;
+  }
+  return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void UftpCheckpoint::Remove(const std::string& filename) {
+  unlink(PathFor(filename).c_str());
+}
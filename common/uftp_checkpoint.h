@@ -0,0 +1,56 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+///////////////////////////////////////////////////////////////////////////////
+/// Which byte ranges of a file being received are already on disk. Kept next
+/// to the partial file as "<filename>.uftp-ckpt" so an interrupted transfer
+/// can be resumed by asking only for the missing ranges. The same encoding
+/// is sent over the wire in reply to a "checkpoint" request. It also records
+/// the mtime of the file being sent, since a file rewritten at the same
+/// length can't be told apart by its length alone.
+class UftpCheckpoint {
+ public:
+  using Range = std::pair<uint64_t, uint64_t>;  // offset, length
+
+  static std::string PathFor(const std::string& filename) {
+    return filename + ".uftp-ckpt";
+  }
+
+  void Reset(uint64_t file_length, uint64_t source_mtime_ns);
+  void AddRange(uint64_t offset, uint64_t length);
+
+  uint64_t FileLength() const { return file_length_; }
+  /// The mtime of the file the ranges came from, 0 if it wasn't known.
+  uint64_t SourceMtimeNs() const { return source_mtime_ns_; }
+  bool Empty() const { return ranges_.empty(); }
+  bool Complete() const;
+  std::vector<Range> MissingRanges() const;
+
+  void Serialize(std::vector<uint8_t>& buffer) const;
+  bool Deserialize(const std::vector<uint8_t>& buffer);
+
+  ///
+  /// \brief Load reads the checkpoint kept for filename.
+  /// \return false if there isn't one or it's unreadable.
+  ///
+  bool Load(const std::string& filename);
+  ///
+  /// \brief Save replaces the checkpoint kept for filename. The new one is
+  /// written to the side and renamed over the old. It isn't synced first,
+  /// it's cheap enough to run on an event loop: a crash may leave it short,
+  /// and a short one doesn't load, which costs the resume and nothing more.
+  ///
+  bool Save(const std::string& filename) const;
+  static void Remove(const std::string& filename);
+
+ private:
+  uint64_t file_length_ = 0;
+  uint64_t source_mtime_ns_ = 0;
+  // Disjoint, non-adjacent [start, end) ranges keyed by start.
+  std::map<uint64_t, uint64_t> ranges_;
+};
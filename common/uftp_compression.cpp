@@ -0,0 +1,294 @@
+#include <uftp_compression.h>
+
+#include <setjmp.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <algorithm>
+#include <cstring>
+
+#include <uftp_buffer_pool.h>
+#include <uftp_crc32c.h>
+#include <uftp_defs.h>
+
+namespace {
+
+// Chunks to skip after one that didn't compress, doubling each time.
+constexpr uint32_t kMinBackoff = 8;
+constexpr uint32_t kMaxBackoff = 256;
+
+// Speed matters more than ratio, the point is to beat the link.
+constexpr int kDeflateLevel = 1;
+// Negative for raw deflate, no zlib header or trailer. A chunk is covered by
+// its own CRC already.
+constexpr int kWindowBits = -15;
+constexpr int kMemLevel = 8;
+
+///////////////////////////////////////////////////////////////////////////////
+// zlib's state comes out of the pool like the rest of a transfer's.
+void* PoolAlloc(void* opaque, unsigned items, unsigned size) {
+  return UftpBufferPool::Allocate((std::size_t)items * size);
+}
+void PoolFree(void* opaque, void* block) { UftpBufferPool::Free(block); }
+
+///////////////////////////////////////////////////////////////////////////////
+// One per worker thread, so compressing a chunk never allocates.
+struct Deflater {
+  Deflater() {
+    std::memset(&stream, 0, sizeof(stream));
+    ready = deflateInit2(&stream, kDeflateLevel, Z_DEFLATED, kWindowBits,
+                         kMemLevel, Z_DEFAULT_STRATEGY) == Z_OK;
+  }
+  ~Deflater() {
+    if (ready) {
+      deflateEnd(&stream);
+    }
+  }
+
+  z_stream stream;
+  bool ready = false;
+};
+
+thread_local Deflater deflater;
+
+}  // namespace
+
+///////////////////////////////////////////////////////////////////////////////
+uint8_t UftpSupportedCodecs() { return 1 << CODEC_DEFLATE; }
+
+///////////////////////////////////////////////////////////////////////////////
+UftpCodec UftpPickCodec(uint8_t codecs) {
+  if (codecs & UftpSupportedCodecs() & (1 << CODEC_DEFLATE)) {
+    return CODEC_DEFLATE;
+  }
+  return CODEC_NONE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bool UftpCodecFromName(const std::string& name, UftpCodec& codec) {
+  if (name == "none") {
+    codec = CODEC_NONE;
+    return true;
+  }
+  if (name == "deflate") {
+    codec = CODEC_DEFLATE;
+    return true;
+  }
+  return false;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+UftpInflater::UftpInflater() {}
+
+///////////////////////////////////////////////////////////////////////////////
+UftpInflater::~UftpInflater() {
+  if (ready_) {
+    inflateEnd(stream_.get());
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bool UftpInflater::Inflate(const uint8_t* input, std::size_t input_length,
+                           uint8_t* output, std::size_t output_length) {
+  // Set up on first use, most transfers are never compressed.
+  if (!stream_) {
+    stream_.reset(new z_stream_s);
+    std::memset(stream_.get(), 0, sizeof(*stream_));
+    stream_->zalloc = PoolAlloc;
+    stream_->zfree = PoolFree;
+    ready_ = inflateInit2(stream_.get(), kWindowBits) == Z_OK;
+  }
+  if (!ready_ || inflateReset(stream_.get()) != Z_OK) {
+    return false;
+  }
+  stream_->next_in = const_cast<uint8_t*>(input);
+  stream_->avail_in = input_length;
+  stream_->next_out = output;
+  stream_->avail_out = output_length;
+  // Anything that would run past output_length stops with Z_BUF_ERROR.
+  return inflate(stream_.get(), Z_FINISH) == Z_STREAM_END &&
+         stream_->total_out == output_length;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+UftpChunkCompressor::UftpChunkCompressor(UftpCodec codec,
+                                         UftpPayloadSource& message,
+                                         uint32_t meta_length,
+                                         uint64_t transfer_length,
+                                         UftpWorkerPool& workers,
+                                         int wake_fd)
+    : codec_(codec),
+      message_(message),
+      read_on_workers_(message.ConcurrentReads()),
+      meta_length_(meta_length),
+      transfer_length_(transfer_length),
+      num_chunks_((transfer_length + UftpChunkSize - 1) / UftpChunkSize),
+      first_chunk_((meta_length + UftpChunkSize - 1) / UftpChunkSize),
+      workers_(workers),
+      wake_fd_(wake_fd),
+      chunks_(UftpCompressionLookahead),
+      next_submit_(first_chunk_),
+      backoff_(kMinBackoff) {
+  static_assert(UftpCompressionLookahead % UftpCompressionBlock == 0,
+                "Blocks must tile the lookahead");
+}
+
+///////////////////////////////////////////////////////////////////////////////
+UftpChunkCompressor::~UftpChunkCompressor() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  chunk_done_.wait(lock, [this] { return pending_ == 0; });
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bool UftpChunkCompressor::ReadChunk(uint32_t chunk_num, Chunk& chunk) {
+  const uint64_t offset = (uint64_t)chunk_num * UftpChunkSize;
+  const uint8_t* data =
+      message_.Read(offset - meta_length_, chunk.raw_length, chunk.raw);
+  if (data == nullptr) {
+    return false;
+  }
+  if (data == chunk.raw) {
+    return true;
+  }
+  // data may be a mapping of a file someone has since truncated.
+  sigjmp_buf jump;
+  if (sigsetjmp(jump, 0) != 0) {
+    message_.Faulted();
+    return false;
+  }
+  UftpMappedFileSource::CatchFaults(&jump);
+  std::memcpy(chunk.raw, data, chunk.raw_length);
+  UftpMappedFileSource::CatchFaults(nullptr);
+  return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bool UftpChunkCompressor::BlockReady(uint32_t first_chunk_num) {
+  if (read_on_workers_) {
+    return true;
+  }
+  const uint64_t offset = (uint64_t)first_chunk_num * UftpChunkSize;
+  const uint64_t end =
+      std::min(transfer_length_,
+               offset + (uint64_t)UftpCompressionBlock * UftpChunkSize);
+  return message_.Ready(offset - meta_length_, end - offset);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void UftpChunkCompressor::Submit(uint32_t first_chunk_num) {
+  const uint32_t end_chunk_num =
+      std::min(num_chunks_, first_chunk_num + UftpCompressionBlock);
+  for (uint32_t chunk_num = first_chunk_num; chunk_num < end_chunk_num;
+       ++chunk_num) {
+    Chunk& chunk = Slot(chunk_num);
+    const uint64_t offset = (uint64_t)chunk_num * UftpChunkSize;
+    chunk.raw_length = std::min((uint64_t)UftpChunkSize,
+                                transfer_length_ - offset);
+    chunk.compressed_length = 0;
+    chunk.attempt = chunk_num >= skip_until_;
+    chunk.done = false;
+    chunk.failed = !read_on_workers_ && !ReadChunk(chunk_num, chunk);
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    ++pending_;
+  }
+  workers_.Submit([this, first_chunk_num, end_chunk_num] {
+    for (uint32_t chunk_num = first_chunk_num; chunk_num < end_chunk_num;
+         ++chunk_num) {
+      Chunk& chunk = Slot(chunk_num);
+      if (read_on_workers_ && !chunk.failed) {
+        chunk.failed = !ReadChunk(chunk_num, chunk);
+      }
+      if (!chunk.failed) {
+        Compress(codec_, chunk);
+      }
+
+      std::lock_guard<std::mutex> lock(mutex_);
+      chunk.done = true;
+      if (waiting_ && waiting_for_ == chunk_num) {
+        waiting_ = false;
+        if (wake_fd_ >= 0) {
+          const uint64_t one = 1;
+          (void)write(wake_fd_, &one, sizeof(one));
+        }
+      }
+      if (chunk_num + 1 == end_chunk_num) {
+        --pending_;
+      }
+      chunk_done_.notify_all();
+    }
+  });
+}
+///////////////////////////////////////////////////////////////////////////////
+void UftpChunkCompressor::Compress(UftpCodec codec, Chunk& chunk) {
+  chunk.raw_checksum = UftpCrc32c(0, chunk.raw, chunk.raw_length);
+  if (!chunk.attempt || codec != CODEC_DEFLATE || !deflater.ready ||
+      deflateReset(&deflater.stream) != Z_OK) {
+    return;
+  }
+
+  z_stream& stream = deflater.stream;
+  stream.next_in = chunk.raw;
+  stream.avail_in = chunk.raw_length;
+  stream.next_out = chunk.compressed;
+  // Not worth it unless it saves an eighth. deflate stops as soon as the
+  // output is full, which is how incompressible chunks bail out early.
+  stream.avail_out = chunk.raw_length - chunk.raw_length / 8;
+  if (deflate(&stream, Z_FINISH) == Z_STREAM_END) {
+    chunk.compressed_length = stream.total_out;
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bool UftpChunkCompressor::Ready(uint32_t chunk_num) {
+  // A block goes out once its slots have all been taken.
+  next_submit_ = std::max(next_submit_, chunk_num);
+  while (next_submit_ < num_chunks_ &&
+         next_submit_ + UftpCompressionBlock <=
+             chunk_num + UftpCompressionLookahead &&
+         BlockReady(next_submit_)) {
+    Submit(next_submit_);
+    next_submit_ += UftpCompressionBlock;
+  }
+  if (chunk_num >= next_submit_) {
+    // Still coming off the disk, whose completions wake the caller.
+    return false;
+  }
+
+  Chunk& chunk = Slot(chunk_num);
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (wake_fd_ < 0) {
+    chunk_done_.wait(lock, [&chunk] { return chunk.done; });
+  }
+  // Woken once the rest of the block is done too, so a sender that caught
+  // up with the workers goes on to send a batch rather than a chunk.
+  const uint32_t block_end =
+      chunk_num - (chunk_num - first_chunk_) % UftpCompressionBlock +
+      UftpCompressionBlock;
+  waiting_ = !chunk.done;
+  waiting_for_ = std::min(block_end, num_chunks_) - 1;
+  return chunk.done;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+const UftpChunkCompressor::Chunk* UftpChunkCompressor::Take(
+    uint32_t chunk_num) {
+  Chunk& chunk = Slot(chunk_num);
+  if (chunk.failed) {
+    return nullptr;
+  }
+
+  if (chunk.attempt && chunk.compressed_length == 0) {
+    // Chunks already submitted have been tried, skip the ones after them.
+    skip_until_ = std::max(skip_until_, next_submit_ + backoff_);
+    backoff_ = std::min(2 * backoff_, kMaxBackoff);
+  } else if (chunk.compressed_length > 0) {
+    backoff_ = kMinBackoff;
+  }
+
+  raw_bytes_ += chunk.raw_length;
+  compressed_bytes_ += chunk.compressed_length ? chunk.compressed_length
+                                               : chunk.raw_length;
+  return &chunk;
+}
@@ -0,0 +1,154 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <uftp_defs.h>
+#include <uftp_payload.h>
+#include <uftp_worker_pool.h>
+
+struct z_stream_s;
+
+///
+/// \brief UftpSupportedCodecs
+/// \return the bitmask of 1 << UftpCodec this build can use.
+///
+uint8_t UftpSupportedCodecs();
+
+///
+/// \brief UftpPickCodec
+/// \return the codec to send with out of codecs, a bitmask of 1 << UftpCodec,
+/// or CODEC_NONE.
+///
+UftpCodec UftpPickCodec(uint8_t codecs);
+
+///
+/// \brief UftpCodecFromName parses "none" or "deflate".
+/// \return false if name isn't a codec this build supports.
+///
+bool UftpCodecFromName(const std::string& name, UftpCodec& codec);
+
+///////////////////////////////////////////////////////////////////////////////
+/// Decompresses chunks sent with CHUNK_FLAG_DEFLATE. Keeps its zlib state
+/// between chunks so there's no allocation per chunk.
+class UftpInflater {
+ public:
+  UftpInflater();
+  ~UftpInflater();
+
+  ///
+  /// \brief Inflate
+  /// \return false unless input is a complete deflate stream of exactly
+  /// output_length bytes.
+  ///
+  bool Inflate(const uint8_t* input, std::size_t input_length,
+               uint8_t* output, std::size_t output_length);
+
+ private:
+  std::unique_ptr<z_stream_s> stream_;
+  bool ready_ = false;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+/// Compresses the message chunks of one outgoing transfer on a worker pool,
+/// up to UftpCompressionLookahead chunks ahead of the send window, a block
+/// of UftpCompressionBlock chunks per job. Sources that allow concurrent
+/// reads are read by the job too, others on the caller's thread when the
+/// block is submitted. The caller never waits: Ready() says whether a chunk
+/// can be taken yet and writes wake_fd once it can.
+///
+/// A chunk that doesn't shrink by at least an eighth is sent raw. After one
+/// of those the next few chunks aren't tried at all, backing off further
+/// each time, so incompressible data costs little more than a CRC.
+class UftpChunkCompressor {
+ public:
+  struct Chunk {
+    uint16_t raw_length = 0;
+    // 0 when the chunk should go raw.
+    uint16_t compressed_length = 0;
+    uint32_t raw_checksum = 0;
+    bool attempt = false;
+    bool done = false;
+    bool failed = false;
+    uint8_t raw[UftpChunkSize];
+    uint8_t compressed[UftpChunkSize];
+  };
+
+  ///
+  /// \param wake_fd an eventfd the caller's loop polls, or -1 to have
+  /// Ready() wait for the chunk instead.
+  ///
+  UftpChunkCompressor(UftpCodec codec, UftpPayloadSource& message,
+                      uint32_t meta_length, uint64_t transfer_length,
+                      UftpWorkerPool& workers, int wake_fd);
+  /// Waits for any chunks still being compressed.
+  ~UftpChunkCompressor();
+
+  /// The first chunk holding nothing but message bytes. Earlier chunks
+  /// aren't compressed.
+  uint32_t FirstChunk() const { return first_chunk_; }
+
+  ///
+  /// \brief Ready submits the blocks up to UftpCompressionLookahead chunks
+  /// past chunk_num.
+  /// \return whether chunk_num can be taken. If not, wake_fd is written once
+  /// it can, unless its block is still waiting on the message's Ready().
+  ///
+  bool Ready(uint32_t chunk_num);
+
+  ///
+  /// \brief Take hands over chunk_num, which must be Ready(). Each chunk can
+  /// be taken once, in order. The chunk stays valid until the next call.
+  /// \return nullptr if the message couldn't be read.
+  ///
+  const Chunk* Take(uint32_t chunk_num);
+
+  /// Bytes taken so far, before and after compression.
+  uint64_t RawBytes() const { return raw_bytes_; }
+  uint64_t CompressedBytes() const { return compressed_bytes_; }
+
+ private:
+  /// Whether the block starting at first_chunk_num can be read without
+  /// waiting on the disk.
+  bool BlockReady(uint32_t first_chunk_num);
+  /// Queues the block of chunks starting at first_chunk_num.
+  void Submit(uint32_t first_chunk_num);
+  /// Fills in chunk_num's raw bytes.
+  bool ReadChunk(uint32_t chunk_num, Chunk& chunk);
+  static void Compress(UftpCodec codec, Chunk& chunk);
+  Chunk& Slot(uint32_t chunk_num) {
+    return chunks_[(chunk_num - first_chunk_) % UftpCompressionLookahead];
+  }
+
+  const UftpCodec codec_;
+  UftpPayloadSource& message_;
+  const bool read_on_workers_;
+  const uint32_t meta_length_;
+  const uint64_t transfer_length_;
+  const uint32_t num_chunks_;
+  const uint32_t first_chunk_;
+  UftpWorkerPool& workers_;
+  const int wake_fd_;
+
+  std::vector<Chunk> chunks_;
+  uint32_t next_submit_;
+
+  // Chunks before skip_until_ aren't tried, see the class comment.
+  uint32_t skip_until_ = 0;
+  uint32_t backoff_;
+
+  uint64_t raw_bytes_ = 0;
+  uint64_t compressed_bytes_ = 0;
+
+  std::mutex mutex_;
+  std::condition_variable chunk_done_;
+  uint32_t pending_ = 0;
+  // Set when Ready() says no, so that whoever finishes waiting_for_ writes
+  // wake_fd_.
+  bool waiting_ = false;
+  uint32_t waiting_for_ = 0;
+};
@@ -0,0 +1,239 @@
+#include <uftp_congestion.h>
+
+#include <algorithm>
+#include <cmath>
+
+#include <uftp_defs.h>
+#include <uftp_trace.h>
+#include <uftp_utils.h>
+
+constexpr int UftpBbr::kBandwidthRounds;
+constexpr int UftpBbr::kGainCycleLength;
+
+namespace {
+
+// RFC 8312 constants.
+constexpr double kCubicC = 0.4;
+constexpr double kCubicBeta = 0.7;
+
+// Gains from the BBR paper. Startup doubles the delivery rate every round,
+// drain undoes the queue that built, probe-bw cycles gently around 1.
+constexpr double kBbrHighGain = 2.89;
+constexpr double kBbrCwndGain = 2.0;
+constexpr double kBbrGainCycle[] = {1.25, 0.75, 1, 1, 1, 1, 1, 1};
+constexpr auto kBbrMinRttWindow = std::chrono::seconds(10);
+constexpr auto kBbrProbeRttDuration = std::chrono::milliseconds(200);
+
+double Seconds(UftpClock::duration duration) {
+  return std::chrono::duration<double>(duration).count();
+}
+
+}  // namespace
+
+///////////////////////////////////////////////////////////////////////////////
+std::shared_ptr<UftpCongestionControl> UftpCongestionControl::Create(
+    const std::string& name) {
+  if (name == "cubic") {
+    return std::make_shared<UftpCubic>();
+  } else if (name == "bbr") {
+    return std::make_shared<UftpBbr>();
+  }
+  return nullptr;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void UftpCubic::OnAck(const AckSample& sample, UftpClock::time_point now) {
+  if (sample.rtt > UftpClock::duration::zero()) {
+    srtt_ = (srtt_ == UftpClock::duration::zero())
+                ? sample.rtt
+                : (7 * srtt_ + sample.rtt) / 8;
+    if (min_rtt_ == UftpClock::duration::zero() || sample.rtt < min_rtt_) {
+      min_rtt_ = sample.rtt;
+    }
+  }
+
+  if (cwnd_ < ssthresh_) {
+    cwnd_ = std::min<double>(cwnd_ + sample.acked_chunks, UftpWindowSize);
+    return;
+  }
+
+  if (!in_epoch_) {
+    in_epoch_ = true;
+    epoch_start_ = now;
+    if (cwnd_ < w_max_) {
+      k_ = std::cbrt((w_max_ - cwnd_) / kCubicC);
+    } else {
+      k_ = 0.0;
+      w_max_ = cwnd_;
+    }
+    w_reno_ = cwnd_;
+  }
+
+  // Where the cubic curve will be one RTT from now, and where Reno would be.
+  const double t = Seconds(now - epoch_start_ + min_rtt_);
+  double target = kCubicC * std::pow(t - k_, 3) + w_max_;
+  w_reno_ += 3 * (1 - kCubicBeta) / (1 + kCubicBeta) * sample.acked_chunks /
+             cwnd_;
+  target = std::min(std::max(target, w_reno_), 1.5 * cwnd_);
+
+  if (target > cwnd_) {
+    cwnd_ += (target - cwnd_) / cwnd_ * sample.acked_chunks;
+  }
+  cwnd_ = std::min<double>(cwnd_, UftpWindowSize);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void UftpCubic::OnLoss(uint32_t in_flight, UftpClock::time_point now) {
+  undo_cwnd_ = cwnd_;
+  undo_ssthresh_ = ssthresh_;
+  undo_w_max_ = w_max_;
+  in_epoch_ = false;
+  // Fast convergence: if we lost before getting back to the last maximum,
+  // another flow probably wants the bandwidth, so leave it some room.
+  w_max_ = (cwnd_ < w_max_) ? cwnd_ * (1 + kCubicBeta) / 2 : cwnd_;
+  cwnd_ = std::max<double>(cwnd_ * kCubicBeta, UftpMinCongestionWindow);
+  ssthresh_ = cwnd_;
+  UFTP_TRACE("cubic loss, cwnd: {}, in flight: {}", cwnd_, in_flight);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void UftpCubic::UndoLoss() {
+  // Whatever the window grew by since the cut is kept, the epoch restarts
+  // from where it ends up.
+  in_epoch_ = false;
+  cwnd_ = std::max(cwnd_, undo_cwnd_);
+  ssthresh_ = std::max(ssthresh_, undo_ssthresh_);
+  w_max_ = undo_w_max_;
+  UFTP_TRACE("cubic undo, cwnd: {}", cwnd_);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+double UftpCubic::PacingRate() const {
+  if (srtt_ == UftpClock::duration::zero()) {
+    return 0.0;
+  }
+  // Same gains as Linux: slow start has to be able to double every RTT.
+  const double gain = (cwnd_ < ssthresh_) ? 2.0 : 1.2;
+  return gain * cwnd_ * UftpChunkSize / Seconds(srtt_);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void UftpBbr::StartRound(UftpClock::time_point now) {
+  ++round_count_;
+  round_end_ = now + std::max<UftpClock::duration>(
+                         min_rtt_, std::chrono::microseconds(100));
+  bandwidth_samples_[round_count_ % kBandwidthRounds] = 0.0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void UftpBbr::OnAck(const AckSample& sample, UftpClock::time_point now) {
+  if (sample.rtt > UftpClock::duration::zero() &&
+      (min_rtt_ == UftpClock::duration::zero() || sample.rtt <= min_rtt_ ||
+       now - min_rtt_stamp_ > kBbrMinRttWindow)) {
+    min_rtt_ = sample.rtt;
+    min_rtt_stamp_ = now;
+  }
+
+  // Rounds are approximated as one min RTT of wall time.
+  const bool round_start = (now >= round_end_);
+  if (round_start) {
+    StartRound(now);
+  }
+
+  if (sample.delivery_rate > 0.0) {
+    double& slot = bandwidth_samples_[round_count_ % kBandwidthRounds];
+    slot = std::max(slot, sample.delivery_rate);
+  }
+  bandwidth_ = *std::max_element(bandwidth_samples_.begin(),
+                                 bandwidth_samples_.end());
+
+  UpdateMode(sample, now, round_start);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void UftpBbr::UpdateMode(const AckSample& sample, UftpClock::time_point now,
+                         bool round_start) {
+  switch (mode_) {
+    case Mode::STARTUP:
+      // The pipe is full once three rounds go by without 25% more bandwidth.
+      if (round_start && bandwidth_ > 0.0) {
+        if (bandwidth_ >= full_bandwidth_ * 1.25) {
+          full_bandwidth_ = bandwidth_;
+          full_bandwidth_rounds_ = 0;
+        } else if (++full_bandwidth_rounds_ >= 3) {
+          full_bandwidth_reached_ = true;
+          mode_ = Mode::DRAIN;
+          pacing_gain_ = 1 / kBbrHighGain;
+          cwnd_gain_ = kBbrHighGain;
+        }
+      }
+      break;
+
+    case Mode::DRAIN:
+      if (sample.in_flight <= BdpChunks()) {
+        mode_ = Mode::PROBE_BW;
+        cycle_index_ = 2;
+        cycle_stamp_ = now;
+        pacing_gain_ = kBbrGainCycle[cycle_index_];
+        cwnd_gain_ = kBbrCwndGain;
+      }
+      break;
+
+    case Mode::PROBE_BW:
+      if (now - cycle_stamp_ > min_rtt_) {
+        cycle_index_ = (cycle_index_ + 1) % kGainCycleLength;
+        cycle_stamp_ = now;
+        pacing_gain_ = kBbrGainCycle[cycle_index_];
+      }
+      break;
+
+    case Mode::PROBE_RTT:
+      if (now >= probe_rtt_done_) {
+        min_rtt_stamp_ = now;
+        if (full_bandwidth_reached_) {
+          mode_ = Mode::PROBE_BW;
+          cycle_stamp_ = now;
+          pacing_gain_ = kBbrGainCycle[cycle_index_];
+          cwnd_gain_ = kBbrCwndGain;
+        } else {
+          mode_ = Mode::STARTUP;
+          pacing_gain_ = kBbrHighGain;
+          cwnd_gain_ = kBbrHighGain;
+        }
+      }
+      return;
+  }
+
+  // The min RTT estimate has gone stale, drain the queue for a moment so the
+  // next sample sees the bare path.
+  if (min_rtt_ != UftpClock::duration::zero() &&
+      now - min_rtt_stamp_ > kBbrMinRttWindow) {
+    mode_ = Mode::PROBE_RTT;
+    pacing_gain_ = 1.0;
+    probe_rtt_done_ = now + std::max<UftpClock::duration>(
+                                kBbrProbeRttDuration, min_rtt_);
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+double UftpBbr::BdpChunks() const {
+  return bandwidth_ * Seconds(min_rtt_);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+uint32_t UftpBbr::CongestionWindow() const {
+  if (mode_ == Mode::PROBE_RTT) {
+    return UftpMinCongestionWindow;
+  }
+  if (bandwidth_ == 0.0 || min_rtt_ == UftpClock::duration::zero()) {
+    return UftpInitialCongestionWindow;
+  }
+  const double cwnd = cwnd_gain_ * BdpChunks() + UftpAckInterval;
+  return std::min<double>(std::max<double>(cwnd, UftpMinCongestionWindow),
+                          UftpWindowSize);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+double UftpBbr::PacingRate() const {
+  return pacing_gain_ * bandwidth_ * UftpChunkSize;
+}
@@ -0,0 +1,138 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include <uftp_defs.h>
+
+using UftpClock = std::chrono::steady_clock;
+
+///////////////////////////////////////////////////////////////////////////////
+/// Decides how many chunks a sender may have in flight and how fast to pace
+/// them out. One controller lives for as long as the peer does, so what it
+/// learns about the path carries over from one transfer to the next.
+class UftpCongestionControl {
+ public:
+  /// What the send window learned from one ack.
+  struct AckSample {
+    uint32_t acked_chunks = 0;  // newly acked by this ack
+    uint32_t in_flight = 0;     // chunks still in flight afterwards
+    // Round trip measured from the ack's timestamp echo, zero if it had none.
+    UftpClock::duration rtt = UftpClock::duration::zero();
+    // Chunks per second delivered while the newest chunk was in flight, zero
+    // if there's no estimate.
+    double delivery_rate = 0.0;
+  };
+
+  virtual ~UftpCongestionControl() {}
+
+  virtual const char* Name() const = 0;
+
+  virtual void OnAck(const AckSample& sample, UftpClock::time_point now) = 0;
+  /// A chunk sent since the last loss event was found lost.
+  virtual void OnLoss(uint32_t in_flight, UftpClock::time_point now) = 0;
+  /// The last loss turned out not to be one, the chunk was only late or
+  /// overtaken. Puts the window back as it was before OnLoss.
+  virtual void UndoLoss() = 0;
+
+  /// Chunks allowed in flight.
+  virtual uint32_t CongestionWindow() const = 0;
+  /// Bytes per second to pace at, 0 to send as fast as the window allows.
+  virtual double PacingRate() const = 0;
+
+  ///
+  /// \brief Create
+  /// \param name "cubic" or "bbr".
+  /// \return nullptr for unknown names.
+  ///
+  static std::shared_ptr<UftpCongestionControl> Create(const std::string& name);
+};
+
+///////////////////////////////////////////////////////////////////////////////
+/// Loss based, along the lines of RFC 8312. Slow start, then the window grows
+/// along a cubic curve centred on the size it was at the last loss, never
+/// slower than Reno would. A loss multiplies the window by kBeta.
+class UftpCubic : public UftpCongestionControl {
+ public:
+  const char* Name() const override { return "cubic"; }
+
+  void OnAck(const AckSample& sample, UftpClock::time_point now) override;
+  void OnLoss(uint32_t in_flight, UftpClock::time_point now) override;
+  void UndoLoss() override;
+
+  uint32_t CongestionWindow() const override { return (uint32_t)cwnd_; }
+  double PacingRate() const override;
+
+ private:
+  double cwnd_ = UftpInitialCongestionWindow;
+  double ssthresh_ = UftpWindowSize;
+  double w_max_ = 0.0;
+  double w_reno_ = 0.0;
+  double k_ = 0.0;
+  bool in_epoch_ = false;
+  UftpClock::time_point epoch_start_;
+  UftpClock::duration srtt_ = UftpClock::duration::zero();
+  UftpClock::duration min_rtt_ = UftpClock::duration::zero();
+  // The window as it was before the last loss, for UndoLoss.
+  double undo_cwnd_ = 0.0;
+  double undo_ssthresh_ = 0.0;
+  double undo_w_max_ = 0.0;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+/// Delay based, modelled on BBR. Estimates the bottleneck bandwidth (max
+/// delivery rate over the last few rounds) and the propagation delay (min
+/// RTT over the last 10 seconds), paces at the bandwidth and keeps about two
+/// bandwidth-delay products in flight. Loss alone doesn't slow it down, so
+/// queues stay short on links shared with latency sensitive traffic.
+class UftpBbr : public UftpCongestionControl {
+ public:
+  const char* Name() const override { return "bbr"; }
+
+  void OnAck(const AckSample& sample, UftpClock::time_point now) override;
+  void OnLoss(uint32_t in_flight, UftpClock::time_point now) override {}
+  void UndoLoss() override {}
+
+  uint32_t CongestionWindow() const override;
+  double PacingRate() const override;
+
+ private:
+  enum class Mode {
+    STARTUP,
+    DRAIN,
+    PROBE_BW,
+    PROBE_RTT,
+  };
+
+  static constexpr int kBandwidthRounds = 10;
+  static constexpr int kGainCycleLength = 8;
+
+  void StartRound(UftpClock::time_point now);
+  void UpdateMode(const AckSample& sample, UftpClock::time_point now,
+                  bool round_start);
+  double BdpChunks() const;
+
+  Mode mode_ = Mode::STARTUP;
+  double pacing_gain_ = 2.89;
+  double cwnd_gain_ = 2.89;
+
+  // Windowed max of the delivery rate, one slot per round.
+  std::array<double, kBandwidthRounds> bandwidth_samples_{};
+  double bandwidth_ = 0.0;  // chunks per second
+  uint64_t round_count_ = 0;
+  UftpClock::time_point round_end_;
+
+  UftpClock::duration min_rtt_ = UftpClock::duration::zero();
+  UftpClock::time_point min_rtt_stamp_;
+
+  double full_bandwidth_ = 0.0;
+  int full_bandwidth_rounds_ = 0;
+  bool full_bandwidth_reached_ = false;
+
+  int cycle_index_ = 0;
+  UftpClock::time_point cycle_stamp_;
+  UftpClock::time_point probe_rtt_done_;
+};
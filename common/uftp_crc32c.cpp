@@ -0,0 +1,184 @@
+#include <uftp_crc32c.h>
+
+#include <cstring>
+
+#include <uftp_defs.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+namespace {
+
+// Reflected Castagnoli polynomial.
+constexpr uint32_t kPolynomial = 0x82f63b78;
+
+///////////////////////////////////////////////////////////////////////////////
+// x^(2^n) mod P for n = 0..31, the building block for shifting a CRC past a
+// run of zeros.
+struct PowerTable {
+  uint32_t powers[32];
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// Multiplies a and b modulo P, in the reflected bit order CRCs use.
+uint32_t MultiplyModP(uint32_t a, uint32_t b) {
+  uint32_t product = 0;
+  for (uint32_t mask = 1u << 31; mask != 0; mask >>= 1) {
+    if (a & mask) {
+      product ^= b;
+    }
+    b = (b & 1) ? (b >> 1) ^ kPolynomial : b >> 1;
+  }
+  return product;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+PowerTable MakePowerTable() {
+  PowerTable table;
+  uint32_t power = 1u << 30;  // x^1
+  for (int n = 0; n < 32; ++n) {
+    table.powers[n] = power;
+    power = MultiplyModP(power, power);
+  }
+  return table;
+}
+
+const PowerTable kPowers = MakePowerTable();
+
+///////////////////////////////////////////////////////////////////////////////
+// x^(8 * length) mod P, which multiplies a CRC by the effect of appending
+// length zero bytes.
+uint32_t ZerosOperator(uint64_t length) {
+  uint32_t op = 1u << 31;  // x^0
+  for (int n = 3; length != 0; length >>= 1, ++n) {
+    if (length & 1) {
+      op = MultiplyModP(kPowers.powers[n % 32], op);
+    }
+  }
+  return op;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Multiplying by a fixed operator is linear in the CRC, so it can be done a
+// byte at a time from tables. Used for the chunk size, which is what nearly
+// every combine shifts by.
+struct ShiftTable {
+  uint32_t bytes[4][256];
+};
+
+ShiftTable MakeShiftTable(uint64_t length) {
+  const uint32_t op = ZerosOperator(length);
+  ShiftTable table;
+  for (int byte = 0; byte < 4; ++byte) {
+    for (uint32_t value = 0; value < 256; ++value) {
+      table.bytes[byte][value] = MultiplyModP(op, value << (8 * byte));
+    }
+  }
+  return table;
+}
+
+const ShiftTable kChunkShift = MakeShiftTable(UftpChunkSize);
+
+///////////////////////////////////////////////////////////////////////////////
+struct SliceTable {
+  uint32_t slices[8][256];
+};
+
+SliceTable MakeSliceTable() {
+  SliceTable table;
+  for (uint32_t value = 0; value < 256; ++value) {
+    uint32_t crc = value;
+    for (int bit = 0; bit < 8; ++bit) {
+      crc = (crc & 1) ? (crc >> 1) ^ kPolynomial : crc >> 1;
+    }
+    table.slices[0][value] = crc;
+  }
+  for (uint32_t value = 0; value < 256; ++value) {
+    for (int slice = 1; slice < 8; ++slice) {
+      const uint32_t previous = table.slices[slice - 1][value];
+      table.slices[slice][value] =
+          (previous >> 8) ^ table.slices[0][previous & 0xff];
+    }
+  }
+  return table;
+}
+
+const SliceTable kSlices = MakeSliceTable();
+
+///////////////////////////////////////////////////////////////////////////////
+uint32_t Crc32cPortable(uint32_t crc, const uint8_t* data,
+                        std::size_t length) {
+  while (length >= 8) {
+    uint64_t word;
+    std::memcpy(&word, data, sizeof(word));
+    word ^= crc;
+    crc = kSlices.slices[7][word & 0xff] ^
+          kSlices.slices[6][(word >> 8) & 0xff] ^
+          kSlices.slices[5][(word >> 16) & 0xff] ^
+          kSlices.slices[4][(word >> 24) & 0xff] ^
+          kSlices.slices[3][(word >> 32) & 0xff] ^
+          kSlices.slices[2][(word >> 40) & 0xff] ^
+          kSlices.slices[1][(word >> 48) & 0xff] ^
+          kSlices.slices[0][word >> 56];
+    data += 8;
+    length -= 8;
+  }
+  while (length-- > 0) {
+    crc = (crc >> 8) ^ kSlices.slices[0][(crc ^ *data++) & 0xff];
+  }
+  return crc;
+}
+
+#if defined(__x86_64__)
+///////////////////////////////////////////////////////////////////////////////
+__attribute__((target("sse4.2"))) uint32_t Crc32cSse42(uint32_t crc,
+                                                       const uint8_t* data,
+                                                       std::size_t length) {
+  uint64_t crc64 = crc;
+  while (length >= 8) {
+    uint64_t word;
+    std::memcpy(&word, data, sizeof(word));
+    crc64 = _mm_crc32_u64(crc64, word);
+    data += 8;
+    length -= 8;
+  }
+  crc = (uint32_t)crc64;
+  while (length-- > 0) {
+    crc = _mm_crc32_u8(crc, *data++);
+  }
+  return crc;
+}
+#endif
+
+///////////////////////////////////////////////////////////////////////////////
+using Crc32cKernel = uint32_t (*)(uint32_t, const uint8_t*, std::size_t);
+
+Crc32cKernel PickKernel() {
+#if defined(__x86_64__)
+  if (__builtin_cpu_supports("sse4.2")) {
+    return Crc32cSse42;
+  }
+#endif
+  return Crc32cPortable;
+}
+
+const Crc32cKernel kKernel = PickKernel();
+
+}  // namespace
+
+///////////////////////////////////////////////////////////////////////////////
+uint32_t UftpCrc32c(uint32_t crc, const void* data, std::size_t length) {
+  return ~kKernel(~crc, static_cast<const uint8_t*>(data), length);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+uint32_t UftpCrc32cCombine(uint32_t crc1, uint32_t crc2, uint64_t length2) {
+  if (length2 == UftpChunkSize) {
+    return kChunkShift.bytes[0][crc1 & 0xff] ^
+           kChunkShift.bytes[1][(crc1 >> 8) & 0xff] ^
+           kChunkShift.bytes[2][(crc1 >> 16) & 0xff] ^
+           kChunkShift.bytes[3][crc1 >> 24] ^ crc2;
+  }
+  return MultiplyModP(ZerosOperator(length2), crc1) ^ crc2;
+}
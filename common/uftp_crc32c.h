@@ -0,0 +1,18 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+///
+/// \brief UftpCrc32c extends crc, the CRC32C (Castagnoli) of some earlier
+/// bytes, with length more. Start from 0. Uses the SSE4.2 crc32 instruction
+/// when the CPU has it, slicing-by-8 tables otherwise.
+///
+uint32_t UftpCrc32c(uint32_t crc, const void* data, std::size_t length);
+
+///
+/// \brief UftpCrc32cCombine
+/// \return the CRC32C of A followed by B, given crc1 of A and crc2 of B,
+/// which is length2 bytes long. Cheapest when length2 is UftpChunkSize.
+///
+uint32_t UftpCrc32cCombine(uint32_t crc1, uint32_t crc2, uint64_t length2);
@@ -2,6 +2,7 @@
 
 #include <arpa/inet.h>
 #include <cstdint>
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -12,13 +13,133 @@ enum UftpStatusCode {
   ERR_BAD_PERMISSIONS,
   ERR_BAD_COMMAND,
   ERR_UNKNOWN,
+  ERR_DELTA_TOO_LARGE,
+  // A ranged transfer was asked to carry on from another version of the
+  // file, see UftpMessage::file_mtime_ns.
+  ERR_FILE_CHANGED,
+  // The server never answered. Only ever set by the client, see
+  // UftpClient::Exchange().
+  ERR_NO_RESPONSE,
 };
 
 #define UftpSyncWord (0x55555555)
-#define UftpMTU (65000)
-#define UftpAck ('!')
 
-using UftpAckType = uint8_t;
+// Wire formats of a transfer's meta bytes, see UftpMeta. Servers answer in
+// the version they were asked in.
+#define UftpProtocolV1 (1)
+#define UftpProtocolV2 (2)
+#define UftpProtocolV3 (3)
+#define UftpProtocolVersion UftpProtocolV3
+
+// Windowed transport parameters. A chunk is the payload of one datagram.
+#define UftpChunkSize (1400)
+#define UftpWindowSize (1024)
+#define UftpAckInterval (16)
+// Retransmit timeout bounds, see UftpRttEstimator. The initial RTO is used
+// until the first round trip has been measured. The floor is the 200 ms
+// Linux uses, any lower and a late ack or a descheduled peer reads as loss.
+#define UftpInitialRetransmitTimeoutMs (250)
+#define UftpMinRetransmitTimeoutMs (200)
+#define UftpMaxRetransmitTimeoutMs (2000)
+#define UftpIdleTimeoutMs (5000)
+#define UftpFinalAckCopies (3)
+
+// Congestion control, see UftpCongestionControl. Windows are in chunks.
+#define UftpDefaultCongestionControl "cubic"
+#define UftpInitialCongestionWindow (32)
+#define UftpMinCongestionWindow (4)
+// Paced chunks may go out this far ahead of schedule, so each timer wakeup
+// sends a small burst rather than a single datagram.
+#define UftpPacingBurstUs (500)
+// Forward error correction, see UftpFecController. Bounds on how many chunks
+// one XOR parity datagram covers.
+#define UftpFecMinGroupSize (4)
+#define UftpFecMaxGroupSize (64)
+// How many chunks ahead of the sender the compression workers run, see
+// UftpChunkCompressor.
+#define UftpCompressionLookahead (64)
+// Chunks read and compressed per worker job. Divides the lookahead.
+#define UftpCompressionBlock (16)
+// Most datagrams handed to the kernel per sendmmsg/recvmmsg.
+#define UftpBatchSize (64)
+// How soon a send the kernel pushed back on is tried again. ENOBUFS, unlike
+// a full socket buffer, never shows up as writable.
+#define UftpSendRetryUs (1000)
+// How long the server keeps an idle client's session, and with it the cached
+// response to its last request.
+#define UftpSessionTimeoutMs (60000)
+
+// Per-transfer buffer used when streaming files to and from disk.
+#define UftpStreamBufferSize (1 << 20)
+// A file sink syncs its data and rewrites its checkpoint after this many
+// bytes, which bounds what an interrupted transfer has to fetch again.
+#define UftpCheckpointInterval (64 << 20)
+// Striped transfers, see UftpClient::SetStreams(). Stripes are at least
+// UftpMinStripeSize bytes, so smaller files use fewer streams.
+#define UftpMaxStreams (64)
+#define UftpMinStripeSize (4 << 20)
+// Parallel sessions mget and mput run over, see
+// UftpClient::SetPipelineDepth().
+#define UftpDefaultPipelineDepth (8)
+#define UftpMaxPipelineDepth (64)
+// Total length of the files each server keeps mapped, see UftpFileCache.
+#define UftpDefaultFileCacheSize (256 << 20)
+// Requests the server keeps in flight to disk, and the size of each, see
+// UftpDiskEngine. Also the buffers it owns, so queue depth times size bytes.
+#define UftpDiskQueueDepth (32)
+#define UftpDiskBufferSize (256 << 10)
+// Engine buffers a UftpFileSource keeps reading ahead into.
+#define UftpReadAheadBuffers (4)
+// Biggest block UftpBufferPool recycles, and how much each thread keeps free.
+#define UftpMaxPooledBlock (8 << 20)
+#define UftpBufferPoolCacheSize (64 << 20)
+// Directory entries per "ls" page, see UftpListing.
+#define UftpListPageSize (1000)
+#define UftpMaxListPageSize (10000)
+// Largest message ReceiveMessage will hold in memory. Anything bigger has to
+// be streamed to a sink.
+#define UftpMaxBufferedMessageSize (64 << 20)
+// How often the server rewrites its --metrics-file, see UftpMetrics.
+#define UftpDefaultMetricsIntervalMs (10000)
+// Events each thread's trace ring keeps, a power of two, see UftpTrace.
+#define UftpTraceRingSize (4096)
+// Where a process dumps its trace unless told otherwise.
+#define UftpDefaultTraceDir "/tmp"
+
+///////////////////////////////////////////////////////////////////////////////
+enum UftpDatagramType {
+  DATAGRAM_DATA = 1,
+  DATAGRAM_ACK,
+  DATAGRAM_PARITY,
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// Payload compression, applied to each chunk of a message on its own.
+enum UftpCodec {
+  CODEC_NONE = 0,
+  CODEC_DEFLATE,
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// What a request asks the server to do. v2 meta carries these in place of
+// the command string, see UftpMeta.
+enum UftpOpcode : uint8_t {
+  OP_UNKNOWN = 0,
+  OP_EXIT,
+  OP_LS,
+  OP_GET,
+  OP_PUT,
+  OP_STAT,
+  OP_CHECKPOINT,
+  OP_SIGNATURE,
+  OP_DIFF,
+  OP_PATCH,
+  OP_DELETE,
+  // Asks for the highest protocol version the server speaks, a single byte.
+  OP_VERSION,
+  // Asks for the server's metrics, as Prometheus text.
+  OP_STATS,
+};
 
 ///////////////////////////////////////////////////////////////////////////////
 struct __attribute__((packed)) UftpHeader {
@@ -28,22 +149,181 @@ struct __attribute__((packed)) UftpHeader {
   uint16_t argument_length = 0;
   uint64_t message_length = 0;
   uint32_t sequence_num = 0;
+  // The message is bytes [range_offset, range_offset + message_length) of a
+  // file file_length long. A get asks for range_length bytes from
+  // range_offset, 0 meaning up to the end of the file.
+  uint64_t range_offset = 0;
+  uint64_t range_length = 0;
+  uint64_t file_length = 0;
+  // Bitmask of 1 << UftpCodec the sender of this message is willing to use,
+  // in either direction. Payloads are only ever compressed with a codec
+  // both ends have offered.
+  uint8_t codecs = 0;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+enum UftpChunkFlags {
+  // transfer_checksum is set, see UftpChunkHeader.
+  CHUNK_FLAG_TRANSFER_CHECKSUM = 1 << 0,
+  // The chunk is covered by a parity datagram, see UftpParityHeader.
+  CHUNK_FLAG_FEC = 1 << 1,
+  // The payload is the chunk's bytes compressed with raw deflate. The
+  // chunk's length is still what its place in the transfer says.
+  CHUNK_FLAG_DEFLATE = 1 << 2,
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// Every transfer is the byte stream [UftpHeader | command | argument | message]
+// cut into UftpChunkSize pieces. The first meta_length bytes are the header,
+// command and argument, everything after that is the message.
+//
+// checksum is the CRC32C of the payload followed by this header with checksum
+// zeroed. Chunks that don't match are dropped, and the hole they leave is
+// reported in the next ack like any other loss. Once the sender has built
+// every chunk it also sets transfer_checksum, the CRC32C of the whole
+// transfer, so the receiver can check the chunks were put back together
+// right. That's one transfer, not the file: a file pieced together from
+// ranges, by resume or over several streams, only has each range checked.
+struct __attribute__((packed)) UftpChunkHeader {
+  uint32_t sync = UftpSyncWord;
+  uint8_t type = DATAGRAM_DATA;
+  uint8_t flags = 0;
+  uint16_t payload_length = 0;
+  uint32_t transfer_id = 0;
+  uint32_t chunk_num = 0;
+  uint32_t meta_length = 0;
+  uint64_t transfer_length = 0;
+  uint32_t timestamp = 0;  // sender's clock, see UftpTimestamp()
+  uint32_t transfer_checksum = 0;
+  uint32_t checksum = 0;
 };
 
+///////////////////////////////////////////////////////////////////////////////
+// XOR of the payloads of chunks [first_chunk, first_chunk + num_chunks), each
+// zero padded to payload_length. Follows the last chunk it covers, and lets
+// the receiver rebuild any one of them that goes missing without waiting a
+// round trip for the retransmit. checksum is as for UftpChunkHeader.
+struct __attribute__((packed)) UftpParityHeader {
+  uint32_t sync = UftpSyncWord;
+  uint8_t type = DATAGRAM_PARITY;
+  uint8_t flags = 0;
+  uint16_t payload_length = 0;
+  uint32_t transfer_id = 0;
+  uint32_t first_chunk = 0;
+  uint32_t num_chunks = 0;
+  uint32_t checksum = 0;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// Selective ack. Every chunk below cumulative_ack has been received, bit i of
+// the trailing bitmap (bitmap_length bytes) covers chunk cumulative_ack + 1 + i.
+// timestamp_echo is the timestamp of the latest chunk that moved
+// cumulative_ack, 0 if none has.
+// recovered_chunks counts the chunks of the transfer rebuilt from parity so
+// far, which the sender needs to see the loss its parity is hiding.
+// checksum is the CRC32C of this header with checksum zeroed followed by the
+// bitmap.
+struct __attribute__((packed)) UftpAckHeader {
+  uint32_t sync = UftpSyncWord;
+  uint8_t type = DATAGRAM_ACK;
+  uint8_t flags = 0;
+  uint16_t bitmap_length = 0;
+  uint32_t transfer_id = 0;
+  uint32_t cumulative_ack = 0;
+  uint32_t timestamp_echo = 0;
+  uint32_t recovered_chunks = 0;
+  uint32_t checksum = 0;
+};
+
+class UftpPayloadSource;
+class UftpPayloadSink;
+
 ///////////////////////////////////////////////////////////////////////////////
 struct UftpMessage {
   UftpMessage() {}
   UftpMessage(std::string command_in, std::vector<uint8_t> message_in)
       : command(command_in), message(message_in) {}
 
+  ///
+  /// \brief Reset empties the message for the next request, keeping the
+  /// storage its strings and buffer have grown so that, once warmed up, a
+  /// connection builds its messages without allocating. A buffer bigger
+  /// than UftpMaxPooledBlock is let go of rather than held on to.
+  ///
+  void Reset() {
+    header = UftpHeader();
+    command.clear();
+    argument.clear();
+    if (message.capacity() > UftpMaxPooledBlock) {
+      std::vector<uint8_t>().swap(message);
+    } else {
+      message.clear();
+    }
+    message_source.reset();
+    message_sink.reset();
+    codec = CODEC_NONE;
+    file_mtime_ns = 0;
+    opcode = OP_UNKNOWN;
+    version = UftpProtocolV1;
+  }
+
   UftpHeader header = UftpHeader();
   std::string command;
   std::string argument;
   std::vector<uint8_t> message;
+
+  // command as an opcode, set on received messages.
+  UftpOpcode opcode = OP_UNKNOWN;
+  // Meta format the message is sent in, or was received in.
+  uint8_t version = UftpProtocolV1;
+
+  // When set, the message is streamed from message_source instead of being
+  // sent from `message`. A received message records its sink here.
+  std::shared_ptr<UftpPayloadSource> message_source;
+  std::shared_ptr<UftpPayloadSink> message_sink;
+
+  // Compress the message with this when sending it.
+  UftpCodec codec = CODEC_NONE;
+
+  // Modification time of the file the transfer's bytes come from, 0 if
+  // unknown. Only carried from v3 on, see UftpMeta. Gets answer with the
+  // file's, puts and ranged gets send the one their ranges belong to so the
+  // receiving end can refuse to mix versions with ERR_FILE_CHANGED.
+  uint64_t file_mtime_ns = 0;
 };
 
+class UftpBatchIo;
+class UftpCongestionControl;
+class UftpFecController;
+class UftpRttEstimator;
+class UftpWorkerPool;
+
 ///////////////////////////////////////////////////////////////////////////////
 struct UftpSocketHandle {
   int sockfd;
   sockaddr_in addr;
+
+  // All datagrams to and from sockfd go through here.
+  std::shared_ptr<UftpBatchIo> batch_io;
+
+  // What we know about the path to addr: the congestion controller pacing
+  // and limiting what's sent and the RTT estimate behind the retransmit
+  // timeout. Lives as long as the handle so it outlives a single transfer.
+  std::shared_ptr<UftpCongestionControl> congestion;
+  std::shared_ptr<UftpRttEstimator> rtt;
+  // Set when outgoing transfers should carry parity.
+  std::shared_ptr<UftpFecController> fec;
+  // Set when outgoing transfers may be compressed, which runs here.
+  std::shared_ptr<UftpWorkerPool> workers;
+  // An eventfd the workers write when a chunk the sender is waiting for has
+  // been compressed. The sender polls it along with sockfd. Owned by
+  // whoever set it, -1 has the sender wait for the workers instead.
+  int wake_fd = -1;
+
+  // Transfer bookkeeping. The last received transfer is remembered so that
+  // retransmits arriving after completion can be re-acked.
+  uint32_t next_transfer_id = 0;
+  uint32_t last_rx_transfer_id = 0;
+  uint32_t last_rx_num_chunks = 0;
+  bool has_last_rx = false;
 };
@@ -0,0 +1,374 @@
+#include <uftp_delta.h>
+
+#include <openssl/evp.h>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <memory>
+#include <unordered_map>
+
+#include <uftp_defs.h>
+#include <uftp_payload.h>
+#include <uftp_utils.h>
+
+namespace {
+
+constexpr uint32_t kSignatureMagic = 0x47495355;  // "USIG"
+constexpr uint32_t kDeltaMagic = 0x4c454455;      // "UDEL"
+
+// Block sizes as rsync picks them: about the square root of the file.
+constexpr uint32_t kMinBlockSize = 700;
+constexpr uint32_t kMaxBlockSize = 128 << 10;
+
+constexpr std::size_t kStrongHashLength = 16;
+constexpr std::size_t kDigestLength = 32;
+
+struct __attribute__((packed)) SignatureHeader {
+  uint32_t magic = kSignatureMagic;
+  uint32_t block_size = 0;
+  uint64_t file_length = 0;
+  uint32_t num_blocks = 0;
+};
+
+struct __attribute__((packed)) BlockSignature {
+  uint32_t weak = 0;
+  uint8_t strong[kStrongHashLength];
+};
+
+struct __attribute__((packed)) DeltaHeader {
+  uint32_t magic = kDeltaMagic;
+  uint32_t block_size = 0;
+  uint64_t file_length = 0;
+  uint8_t digest[kDigestLength];  // SHA-256 of the new file
+};
+
+enum DeltaOp : uint8_t {
+  DELTA_COPY = 1,  // uint32_t first_block, uint32_t num_blocks
+  DELTA_LITERAL,   // uint32_t length, then length bytes
+};
+
+struct __attribute__((packed)) CopyOp {
+  uint8_t op = DELTA_COPY;
+  uint32_t first_block = 0;
+  uint32_t num_blocks = 0;
+};
+
+struct __attribute__((packed)) LiteralOp {
+  uint8_t op = DELTA_LITERAL;
+  uint32_t length = 0;
+};
+
+using DigestContext =
+    std::unique_ptr<EVP_MD_CTX, decltype(&EVP_MD_CTX_free)>;
+
+///////////////////////////////////////////////////////////////////////////////
+// The rsync rolling checksum. Two 16 bit sums, the plain sum of the bytes in
+// the window and the sum of those sums, which can both be slid along by one
+// byte in constant time.
+class RollingChecksum {
+ public:
+  void Reset(const uint8_t* data, uint32_t length) {
+    a_ = b_ = 0;
+    for (uint32_t index = 0; index < length; ++index) {
+      a_ += data[index];
+      b_ += (length - index) * data[index];
+    }
+    length_ = length;
+  }
+
+  void Roll(uint8_t out, uint8_t in) {
+    a_ += in - out;
+    b_ += a_ - length_ * out;
+  }
+
+  uint32_t Value() const { return (a_ & 0xffff) | (b_ << 16); }
+
+ private:
+  uint32_t a_ = 0;
+  uint32_t b_ = 0;
+  uint32_t length_ = 0;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+void StrongHash(const uint8_t* data, std::size_t length,
+                uint8_t (&hash)[kStrongHashLength]) {
+  uint8_t digest[EVP_MAX_MD_SIZE];
+  unsigned int digest_length = 0;
+  EVP_Digest(data, length, digest, &digest_length, EVP_sha256(), nullptr);
+  std::memcpy(hash, digest, kStrongHashLength);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+template <typename T>
+void Append(std::vector<uint8_t>& buffer, const T& value) {
+  const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&value);
+  buffer.insert(buffer.end(), bytes, bytes + sizeof(value));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+template <typename T>
+bool Consume(const std::vector<uint8_t>& buffer, std::size_t& offset,
+             T& value) {
+  if (buffer.size() - offset < sizeof(value)) {
+    return false;
+  }
+  std::memcpy(&value, buffer.data() + offset, sizeof(value));
+  offset += sizeof(value);
+  return true;
+}
+
+}  // namespace
+
+///////////////////////////////////////////////////////////////////////////////
+uint32_t UftpDelta::BlockSizeFor(uint64_t file_length) {
+  uint64_t block_size = std::sqrt((double)file_length);
+  block_size = std::max<uint64_t>(block_size & ~7ull, kMinBlockSize);
+  block_size = std::min<uint64_t>(block_size, kMaxBlockSize);
+
+  // Very large files get bigger blocks so the signature still fits in
+  // memory.
+  const uint64_t max_blocks =
+      UftpMaxBufferedMessageSize / sizeof(BlockSignature);
+  return std::max(block_size, (file_length + max_blocks - 1) / max_blocks);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+UftpStatusCode UftpDelta::ComputeSignature(const std::string& filename,
+                                           std::vector<uint8_t>& signature) {
+  UftpMappedFileSource file;
+  const UftpStatusCode status = file.Open(filename);
+  if (status != UftpStatusCode::NO_ERR) {
+    return status;
+  }
+  const uint8_t* data = file.Read(0, file.Length(), nullptr);
+
+  // Only whole blocks, whatever is left over at the end is never matched.
+  SignatureHeader header;
+  header.block_size = BlockSizeFor(file.Length());
+  header.file_length = file.Length();
+  header.num_blocks = file.Length() / header.block_size;
+
+  signature.clear();
+  signature.reserve(sizeof(header) +
+                    header.num_blocks * sizeof(BlockSignature));
+  Append(signature, header);
+
+  RollingChecksum checksum;
+  for (uint32_t block = 0; block < header.num_blocks; ++block) {
+    const uint8_t* block_data = data + (uint64_t)block * header.block_size;
+    BlockSignature block_signature;
+    checksum.Reset(block_data, header.block_size);
+    block_signature.weak = checksum.Value();
+    StrongHash(block_data, header.block_size, block_signature.strong);
+    Append(signature, block_signature);
+  }
+  DEBUG_LOG("Signature of ", filename, ": ", header.num_blocks, " blocks of ",
+            header.block_size);
+  return UftpStatusCode::NO_ERR;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+UftpStatusCode UftpDelta::ComputeDelta(const std::string& filename,
+                                       const std::vector<uint8_t>& signature,
+                                       std::vector<uint8_t>& delta) {
+  std::size_t signature_offset = 0;
+  SignatureHeader signature_header;
+  if (!Consume(signature, signature_offset, signature_header) ||
+      signature_header.magic != kSignatureMagic ||
+      signature_header.block_size == 0 ||
+      signature.size() - signature_offset !=
+          (uint64_t)signature_header.num_blocks * sizeof(BlockSignature)) {
+    return UftpStatusCode::ERR_BAD_COMMAND;
+  }
+  const uint32_t block_size = signature_header.block_size;
+  std::vector<BlockSignature> blocks(signature_header.num_blocks);
+  std::memcpy(blocks.data(), signature.data() + signature_offset,
+              blocks.size() * sizeof(BlockSignature));
+
+  // Most windows won't match anything, so a bitmap of the weak checksums
+  // turns most of them away before the hash table is consulted.
+  constexpr uint32_t kFilterBits = 1 << 20;
+  std::vector<uint64_t> filter(kFilterBits / 64);
+  const auto filter_slot = [](uint32_t weak) {
+    return (weak ^ (weak >> 12)) & (kFilterBits - 1);
+  };
+  std::unordered_map<uint32_t, std::vector<uint32_t>> blocks_by_weak;
+  for (uint32_t block = 0; block < blocks.size(); ++block) {
+    const uint32_t slot = filter_slot(blocks[block].weak);
+    filter[slot / 64] |= 1ull << (slot % 64);
+    blocks_by_weak[blocks[block].weak].push_back(block);
+  }
+
+  UftpMappedFileSource file;
+  const UftpStatusCode status = file.Open(filename);
+  if (status != UftpStatusCode::NO_ERR) {
+    return status;
+  }
+  const uint64_t length = file.Length();
+  const uint8_t* data = file.Read(0, length, nullptr);
+  const uint64_t max_delta_length =
+      std::min<uint64_t>(length, UftpMaxBufferedMessageSize);
+
+  DeltaHeader header;
+  header.block_size = block_size;
+  header.file_length = length;
+  unsigned int digest_length = 0;
+  EVP_Digest(data, length, header.digest, &digest_length, EVP_sha256(),
+             nullptr);
+  delta.clear();
+  Append(delta, header);
+
+  // Consecutive matching blocks are sent as one run.
+  CopyOp run;
+  const auto flush_run = [&]() {
+    if (run.num_blocks > 0) {
+      Append(delta, run);
+      run.num_blocks = 0;
+    }
+  };
+  const auto append_literal = [&](uint64_t start, uint64_t end) {
+    if (end > start) {
+      flush_run();
+      LiteralOp literal;
+      literal.length = end - start;
+      Append(delta, literal);
+      delta.insert(delta.end(), data + start, data + end);
+    }
+  };
+
+  RollingChecksum checksum;
+  bool checksum_valid = false;
+  uint64_t literal_start = 0;
+  uint64_t position = 0;
+  while (position + block_size <= length) {
+    if (delta.size() + (position - literal_start) >= max_delta_length) {
+      return UftpStatusCode::ERR_DELTA_TOO_LARGE;
+    }
+    if (!checksum_valid) {
+      checksum.Reset(data + position, block_size);
+      checksum_valid = true;
+    }
+
+    const uint32_t weak = checksum.Value();
+    const uint32_t slot = filter_slot(weak);
+    int64_t matched_block = -1;
+    if (filter[slot / 64] & (1ull << (slot % 64))) {
+      const auto candidates = blocks_by_weak.find(weak);
+      if (candidates != blocks_by_weak.end()) {
+        uint8_t strong[kStrongHashLength];
+        StrongHash(data + position, block_size, strong);
+        for (const uint32_t block : candidates->second) {
+          if (std::memcmp(blocks[block].strong, strong, sizeof(strong)) != 0) {
+            continue;
+          }
+          matched_block = block;
+          // Carrying on the current run is cheapest.
+          if (run.num_blocks > 0 &&
+              block == run.first_block + run.num_blocks) {
+            break;
+          }
+        }
+      }
+    }
+
+    if (matched_block >= 0) {
+      append_literal(literal_start, position);
+      if (run.num_blocks == 0 ||
+          matched_block != run.first_block + run.num_blocks) {
+        flush_run();
+        run.first_block = matched_block;
+      }
+      ++run.num_blocks;
+      position += block_size;
+      literal_start = position;
+      checksum_valid = false;
+    } else {
+      if (position + block_size < length) {
+        checksum.Roll(data[position], data[position + block_size]);
+      }
+      ++position;
+    }
+  }
+  append_literal(literal_start, length);
+  flush_run();
+
+  if (delta.size() >= max_delta_length) {
+    return UftpStatusCode::ERR_DELTA_TOO_LARGE;
+  }
+  DEBUG_LOG("Delta of ", filename, ": ", delta.size(), " bytes for ", length);
+  return UftpStatusCode::NO_ERR;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+UftpStatusCode UftpDelta::ApplyDelta(const std::string& filename,
+                                     const std::vector<uint8_t>& delta,
+                                     std::size_t buffer_size) {
+  std::size_t delta_offset = 0;
+  DeltaHeader header;
+  if (!Consume(delta, delta_offset, header) || header.magic != kDeltaMagic) {
+    return UftpStatusCode::ERR_BAD_COMMAND;
+  }
+
+  UftpMappedFileSource basis;
+  UftpStatusCode status = basis.Open(filename);
+  if (status != UftpStatusCode::NO_ERR) {
+    return status;
+  }
+  const uint8_t* basis_data = basis.Read(0, basis.Length(), nullptr);
+
+  UftpFileSink sink(buffer_size);
+  // The whole file, so a put or resume of it in progress isn't joined.
+  status = sink.Open(filename, header.file_length, 0, header.file_length);
+  if (status != UftpStatusCode::NO_ERR) {
+    return status;
+  }
+
+  DigestContext digest_context(EVP_MD_CTX_new(), EVP_MD_CTX_free);
+  EVP_DigestInit_ex(digest_context.get(), EVP_sha256(), nullptr);
+
+  uint64_t file_offset = 0;
+  const auto write = [&](const uint8_t* data, uint64_t length) {
+    if (length > header.file_length - file_offset) {
+      return false;
+    }
+    sink.Write(file_offset, data, length);
+    EVP_DigestUpdate(digest_context.get(), data, length);
+    file_offset += length;
+    return true;
+  };
+
+  bool valid = true;
+  uint8_t op = 0;
+  while (valid && delta_offset < delta.size()) {
+    std::memcpy(&op, delta.data() + delta_offset, sizeof(op));
+    if (op == DELTA_COPY) {
+      CopyOp copy;
+      valid = Consume(delta, delta_offset, copy);
+      const uint64_t start = (uint64_t)copy.first_block * header.block_size;
+      const uint64_t length = (uint64_t)copy.num_blocks * header.block_size;
+      valid = valid && start <= basis.Length() &&
+              length <= basis.Length() - start &&
+              write(basis_data + start, length);
+    } else if (op == DELTA_LITERAL) {
+      LiteralOp literal;
+      valid = Consume(delta, delta_offset, literal) &&
+              literal.length <= delta.size() - delta_offset &&
+              write(delta.data() + delta_offset, literal.length);
+      delta_offset += literal.length;
+    } else {
+      valid = false;
+    }
+  }
+
+  uint8_t digest[EVP_MAX_MD_SIZE];
+  unsigned int digest_length = 0;
+  EVP_DigestFinal_ex(digest_context.get(), digest, &digest_length);
+  if (!valid || file_offset != header.file_length ||
+      std::memcmp(digest, header.digest, kDigestLength) != 0) {
+    // Most likely the old copy changed since its signature was taken.
+    DEBUG_LOG("Delta doesn't reproduce ", filename);
+    sink.Discard();
+    return UftpStatusCode::ERR_UNKNOWN;
+  }
+  return sink.Finish();
+}
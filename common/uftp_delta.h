@@ -0,0 +1,52 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <uftp_defs.h>
+
+///////////////////////////////////////////////////////////////////////////////
+/// rsync style delta transfer. The side that has an old copy of a file sends
+/// a signature of it: a weak rolling checksum and a strong hash for every
+/// block. The side with the new copy scans it for blocks the old one already
+/// has and answers with a delta of block references and literal bytes,
+/// which the first side replays against its old copy.
+///
+/// Everything works on whole files by name. Signatures and deltas are kept
+/// in memory, so they're capped at UftpMaxBufferedMessageSize.
+class UftpDelta {
+ public:
+  ///
+  /// \brief ComputeSignature
+  /// \param filename the old copy.
+  /// \param signature filled with the block signatures of filename.
+  ///
+  static UftpStatusCode ComputeSignature(const std::string& filename,
+                                         std::vector<uint8_t>& signature);
+
+  ///
+  /// \brief ComputeDelta
+  /// \param filename the new copy.
+  /// \param signature from ComputeSignature() on the old copy.
+  /// \param delta filled with what turns the old copy into filename.
+  /// \return ERR_DELTA_TOO_LARGE if the delta would be no smaller than the
+  /// file or wouldn't fit in memory, in which case the whole file should be
+  /// sent instead.
+  ///
+  static UftpStatusCode ComputeDelta(const std::string& filename,
+                                     const std::vector<uint8_t>& signature,
+                                     std::vector<uint8_t>& delta);
+
+  ///
+  /// \brief ApplyDelta rebuilds filename from its old copy and delta. The new
+  /// file is checked against the digest in the delta before it replaces the
+  /// old one.
+  ///
+  static UftpStatusCode ApplyDelta(const std::string& filename,
+                                   const std::vector<uint8_t>& delta,
+                                   std::size_t buffer_size);
+
+ private:
+  static uint32_t BlockSizeFor(uint64_t file_length);
+};
@@ -0,0 +1,292 @@
+#include <uftp_disk_engine.h>
+
+#include <errno.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstring>
+
+#include <uftp_defs.h>
+#include <uftp_metrics.h>
+#include <uftp_utils.h>
+
+namespace {
+
+// Syncs don't take a buffer, so they get request slots of their own.
+constexpr unsigned kSyncRequests = 4;
+
+}  // namespace
+
+///////////////////////////////////////////////////////////////////////////////
+UftpDiskEngine::UftpDiskEngine(unsigned queue_depth, std::size_t buffer_size,
+                               bool use_io_uring)
+    : buffer_size_(buffer_size),
+      requests_(std::max(queue_depth, 1u) + kSyncRequests) {
+  queue_depth = requests_.size() - kSyncRequests;
+  buffers_length_ = queue_depth * buffer_size_;
+  void* buffers = mmap(nullptr, buffers_length_, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  UftpUtils::CheckErr(buffers == MAP_FAILED ? -1 : 0,
+                      "Error allocating disk buffers");
+  buffers_ = static_cast<uint8_t*>(buffers);
+  for (int buffer = queue_depth - 1; buffer >= 0; --buffer) {
+    free_buffers_.push_back(buffer);
+  }
+  for (uint64_t request = requests_.size(); request > 0; --request) {
+    free_requests_.push_back(request - 1);
+  }
+
+  event_fd_ = UftpUtils::CheckErr(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC),
+                                  "Error creating eventfd");
+  if (use_io_uring && !SetUpRing(requests_.size())) {
+    DEBUG_LOG("No io_uring, errno = ", std::strerror(errno),
+              ", disk I/O is synchronous");
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+UftpDiskEngine::~UftpDiskEngine() {
+  // The kernel may still be writing into the buffers.
+  while (in_flight_ > 0) {
+    Wait();
+  }
+  if (ring_fd_ >= 0) {
+    munmap(sqes_, sqes_length_);
+    if (cq_ring_ != sq_ring_) {
+      munmap(cq_ring_, cq_ring_length_);
+    }
+    munmap(sq_ring_, sq_ring_length_);
+    close(ring_fd_);
+  }
+  close(event_fd_);
+  munmap(buffers_, buffers_length_);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bool UftpDiskEngine::SetUpRing(unsigned entries) {
+  io_uring_params params;
+  std::memset(&params, 0, sizeof(params));
+  const int ring_fd = syscall(__NR_io_uring_setup, entries, &params);
+  if (ring_fd < 0) {
+    return false;
+  }
+
+  sq_ring_length_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cq_ring_length_ =
+      params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+  const bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+  if (single_mmap) {
+    sq_ring_length_ = cq_ring_length_ =
+        std::max(sq_ring_length_, cq_ring_length_);
+  }
+  sq_ring_ = mmap(nullptr, sq_ring_length_, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+  if (sq_ring_ == MAP_FAILED) {
+    close(ring_fd);
+    return false;
+  }
+  cq_ring_ = single_mmap
+                 ? sq_ring_
+                 : mmap(nullptr, cq_ring_length_, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring_fd,
+                        IORING_OFF_CQ_RING);
+  sqes_length_ = params.sq_entries * sizeof(io_uring_sqe);
+  void* sqes = mmap(nullptr, sqes_length_, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+  if (cq_ring_ == MAP_FAILED || sqes == MAP_FAILED) {
+    if (sqes != MAP_FAILED) munmap(sqes, sqes_length_);
+    if (cq_ring_ != MAP_FAILED && !single_mmap) {
+      munmap(cq_ring_, cq_ring_length_);
+    }
+    munmap(sq_ring_, sq_ring_length_);
+    close(ring_fd);
+    return false;
+  }
+  sqes_ = static_cast<io_uring_sqe*>(sqes);
+
+  uint8_t* sq_ring = static_cast<uint8_t*>(sq_ring_);
+  sq_tail_ = reinterpret_cast<unsigned*>(sq_ring + params.sq_off.tail);
+  sq_mask_ = reinterpret_cast<unsigned*>(sq_ring + params.sq_off.ring_mask);
+  sq_array_ = reinterpret_cast<unsigned*>(sq_ring + params.sq_off.array);
+  uint8_t* cq_ring = static_cast<uint8_t*>(cq_ring_);
+  cq_head_ = reinterpret_cast<unsigned*>(cq_ring + params.cq_off.head);
+  cq_tail_ = reinterpret_cast<unsigned*>(cq_ring + params.cq_off.tail);
+  cq_mask_ = reinterpret_cast<unsigned*>(cq_ring + params.cq_off.ring_mask);
+  cqes_ = reinterpret_cast<io_uring_cqe*>(cq_ring + params.cq_off.cqes);
+  ring_fd_ = ring_fd;
+
+  // Registering the buffers pins them, which RLIMIT_MEMLOCK may not allow.
+  // Plain reads and writes into them work all the same.
+  std::vector<iovec> iovs(free_buffers_.size());
+  for (std::size_t buffer = 0; buffer < iovs.size(); ++buffer) {
+    iovs[buffer].iov_base = Buffer(buffer);
+    iovs[buffer].iov_len = buffer_size_;
+  }
+  fixed_buffers_ = syscall(__NR_io_uring_register, ring_fd_,
+                           IORING_REGISTER_BUFFERS, iovs.data(),
+                           iovs.size()) == 0;
+  if (!fixed_buffers_) {
+    DEBUG_LOG("Couldn't register disk buffers, errno = ",
+              std::strerror(errno));
+  }
+
+  UftpUtils::CheckErr(syscall(__NR_io_uring_register, ring_fd_,
+                              IORING_REGISTER_EVENTFD, &event_fd_, 1),
+                      "Error registering eventfd");
+  DEBUG_LOG("io_uring up, entries: ", params.sq_entries,
+            ", fixed buffers: ", fixed_buffers_);
+  return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int UftpDiskEngine::AcquireBuffer() {
+  if (free_buffers_.empty()) {
+    return -1;
+  }
+  const int buffer = free_buffers_.back();
+  free_buffers_.pop_back();
+  return buffer;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void UftpDiskEngine::ReleaseBuffer(int buffer) {
+  free_buffers_.push_back(buffer);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bool UftpDiskEngine::Read(int fd, int buffer, uint64_t offset,
+                          std::size_t length, Completion done) {
+  return Submit(fixed_buffers_ ? IORING_OP_READ_FIXED : IORING_OP_READ, fd,
+                buffer, offset, length, std::move(done));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bool UftpDiskEngine::Write(int fd, int buffer, uint64_t offset,
+                           std::size_t length, Completion done) {
+  return Submit(fixed_buffers_ ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE, fd,
+                buffer, offset, length, std::move(done));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bool UftpDiskEngine::Sync(int fd, Completion done) {
+  return Submit(IORING_OP_FSYNC, fd, -1, 0, 0, std::move(done));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bool UftpDiskEngine::Submit(uint8_t opcode, int fd, int buffer,
+                            uint64_t offset, std::size_t length,
+                            Completion done) {
+  if (free_requests_.empty()) {
+    return false;
+  }
+  const uint64_t request = free_requests_.back();
+  free_requests_.pop_back();
+  requests_[request] = std::move(done);
+  ++in_flight_;
+  UftpMetrics::AddGauge(GAUGE_DISK_QUEUE_DEPTH, 1);
+
+  length = std::min(length, buffer_size_);
+  const bool sync = opcode == IORING_OP_FSYNC;
+  if (ring_fd_ < 0) {
+    const bool read =
+        opcode == IORING_OP_READ || opcode == IORING_OP_READ_FIXED;
+    ssize_t result = 0;
+    do {
+      result = sync   ? fdatasync(fd)
+               : read ? pread(fd, Buffer(buffer), length, offset)
+                      : pwrite(fd, Buffer(buffer), length, offset);
+    } while (result < 0 && errno == EINTR);
+    done_requests_.emplace_back(request, result < 0 ? -errno : result);
+    const uint64_t one = 1;
+    (void)write(event_fd_, &one, sizeof(one));
+    return true;
+  }
+
+  // We're the only producer, so the tail is ours to read without ordering.
+  const unsigned tail = *sq_tail_;
+  const unsigned index = tail & *sq_mask_;
+  io_uring_sqe& sqe = sqes_[index];
+  std::memset(&sqe, 0, sizeof(sqe));
+  sqe.opcode = opcode;
+  sqe.fd = fd;
+  if (sync) {
+    sqe.fsync_flags = IORING_FSYNC_DATASYNC;
+  } else {
+    sqe.off = offset;
+    sqe.addr = reinterpret_cast<uint64_t>(Buffer(buffer));
+    sqe.len = length;
+    if (fixed_buffers_) {
+      sqe.buf_index = buffer;
+    }
+  }
+  sqe.user_data = request;
+  sq_array_[index] = index;
+  __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+
+  int ret = 0;
+  do {
+    ret = syscall(__NR_io_uring_enter, ring_fd_, 1, 0, 0, nullptr, 0);
+  } while (ret < 0 && errno == EINTR);
+  if (ret < 0) {
+    // Nothing was consumed, take the SQE back and fail the request.
+    __atomic_store_n(sq_tail_, tail, __ATOMIC_RELEASE);
+    done_requests_.emplace_back(request, -errno);
+    // The ring won't wake the loop for it.
+    const uint64_t one = 1;
+    (void)write(event_fd_, &one, sizeof(one));
+  }
+  return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void UftpDiskEngine::Complete(uint64_t request, int result) {
+  Completion done = std::move(requests_[request]);
+  requests_[request] = nullptr;
+  free_requests_.push_back(request);
+  --in_flight_;
+  UftpMetrics::AddGauge(GAUGE_DISK_QUEUE_DEPTH, -1);
+  done(result);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int UftpDiskEngine::Reap() {
+  uint64_t count = 0;
+  (void)read(event_fd_, &count, sizeof(count));
+
+  int num_reaped = 0;
+  // Callbacks may queue more requests, which the loops pick up too.
+  while (!done_requests_.empty()) {
+    const auto done = done_requests_.back();
+    done_requests_.pop_back();
+    Complete(done.first, done.second);
+    ++num_reaped;
+  }
+  if (ring_fd_ < 0) {
+    return num_reaped;
+  }
+
+  unsigned head = *cq_head_;
+  while (head != __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)) {
+    const io_uring_cqe cqe = cqes_[head & *cq_mask_];
+    __atomic_store_n(cq_head_, ++head, __ATOMIC_RELEASE);
+    Complete(cqe.user_data, cqe.res);
+    ++num_reaped;
+  }
+  return num_reaped;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int UftpDiskEngine::Wait() {
+  if (ring_fd_ >= 0 && done_requests_.empty() && in_flight_ > 0 &&
+      *cq_head_ == __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)) {
+    int ret = 0;
+    do {
+      ret = syscall(__NR_io_uring_enter, ring_fd_, 0, 1,
+                    IORING_ENTER_GETEVENTS, nullptr, 0);
+    } while (ret < 0 && errno == EINTR);
+  }
+  return Reap();
+}
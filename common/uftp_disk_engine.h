@@ -0,0 +1,104 @@
+#pragma once
+
+#include <linux/io_uring.h>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+#include <uftp_defs.h>
+
+///////////////////////////////////////////////////////////////////////////////
+/// Asynchronous file reads and writes through io_uring, driven with the raw
+/// syscalls. Every request works on one of a fixed pool of page aligned
+/// buffers, registered with the kernel so they aren't mapped again for each
+/// request and aligned well enough for O_DIRECT. There are as many buffers
+/// as the queue is deep, which bounds both what's in flight and the memory.
+///
+/// Completions are handed back to the owner's event loop: EventFd() turns
+/// readable when some are waiting and Reap() runs their callbacks. Wait()
+/// blocks for one, for when the caller can't go on without it. Where
+/// io_uring isn't available requests are done on the spot with pread and
+/// pwrite, and still complete through Reap(). Not thread safe, each event
+/// loop has its own.
+class UftpDiskEngine {
+ public:
+  /// Called with the number of bytes transferred, or -errno.
+  using Completion = std::function<void(int result)>;
+
+  ///
+  /// \param queue_depth the most requests in flight, and number of buffers.
+  /// \param buffer_size bytes per buffer, a multiple of the page size.
+  /// \param use_io_uring false to always use the synchronous fallback.
+  ///
+  explicit UftpDiskEngine(unsigned queue_depth = UftpDiskQueueDepth,
+                          std::size_t buffer_size = UftpDiskBufferSize,
+                          bool use_io_uring = true);
+  ~UftpDiskEngine();
+
+  UftpDiskEngine(const UftpDiskEngine&) = delete;
+  UftpDiskEngine& operator=(const UftpDiskEngine&) = delete;
+
+  bool Async() const { return ring_fd_ >= 0; }
+  int EventFd() const { return event_fd_; }
+  std::size_t BufferSize() const { return buffer_size_; }
+  std::size_t InFlight() const { return in_flight_; }
+
+  /// \return a free buffer, or -1 if they're all in use.
+  int AcquireBuffer();
+  uint8_t* Buffer(int buffer) { return buffers_ + buffer * buffer_size_; }
+  void ReleaseBuffer(int buffer);
+
+  ///
+  /// \brief Read queues a read of length bytes of fd at offset into buffer.
+  /// done runs from Reap() or Wait() once it's finished.
+  /// \return false if the queue is full.
+  ///
+  bool Read(int fd, int buffer, uint64_t offset, std::size_t length,
+            Completion done);
+  bool Write(int fd, int buffer, uint64_t offset, std::size_t length,
+             Completion done);
+  /// Queues an fdatasync of fd, writes that completed before it included.
+  bool Sync(int fd, Completion done);
+
+  /// Runs the callbacks of every finished request. \return how many.
+  int Reap();
+  /// Blocks until a request finishes, if any are in flight, then reaps.
+  int Wait();
+
+ private:
+  bool SetUpRing(unsigned entries);
+  bool Submit(uint8_t opcode, int fd, int buffer, uint64_t offset,
+              std::size_t length, Completion done);
+  void Complete(uint64_t request, int result);
+
+  const std::size_t buffer_size_;
+  uint8_t* buffers_ = nullptr;
+  std::size_t buffers_length_ = 0;
+  std::vector<int> free_buffers_;
+  bool fixed_buffers_ = false;
+
+  // One slot per request in flight, indexed by the SQE's user_data.
+  std::vector<Completion> requests_;
+  std::vector<uint64_t> free_requests_;
+  std::size_t in_flight_ = 0;
+  // Requests the synchronous fallback has done but not reaped: slot, result.
+  std::vector<std::pair<uint64_t, int>> done_requests_;
+
+  int event_fd_ = -1;
+  int ring_fd_ = -1;
+  void* sq_ring_ = nullptr;
+  std::size_t sq_ring_length_ = 0;
+  void* cq_ring_ = nullptr;
+  std::size_t cq_ring_length_ = 0;
+  io_uring_sqe* sqes_ = nullptr;
+  std::size_t sqes_length_ = 0;
+
+  unsigned* sq_tail_ = nullptr;
+  unsigned* sq_mask_ = nullptr;
+  unsigned* sq_array_ = nullptr;
+  unsigned* cq_head_ = nullptr;
+  unsigned* cq_tail_ = nullptr;
+  unsigned* cq_mask_ = nullptr;
+  io_uring_cqe* cqes_ = nullptr;
+};
@@ -0,0 +1,63 @@
+#include <uftp_fec.h>
+
+#include <algorithm>
+#include <cmath>
+
+#include <uftp_defs.h>
+
+#if defined(__x86_64__)
+#include <emmintrin.h>
+#endif
+
+namespace {
+
+// Chunks per loss rate sample, and how much each sample moves the estimate.
+constexpr uint32_t kSampleChunks = 256;
+constexpr double kSampleWeight = 0.25;
+// Below this the odd retransmit is cheaper than parity.
+constexpr double kMinLossRate = 0.005;
+// Parity datagrams per lost chunk. An XOR group only survives one loss, so
+// aim for groups that rarely see two.
+constexpr double kRedundancy = 3.0;
+
+}  // namespace
+
+///////////////////////////////////////////////////////////////////////////////
+void UftpFecController::OnAck(uint32_t delivered, uint32_t recovered,
+                              uint32_t lost) {
+  sample_chunks_ += delivered + lost;
+  sample_losses_ += recovered + lost;
+  if (sample_chunks_ < kSampleChunks) {
+    return;
+  }
+  const double sample = (double)sample_losses_ / sample_chunks_;
+  loss_rate_ = (1.0 - kSampleWeight) * loss_rate_ + kSampleWeight * sample;
+  sample_chunks_ = 0;
+  sample_losses_ = 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+uint32_t UftpFecController::GroupSize() const {
+  if (loss_rate_ < kMinLossRate) {
+    return 0;
+  }
+  const double group_size = std::round(1.0 / (kRedundancy * loss_rate_));
+  return std::min<uint32_t>(
+      std::max<uint32_t>(group_size, UftpFecMinGroupSize),
+      UftpFecMaxGroupSize);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void UftpXorInto(uint8_t* dst, const uint8_t* src, std::size_t length) {
+  std::size_t offset = 0;
+#if defined(__x86_64__)
+  for (; offset + 16 <= length; offset += 16) {
+    const __m128i lhs = _mm_loadu_si128((const __m128i*)(dst + offset));
+    const __m128i rhs = _mm_loadu_si128((const __m128i*)(src + offset));
+    _mm_storeu_si128((__m128i*)(dst + offset), _mm_xor_si128(lhs, rhs));
+  }
+#endif
+  for (; offset < length; ++offset) {
+    dst[offset] ^= src[offset];
+  }
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+///////////////////////////////////////////////////////////////////////////////
+/// Forward error correction policy for one peer. Tracks how many chunks the
+/// path loses, counting the ones the receiver rebuilt from parity as lost,
+/// and picks how many chunks each XOR parity datagram covers. Lower loss
+/// means bigger groups and less overhead, no loss means no parity at all.
+class UftpFecController {
+ public:
+  ///
+  /// \brief OnAck feeds in what one ack told the send window.
+  /// \param delivered chunks newly acked.
+  /// \param recovered of those, how many the receiver rebuilt from parity.
+  /// \param lost chunks newly found lost and queued for retransmit.
+  ///
+  void OnAck(uint32_t delivered, uint32_t recovered, uint32_t lost);
+
+  /// Chunks per parity datagram, 0 to send no parity.
+  uint32_t GroupSize() const;
+  double LossRate() const { return loss_rate_; }
+
+ private:
+  double loss_rate_ = 0.0;
+  uint32_t sample_chunks_ = 0;
+  uint32_t sample_losses_ = 0;
+};
+
+///
+/// \brief UftpXorInto xors length bytes of src into dst.
+///
+void UftpXorInto(uint8_t* dst, const uint8_t* src, std::size_t length);
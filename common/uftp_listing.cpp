@@ -0,0 +1,135 @@
+#include <uftp_listing.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <utility>
+
+#include <uftp_defs.h>
+
+namespace {
+
+constexpr uint32_t kListingMagic = 0x314c5355;  // "USL1"
+
+struct __attribute__((packed)) ListRequest {
+  uint32_t magic = kListingMagic;
+  uint32_t max_entries = 0;
+  uint16_t cursor_length = 0;
+};
+
+struct __attribute__((packed)) ListPageHeader {
+  uint32_t magic = kListingMagic;
+  uint32_t num_entries = 0;
+  uint8_t more = 0;
+};
+
+// Followed by name_length bytes of name.
+struct __attribute__((packed)) ListEntry {
+  uint64_t size;
+  uint64_t mtime_ns;
+  uint8_t type;
+  uint16_t name_length;
+};
+
+}  // namespace
+
+///////////////////////////////////////////////////////////////////////////////
+void UftpListing::SerializeRequest(const std::string& cursor,
+                                   uint32_t max_entries,
+                                   std::vector<uint8_t>& buffer) {
+  ListRequest request;
+  request.max_entries = max_entries;
+  request.cursor_length = cursor.size();
+  buffer.resize(sizeof(request) + cursor.size());
+  std::memcpy(buffer.data(), &request, sizeof(request));
+  std::memcpy(buffer.data() + sizeof(request), cursor.data(), cursor.size());
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bool UftpListing::DeserializeRequest(const std::vector<uint8_t>& buffer,
+                                     std::string& cursor,
+                                     uint32_t& max_entries) {
+  cursor.clear();
+  max_entries = UftpListPageSize;
+  if (buffer.empty()) {
+    return true;
+  }
+
+  ListRequest request;
+  if (buffer.size() < sizeof(request)) {
+    return false;
+  }
+  std::memcpy(&request, buffer.data(), sizeof(request));
+  if (request.magic != kListingMagic ||
+      buffer.size() != sizeof(request) + request.cursor_length) {
+    return false;
+  }
+  cursor.assign(buffer.begin() + sizeof(request), buffer.end());
+  if (request.max_entries != 0) {
+    max_entries = std::min<uint32_t>(request.max_entries, UftpMaxListPageSize);
+  }
+  return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void UftpListing::SerializePage(const std::vector<UftpListEntry>& entries,
+                                bool more, std::vector<uint8_t>& buffer) {
+  std::size_t length = sizeof(ListPageHeader);
+  for (const auto& entry : entries) {
+    length += sizeof(ListEntry) + entry.name.size();
+  }
+  buffer.resize(length);
+
+  ListPageHeader header;
+  header.num_entries = entries.size();
+  header.more = more;
+  std::memcpy(buffer.data(), &header, sizeof(header));
+  uint8_t* next = buffer.data() + sizeof(header);
+  for (const auto& entry : entries) {
+    const ListEntry wire_entry{entry.size, entry.mtime_ns, (uint8_t)entry.type,
+                               (uint16_t)entry.name.size()};
+    std::memcpy(next, &wire_entry, sizeof(wire_entry));
+    next += sizeof(wire_entry);
+    std::memcpy(next, entry.name.data(), entry.name.size());
+    next += entry.name.size();
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bool UftpListing::DeserializePage(const std::vector<uint8_t>& buffer,
+                                  std::vector<UftpListEntry>& entries,
+                                  bool& more) {
+  ListPageHeader header;
+  if (buffer.size() < sizeof(header)) {
+    return false;
+  }
+  std::memcpy(&header, buffer.data(), sizeof(header));
+  if (header.magic != kListingMagic) {
+    return false;
+  }
+  more = header.more != 0;
+
+  entries.clear();
+  const uint8_t* next = buffer.data() + sizeof(header);
+  const uint8_t* const end = buffer.data() + buffer.size();
+  for (uint32_t index = 0; index < header.num_entries; ++index) {
+    ListEntry wire_entry;
+    if (end - next < (std::ptrdiff_t)sizeof(wire_entry)) {
+      return false;
+    }
+    std::memcpy(&wire_entry, next, sizeof(wire_entry));
+    next += sizeof(wire_entry);
+    if (end - next < wire_entry.name_length) {
+      return false;
+    }
+
+    UftpListEntry entry;
+    entry.name.assign(next, next + wire_entry.name_length);
+    entry.size = wire_entry.size;
+    entry.mtime_ns = wire_entry.mtime_ns;
+    entry.type = static_cast<UftpFileType>(wire_entry.type);
+    entries.push_back(std::move(entry));
+    next += wire_entry.name_length;
+  }
+  return next == end;
+}
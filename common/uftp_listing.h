@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+///////////////////////////////////////////////////////////////////////////////
+enum UftpFileType {
+  FILE_TYPE_REGULAR = 1,
+  FILE_TYPE_DIRECTORY,
+  FILE_TYPE_SYMLINK,
+  FILE_TYPE_OTHER,
+};
+
+///////////////////////////////////////////////////////////////////////////////
+struct UftpListEntry {
+  std::string name;
+  uint64_t size = 0;
+  uint64_t mtime_ns = 0;  // since the epoch
+  UftpFileType type = FILE_TYPE_OTHER;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+/// The wire format of "ls". A listing is read a page at a time in name
+/// order. The request's argument is a prefix every name has to start with
+/// and its message a UftpListing request: the cursor, which is the last
+/// name of the previous page or empty for the first page, and the most
+/// entries to return. The response's message is a page of entries and
+/// whether there are more after it.
+class UftpListing {
+ public:
+  static void SerializeRequest(const std::string& cursor, uint32_t max_entries,
+                               std::vector<uint8_t>& buffer);
+  /// An empty buffer asks for the first page at the default size.
+  static bool DeserializeRequest(const std::vector<uint8_t>& buffer,
+                                 std::string& cursor, uint32_t& max_entries);
+
+  static void SerializePage(const std::vector<UftpListEntry>& entries,
+                            bool more, std::vector<uint8_t>& buffer);
+  static bool DeserializePage(const std::vector<uint8_t>& buffer,
+                              std::vector<UftpListEntry>& entries, bool& more);
+};
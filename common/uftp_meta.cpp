@@ -0,0 +1,274 @@
+#include <uftp_meta.h>
+
+#include <cstring>
+
+namespace {
+
+constexpr uint32_t kMetaV2Magic = 0x32544655;  // "UFT2"
+
+struct __attribute__((packed)) MetaV2Header {
+  uint32_t magic = kMetaV2Magic;
+  uint8_t version = UftpProtocolV2;
+  uint8_t opcode = OP_UNKNOWN;
+  // Bitmask of MetaV2Fields, what follows in that order.
+  uint8_t fields = 0;
+  uint8_t codecs = 0;
+  uint32_t sequence_num = 0;
+};
+static_assert(sizeof(MetaV2Header) == UftpMeta::kMinLength,
+              "kMinLength must be the v2 fixed header");
+
+enum MetaV2Fields {
+  FIELD_STATUS = 1 << 0,
+  // range_offset then range_length.
+  FIELD_RANGE = 1 << 1,
+  FIELD_FILE_LENGTH = 1 << 2,
+  FIELD_COMMAND = 1 << 3,
+  FIELD_ARGUMENT = 1 << 4,
+  // v3 only, after FIELD_FILE_LENGTH.
+  FIELD_FILE_MTIME = 1 << 5,
+};
+
+// Indexed by UftpOpcode.
+const char* const kCommandNames[] = {
+    "",           "exit",      "ls",   "get",   "put",    "stat",
+    "checkpoint", "signature", "diff", "patch", "delete", "version",
+    "stats",
+};
+constexpr std::size_t kNumOpcodes =
+    sizeof(kCommandNames) / sizeof(kCommandNames[0]);
+static_assert(kNumOpcodes == OP_STATS + 1,
+              "Every opcode needs a command name");
+
+constexpr std::size_t kMaxStringLength = std::numeric_limits<uint16_t>::max();
+
+///////////////////////////////////////////////////////////////////////////////
+uint8_t* PutVarint(uint8_t* next, uint64_t value) {
+  while (value >= 0x80) {
+    *next++ = (uint8_t)value | 0x80;
+    value >>= 7;
+  }
+  *next++ = (uint8_t)value;
+  return next;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bool GetVarint(const uint8_t*& next, const uint8_t* end, uint64_t& value) {
+  value = 0;
+  for (unsigned shift = 0; shift < 64 && next < end; shift += 7) {
+    const uint8_t byte = *next++;
+    value |= (uint64_t)(byte & 0x7f) << shift;
+    if ((byte & 0x80) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+uint8_t* PutString(uint8_t* next, const std::string& value) {
+  next = PutVarint(next, value.size());
+  std::memcpy(next, value.data(), value.size());
+  return next + value.size();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bool GetString(const uint8_t*& next, const uint8_t* end, std::string& value) {
+  uint64_t length = 0;
+  if (!GetVarint(next, end, length) || length > kMaxStringLength ||
+      length > (uint64_t)(end - next)) {
+    return false;
+  }
+  value.assign(reinterpret_cast<const char*>(next), length);
+  next += length;
+  return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void SerializeV1(const UftpMessage& message, UftpPooledBuffer& meta) {
+  const UftpHeader& header = message.header;
+  meta.resize(sizeof(header) + header.command_length + header.argument_length);
+  std::memcpy(meta.data(), &header, sizeof(header));
+  std::memcpy(meta.data() + sizeof(header), message.command.data(),
+              header.command_length);
+  std::memcpy(meta.data() + sizeof(header) + header.command_length,
+              message.argument.data(), header.argument_length);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void SerializeV2(const UftpMessage& message, UftpPooledBuffer& meta) {
+  const UftpHeader& header = message.header;
+  MetaV2Header fixed;
+  fixed.version = message.version;
+  fixed.opcode = UftpOpcodeFor(message.command);
+  fixed.codecs = header.codecs;
+  fixed.sequence_num = header.sequence_num;
+  if (header.status_code != NO_ERR) fixed.fields |= FIELD_STATUS;
+  if (header.range_offset != 0 || header.range_length != 0) {
+    fixed.fields |= FIELD_RANGE;
+  }
+  if (header.file_length != 0) fixed.fields |= FIELD_FILE_LENGTH;
+  if (message.version >= UftpProtocolV3 && message.file_mtime_ns != 0) {
+    fixed.fields |= FIELD_FILE_MTIME;
+  }
+  if (fixed.opcode == OP_UNKNOWN && !message.command.empty()) {
+    fixed.fields |= FIELD_COMMAND;
+  }
+  if (!message.argument.empty()) fixed.fields |= FIELD_ARGUMENT;
+
+  // Sized for the worst case, then trimmed.
+  meta.resize(sizeof(fixed) + 7 * 10 + message.command.size() +
+              message.argument.size());
+  std::memcpy(meta.data(), &fixed, sizeof(fixed));
+  uint8_t* next = meta.data() + sizeof(fixed);
+  if (fixed.fields & FIELD_STATUS) {
+    next = PutVarint(next, header.status_code);
+  }
+  if (fixed.fields & FIELD_RANGE) {
+    next = PutVarint(next, header.range_offset);
+    next = PutVarint(next, header.range_length);
+  }
+  if (fixed.fields & FIELD_FILE_LENGTH) {
+    next = PutVarint(next, header.file_length);
+  }
+  if (fixed.fields & FIELD_FILE_MTIME) {
+    next = PutVarint(next, message.file_mtime_ns);
+  }
+  if (fixed.fields & FIELD_COMMAND) {
+    next = PutString(next, message.command);
+  }
+  if (fixed.fields & FIELD_ARGUMENT) {
+    next = PutString(next, message.argument);
+  }
+  meta.resize(next - meta.data());
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bool ParseV1(const uint8_t* meta, std::size_t meta_length,
+             uint64_t message_length, UftpMessage& message) {
+  UftpHeader& header = message.header;
+  if (meta_length < sizeof(header)) {
+    return false;
+  }
+  std::memcpy(&header, meta, sizeof(header));
+  if (sizeof(header) + header.command_length + header.argument_length !=
+          meta_length ||
+      header.message_length != message_length) {
+    return false;
+  }
+
+  const char* meta_str = reinterpret_cast<const char*>(meta);
+  message.command.assign(meta_str + sizeof(header), header.command_length);
+  message.argument.assign(meta_str + sizeof(header) + header.command_length,
+                          header.argument_length);
+  message.opcode = UftpOpcodeFor(message.command);
+  message.file_mtime_ns = 0;
+  message.version = UftpProtocolV1;
+  return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bool ParseV2(const uint8_t* meta, std::size_t meta_length,
+             uint64_t message_length, UftpMessage& message) {
+  MetaV2Header fixed;
+  std::memcpy(&fixed, meta, sizeof(fixed));
+  if (fixed.version < UftpProtocolV2 || fixed.version > UftpProtocolV3 ||
+      (fixed.version < UftpProtocolV3 && (fixed.fields & FIELD_FILE_MTIME))) {
+    return false;
+  }
+
+  UftpHeader& header = message.header;
+  header = UftpHeader();
+  header.codecs = fixed.codecs;
+  header.sequence_num = fixed.sequence_num;
+  header.message_length = message_length;
+
+  // Read into locals, the header's fields are packed.
+  const uint8_t* next = meta + sizeof(fixed);
+  const uint8_t* const end = meta + meta_length;
+  uint64_t status_code = NO_ERR;
+  uint64_t range_offset = 0;
+  uint64_t range_length = 0;
+  uint64_t file_length = 0;
+  uint64_t file_mtime_ns = 0;
+  if (((fixed.fields & FIELD_STATUS) && !GetVarint(next, end, status_code)) ||
+      ((fixed.fields & FIELD_RANGE) &&
+       (!GetVarint(next, end, range_offset) ||
+        !GetVarint(next, end, range_length))) ||
+      ((fixed.fields & FIELD_FILE_LENGTH) &&
+       !GetVarint(next, end, file_length)) ||
+      ((fixed.fields & FIELD_FILE_MTIME) &&
+       !GetVarint(next, end, file_mtime_ns))) {
+    return false;
+  }
+  header.status_code = status_code;
+  header.range_offset = range_offset;
+  header.range_length = range_length;
+  header.file_length = file_length;
+  message.file_mtime_ns = file_mtime_ns;
+
+  message.opcode = fixed.opcode < kNumOpcodes
+                       ? static_cast<UftpOpcode>(fixed.opcode)
+                       : OP_UNKNOWN;
+  message.command = kCommandNames[message.opcode];
+  if ((fixed.fields & FIELD_COMMAND) &&
+      !GetString(next, end, message.command)) {
+    return false;
+  }
+  message.argument.clear();
+  if ((fixed.fields & FIELD_ARGUMENT) &&
+      !GetString(next, end, message.argument)) {
+    return false;
+  }
+  if (next != end) {
+    return false;
+  }
+
+  header.command_length = message.command.size();
+  header.argument_length = message.argument.size();
+  message.version = fixed.version;
+  return true;
+}
+
+}  // namespace
+
+///////////////////////////////////////////////////////////////////////////////
+void UftpMeta::Serialize(const UftpMessage& message, UftpPooledBuffer& meta) {
+  if (message.version >= UftpProtocolV2) {
+    // v3 only adds a field, it goes the same way.
+    SerializeV2(message, meta);
+  } else {
+    SerializeV1(message, meta);
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bool UftpMeta::Parse(const uint8_t* meta, std::size_t meta_length,
+                     uint64_t message_length, UftpMessage& message) {
+  uint32_t magic = 0;
+  if (meta_length < kMinLength) {
+    return false;
+  }
+  std::memcpy(&magic, meta, sizeof(magic));
+  if (magic == UftpSyncWord) {
+    return ParseV1(meta, meta_length, message_length, message);
+  } else if (magic == kMetaV2Magic) {
+    return ParseV2(meta, meta_length, message_length, message);
+  }
+  return false;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+UftpOpcode UftpOpcodeFor(const std::string& command) {
+  for (std::size_t opcode = OP_UNKNOWN + 1; opcode < kNumOpcodes; ++opcode) {
+    if (command == kCommandNames[opcode]) {
+      return static_cast<UftpOpcode>(opcode);
+    }
+  }
+  return OP_UNKNOWN;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+const char* UftpCommandName(UftpOpcode opcode) {
+  return opcode < kNumOpcodes ? kCommandNames[opcode] : "";
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <string>
+
+#include <uftp_buffer_pool.h>
+#include <uftp_defs.h>
+
+///////////////////////////////////////////////////////////////////////////////
+/// The meta bytes every transfer starts with: its UftpHeader, command and
+/// argument.
+///
+/// v1 is the UftpHeader as is, followed by the command and argument strings.
+///
+/// v2 is a 12 byte fixed header, [magic | version | opcode | fields | codecs
+/// | sequence_num], followed by whichever of status, range_offset and
+/// range_length, and file_length aren't zero as LEB128 varints, then the
+/// argument with a varint length in front. The command goes as its
+/// UftpOpcode, and is only spelt out for commands with no opcode. The
+/// message length is whatever of the transfer follows the meta, so it isn't
+/// sent at all. A typical request is a dozen bytes plus its argument rather
+/// than fifty plus its command and argument, leaving more of the first
+/// datagram for an inline message.
+///
+/// v3 is v2 with the file's mtime as one more optional varint after
+/// file_length, and its own version byte so that v2 peers are never sent it.
+///
+/// v1 and v2 are told apart by their first four bytes, so a receiver takes
+/// any of them whatever it's sent.
+class UftpMeta {
+ public:
+  /// Bounds on the meta_length of a transfer in any format. Commands and
+  /// arguments are at most 64KiB, varints at most 10 bytes.
+  static constexpr uint32_t kMinLength = 12;
+  static constexpr uint32_t kMaxLength =
+      sizeof(UftpHeader) + 7 * 10 +
+      2 * (uint32_t)std::numeric_limits<uint16_t>::max();
+
+  ///
+  /// \brief Serialize writes message's header, command and argument into
+  /// meta in message.version's format. The header's lengths have to be
+  /// filled in already, see UftpUtils::ConstructUftpHeader().
+  ///
+  static void Serialize(const UftpMessage& message, UftpPooledBuffer& meta);
+
+  ///
+  /// \brief Parse fills in message's header, command, argument, opcode and
+  /// version from meta, in either format.
+  /// \param message_length length of the rest of the transfer.
+  /// \return false if the meta is malformed.
+  ///
+  static bool Parse(const uint8_t* meta, std::size_t meta_length,
+                    uint64_t message_length, UftpMessage& message);
+};
+
+/// \return the opcode for command, OP_UNKNOWN if it has none.
+UftpOpcode UftpOpcodeFor(const std::string& command);
+
+/// \return the command opcode stands for, empty for OP_UNKNOWN.
+const char* UftpCommandName(UftpOpcode opcode);
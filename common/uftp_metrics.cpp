@@ -0,0 +1,308 @@
+#include <uftp_metrics.h>
+
+#include <stdlib.h>
+#include <cstdio>
+#include <fstream>
+#include <mutex>
+#include <new>
+#include <sstream>
+#include <vector>
+
+#include <uftp_buffer_pool.h>
+#include <uftp_meta.h>
+
+namespace {
+
+struct MetricInfo {
+  const char* name;
+  const char* help;
+};
+
+// Indexed by UftpCounter.
+const MetricInfo kCounters[] = {
+    {"uftp_bytes_sent_total", "Message bytes of completed transfers sent."},
+    {"uftp_bytes_received_total",
+     "Message bytes of completed transfers received."},
+    {"uftp_transfers_sent_total", "Transfers sent to the last ack."},
+    {"uftp_transfers_received_total", "Transfers received whole."},
+    {"uftp_chunks_sent_total", "Chunks of completed transfers sent."},
+    {"uftp_retransmits_total", "Chunks sent again."},
+    {"uftp_retransmit_timeouts_total",
+     "Times the oldest chunk in flight went unacked for a whole RTO."},
+    {"uftp_spurious_losses_total",
+     "Loss events undone, the chunk turned out to be late, not lost."},
+    {"uftp_transfer_timeouts_total",
+     "Transfers given up on for lack of progress."},
+    {"uftp_requests_total", "Requests handled."},
+    {"uftp_duplicate_requests_total",
+     "Requests repeating the last sequence number, answered again."},
+    {"uftp_sessions_opened_total", "Sessions opened."},
+    {"uftp_file_cache_hits_total", "Gets served from a cached mapping."},
+    {"uftp_file_cache_misses_total", "Gets that had to open the file."},
+    {"uftp_file_cache_evictions_total", "Files evicted from the cache."},
+    {"uftp_file_cache_invalidations_total",
+     "Cached files dropped because they changed."},
+    {"uftp_mapped_file_truncations_total",
+     "Sends failed because the mapped file was truncated."},
+};
+static_assert(sizeof(kCounters) / sizeof(kCounters[0]) == NUM_COUNTERS,
+              "Every counter needs a name");
+
+// Indexed by UftpGauge.
+const MetricInfo kGauges[] = {
+    {"uftp_sessions", "Sessions open."},
+    {"uftp_file_cache_bytes", "Length of the files cached."},
+    {"uftp_disk_queue_depth", "Disk reads and writes in flight."},
+};
+static_assert(sizeof(kGauges) / sizeof(kGauges[0]) == NUM_GAUGES,
+              "Every gauge needs a name");
+
+// Indexed by UftpHistogram.
+const MetricInfo kHistograms[] = {
+    {"uftp_rtt_microseconds", "RTT samples."},
+    {"uftp_goodput_bytes_per_second", "Goodput of each large transfer."},
+};
+static_assert(sizeof(kHistograms) / sizeof(kHistograms[0]) == NUM_HISTOGRAMS,
+              "Every histogram needs a name");
+
+std::mutex slots_mutex;
+std::vector<void*> slots;
+
+std::mutex sessions_mutex;
+std::vector<UftpSessionMetrics*> sessions;
+
+///////////////////////////////////////////////////////////////////////////////
+uint64_t Read(const std::atomic<uint64_t>& value) {
+  return value.load(std::memory_order_relaxed);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void FormatHeader(std::ostringstream& out, const MetricInfo& info,
+                  const char* type) {
+  out << "# HELP " << info.name << " " << info.help << "\n# TYPE "
+      << info.name << " " << type << "\n";
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void FormatValue(std::ostringstream& out, const char* name, uint64_t value) {
+  out << name << " " << value << "\n";
+}
+
+}  // namespace
+
+///////////////////////////////////////////////////////////////////////////////
+UftpMetrics::Slot* UftpMetrics::NewSlot() {
+  // Cache line aligned, so no two threads' slots share one.
+  void* memory = nullptr;
+  if (posix_memalign(&memory, 64, sizeof(Slot)) != 0) {
+    throw std::bad_alloc();
+  }
+  Slot* slot = new (memory) Slot();
+  std::lock_guard<std::mutex> lock(slots_mutex);
+  slots.push_back(slot);
+  return slot;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void UftpMetrics::RegisterSession(UftpSessionMetrics* session) {
+  std::lock_guard<std::mutex> lock(sessions_mutex);
+  sessions.push_back(session);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void UftpMetrics::UnregisterSession(UftpSessionMetrics* session) {
+  std::lock_guard<std::mutex> lock(sessions_mutex);
+  for (auto session_it = sessions.begin(); session_it != sessions.end();
+       ++session_it) {
+    if (*session_it == session) {
+      *session_it = sessions.back();
+      sessions.pop_back();
+      break;
+    }
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+uint64_t UftpMetrics::Get(UftpCounter counter) {
+  std::lock_guard<std::mutex> lock(slots_mutex);
+  uint64_t total = 0;
+  for (void* slot : slots) {
+    total += Read(static_cast<Slot*>(slot)->counters[counter]);
+  }
+  return total;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void UftpMetrics::Format(std::string& text) {
+  // Totals over every slot. Each slot is read field by field as it's being
+  // written, so the totals are only as consistent as relaxed reads make them,
+  // which is plenty for monitoring.
+  uint64_t counters[NUM_COUNTERS] = {};
+  uint64_t gauges[NUM_GAUGES] = {};
+  uint64_t histograms[NUM_HISTOGRAMS][kNumBuckets + 1] = {};
+  uint64_t latencies[kNumOpcodes][kNumBuckets + 1] = {};
+  const auto add_histogram = [](const Histogram& from, uint64_t* to) {
+    for (std::size_t bucket = 0; bucket < kNumBuckets; ++bucket) {
+      to[bucket] += Read(from.buckets[bucket]);
+    }
+    to[kNumBuckets] += Read(from.sum);
+  };
+  {
+    std::lock_guard<std::mutex> lock(slots_mutex);
+    for (void* memory : slots) {
+      const Slot& slot = *static_cast<Slot*>(memory);
+      for (int counter = 0; counter < NUM_COUNTERS; ++counter) {
+        counters[counter] += Read(slot.counters[counter]);
+      }
+      for (int gauge = 0; gauge < NUM_GAUGES; ++gauge) {
+        gauges[gauge] += Read(slot.gauges[gauge]);
+      }
+      for (int histogram = 0; histogram < NUM_HISTOGRAMS; ++histogram) {
+        add_histogram(slot.histograms[histogram], histograms[histogram]);
+      }
+      for (std::size_t opcode = 0; opcode < kNumOpcodes; ++opcode) {
+        add_histogram(slot.latencies[opcode], latencies[opcode]);
+      }
+    }
+  }
+
+  std::ostringstream out;
+  for (int counter = 0; counter < NUM_COUNTERS; ++counter) {
+    FormatHeader(out, kCounters[counter], "counter");
+    FormatValue(out, kCounters[counter].name, counters[counter]);
+  }
+  for (int gauge = 0; gauge < NUM_GAUGES; ++gauge) {
+    FormatHeader(out, kGauges[gauge], "gauge");
+    // Each thread's share may be negative, the total never is.
+    out << kGauges[gauge].name << " " << (int64_t)gauges[gauge] << "\n";
+  }
+
+  // Buckets are cumulative in the exposition format.
+  const auto format_histogram = [&out](const char* name,
+                                       const std::string& labels,
+                                       const uint64_t* buckets) {
+    uint64_t count = 0;
+    uint64_t bound = 1;
+    for (std::size_t bucket = 0; bucket < kNumBuckets; ++bucket, bound *= 4) {
+      count += buckets[bucket];
+      out << name << "_bucket{" << labels << "le=\"";
+      if (bucket + 1 < kNumBuckets) {
+        out << bound;
+      } else {
+        out << "+Inf";
+      }
+      out << "\"} " << count << "\n";
+    }
+    out << name << "_sum";
+    if (!labels.empty()) {
+      out << "{" << labels.substr(0, labels.size() - 1) << "}";
+    }
+    out << " " << buckets[kNumBuckets] << "\n" << name << "_count";
+    if (!labels.empty()) {
+      out << "{" << labels.substr(0, labels.size() - 1) << "}";
+    }
+    out << " " << count << "\n";
+  };
+  for (int histogram = 0; histogram < NUM_HISTOGRAMS; ++histogram) {
+    FormatHeader(out, kHistograms[histogram], "histogram");
+    format_histogram(kHistograms[histogram].name, "", histograms[histogram]);
+  }
+  const MetricInfo latency_info = {
+      "uftp_command_latency_microseconds",
+      "From a request's first datagram to the last ack of its response."};
+  FormatHeader(out, latency_info, "histogram");
+  for (std::size_t opcode = 0; opcode < kNumOpcodes; ++opcode) {
+    bool used = false;
+    for (std::size_t bucket = 0; bucket < kNumBuckets; ++bucket) {
+      used |= latencies[opcode][bucket] != 0;
+    }
+    if (used) {
+      const char* command = UftpCommandName(static_cast<UftpOpcode>(opcode));
+      format_histogram(
+          latency_info.name,
+          std::string("command=\"") + (*command ? command : "unknown") + "\",",
+          latencies[opcode]);
+    }
+  }
+
+  const UftpBufferPool::Stats pool = UftpBufferPool::GetStats();
+  const MetricInfo pool_metrics[] = {
+      {"uftp_buffer_pool_blocks_in_use", "Pooled blocks handed out."},
+      {"uftp_buffer_pool_bytes_in_use", "Bytes of pooled blocks handed out."},
+      {"uftp_buffer_pool_blocks_free", "Blocks on the free lists."},
+      {"uftp_buffer_pool_bytes_free", "Bytes of blocks on the free lists."},
+  };
+  const uint64_t pool_values[] = {pool.blocks_in_use, pool.bytes_in_use,
+                                  pool.blocks_free, pool.bytes_free};
+  for (int metric = 0; metric < 4; ++metric) {
+    FormatHeader(out, pool_metrics[metric], "gauge");
+    FormatValue(out, pool_metrics[metric].name, pool_values[metric]);
+  }
+  const MetricInfo pool_allocations = {"uftp_buffer_pool_allocations_total",
+                                       "Blocks that had to come from malloc."};
+  FormatHeader(out, pool_allocations, "counter");
+  FormatValue(out, pool_allocations.name, pool.allocations);
+  const MetricInfo pool_reuses = {"uftp_buffer_pool_reuses_total",
+                                  "Blocks that came off a free list."};
+  FormatHeader(out, pool_reuses, "counter");
+  FormatValue(out, pool_reuses.name, pool.reuses);
+
+  // One series per live session, labelled with the client's address.
+  struct SessionField {
+    MetricInfo info;
+    const char* type;
+    std::atomic<uint64_t> UftpSessionMetrics::*value;
+  };
+  const SessionField session_fields[] = {
+      {{"uftp_session_requests_total", "Requests from the session."},
+       "counter",
+       &UftpSessionMetrics::requests},
+      {{"uftp_session_bytes_sent_total", "Message bytes sent to the session."},
+       "counter",
+       &UftpSessionMetrics::bytes_sent},
+      {{"uftp_session_bytes_received_total",
+        "Message bytes received from the session."},
+       "counter",
+       &UftpSessionMetrics::bytes_received},
+      {{"uftp_session_retransmits_total", "Chunks sent to the session again."},
+       "counter",
+       &UftpSessionMetrics::retransmits},
+      {{"uftp_session_retransmit_timeouts_total",
+        "Retransmit timeouts sending to the session."},
+       "counter",
+       &UftpSessionMetrics::retransmit_timeouts},
+      {{"uftp_session_srtt_microseconds", "Smoothed RTT to the session."},
+       "gauge",
+       &UftpSessionMetrics::srtt_us},
+  };
+  {
+    std::lock_guard<std::mutex> lock(sessions_mutex);
+    for (const SessionField& field : session_fields) {
+      if (sessions.empty()) {
+        break;
+      }
+      FormatHeader(out, field.info, field.type);
+      for (const UftpSessionMetrics* session : sessions) {
+        out << field.info.name << "{peer=\"" << session->peer << "\"} "
+            << Read(session->*field.value) << "\n";
+      }
+    }
+  }
+  text = out.str();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bool UftpMetrics::WriteFile(const std::string& filename) {
+  std::string text;
+  Format(text);
+
+  const std::string temp_filename = filename + ".tmp";
+  {
+    std::ofstream file(temp_filename, std::ios::out | std::ios::trunc);
+    file << text;
+    if (!file.good()) {
+      return false;
+    }
+  }
+  return std::rename(temp_filename.c_str(), filename.c_str()) == 0;
+}
@@ -0,0 +1,174 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include <uftp_defs.h>
+
+///////////////////////////////////////////////////////////////////////////////
+enum UftpCounter {
+  // Message bytes of completed transfers, not counting headers or
+  // retransmits.
+  COUNTER_BYTES_SENT,
+  COUNTER_BYTES_RECEIVED,
+  COUNTER_TRANSFERS_SENT,
+  COUNTER_TRANSFERS_RECEIVED,
+  COUNTER_CHUNKS_SENT,
+  COUNTER_RETRANSMITS,
+  COUNTER_RETRANSMIT_TIMEOUTS,
+  // Loss events whose window cut was undone, see UftpSendWindow.
+  COUNTER_SPURIOUS_LOSSES,
+  // Transfers given up on after UftpIdleTimeoutMs without progress.
+  COUNTER_TRANSFER_TIMEOUTS,
+  COUNTER_REQUESTS,
+  // Requests repeating the sequence number of the last response, which is
+  // sent again.
+  COUNTER_DUPLICATE_REQUESTS,
+  COUNTER_SESSIONS_OPENED,
+  COUNTER_FILE_CACHE_HITS,
+  COUNTER_FILE_CACHE_MISSES,
+  COUNTER_FILE_CACHE_EVICTIONS,
+  COUNTER_FILE_CACHE_INVALIDATIONS,
+  // Mapped reads that hit SIGBUS, the file was truncated under the mapping.
+  COUNTER_MAPPED_FILE_TRUNCATIONS,
+  NUM_COUNTERS,
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// Gauges are kept as the sum of every thread's ups and downs, so each thread
+// only ever adds to its own.
+enum UftpGauge {
+  GAUGE_SESSIONS,
+  GAUGE_FILE_CACHE_BYTES,
+  // Reads and writes submitted to the disk engines and not yet reaped.
+  GAUGE_DISK_QUEUE_DEPTH,
+  NUM_GAUGES,
+};
+
+///////////////////////////////////////////////////////////////////////////////
+enum UftpHistogram {
+  // Every RTT sample the send windows take, in microseconds.
+  HISTOGRAM_RTT_US,
+  // Bytes per second of each completed transfer of at least
+  // UftpMetrics::kMinGoodputBytes, from its first datagram to its last ack.
+  HISTOGRAM_GOODPUT,
+  NUM_HISTOGRAMS,
+};
+
+///////////////////////////////////////////////////////////////////////////////
+/// What the server keeps about one session, registered with UftpMetrics for
+/// as long as the session lives. Only the session's worker writes to it.
+struct UftpSessionMetrics {
+  std::string peer;
+  std::atomic<uint64_t> requests{0};
+  std::atomic<uint64_t> bytes_sent{0};
+  std::atomic<uint64_t> bytes_received{0};
+  std::atomic<uint64_t> retransmits{0};
+  std::atomic<uint64_t> retransmit_timeouts{0};
+  std::atomic<uint64_t> srtt_us{0};
+
+  static void Add(std::atomic<uint64_t>& value, uint64_t amount) {
+    value.store(value.load(std::memory_order_relaxed) + amount,
+                std::memory_order_relaxed);
+  }
+};
+
+///////////////////////////////////////////////////////////////////////////////
+/// Process-wide counters, gauges and histograms, cheap enough to record from
+/// the transfer paths with metrics always on. Every thread records into a
+/// slot of its own, so recording is a relaxed load and store of memory no
+/// other thread writes, with no lock and no shared cache line. Reading sums
+/// every slot ever made. Slots are never freed, which is fine for the fixed
+/// set of threads that transfer.
+///
+/// Histograms have buckets at powers of 4, up to 4^15, and an overflow
+/// bucket, so they cover microseconds to minutes and bytes per second to
+/// gigabytes per second alike.
+class UftpMetrics {
+ public:
+  static constexpr std::size_t kNumBuckets = 17;
+  static constexpr uint64_t kMinGoodputBytes = 1 << 16;
+
+  static void Add(UftpCounter counter, uint64_t amount = 1) {
+    Bump(LocalSlot().counters[counter], amount);
+  }
+
+  static void AddGauge(UftpGauge gauge, int64_t amount) {
+    Bump(LocalSlot().gauges[gauge], (uint64_t)amount);
+  }
+
+  static void Observe(UftpHistogram histogram, uint64_t value) {
+    Observe(LocalSlot().histograms[histogram], value);
+  }
+
+  /// Time from a request's first datagram to the last ack of its response.
+  static void ObserveLatency(UftpOpcode opcode, uint64_t microseconds) {
+    Observe(LocalSlot().latencies[opcode < kNumOpcodes ? opcode : OP_UNKNOWN],
+            microseconds);
+  }
+
+  static void RegisterSession(UftpSessionMetrics* session);
+  static void UnregisterSession(UftpSessionMetrics* session);
+
+  /// Sum of counter over every thread.
+  static uint64_t Get(UftpCounter counter);
+
+  ///
+  /// \brief Format renders every metric, the buffer pool's and every live
+  /// session's in the Prometheus text exposition format.
+  ///
+  static void Format(std::string& text);
+
+  ///
+  /// \brief WriteFile writes Format() to filename through a temporary file
+  /// renamed over it, so a scraper never reads half a file.
+  /// \return false if it couldn't be written.
+  ///
+  static bool WriteFile(const std::string& filename);
+
+ private:
+  static constexpr std::size_t kNumOpcodes = OP_STATS + 1;
+
+  struct Histogram {
+    std::atomic<uint64_t> buckets[kNumBuckets];
+    std::atomic<uint64_t> sum;
+  };
+
+  struct Slot {
+    std::atomic<uint64_t> counters[NUM_COUNTERS];
+    std::atomic<uint64_t> gauges[NUM_GAUGES];
+    Histogram histograms[NUM_HISTOGRAMS];
+    Histogram latencies[kNumOpcodes];
+  };
+
+  static Slot& LocalSlot() {
+    static thread_local Slot* slot = nullptr;
+    if (slot == nullptr) {
+      slot = NewSlot();
+    }
+    return *slot;
+  }
+  static Slot* NewSlot();
+
+  static void Bump(std::atomic<uint64_t>& value, uint64_t amount) {
+    value.store(value.load(std::memory_order_relaxed) + amount,
+                std::memory_order_relaxed);
+  }
+
+  /// Bucket i counts values up to 4^i, the last one everything bigger.
+  static std::size_t BucketFor(uint64_t value) {
+    if (value <= 1) {
+      return 0;
+    }
+    const std::size_t bits = 64 - __builtin_clzll(value - 1);
+    const std::size_t bucket = (bits + 1) / 2;
+    return bucket < kNumBuckets ? bucket : kNumBuckets - 1;
+  }
+
+  static void Observe(Histogram& histogram, uint64_t value) {
+    Bump(histogram.buckets[BucketFor(value)], 1);
+    Bump(histogram.sum, value);
+  }
+};
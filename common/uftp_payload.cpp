@@ -0,0 +1,760 @@
+#include <uftp_payload.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+#include <uftp_defs.h>
+#include <uftp_metrics.h>
+#include <uftp_utils.h>
+
+namespace {
+
+// Where a SIGBUS on this thread jumps to, while mapped bytes are read.
+thread_local sigjmp_buf* mapped_read_jump = nullptr;
+struct sigaction previous_sigbus_action;
+std::once_flag sigbus_handler_once;
+
+///////////////////////////////////////////////////////////////////////////////
+void OnSigbus(int signal_num) {
+  if (mapped_read_jump != nullptr) {
+    sigjmp_buf* jump = mapped_read_jump;
+    mapped_read_jump = nullptr;
+    siglongjmp(*jump, 1);
+  }
+  // Not ours, hand it to whoever had it. Returning retries the access, which
+  // faults again into the old handler.
+  sigaction(SIGBUS, &previous_sigbus_action, nullptr);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// Chains in front of the SIGBUS handler already installed, the trace dump
+/// one, once the first file is mapped.
+void InstallSigbusHandler() {
+  struct sigaction action;
+  std::memset(&action, 0, sizeof(action));
+  action.sa_handler = OnSigbus;
+  sigemptyset(&action.sa_mask);
+  // The handler doesn't return when it jumps, so it mustn't stay blocked.
+  action.sa_flags = SA_NODEFER;
+  sigaction(SIGBUS, &action, &previous_sigbus_action);
+}
+
+}  // namespace
+
+///////////////////////////////////////////////////////////////////////////////
+void UftpBufferSink::Write(uint64_t offset, const uint8_t* data,
+                           std::size_t length) {
+  std::memcpy(buffer_.data() + offset, data, length);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+UftpFileSource::UftpFileSource(std::size_t buffer_size,
+                               std::shared_ptr<UftpDiskEngine> engine,
+                               bool direct_io)
+    : engine_(std::move(engine)), direct_io_(direct_io && engine_) {
+  // The engine's buffers stand in for our own.
+  if (!engine_) {
+    buffer_.resize(std::max<std::size_t>(buffer_size, UftpChunkSize));
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+UftpFileSource::~UftpFileSource() {
+  if (engine_) {
+    DrainReadAhead();
+  }
+  if (direct_fd_ >= 0) {
+    close(direct_fd_);
+  }
+  if (fd_ >= 0) {
+    close(fd_);
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+UftpStatusCode UftpFileSource::Open(const std::string& filename) {
+  fd_ = open(filename.c_str(), O_RDONLY);
+  if (fd_ < 0) {
+    DEBUG_LOG("Couldn't open file:", filename);
+    return UftpUtils::ErrnoToStatusCode(errno);
+  }
+
+  struct stat file_stat;
+  if (fstat(fd_, &file_stat) != 0 || !S_ISREG(file_stat.st_mode)) {
+    close(fd_);
+    fd_ = -1;
+    return UftpStatusCode::ERR_FILE_NOT_FOUND;
+  }
+
+  length_ = file_stat.st_size;
+  mtime_ns_ = (uint64_t)file_stat.st_mtim.tv_sec * 1000000000 +
+              file_stat.st_mtim.tv_nsec;
+  posix_fadvise(fd_, 0, 0, POSIX_FADV_SEQUENTIAL);
+  if (direct_io_) {
+    // Not every filesystem takes O_DIRECT, the page cache will do there.
+    direct_fd_ = open(filename.c_str(), O_RDONLY | O_DIRECT);
+    if (direct_fd_ < 0) {
+      DEBUG_LOG("No O_DIRECT for file:", filename);
+    }
+  }
+  DEBUG_LOG("File Size:", length_);
+  return UftpStatusCode::NO_ERR;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+static bool PreadAll(int fd, uint8_t* buff, std::size_t length,
+                     uint64_t offset) {
+  while (length > 0) {
+    const ssize_t bytes_read = pread(fd, buff, length, offset);
+    if (bytes_read <= 0) {
+      if (bytes_read < 0 && errno == EINTR) continue;
+      return false;
+    }
+    buff += bytes_read;
+    offset += bytes_read;
+    length -= bytes_read;
+  }
+  return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+const uint8_t* UftpFileSource::Read(uint64_t offset, std::size_t length,
+                                    uint8_t* scratch) {
+  if (offset + length > length_) {
+    return nullptr;
+  }
+  if (engine_) {
+    return ReadFromEngine(offset, length, scratch);
+  }
+
+  // The read-ahead buffer gets refilled as the window moves, so hand out a
+  // copy rather than a pointer into it.
+  if (offset >= buffer_offset_ &&
+      offset + length <= buffer_offset_ + buffer_length_) {
+    std::memcpy(scratch, buffer_.data() + (offset - buffer_offset_), length);
+    return scratch;
+  }
+
+  if (offset < buffer_offset_) {
+    // A retransmit from behind the read-ahead window. Don't throw away the
+    // buffer the window is about to need.
+    return PreadAll(fd_, scratch, length, offset) ? scratch : nullptr;
+  }
+
+  buffer_offset_ = offset;
+  buffer_length_ = std::min<uint64_t>(buffer_.size(), length_ - offset);
+  if (length > buffer_length_ ||
+      !PreadAll(fd_, buffer_.data(), buffer_length_, offset)) {
+    buffer_length_ = 0;
+    return nullptr;
+  }
+  std::memcpy(scratch, buffer_.data(), length);
+  return scratch;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bool UftpFileSource::Ready(uint64_t offset, std::size_t length) {
+  if (!engine_ || offset + length > length_) {
+    return true;
+  }
+  AdvanceReadAhead(offset);
+
+  // Anything not covered by the read-ahead is read the plain way.
+  const std::size_t buffer_size = engine_->BufferSize();
+  for (const auto& read_ahead : read_ahead_) {
+    if (read_ahead->offset < offset + length &&
+        offset < read_ahead->offset + buffer_size && !read_ahead->done) {
+      return false;
+    }
+  }
+  return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void UftpFileSource::AdvanceReadAhead(uint64_t offset) {
+  // Let go of the buffers the window has moved past.
+  const std::size_t buffer_size = engine_->BufferSize();
+  while (!read_ahead_.empty() && read_ahead_.front()->done &&
+         read_ahead_.front()->offset + buffer_size <= offset) {
+    engine_->ReleaseBuffer(read_ahead_.front()->buffer);
+    read_ahead_.pop_front();
+  }
+
+  const uint64_t read_ahead_offset =
+      read_ahead_.empty() ? next_read_offset_ : read_ahead_.front()->offset;
+  if (offset < read_ahead_offset) {
+    // A retransmit from behind the read-ahead.
+    return;
+  }
+  if (offset >= next_read_offset_) {
+    // Past anything queued, a jump ahead or the very first read. Start over
+    // from the buffer holding offset.
+    DrainReadAhead();
+    next_read_offset_ = offset - offset % buffer_size;
+  }
+  TopUpReadAhead();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+const uint8_t* UftpFileSource::ReadFromEngine(uint64_t offset,
+                                              std::size_t length,
+                                              uint8_t* scratch) {
+  AdvanceReadAhead(offset);
+  if (!read_ahead_.empty() && offset < read_ahead_.front()->offset) {
+    // A retransmit from behind the read-ahead.
+    return PreadAll(fd_, scratch, length, offset) ? scratch : nullptr;
+  }
+
+  // The chunk may straddle two buffers.
+  const std::size_t buffer_size = engine_->BufferSize();
+  uint8_t* next = scratch;
+  while (length > 0) {
+    std::shared_ptr<ReadAhead> read_ahead;
+    for (const auto& queued : read_ahead_) {
+      if (queued->offset <= offset && offset < queued->offset + buffer_size) {
+        read_ahead = queued;
+        break;
+      }
+    }
+    if (!read_ahead) {
+      // The engine had no buffer to spare.
+      return PreadAll(fd_, next, length, offset) ? scratch : nullptr;
+    }
+
+    // Only when the caller didn't check Ready() first.
+    while (!read_ahead->done) {
+      engine_->Wait();
+    }
+    const uint64_t skip = offset - read_ahead->offset;
+    if (read_ahead->result < 0 || (uint64_t)read_ahead->result <= skip) {
+      // Failed or came back short, try again the plain way.
+      DEBUG_LOG("Read ahead failed at:", read_ahead->offset, ", result: ",
+                read_ahead->result);
+      return PreadAll(fd_, next, length, offset) ? scratch : nullptr;
+    }
+    const std::size_t piece =
+        std::min<std::size_t>(length, read_ahead->result - skip);
+    std::memcpy(next, engine_->Buffer(read_ahead->buffer) + skip, piece);
+    next += piece;
+    offset += piece;
+    length -= piece;
+  }
+  return scratch;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void UftpFileSource::TopUpReadAhead() {
+  const int fd = direct_fd_ >= 0 ? direct_fd_ : fd_;
+  while (read_ahead_.size() < UftpReadAheadBuffers &&
+         next_read_offset_ < length_) {
+    const int buffer = engine_->AcquireBuffer();
+    if (buffer < 0) {
+      return;
+    }
+    auto read_ahead = std::make_shared<ReadAhead>();
+    read_ahead->buffer = buffer;
+    read_ahead->offset = next_read_offset_;
+    // Whole buffers even at the end of the file, O_DIRECT wants aligned
+    // lengths and the read comes back short anyway.
+    UftpDiskEngine* engine = engine_.get();
+    if (!engine_->Read(fd, buffer, next_read_offset_, engine_->BufferSize(),
+                       [read_ahead, engine](int result) {
+                         read_ahead->result = result;
+                         read_ahead->done = true;
+                         if (read_ahead->abandoned) {
+                           engine->ReleaseBuffer(read_ahead->buffer);
+                         }
+                       })) {
+      engine_->ReleaseBuffer(buffer);
+      return;
+    }
+    read_ahead_.push_back(std::move(read_ahead));
+    next_read_offset_ += engine_->BufferSize();
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void UftpFileSource::DrainReadAhead() {
+  // The kernel may still be reading into the buffers, those go back to the
+  // engine once it's done.
+  for (const auto& read_ahead : read_ahead_) {
+    if (read_ahead->done) {
+      engine_->ReleaseBuffer(read_ahead->buffer);
+    } else {
+      read_ahead->abandoned = true;
+    }
+  }
+  read_ahead_.clear();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+UftpMappedFileSource::~UftpMappedFileSource() {
+  if (data_ != nullptr) {
+    munmap((void*)data_, length_);
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+UftpStatusCode UftpMappedFileSource::Open(const std::string& filename) {
+  const int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) {
+    DEBUG_LOG("Couldn't open file:", filename);
+    return UftpUtils::ErrnoToStatusCode(errno);
+  }
+
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) != 0 || !S_ISREG(file_stat.st_mode)) {
+    close(fd);
+    return UftpStatusCode::ERR_FILE_NOT_FOUND;
+  }
+
+  std::call_once(sigbus_handler_once, InstallSigbusHandler);
+  length_ = file_stat.st_size;
+  mtime_ns_ = (uint64_t)file_stat.st_mtim.tv_sec * 1000000000 +
+              file_stat.st_mtim.tv_nsec;
+  if (length_ > 0) {
+    void* data = mmap(nullptr, length_, PROT_READ, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+      DEBUG_LOG("Couldn't map file:", filename);
+      close(fd);
+      length_ = 0;
+      return UftpStatusCode::ERR_UNKNOWN;
+    }
+    madvise(data, length_, MADV_SEQUENTIAL);
+    data_ = static_cast<const uint8_t*>(data);
+  }
+
+  // The mapping keeps the file alive.
+  close(fd);
+  DEBUG_LOG("File Size:", length_);
+  return UftpStatusCode::NO_ERR;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+const uint8_t* UftpMappedFileSource::Read(uint64_t offset, std::size_t length,
+                                          uint8_t* scratch) {
+  if (offset + length > length_ || Truncated()) {
+    return nullptr;
+  }
+  return data_ + offset;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void UftpMappedFileSource::Faulted() {
+  DEBUG_LOG("Mapped file truncated");
+  UftpMetrics::Add(COUNTER_MAPPED_FILE_TRUNCATIONS);
+  truncated_.store(true, std::memory_order_relaxed);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void UftpMappedFileSource::CatchFaults(sigjmp_buf* jump) {
+  mapped_read_jump = jump;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+std::mutex UftpPartFile::registry_mutex_;
+std::map<std::string, std::weak_ptr<UftpPartFile>> UftpPartFile::registry_;
+
+///////////////////////////////////////////////////////////////////////////////
+UftpPartFile::UftpPartFile(const std::string& filename, uint64_t file_length,
+                           uint64_t source_mtime_ns)
+    : filename_(filename),
+      part_filename_(filename + ".uftp-part"),
+      file_length_(file_length),
+      source_mtime_ns_(source_mtime_ns) {}
+
+///////////////////////////////////////////////////////////////////////////////
+UftpPartFile::~UftpPartFile() {
+  if (fd_ >= 0) {
+    close(fd_);
+  }
+  std::lock_guard<std::mutex> lock(registry_mutex_);
+  const auto ite = registry_.find(filename_);
+  if (ite != registry_.end() && ite->second.expired()) {
+    registry_.erase(ite);
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+std::shared_ptr<UftpPartFile> UftpPartFile::Open(const std::string& filename,
+                                                 uint64_t file_length,
+                                                 uint64_t source_mtime_ns,
+                                                 bool whole_file,
+                                                 UftpStatusCode& status) {
+  std::unique_lock<std::mutex> lock(registry_mutex_);
+  std::weak_ptr<UftpPartFile>& entry = registry_[filename];
+  std::shared_ptr<UftpPartFile> part = entry.lock();
+  if (part && !whole_file && !part->finished_ &&
+      part->file_length_ == file_length) {
+    if (source_mtime_ns != 0 && part->source_mtime_ns_ != source_mtime_ns) {
+      // The file changed under the other streams.
+      status = UftpStatusCode::ERR_FILE_CHANGED;
+      return nullptr;
+    }
+    status = UftpStatusCode::NO_ERR;
+    return part;
+  }
+
+  part.reset(new UftpPartFile(filename, file_length, source_mtime_ns));
+  status = part->Create(whole_file);
+  if (status != UftpStatusCode::NO_ERR) {
+    // Its destructor takes registry_mutex_ too.
+    lock.unlock();
+    part.reset();
+    return nullptr;
+  }
+  entry = part;
+  return part;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+UftpStatusCode UftpPartFile::Create(bool whole_file) {
+  int flags = O_WRONLY | O_CREAT;
+  const bool fresh = whole_file || !checkpoint_.Load(filename_) ||
+                     checkpoint_.FileLength() != file_length_;
+  if (!fresh && source_mtime_ns_ != 0 &&
+      checkpoint_.SourceMtimeNs() != source_mtime_ns_) {
+    // Same length, but the ranges we hold are of another version of the
+    // file. Adding this one would splice the two.
+    DEBUG_LOG("Checkpoint is of another version of:", filename_);
+    return UftpStatusCode::ERR_FILE_CHANGED;
+  }
+  if (fresh) {
+    checkpoint_.Reset(file_length_, source_mtime_ns_);
+    flags |= O_TRUNC;
+    // A new inode, so sinks still holding the old part file can tell
+    // they've been replaced.
+    unlink(part_filename_.c_str());
+  }
+
+  fd_ = open(part_filename_.c_str(), flags, 0644);
+  if (fd_ < 0) {
+    DEBUG_LOG("Couldn't open file:", part_filename_);
+    return UftpUtils::ErrnoToStatusCode(errno);
+  }
+  if (fresh && file_length_ > 0 && fallocate(fd_, 0, 0, file_length_) != 0) {
+    // Not every filesystem can, and it's only an optimisation.
+    DEBUG_LOG("Couldn't preallocate file:", part_filename_);
+  }
+  return UftpStatusCode::NO_ERR;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bool UftpPartFile::Empty() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return checkpoint_.Empty();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+UftpStatusCode UftpPartFile::AddRange(uint64_t offset, uint64_t length,
+                                      UftpDiskEngine* engine) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  checkpoint_.AddRange(offset, length);
+  unsynced_length_ += length;
+  if (unsynced_length_ < UftpCheckpointInterval ||
+      (engine != nullptr && CheckpointAsyncLocked(*engine))) {
+    return UftpStatusCode::NO_ERR;
+  }
+  return CheckpointLocked();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+UftpStatusCode UftpPartFile::Checkpoint() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return CheckpointLocked();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+UftpStatusCode UftpPartFile::CheckpointLocked() {
+  if (finished_ || !OwnsPartFile()) {
+    DEBUG_LOG("Part file replaced, not checkpointing:", part_filename_);
+    return UftpStatusCode::NO_ERR;
+  }
+  // Every range in the checkpoint has been written by now, sync so they're
+  // on disk too before saving it.
+  if (fdatasync(fd_) != 0) {
+    return UftpUtils::ErrnoToStatusCode(errno);
+  }
+  if (!checkpoint_.Save(filename_)) {
+    DEBUG_LOG("Couldn't save checkpoint for:", filename_);
+  }
+  unsynced_length_ = 0;
+  return UftpStatusCode::NO_ERR;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bool UftpPartFile::CheckpointAsyncLocked(UftpDiskEngine& engine) {
+  if (sync_in_flight_) {
+    // The next range after it's done starts another.
+    return true;
+  }
+  // Only the ranges written so far are sure to be covered by the sync.
+  auto synced = std::make_shared<UftpCheckpoint>(checkpoint_);
+  auto self = shared_from_this();
+  if (!engine.Sync(fd_, [self, synced](int result) {
+        self->OnSynced(*synced, result);
+      })) {
+    return false;
+  }
+  sync_in_flight_ = true;
+  unsynced_length_ = 0;
+  return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void UftpPartFile::OnSynced(const UftpCheckpoint& synced, int result) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  sync_in_flight_ = false;
+  if (result < 0) {
+    // The next checkpoint tries again.
+    DEBUG_LOG("Couldn't sync file:", part_filename_);
+    return;
+  }
+  if (finished_ || !OwnsPartFile()) {
+    return;
+  }
+  if (!synced.Save(filename_)) {
+    DEBUG_LOG("Couldn't save checkpoint for:", filename_);
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bool UftpPartFile::OwnsPartFile() const {
+  // Another transfer of the same file may have finished, or started over,
+  // since this one opened it. Its files aren't ours to touch.
+  struct stat open_stat, part_stat;
+  return fstat(fd_, &open_stat) == 0 &&
+         stat(part_filename_.c_str(), &part_stat) == 0 &&
+         open_stat.st_ino == part_stat.st_ino &&
+         open_stat.st_dev == part_stat.st_dev;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+UftpStatusCode UftpPartFile::Finish(bool& complete) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (finished_) {
+    complete = true;
+    return UftpStatusCode::NO_ERR;
+  }
+  if (!checkpoint_.Complete()) {
+    // Other ranges of the file are still to come.
+    complete = false;
+    return CheckpointLocked();
+  }
+
+  if (ftruncate(fd_, file_length_) != 0 ||
+      std::rename(part_filename_.c_str(), filename_.c_str()) != 0) {
+    return UftpUtils::ErrnoToStatusCode(errno);
+  }
+  UftpCheckpoint::Remove(filename_);
+  finished_ = true;
+  complete = true;
+  return UftpStatusCode::NO_ERR;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void UftpPartFile::Discard() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!finished_ && OwnsPartFile()) {
+    unlink(part_filename_.c_str());
+    UftpCheckpoint::Remove(filename_);
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+UftpFileSink::UftpFileSink(std::size_t buffer_size,
+                           std::shared_ptr<UftpDiskEngine> engine)
+    : buffer_(std::max<std::size_t>(buffer_size, UftpChunkSize)),
+      engine_(std::move(engine)) {}
+
+///////////////////////////////////////////////////////////////////////////////
+UftpFileSink::~UftpFileSink() {
+  if (!part_) {
+    return;
+  }
+  // Never finished. Keep what made it to disk so the transfer can be
+  // resumed, unless nothing did.
+  Flush();
+  WaitForWrites();
+  if (status_ == UftpStatusCode::NO_ERR && !part_->Empty()) {
+    part_->Checkpoint();
+    return;
+  }
+  Discard();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+UftpStatusCode UftpFileSink::Open(const std::string& filename,
+                                  uint64_t file_length, uint64_t range_offset,
+                                  uint64_t range_length,
+                                  uint64_t source_mtime_ns) {
+  range_offset_ = range_offset;
+
+  if (range_offset > file_length || range_length > file_length - range_offset) {
+    DEBUG_LOG("Range outside of file:", filename);
+    status_ = UftpStatusCode::ERR_BAD_COMMAND;
+    return status_;
+  }
+
+  const bool whole_file = (range_offset == 0 && range_length == file_length);
+  part_ = UftpPartFile::Open(filename, file_length, source_mtime_ns,
+                             whole_file, status_);
+  return status_;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void UftpFileSink::Flush() {
+  const int buffer = pending_buffer_;
+  const uint64_t offset = pending_offset_;
+  const std::size_t length = pending_length_;
+  pending_buffer_ = -1;
+  pending_offset_ = kNoRun;
+  pending_length_ = 0;
+  if (buffer < 0) {
+    WriteThrough(offset, buffer_.data(), length);
+    return;
+  }
+  if (length == 0 || status_ != UftpStatusCode::NO_ERR) {
+    engine_->ReleaseBuffer(buffer);
+    return;
+  }
+
+  // The engine has a request for every buffer so the queue can't be full,
+  // but if it is, OnWritten() writes the lot the plain way.
+  ++writes_in_flight_;
+  if (!engine_->Write(part_->Fd(), buffer, offset, length,
+                      [this, buffer, offset, length](int result) {
+                        OnWritten(buffer, offset, length, result);
+                      })) {
+    OnWritten(buffer, offset, length, 0);
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void UftpFileSink::OnWritten(int buffer, uint64_t offset, std::size_t length,
+                             int result) {
+  --writes_in_flight_;
+  if (result < 0) {
+    DEBUG_LOG("Couldn't write file:", part_->PartFilename());
+    if (status_ == UftpStatusCode::NO_ERR) {
+      status_ = UftpUtils::ErrnoToStatusCode(-result);
+    }
+  } else if ((std::size_t)result < length) {
+    // Short, write the rest the plain way. It adds its own range.
+    WriteThrough(offset + result, engine_->Buffer(buffer) + result,
+                 length - result);
+  }
+  if (status_ == UftpStatusCode::NO_ERR && result > 0) {
+    status_ = part_->AddRange(offset, result, engine_.get());
+  }
+  engine_->ReleaseBuffer(buffer);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void UftpFileSink::WaitForWrites() {
+  while (writes_in_flight_ > 0) {
+    engine_->Wait();
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void UftpFileSink::StartRun(uint64_t offset) {
+  pending_offset_ = offset;
+  if (!engine_) {
+    return;
+  }
+  // With none free the run goes through our own buffer, rather than stall
+  // the event loop until one of the writes is done.
+  pending_buffer_ = engine_->AcquireBuffer();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void UftpFileSink::WriteThrough(uint64_t offset, const uint8_t* data,
+                                std::size_t length) {
+  const uint64_t range_offset = offset;
+  const std::size_t range_length = length;
+  while (length > 0 && status_ == UftpStatusCode::NO_ERR) {
+    const ssize_t bytes_written = pwrite(part_->Fd(), data, length, offset);
+    if (bytes_written < 0) {
+      if (errno == EINTR) continue;
+      DEBUG_LOG("Couldn't write file:", part_->PartFilename());
+      status_ = UftpUtils::ErrnoToStatusCode(errno);
+      return;
+    }
+    data += bytes_written;
+    offset += bytes_written;
+    length -= bytes_written;
+  }
+  if (status_ == UftpStatusCode::NO_ERR && range_length > 0) {
+    status_ = part_->AddRange(range_offset, range_length, engine_.get());
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void UftpFileSink::Discard() {
+  if (!part_) {
+    return;
+  }
+  WaitForWrites();
+  part_->Discard();
+  part_.reset();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void UftpFileSink::Write(uint64_t offset, const uint8_t* data,
+                         std::size_t length) {
+  if (!part_ || status_ != UftpStatusCode::NO_ERR) {
+    return;
+  }
+
+  // Chunks mostly arrive in order, so coalesce contiguous runs into one
+  // pwrite per buffer.
+  offset += range_offset_;
+  const bool contiguous = (offset == pending_offset_ + pending_length_);
+  if (!contiguous || pending_length_ + length > PendingCapacity()) {
+    Flush();
+    StartRun(offset);
+  }
+  if (length > PendingCapacity()) {
+    // Too big to be worth buffering.
+    WriteThrough(offset, data, length);
+  } else {
+    std::memcpy(PendingData() + pending_length_, data, length);
+    pending_length_ += length;
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bool UftpFileSink::Drain() {
+  if (part_) {
+    Flush();
+  }
+  return writes_in_flight_ == 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+UftpStatusCode UftpFileSink::Finish() {
+  if (!part_) {
+    return status_;
+  }
+
+  Flush();
+  WaitForWrites();
+  if (status_ == UftpStatusCode::NO_ERR) {
+    status_ = part_->Finish(complete_);
+  }
+  if (status_ != UftpStatusCode::NO_ERR) {
+    Discard();
+    return status_;
+  }
+  part_.reset();
+  return status_;
+}
@@ -0,0 +1,415 @@
+#pragma once
+
+#include <setjmp.h>
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <uftp_checkpoint.h>
+#include <uftp_defs.h>
+#include <uftp_disk_engine.h>
+
+///////////////////////////////////////////////////////////////////////////////
+/// Where the message bytes of an outgoing transfer come from. Reads are by
+/// offset since the window may ask for a chunk again when retransmitting.
+class UftpPayloadSource {
+ public:
+  virtual ~UftpPayloadSource() {}
+
+  virtual uint64_t Length() const = 0;
+
+  /// The mtime of the file behind the source as it was opened, 0 for
+  /// sources that aren't files.
+  virtual uint64_t MtimeNs() const { return 0; }
+
+  ///
+  /// \brief Read
+  /// \param scratch room for length bytes, used by sources that don't keep
+  /// the data in memory themselves.
+  /// \return a pointer to length bytes at offset, or nullptr on an I/O error.
+  /// Several reads may be outstanding while a batch is assembled, so the
+  /// pointer has to stay valid until the scratch buffer is reused.
+  ///
+  virtual const uint8_t* Read(uint64_t offset, std::size_t length,
+                              uint8_t* scratch) = 0;
+
+  /// Whether Read() may be called from several threads at once, each with
+  /// its own scratch. Lets compression read on its workers.
+  virtual bool ConcurrentReads() const { return false; }
+
+  ///
+  /// \brief Ready starts whatever Read() of the range needs from the disk.
+  /// \return false while that's in flight, Read() would have to wait for it.
+  /// Sources with nothing to wait for are always ready.
+  ///
+  virtual bool Ready(uint64_t offset, std::size_t length) { return true; }
+
+  /// Tells the source that touching bytes Read() handed back faulted, see
+  /// UftpMappedFileSource::CatchFaults().
+  virtual void Faulted() {}
+};
+
+///////////////////////////////////////////////////////////////////////////////
+/// Where the message bytes of an incoming transfer go. Writes may arrive out
+/// of order.
+class UftpPayloadSink {
+ public:
+  virtual ~UftpPayloadSink() {}
+
+  virtual void Write(uint64_t offset, const uint8_t* data,
+                     std::size_t length) = 0;
+
+  ///
+  /// \brief Drain starts writing out whatever is still buffered, once every
+  /// byte has been written.
+  /// \return false while writes are in flight, Finish() would have to wait
+  /// for them.
+  ///
+  virtual bool Drain() { return true; }
+
+  /// Called once every byte has been written.
+  virtual UftpStatusCode Finish() = 0;
+
+  virtual UftpStatusCode Status() const = 0;
+};
+
+///
+/// Picks the sink for an incoming message once its header, command and
+/// argument are known. Returning nullptr buffers the message in memory.
+///
+using UftpSinkSelector =
+    std::function<std::shared_ptr<UftpPayloadSink>(const UftpMessage&)>;
+
+///////////////////////////////////////////////////////////////////////////////
+class UftpBufferSource : public UftpPayloadSource {
+ public:
+  explicit UftpBufferSource(const std::vector<uint8_t>& buffer)
+      : buffer_(buffer) {}
+
+  uint64_t Length() const override { return buffer_.size(); }
+  const uint8_t* Read(uint64_t offset, std::size_t length,
+                      uint8_t* scratch) override {
+    return buffer_.data() + offset;
+  }
+  bool ConcurrentReads() const override { return true; }
+
+ private:
+  const std::vector<uint8_t>& buffer_;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+class UftpBufferSink : public UftpPayloadSink {
+ public:
+  UftpBufferSink(std::vector<uint8_t>& buffer, uint64_t length)
+      : buffer_(buffer) {
+    buffer_.resize(length);
+  }
+
+  void Write(uint64_t offset, const uint8_t* data,
+             std::size_t length) override;
+  UftpStatusCode Finish() override { return UftpStatusCode::NO_ERR; }
+  UftpStatusCode Status() const override { return UftpStatusCode::NO_ERR; }
+
+ private:
+  std::vector<uint8_t>& buffer_;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+/// A window onto part of another source, for sending a byte range of a file.
+class UftpRangeSource : public UftpPayloadSource {
+ public:
+  UftpRangeSource(std::shared_ptr<UftpPayloadSource> source, uint64_t offset,
+                  uint64_t length)
+      : source_(std::move(source)), offset_(offset), length_(length) {}
+
+  uint64_t Length() const override { return length_; }
+  uint64_t MtimeNs() const override { return source_->MtimeNs(); }
+  const uint8_t* Read(uint64_t offset, std::size_t length,
+                      uint8_t* scratch) override {
+    return (offset + length <= length_)
+               ? source_->Read(offset_ + offset, length, scratch)
+               : nullptr;
+  }
+  bool ConcurrentReads() const override { return source_->ConcurrentReads(); }
+  bool Ready(uint64_t offset, std::size_t length) override {
+    return source_->Ready(offset_ + offset, length);
+  }
+
+ private:
+  std::shared_ptr<UftpPayloadSource> source_;
+  uint64_t offset_;
+  uint64_t length_;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+/// Streams a file from disk through a read-ahead buffer of a fixed size, so
+/// memory use doesn't depend on the size of the file. Given a
+/// UftpDiskEngine it reads ahead through the engine's buffers instead, a few
+/// of them in flight at once, so the disk works while the window sends.
+class UftpFileSource : public UftpPayloadSource {
+ public:
+  ///
+  /// \param engine reads through it if set. It must not be used from any
+  /// other thread.
+  /// \param direct_io read ahead with O_DIRECT, bypassing the page cache.
+  /// Only with an engine, whose buffers are aligned for it.
+  ///
+  explicit UftpFileSource(std::size_t buffer_size = UftpStreamBufferSize,
+                          std::shared_ptr<UftpDiskEngine> engine = nullptr,
+                          bool direct_io = false);
+  ~UftpFileSource();
+
+  UftpStatusCode Open(const std::string& filename);
+
+  uint64_t Length() const override { return length_; }
+  uint64_t MtimeNs() const override { return mtime_ns_; }
+  const uint8_t* Read(uint64_t offset, std::size_t length,
+                      uint8_t* scratch) override;
+  bool Ready(uint64_t offset, std::size_t length) override;
+
+ private:
+  struct ReadAhead {
+    int buffer;
+    uint64_t offset;
+    // Bytes read, or -errno, once done.
+    int result = 0;
+    bool done = false;
+    // The source let go of it before the read finished, the completion
+    // hands the buffer back.
+    bool abandoned = false;
+  };
+
+  /// Releases the buffers behind offset and keeps the read-ahead going
+  /// from there.
+  void AdvanceReadAhead(uint64_t offset);
+  const uint8_t* ReadFromEngine(uint64_t offset, std::size_t length,
+                                uint8_t* scratch);
+  /// Queues reads until UftpReadAheadBuffers are in flight or the file ends.
+  void TopUpReadAhead();
+  void DrainReadAhead();
+
+  int fd_ = -1;
+  uint64_t length_ = 0;
+  uint64_t mtime_ns_ = 0;
+
+  std::vector<uint8_t> buffer_;
+  uint64_t buffer_offset_ = 0;
+  std::size_t buffer_length_ = 0;
+
+  std::shared_ptr<UftpDiskEngine> engine_;
+  bool direct_io_ = false;
+  // O_DIRECT reads go through their own descriptor, the retransmits that
+  // miss the read-ahead are better off in the page cache.
+  int direct_fd_ = -1;
+  std::deque<std::shared_ptr<ReadAhead>> read_ahead_;
+  uint64_t next_read_offset_ = 0;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+/// Serves a file straight out of the page cache, the mapping saves the open
+/// and read() per get. Another process may truncate the file while it's
+/// mapped, and touching a page past the new end raises SIGBUS. Read() hands
+/// back a pointer into the mapping without touching it, whoever first reads
+/// the bytes does so under CatchFaults() and calls Faulted() if it jumps.
+/// That fails the transfer and marks the source Truncated() so it's never
+/// used again. The kernel reports the same fault inside a send as EFAULT.
+class UftpMappedFileSource : public UftpPayloadSource {
+ public:
+  UftpMappedFileSource() {}
+  ~UftpMappedFileSource();
+
+  UftpStatusCode Open(const std::string& filename);
+
+  uint64_t Length() const override { return length_; }
+  uint64_t MtimeNs() const override { return mtime_ns_; }
+  const uint8_t* Read(uint64_t offset, std::size_t length,
+                      uint8_t* scratch) override;
+  bool ConcurrentReads() const override { return true; }
+  void Faulted() override;
+
+  ///
+  /// \brief CatchFaults has a SIGBUS on this thread siglongjmp() to jump,
+  /// until it's called again with nullptr. The handler stops catching
+  /// before it jumps. Nothing with a destructor may be live in between.
+  ///
+  static void CatchFaults(sigjmp_buf* jump);
+
+  /// Whether a read found the file shorter than it was mapped.
+  bool Truncated() const {
+    return truncated_.load(std::memory_order_relaxed);
+  }
+
+ private:
+  const uint8_t* data_ = nullptr;
+  uint64_t length_ = 0;
+  uint64_t mtime_ns_ = 0;
+  // Set by whichever thread faulted, compression workers read too.
+  std::atomic<bool> truncated_{false};
+};
+
+///////////////////////////////////////////////////////////////////////////////
+/// "<filename>.uftp-part" and the UftpCheckpoint of the ranges it holds. Every
+/// sink in the process writing to the same file at the same time shares one,
+/// so the stripes of a file can arrive over parallel streams, even on
+/// different threads. A new part file is preallocated to the full length.
+/// Ranges are only added once they've been written, and every
+/// UftpCheckpointInterval bytes the part file is synced and the checkpoint
+/// saved. Given the adding sink's UftpDiskEngine the sync goes through it
+/// and the checkpoint of the ranges it covers is saved once it's done.
+/// Nothing checks the assembled file as a whole, each range was checked by
+/// the transfer that brought it and the checkpoint's source mtime keeps
+/// ranges of different versions apart.
+class UftpPartFile : public std::enable_shared_from_this<UftpPartFile> {
+ public:
+  ///
+  /// \brief Open joins the part file another sink has open for filename,
+  /// unless whole_file is set or the length differs. Otherwise it picks up
+  /// the part file an earlier transfer left behind if its checkpoint says
+  /// the file was the same length, and starts a new one if not.
+  /// \param source_mtime_ns the mtime of the file being sent, 0 if unknown.
+  /// A range of one version of the file is never added to a part file
+  /// holding another, that fails with ERR_FILE_CHANGED.
+  /// \return nullptr if the part file couldn't be opened, with the reason in
+  /// status.
+  ///
+  static std::shared_ptr<UftpPartFile> Open(const std::string& filename,
+                                            uint64_t file_length,
+                                            uint64_t source_mtime_ns,
+                                            bool whole_file,
+                                            UftpStatusCode& status);
+  ~UftpPartFile();
+
+  int Fd() const { return fd_; }
+  const std::string& PartFilename() const { return part_filename_; }
+  bool Empty();
+
+  /// Records bytes that have been written to Fd(). engine, if set, is the
+  /// caller's and checkpoints through it.
+  UftpStatusCode AddRange(uint64_t offset, uint64_t length,
+                          UftpDiskEngine* engine = nullptr);
+  /// Syncs the part file and saves the checkpoint.
+  UftpStatusCode Checkpoint();
+
+  ///
+  /// \brief Finish renames the part file into place once every byte of the
+  /// file is there, and checkpoints otherwise.
+  /// \param complete set when the file is in place.
+  ///
+  UftpStatusCode Finish(bool& complete);
+
+  /// Drops the part file and its checkpoint.
+  void Discard();
+
+ private:
+  UftpPartFile(const std::string& filename, uint64_t file_length,
+               uint64_t source_mtime_ns);
+  UftpStatusCode Create(bool whole_file);
+  UftpStatusCode CheckpointLocked();
+  /// \return false if the engine couldn't take the sync.
+  bool CheckpointAsyncLocked(UftpDiskEngine& engine);
+  void OnSynced(const UftpCheckpoint& synced, int result);
+  bool OwnsPartFile() const;
+
+  static std::mutex registry_mutex_;
+  static std::map<std::string, std::weak_ptr<UftpPartFile>> registry_;
+
+  const std::string filename_;
+  const std::string part_filename_;
+  const uint64_t file_length_;
+  const uint64_t source_mtime_ns_;
+  int fd_ = -1;
+
+  std::mutex mutex_;
+  UftpCheckpoint checkpoint_;
+  uint64_t unsynced_length_ = 0;
+  bool sync_in_flight_ = false;
+  bool finished_ = false;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+/// Writes one range of a file into its UftpPartFile through a write-behind
+/// buffer of a fixed size. The part file is renamed into place once every
+/// byte of the file is there, whichever sink writes the last of them. If a
+/// sink is destroyed unfinished the checkpoint is saved, so the transfer can
+/// be picked up where it left off. If the file couldn't be opened or written
+/// the part file is dropped, writes are discarded and the error is kept in
+/// Status().
+/// Given a UftpDiskEngine, runs are gathered in the engine's buffers and
+/// written behind asynchronously, falling back to the sink's own buffer and
+/// pwrite when the engine has none to spare. Drain() says when Finish() can
+/// go ahead without waiting on those writes.
+class UftpFileSink : public UftpPayloadSink {
+ public:
+  ///
+  /// \param engine writes through it if set. It must not be used from any
+  /// other thread.
+  ///
+  explicit UftpFileSink(std::size_t buffer_size = UftpStreamBufferSize,
+                        std::shared_ptr<UftpDiskEngine> engine = nullptr);
+  ~UftpFileSink();
+
+  ///
+  /// \brief Open
+  /// \param file_length length of the whole file.
+  /// \param range_offset where in the file the incoming message starts.
+  /// \param range_length length of the incoming message. A range that isn't
+  /// the whole file shares the part file with whoever else is writing to it,
+  /// see UftpPartFile::Open().
+  /// \param source_mtime_ns the sender's mtime for the file, 0 if unknown.
+  ///
+  UftpStatusCode Open(const std::string& filename, uint64_t file_length,
+                      uint64_t range_offset = 0, uint64_t range_length = 0,
+                      uint64_t source_mtime_ns = 0);
+
+  void Write(uint64_t offset, const uint8_t* data,
+             std::size_t length) override;
+  bool Drain() override;
+  UftpStatusCode Finish() override;
+  UftpStatusCode Status() const override { return status_; }
+
+  /// Whether Finish() found the whole file in place.
+  bool Complete() const { return complete_; }
+
+  /// Drops the part file and its checkpoint instead of finishing.
+  void Discard();
+
+ private:
+  void Flush();
+  void WriteThrough(uint64_t offset, const uint8_t* data, std::size_t length);
+  /// Where the next run is gathered, an engine buffer if one is free.
+  void StartRun(uint64_t offset);
+  void OnWritten(int buffer, uint64_t offset, std::size_t length, int result);
+  void WaitForWrites();
+
+  uint8_t* PendingData() {
+    return pending_buffer_ >= 0 ? engine_->Buffer(pending_buffer_)
+                                : buffer_.data();
+  }
+  std::size_t PendingCapacity() const {
+    return pending_buffer_ >= 0 ? engine_->BufferSize() : buffer_.size();
+  }
+
+  std::shared_ptr<UftpPartFile> part_;
+  uint64_t range_offset_ = 0;
+  UftpStatusCode status_ = UftpStatusCode::NO_ERR;
+  bool complete_ = false;
+
+  std::vector<uint8_t> buffer_;
+  // kNoRun until the first write, and again after a flush, so that the
+  // next write always starts a run of its own.
+  static constexpr uint64_t kNoRun = std::numeric_limits<uint64_t>::max();
+  uint64_t pending_offset_ = kNoRun;
+  std::size_t pending_length_ = 0;
+
+  std::shared_ptr<UftpDiskEngine> engine_;
+  // The engine buffer holding the pending run, -1 if it's in buffer_.
+  int pending_buffer_ = -1;
+  std::size_t writes_in_flight_ = 0;
+};
@@ -0,0 +1,54 @@
+#include <uftp_rtt.h>
+
+#include <algorithm>
+
+#include <uftp_defs.h>
+
+namespace {
+
+// Doubling past this would overflow UftpMaxRetransmitTimeoutMs anyway.
+constexpr int kMaxBackoff = 16;
+// RFC 6298's G, the least the variance term may shrink to.
+constexpr auto kClockGranularity = std::chrono::milliseconds(1);
+
+}  // namespace
+
+///////////////////////////////////////////////////////////////////////////////
+void UftpRttEstimator::OnSample(UftpClock::duration rtt) {
+  if (!has_sample_) {
+    has_sample_ = true;
+    srtt_ = rtt;
+    rttvar_ = rtt / 2;
+  } else {
+    const auto error = (srtt_ > rtt) ? srtt_ - rtt : rtt - srtt_;
+    rttvar_ = (3 * rttvar_ + error) / 4;
+    srtt_ = (7 * srtt_ + rtt) / 8;
+  }
+  backoff_ = 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void UftpRttEstimator::OnTimeout() {
+  backoff_ = std::min(backoff_ + 1, kMaxBackoff);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+UftpClock::duration UftpRttEstimator::Rto() const {
+  const auto min_rto = std::chrono::milliseconds(UftpMinRetransmitTimeoutMs);
+  const auto max_rto = std::chrono::milliseconds(UftpMaxRetransmitTimeoutMs);
+
+  // A steady path, a netem delay or a quiet LAN, drives the variance to
+  // nearly nothing, and the RTO down onto SRTT where the first late ack
+  // times out. Keep it at least a quarter of SRTT, so the RTO stays at
+  // twice the round trip or more.
+  const auto rttvar = std::max<UftpClock::duration>(
+      rttvar_, std::max<UftpClock::duration>(srtt_ / 4, kClockGranularity));
+  UftpClock::duration rto =
+      has_sample_ ? srtt_ + 4 * rttvar
+                  : std::chrono::milliseconds(UftpInitialRetransmitTimeoutMs);
+  rto = std::max<UftpClock::duration>(rto, min_rto);
+  for (int doubling = 0; doubling < backoff_ && rto < max_rto; ++doubling) {
+    rto *= 2;
+  }
+  return std::min<UftpClock::duration>(rto, max_rto);
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+
+#include <uftp_congestion.h>
+#include <uftp_defs.h>
+
+///
+/// Microsecond timestamp carried in chunks and echoed in acks. Only ever
+/// compared with another from the same clock, so it's fine for it to wrap.
+/// Never 0, which acks use for "no echo".
+///
+inline uint32_t UftpTimestamp(UftpClock::time_point time) {
+  const uint32_t timestamp =
+      std::chrono::duration_cast<std::chrono::microseconds>(
+          time.time_since_epoch())
+          .count();
+  return timestamp ? timestamp : 1;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// Smoothed round trip time and retransmit timeout for one peer, as in
+/// RFC 6298. Samples come from timestamps echoed in acks, so retransmitted
+/// chunks can be measured too. Each timeout doubles the RTO until the next
+/// sample.
+class UftpRttEstimator {
+ public:
+  void OnSample(UftpClock::duration rtt);
+  void OnTimeout();
+
+  UftpClock::duration Rto() const;
+
+  bool HasSample() const { return has_sample_; }
+  UftpClock::duration Srtt() const { return srtt_; }
+  UftpClock::duration RttVar() const { return rttvar_; }
+
+ private:
+  bool has_sample_ = false;
+  UftpClock::duration srtt_ = UftpClock::duration::zero();
+  UftpClock::duration rttvar_ = UftpClock::duration::zero();
+  int backoff_ = 0;
+};
@@ -0,0 +1,225 @@
+#include <uftp_trace.h>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <mutex>
+#include <new>
+#include <vector>
+
+static_assert((UftpTraceRingSize & (UftpTraceRingSize - 1)) == 0,
+              "UftpTraceRingSize must be a power of two");
+static_assert(sizeof(UftpTraceEvent) == 64, "Events are a cache line");
+
+namespace {
+
+constexpr uint32_t kMaxSites = 1024;
+constexpr uint32_t kMaxRings = 256;
+
+const int kFatalSignals[] = {SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT};
+
+// Both tables only grow, so a dump can walk them without the lock, up to
+// the count it loads.
+std::mutex sites_mutex;
+std::atomic<UftpTraceSite*> sites[kMaxSites];
+std::atomic<uint32_t> num_sites{0};
+
+std::mutex rings_mutex;
+std::atomic<void*> rings[kMaxRings];
+std::atomic<uint32_t> num_rings{0};
+std::vector<void*> free_rings;
+
+char dump_filename[PATH_MAX];
+
+///////////////////////////////////////////////////////////////////////////////
+uint64_t MonotonicNs() {
+  timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+const uint64_t start_timestamp = UftpTrace::Timestamp();
+const uint64_t start_ns = MonotonicNs();
+
+///////////////////////////////////////////////////////////////////////////////
+bool WriteAll(int fd, const void* data, std::size_t length) {
+  const char* next = static_cast<const char*>(data);
+  while (length > 0) {
+    const ssize_t ret = write(fd, next, length);
+    if (ret < 0) {
+      if (errno == EINTR) continue;
+      return false;
+    }
+    next += ret;
+    length -= ret;
+  }
+  return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bool WriteString(int fd, const char* string) {
+  return WriteAll(fd, string, std::strlen(string));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// Frees the calling thread's ring for the next thread when it exits.
+struct RingReleaser {
+  void* ring = nullptr;
+
+  ~RingReleaser() {
+    std::lock_guard<std::mutex> lock(rings_mutex);
+    free_rings.push_back(ring);
+  }
+};
+
+///////////////////////////////////////////////////////////////////////////////
+void OnSignal(int signal_num) {
+  const int saved_errno = errno;
+  UftpTrace::Dump(dump_filename);
+  errno = saved_errno;
+  if (signal_num != SIGUSR1) {
+    // The handler was reset on the way in, so this dies as it would have.
+    raise(signal_num);
+  }
+}
+
+}  // namespace
+
+///////////////////////////////////////////////////////////////////////////////
+uint32_t UftpTrace::Register(UftpTraceSite& site, const char* format,
+                             const char* types) {
+  std::lock_guard<std::mutex> lock(sites_mutex);
+  uint32_t id = site.id.load(std::memory_order_relaxed);
+  if (id != 0) {
+    return id;
+  }
+  const uint32_t index = num_sites.load(std::memory_order_relaxed);
+  if (index == kMaxSites) {
+    // Recorded, but the decoder won't know what it was.
+    site.id.store(kMaxSites + 1, std::memory_order_relaxed);
+    return kMaxSites + 1;
+  }
+  site.format = format;
+  site.types = types;
+  sites[index].store(&site, std::memory_order_relaxed);
+  num_sites.store(index + 1, std::memory_order_release);
+  site.id.store(index + 1, std::memory_order_relaxed);
+  return index + 1;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+UftpTrace::Ring* UftpTrace::NewRing() {
+  static thread_local RingReleaser releaser;
+  Ring* ring = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(rings_mutex);
+    if (!free_rings.empty()) {
+      ring = static_cast<Ring*>(free_rings.back());
+      free_rings.pop_back();
+    }
+  }
+
+  if (ring == nullptr) {
+    void* memory = nullptr;
+    if (posix_memalign(&memory, 64, sizeof(Ring)) != 0) {
+      throw std::bad_alloc();
+    }
+    ring = new (memory) Ring();
+
+    // A ring past kMaxRings still records, it just isn't dumped.
+    std::lock_guard<std::mutex> lock(rings_mutex);
+    const uint32_t index = num_rings.load(std::memory_order_relaxed);
+    if (index < kMaxRings) {
+      rings[index].store(ring, std::memory_order_relaxed);
+      num_rings.store(index + 1, std::memory_order_release);
+    }
+  }
+  ring->tid = syscall(SYS_gettid);
+  releaser.ring = ring;
+  return ring;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void UftpTrace::InstallDumpHandlers(const std::string& filename) {
+  std::strncpy(dump_filename, filename.c_str(), sizeof(dump_filename) - 1);
+
+  struct sigaction action;
+  std::memset(&action, 0, sizeof(action));
+  action.sa_handler = OnSignal;
+  sigemptyset(&action.sa_mask);
+  action.sa_flags = SA_RESTART;
+  sigaction(SIGUSR1, &action, nullptr);
+
+  action.sa_flags = SA_RESETHAND;
+  for (const int signal_num : kFatalSignals) {
+    sigaction(signal_num, &action, nullptr);
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bool UftpTrace::Dump(const char* filename) {
+  const int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    return false;
+  }
+
+  UftpTraceFileHeader file_header;
+  std::memset(&file_header, 0, sizeof(file_header));
+  std::memcpy(file_header.magic, UftpTraceMagic, sizeof(file_header.magic));
+  file_header.start_timestamp = start_timestamp;
+  file_header.start_ns = start_ns;
+  file_header.dump_timestamp = Timestamp();
+  file_header.dump_ns = MonotonicNs();
+  file_header.num_sites = num_sites.load(std::memory_order_acquire);
+  file_header.num_rings = num_rings.load(std::memory_order_acquire);
+  bool ok = WriteAll(fd, &file_header, sizeof(file_header));
+
+  for (uint32_t index = 0; ok && index < file_header.num_sites; ++index) {
+    const UftpTraceSite& site = *sites[index].load(std::memory_order_relaxed);
+    UftpTraceSiteHeader site_header;
+    site_header.id = index + 1;
+    site_header.line = site.line;
+    site_header.file_length = std::strlen(site.file);
+    site_header.func_length = std::strlen(site.func);
+    site_header.format_length = std::strlen(site.format);
+    site_header.types_length = std::strlen(site.types);
+    ok = WriteAll(fd, &site_header, sizeof(site_header)) &&
+         WriteString(fd, site.file) && WriteString(fd, site.func) &&
+         WriteString(fd, site.format) && WriteString(fd, site.types);
+  }
+
+  for (uint32_t index = 0; ok && index < file_header.num_rings; ++index) {
+    const Ring& ring =
+        *static_cast<Ring*>(rings[index].load(std::memory_order_relaxed));
+    const uint64_t head = ring.head.load(std::memory_order_acquire);
+    UftpTraceRingHeader ring_header;
+    ring_header.num_events = std::min<uint64_t>(head, UftpTraceRingSize);
+    // Oldest first, which is from head on once the ring has wrapped.
+    const std::size_t split = head % UftpTraceRingSize;
+    ok = WriteAll(fd, &ring_header, sizeof(ring_header));
+    if (ok && head > UftpTraceRingSize) {
+      ok = WriteAll(fd, &ring.events[split],
+                    (UftpTraceRingSize - split) * sizeof(UftpTraceEvent));
+    }
+    if (ok) {
+      ok = WriteAll(fd, ring.events,
+                    (head > UftpTraceRingSize ? split : head) *
+                        sizeof(UftpTraceEvent));
+    }
+  }
+
+  return close(fd) == 0 && ok;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+std::string UftpTrace::DefaultFilename(const std::string& program) {
+  return std::string(UftpDefaultTraceDir) + "/" + program + "." +
+         std::to_string(getpid()) + ".trace";
+}
@@ -0,0 +1,211 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <type_traits>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include <uftp_defs.h>
+
+///
+/// \brief UFTP_TRACE records an event in the calling thread's trace ring, e.g.
+/// UFTP_TRACE("Fast retransmit, transfer: {}, chunk: {}", id, chunk_num).
+/// Each {} in the format stands for one argument. Arguments must be numbers,
+/// bools or enums, at most UftpTrace::kMaxArgs of them, and are stored raw,
+/// the format is only applied by tools/uftp_trace_decode.
+///
+#define UFTP_TRACE(...)                                                 \
+  do {                                                                  \
+    static UftpTraceSite uftp_trace_site(__FILE__, __func__, __LINE__); \
+    UftpTrace::Record(uftp_trace_site, __VA_ARGS__);                    \
+  } while (0)
+
+///////////////////////////////////////////////////////////////////////////////
+/// One UFTP_TRACE in the source. Constant initialised, so it costs no guard,
+/// and given its id the first time it records.
+struct UftpTraceSite {
+  constexpr UftpTraceSite(const char* file, const char* func, int line)
+      : file(file), func(func), line(line) {}
+
+  const char* file;
+  const char* func;
+  int line;
+  const char* format = nullptr;
+  // A character per argument: 'i' signed, 'u' unsigned, 'f' floating point,
+  // 'b' bool.
+  const char* types = nullptr;
+  std::atomic<uint32_t> id{0};
+};
+
+///////////////////////////////////////////////////////////////////////////////
+template <typename T>
+struct UftpTraceType {
+  static_assert(std::is_arithmetic<T>::value || std::is_enum<T>::value,
+                "Trace arguments are stored raw, so no strings or pointers");
+  static constexpr char kCode =
+      std::is_same<T, bool>::value
+          ? 'b'
+          : std::is_floating_point<T>::value
+                ? 'f'
+                : std::is_signed<typename std::conditional<
+                      std::is_enum<T>::value, std::underlying_type<T>,
+                      std::common_type<T>>::type::type>::value
+                      ? 'i'
+                      : 'u';
+};
+
+template <typename... Args>
+struct UftpTraceTypes {
+  static constexpr char kCodes[] = {UftpTraceType<Args>::kCode..., '\0'};
+};
+template <typename... Args>
+constexpr char UftpTraceTypes<Args...>::kCodes[];
+
+///////////////////////////////////////////////////////////////////////////////
+/// An event as it's kept in a ring and written to a dump, a cache line each.
+struct UftpTraceEvent {
+  uint64_t timestamp;
+  uint32_t site;
+  uint32_t tid;
+  uint64_t args[6];
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// Layout of a trace dump, in the byte order of the machine that wrote it:
+// a UftpTraceFileHeader, num_sites UftpTraceSiteHeaders each followed by its
+// file, func, format and types strings, then num_rings UftpTraceRingHeaders
+// each followed by its thread's events, oldest first.
+#define UftpTraceMagic "UFTPTRC1"
+
+struct UftpTraceFileHeader {
+  char magic[8];
+  // Two readings of the timestamp counter and CLOCK_MONOTONIC, at start up
+  // and at the dump, to turn timestamps into time.
+  uint64_t start_timestamp;
+  uint64_t start_ns;
+  uint64_t dump_timestamp;
+  uint64_t dump_ns;
+  uint32_t num_sites;
+  uint32_t num_rings;
+};
+
+struct UftpTraceSiteHeader {
+  uint32_t id;
+  uint32_t line;
+  uint16_t file_length;
+  uint16_t func_length;
+  uint16_t format_length;
+  uint16_t types_length;
+};
+
+struct UftpTraceRingHeader {
+  uint64_t num_events;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+/// Tracing cheap enough to leave on in production, for the per-datagram paths
+/// DEBUG_LOG would slow to a crawl. Every thread records into a ring of the
+/// last UftpTraceRingSize events of its own, so recording is a timestamp
+/// counter read and a 64 byte store with no lock, no formatting and no
+/// system call. The rings are only read when they're dumped, to a file the
+/// decoder turns back into text, on SIGUSR1 or when the process crashes.
+class UftpTrace {
+ public:
+  static constexpr std::size_t kMaxArgs = 6;
+
+  template <typename... Args>
+  static void Record(UftpTraceSite& site, const char* format, Args... args) {
+    static_assert(sizeof...(Args) <= kMaxArgs, "Too many trace arguments");
+    uint32_t id = site.id.load(std::memory_order_relaxed);
+    if (id == 0) {
+      id = Register(site, format, UftpTraceTypes<Args...>::kCodes);
+    }
+
+    Ring& ring = LocalRing();
+    const uint64_t head = ring.head.load(std::memory_order_relaxed);
+    UftpTraceEvent& event = ring.events[head % UftpTraceRingSize];
+    event.timestamp = Timestamp();
+    event.site = id;
+    event.tid = ring.tid;
+    Store(event.args, args...);
+    // Publishes the event to a dump from another thread.
+    ring.head.store(head + 1, std::memory_order_release);
+  }
+
+  ///
+  /// \brief InstallDumpHandlers dumps every ring to filename on SIGUSR1, and
+  /// when the process dies of SIGSEGV, SIGBUS, SIGFPE, SIGILL or SIGABRT,
+  /// before it dies as it would have.
+  ///
+  static void InstallDumpHandlers(const std::string& filename);
+
+  ///
+  /// \brief Dump writes every ring to filename. Only makes async signal safe
+  /// calls, the rings of threads still running are written as they change.
+  /// \return false if it couldn't be written.
+  ///
+  static bool Dump(const char* filename);
+
+  /// Where program dumps unless told otherwise.
+  static std::string DefaultFilename(const std::string& program);
+
+  static uint64_t Timestamp() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+#endif
+  }
+
+ private:
+  // Rings outlive their threads, a new thread takes over the ring of one
+  // that has exited.
+  struct Ring {
+    // Events ever recorded, the next one goes at head % UftpTraceRingSize.
+    std::atomic<uint64_t> head{0};
+    uint32_t tid = 0;
+    alignas(64) UftpTraceEvent events[UftpTraceRingSize];
+  };
+
+  static uint32_t Register(UftpTraceSite& site, const char* format,
+                           const char* types);
+
+  static Ring& LocalRing() {
+    static thread_local Ring* ring = nullptr;
+    if (ring == nullptr) {
+      ring = NewRing();
+    }
+    return *ring;
+  }
+  static Ring* NewRing();
+
+  static void Store(uint64_t*) {}
+
+  template <typename T, typename... Args>
+  static void Store(uint64_t* to, T first, Args... rest) {
+    *to = Raw(first);
+    Store(to + 1, rest...);
+  }
+
+  template <typename T>
+  static typename std::enable_if<!std::is_floating_point<T>::value,
+                                 uint64_t>::type
+  Raw(T value) {
+    return static_cast<uint64_t>(value);
+  }
+
+  static uint64_t Raw(double value) {
+    uint64_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    return bits;
+  }
+};
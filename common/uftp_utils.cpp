@@ -2,7 +2,12 @@
 
 #include <dirent.h>
 #include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <algorithm>
 #include <chrono>
 #include <cstdio>
 #include <cstring>
@@ -10,10 +15,18 @@
 #include <iostream>
 #include <map>
 #include <memory>
+#include <random>
 #include <sstream>
 #include <string>
 #include <thread>
 
+#include <uftp_batch_io.h>
+#include <uftp_congestion.h>
+#include <uftp_crc32c.h>
+#include <uftp_fec.h>
+#include <uftp_meta.h>
+#include <uftp_rtt.h>
+#include <uftp_trace.h>
 #include "uftp_defs.h"
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -28,7 +41,10 @@ const std::map<UftpStatusCode, std::string> UftpUtils::UftpStatusCodeStrings{
     {UftpStatusCode::ERR_FILE_NOT_FOUND, "File Not Found"},
     {UftpStatusCode::ERR_BAD_PERMISSIONS, "Bad Permissions"},
     {UftpStatusCode::ERR_BAD_COMMAND, "Unknown Command"},
-    {UftpStatusCode::ERR_UNKNOWN, "Unknown Error"}};
+    {UftpStatusCode::ERR_UNKNOWN, "Unknown Error"},
+    {UftpStatusCode::ERR_DELTA_TOO_LARGE, "Delta Too Large"},
+    {UftpStatusCode::ERR_FILE_CHANGED, "File Changed"},
+    {UftpStatusCode::ERR_NO_RESPONSE, "No Response From Server"}};
 
 const std::map<int, UftpStatusCode> UftpUtils::ErrnoToStatusCodeMap{
     {ENOENT, UftpStatusCode::ERR_FILE_NOT_FOUND},
@@ -117,7 +133,7 @@ UftpStatusCode UftpUtils::ReadFile(const std::string& filename,
   }
 
   file_stream.seekg(0, std::ios::end);
-  const uint32_t file_size = file_stream.tellg();
+  const uint64_t file_size = file_stream.tellg();
   DEBUG_LOG("File Size:", file_size);
   file_stream.seekg(0, std::ios::beg);
   buffer.resize(file_size);
@@ -151,43 +167,86 @@ UftpStatusCode UftpUtils::WriteFile(const std::string& filename,
 ///////////////////////////////////////////////////////////////////////////////
 void UftpUtils::ConstructUftpHeader(UftpMessage& uftp_message) {
   UftpHeader& header = uftp_message.header;
-  header.message_length = uftp_message.message.size();
+  header.message_length = uftp_message.message_source
+                              ? uftp_message.message_source->Length()
+                              : uftp_message.message.size();
   header.command_length = uftp_message.command.size();
   header.argument_length = uftp_message.argument.size();
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-bool UftpUtils::UdpSendTo(UftpSocketHandle& sock_handle,
-                          const SendDataBuffer& send_buff) {
-  if (send_buff.buff_len == 0) return true;
-
-  uint64_t bytes_left_to_write = send_buff.buff_len;
-  auto buff_ptr = send_buff.buff;
-
-  while (bytes_left_to_write > 0) {
-    DEBUG_LOG("Bytes left to write: ", bytes_left_to_write);
-    const uint32_t bytes_to_write =
-        std::min(bytes_left_to_write, (uint64_t)UftpMTU);
-    int bytes_sent = 0;
-    if ((bytes_sent = sendto(sock_handle.sockfd, buff_ptr, bytes_to_write, 0,
-                             (struct sockaddr*)&sock_handle.addr,
-                             sizeof(sock_handle.addr))) == -1) {
-      DEBUG_LOG("Time out sending buffer: ", send_buff.buff_name);
-      return false;
+static bool SamePeer(const sockaddr_in& lhs, const sockaddr_in& rhs) {
+  return lhs.sin_addr.s_addr == rhs.sin_addr.s_addr &&
+         lhs.sin_port == rhs.sin_port;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+timespec UftpUtils::TimeUntil(UftpClock::time_point deadline,
+                             UftpClock::time_point now) {
+  timespec wait{0, 0};
+  if (deadline > now) {
+    const auto nanoseconds =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(deadline - now);
+    wait.tv_sec = nanoseconds.count() / 1000000000;
+    wait.tv_nsec = nanoseconds.count() % 1000000000;
+  }
+  return wait;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bool UftpUtils::HandleDatagram(UftpSocketHandle& sock_handle,
+                               const uint8_t* datagram, std::size_t length,
+                               UftpSendWindow* send_window,
+                               UftpReceiveWindow* recv_window) {
+  uint32_t sync = 0;
+  if (length <= sizeof(sync)) return true;
+  std::memcpy(&sync, datagram, sizeof(sync));
+  if (sync != UftpSyncWord) return true;
+
+  const uint8_t type = datagram[sizeof(sync)];
+  if (type == DATAGRAM_ACK && length >= sizeof(UftpAckHeader)) {
+    UftpAckHeader ack;
+    std::memcpy(&ack, datagram, sizeof(ack));
+    if (length < sizeof(ack) + ack.bitmap_length) return true;
+
+    UftpAckHeader unchecked_ack = ack;
+    unchecked_ack.checksum = 0;
+    const uint32_t checksum =
+        UftpCrc32c(UftpCrc32c(0, &unchecked_ack, sizeof(unchecked_ack)),
+                   datagram + sizeof(ack), ack.bitmap_length);
+    if (checksum != ack.checksum) {
+      UFTP_TRACE("Dropping corrupt ack, transfer: {}", ack.transfer_id);
+      return true;
+    }
+    if (send_window != nullptr) {
+      send_window->OnAck(ack, datagram + sizeof(ack), UftpClock::now());
     }
 
-    const bool sent_expected_num_bytes = (bytes_sent == bytes_to_write);
-    if (sent_expected_num_bytes) {
-      DEBUG_LOG("Sent buff: ", send_buff.buff_name);
+  } else if (type == DATAGRAM_DATA && length >= sizeof(UftpChunkHeader)) {
+    UftpChunkHeader header;
+    std::memcpy(&header, datagram, sizeof(header));
+    if (length != sizeof(header) + header.payload_length) return true;
+
+    if (sock_handle.has_last_rx &&
+        header.transfer_id == sock_handle.last_rx_transfer_id) {
+      // Our completion ack was lost, tell the sender again.
+      QueueCompleteAck(sock_handle, header.timestamp);
+    } else if (recv_window != nullptr) {
+      recv_window->OnChunk(header, datagram + sizeof(header));
     } else {
-      DEBUG_LOG("Couldn't send all of buff: ", send_buff.buff_name, ", sent: ",
-                bytes_sent, ", wanted to send: ", bytes_to_write);
       return false;
     }
 
-    if (RecvAck(sock_handle)) {
-      bytes_left_to_write -= bytes_sent;
-      buff_ptr = (void*)((std::size_t)buff_ptr + bytes_sent);
+  } else if (type == DATAGRAM_PARITY && length >= sizeof(UftpParityHeader)) {
+    UftpParityHeader header;
+    std::memcpy(&header, datagram, sizeof(header));
+    if (length != sizeof(header) + header.payload_length) return true;
+
+    // Parity never starts a transfer, so there's nothing to requeue.
+    if (recv_window != nullptr &&
+        !(sock_handle.has_last_rx &&
+          header.transfer_id == sock_handle.last_rx_transfer_id)) {
+      recv_window->OnParity(header, datagram + sizeof(header));
     }
   }
 
@@ -195,111 +254,236 @@ bool UftpUtils::UdpSendTo(UftpSocketHandle& sock_handle,
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-bool UftpUtils::SendMessage(UftpSocketHandle& sock_handle,
-                            UftpMessage& uftp_message) {
-  static constexpr std::size_t MAX_NUM_RETRY_ATTEMPTS = 3;
-  std::size_t retry_count = 0;
-
-  ConstructUftpHeader(uftp_message);
+int UftpUtils::QueueChunks(UftpSocketHandle& sock_handle,
+                           UftpSendWindow& send_window,
+                           std::size_t max_chunks) {
+  UftpBatchIo& batch_io = *sock_handle.batch_io;
+  std::size_t num_queued = 0;
+  uint32_t chunk_num = 0;
+  UftpBatchIo::SendSlot slot;
+  // A slot first, the chunk is only taken from the window if it can go.
+  while (num_queued < max_chunks && batch_io.NextSendSlot(slot) &&
+         send_window.NextChunk(UftpClock::now(), chunk_num)) {
+    const int iovcnt = send_window.BuildChunk(
+        chunk_num, *reinterpret_cast<UftpChunkHeader*>(slot.header), slot.iov,
+        slot.scratch);
+    if (iovcnt < 0) {
+      return -1;
+    }
+    batch_io.CommitSend(sock_handle.addr, iovcnt);
+    // The batch goes out within microseconds, close enough for the
+    // retransmit timer.
+    send_window.OnChunkSent(chunk_num, UftpClock::now());
+    ++num_queued;
+
+    // Without a slot the parity waits for the next call.
+    if (send_window.ParityReady() && batch_io.NextSendSlot(slot)) {
+      const int parity_iovcnt = send_window.BuildParity(
+          *reinterpret_cast<UftpParityHeader*>(slot.header), slot.iov,
+          slot.scratch);
+      batch_io.CommitSend(sock_handle.addr, parity_iovcnt);
+      send_window.OnParitySent(UftpClock::now());
+    }
+  }
+  return num_queued;
+}
 
-  const UftpHeader& header = uftp_message.header;
-
-  const std::vector<SendDataBuffer> send_buffers{
-      SendDataBuffer(&header, sizeof(header), "header"),
-      SendDataBuffer(uftp_message.command.data(), header.command_length,
-                     "command"),
-      SendDataBuffer(uftp_message.argument.data(), header.argument_length,
-                     "argument"),
-      SendDataBuffer(uftp_message.message.data(), header.message_length,
-                     "message")};
-
-  for (const SendDataBuffer& send_buff : send_buffers) {
-    retry_count = 0;
-    while (!UdpSendTo(sock_handle, send_buff)) {
-      if (++retry_count >= MAX_NUM_RETRY_ATTEMPTS) {
+///////////////////////////////////////////////////////////////////////////////
+bool UftpUtils::UdpSendTo(UftpSocketHandle& sock_handle,
+                          UftpSendWindow& send_window) {
+  UftpBatchIo& batch_io = *sock_handle.batch_io;
+  const auto idle_timeout = std::chrono::milliseconds(UftpIdleTimeoutMs);
+
+  while (!send_window.Done()) {
+    // Fill batches for as long as the window and the socket let us.
+    int num_queued = 0;
+    do {
+      num_queued = QueueChunks(sock_handle, send_window, UftpBatchSize);
+      if (num_queued < 0 || batch_io.FlushSends() < 0) {
+        UFTP_TRACE("Couldn't send transfer: {}", send_window.TransferId());
         return false;
       }
+    } while (num_queued == UftpBatchSize && !batch_io.SendBlocked());
+
+    const auto now = UftpClock::now();
+    const auto give_up_time = send_window.LastProgress() + idle_timeout;
+    if (now >= give_up_time) {
+      UFTP_TRACE("Time out sending transfer: {}", send_window.TransferId());
+      return false;
+    }
+
+    // A pushed back batch goes again once the socket drains.
+    const bool blocked = batch_io.SendBlocked();
+    pollfd poll_fds[] = {
+        {sock_handle.sockfd, (short)(POLLIN | (blocked ? POLLOUT : 0)), 0},
+        {sock_handle.wake_fd, POLLIN, 0}};
+    const nfds_t num_poll_fds = sock_handle.wake_fd >= 0 ? 2 : 1;
+    auto wake_time = std::min(send_window.NextTimeout(), give_up_time);
+    if (blocked) {
+      wake_time = std::min(
+          wake_time, now + std::chrono::microseconds(UftpSendRetryUs));
+    }
+    const timespec wait = TimeUntil(wake_time, now);
+    if (ppoll(poll_fds, num_poll_fds, &wait, nullptr) <= 0) {
+      continue;
+    }
+    if (poll_fds[1].revents & POLLIN) {
+      uint64_t count = 0;
+      (void)read(sock_handle.wake_fd, &count, sizeof(count));
+    }
+
+    int num_datagrams = 0;
+    while ((num_datagrams = batch_io.Receive(MSG_DONTWAIT)) > 0) {
+      for (int index = 0; index < num_datagrams; ++index) {
+        if (SamePeer(batch_io.From(index), sock_handle.addr) &&
+            !HandleDatagram(sock_handle, batch_io.Datagram(index),
+                            batch_io.Length(index), &send_window, nullptr)) {
+          // The peer has already started replying, keep it for the next
+          // ReceiveMessage.
+          batch_io.Requeue(index);
+        }
+      }
+      batch_io.FlushSends();
     }
   }
 
   return true;
 }
 
+///////////////////////////////////////////////////////////////////////////////
+void UftpUtils::BuildMeta(UftpMessage& uftp_message, UftpPooledBuffer& meta) {
+  ConstructUftpHeader(uftp_message);
+  UftpMeta::Serialize(uftp_message, meta);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bool UftpUtils::SendMessage(UftpSocketHandle& sock_handle,
+                            UftpMessage& uftp_message) {
+  // Header, command and argument go out as the leading "meta" bytes of the
+  // transfer, the message follows straight from the caller's buffer.
+  UftpPooledBuffer meta;
+  BuildMeta(uftp_message, meta);
+
+  UftpBufferSource buffer_source(uftp_message.message);
+  UftpPayloadSource& message_source =
+      uftp_message.message_source ? *uftp_message.message_source
+                                  : buffer_source;
+  UftpSendWindow send_window(sock_handle.next_transfer_id++, meta.data(),
+                             meta.size(), message_source,
+                             *sock_handle.congestion, *sock_handle.rtt,
+                             sock_handle.fec.get());
+  if (uftp_message.codec != CODEC_NONE && sock_handle.workers) {
+    send_window.EnableCompression(uftp_message.codec, *sock_handle.workers,
+                                  sock_handle.wake_fd);
+  }
+  if (!UdpSendTo(sock_handle, send_window)) {
+    return false;
+  }
+
+  UFTP_TRACE("Sent transfer: {}, chunks: {}, retransmits: {}, srtt us: {}, "
+             "cwnd: {}, pacing rate: {}",
+             send_window.TransferId(), send_window.NumChunks(),
+             send_window.RetransmitCount(),
+             std::chrono::duration_cast<std::chrono::microseconds>(
+                 sock_handle.rtt->Srtt())
+                 .count(),
+             send_window.CongestionWindow(), send_window.PacingRate());
+  UFTP_TRACE("Sent transfer: {}, compression ratio: {}, loss rate: {}, "
+             "avg send batch: {}, avg recv batch: {}",
+             send_window.TransferId(), send_window.CompressionRatio(),
+             send_window.LossRate(), sock_handle.batch_io->AverageSendBatch(),
+             sock_handle.batch_io->AverageReceiveBatch());
+  return true;
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 bool UftpUtils::UdpRecvFrom(UftpSocketHandle& sock_handle,
-                            ReceiveDataBuffer& recv_buff) {
-  if (recv_buff.buff_len == 0) return true;
-
-  // total bytes to read
-  uint64_t bytes_left_to_read = recv_buff.buff_len;
-  auto buff_ptr = recv_buff.buff;
-
-  while (bytes_left_to_read > 0) {
-    DEBUG_LOG("Bytes left to read: ", bytes_left_to_read);
-
-    const uint32_t bytes_to_read =
-        std::min(bytes_left_to_read, (uint64_t)UftpMTU);
-    socklen_t socklen = sizeof(sock_handle.addr);
-    int bytes_read = 0;
-    if ((bytes_read =
-             recvfrom(sock_handle.sockfd, buff_ptr, bytes_to_read, 0,
-                      (struct sockaddr*)&sock_handle.addr, &socklen)) == -1) {
-      DEBUG_LOG("Time out receiving buff: ", recv_buff.buff_name);
+                            UftpReceiveWindow& recv_window) {
+  UftpBatchIo& batch_io = *sock_handle.batch_io;
+  const auto idle_timeout = std::chrono::milliseconds(UftpIdleTimeoutMs);
+  // Until the transfer starts this is how long we've been waiting for it.
+  // The sender keeps retransmitting with backoff, so silence for a whole
+  // idle timeout means it has given up.
+  auto last_progress = UftpClock::now();
+
+  while (!recv_window.Done()) {
+    if (recv_window.Failed()) {
       return false;
     }
-
-    // If we didn't read all the bytes, exit.
-    const bool read_expected_num_bytes = (bytes_read == bytes_to_read);
-    if (read_expected_num_bytes) {
-      DEBUG_LOG("Received buff: ", recv_buff.buff_name);
-    } else {
-      DEBUG_LOG("Couldn't receive all of buff: ", recv_buff.buff_name,
-                ", received: ", bytes_read, ", wanted to receive: ",
-                bytes_to_read);
+    if (recv_window.AckPending()) {
+      QueueAck(sock_handle, recv_window);
+    }
+    batch_io.FlushSends();
+
+    const auto now = UftpClock::now();
+    if (now - last_progress >= idle_timeout) {
+      if (recv_window.Started()) {
+        UFTP_TRACE("Time out receiving transfer: {}", recv_window.TransferId());
+      } else {
+        UFTP_TRACE("Time out waiting for a transfer");
+      }
       return false;
     }
 
-    if (SendAck(sock_handle)) {
-      bytes_left_to_read -= bytes_read;
-      buff_ptr = (void*)((std::size_t)buff_ptr + bytes_read);
+    // Acks the socket pushed back on go again once it drains.
+    const bool blocked = batch_io.SendBlocked();
+    pollfd poll_fd{sock_handle.sockfd,
+                   (short)(POLLIN | (blocked ? POLLOUT : 0)), 0};
+    auto wake_time = last_progress + idle_timeout;
+    if (blocked) {
+      wake_time = std::min(
+          wake_time, now + std::chrono::microseconds(UftpSendRetryUs));
+    }
+    const timespec wait = TimeUntil(wake_time, now);
+    if (!batch_io.HasRequeued() && ppoll(&poll_fd, 1, &wait, nullptr) <= 0) {
+      continue;
+    }
+
+    const int num_datagrams = batch_io.HasRequeued()
+                                  ? batch_io.TakeRequeued()
+                                  : batch_io.Receive(MSG_DONTWAIT);
+    if (num_datagrams < 0) {
+      continue;
+    }
+
+    for (int index = 0; index < num_datagrams; ++index) {
+      if (!recv_window.Started()) {
+        sock_handle.addr = batch_io.From(index);
+      } else if (!SamePeer(batch_io.From(index), sock_handle.addr)) {
+        continue;
+      }
+
+      HandleDatagram(sock_handle, batch_io.Datagram(index),
+                     batch_io.Length(index), nullptr, &recv_window);
+      if (recv_window.AckNow() && !recv_window.Done()) {
+        QueueAck(sock_handle, recv_window);
+      }
+    }
+    batch_io.FlushSends();
+
+    if (recv_window.Started()) {
+      last_progress = UftpClock::now();
     }
   }
 
+  CompleteReceive(sock_handle, recv_window);
+  batch_io.FlushSends();
+
   return true;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
 bool UftpUtils::ReceiveMessage(UftpSocketHandle& sock_handle,
-                               UftpMessage& uftp_message) {
-  // Receive header.
-  UftpHeader& header = uftp_message.header;
-  header.sync = 0;
-  ReceiveDataBuffer header_buff(&header, sizeof(header), "header");
-  if (!UdpRecvFrom(sock_handle, header_buff) || header.sync != UftpSyncWord) {
+                               UftpMessage& uftp_message,
+                               const UftpSinkSelector& select_sink) {
+  uftp_message.message_sink.reset();
+  UftpReceiveWindow recv_window(uftp_message, select_sink);
+  if (!UdpRecvFrom(sock_handle, recv_window)) {
+    uftp_message.message_sink.reset();
     return false;
   }
 
-  DEBUG_LOG("Received header: ", header);
-
-  // Adjust sizes of payload buffers based on header
-  uftp_message.command.resize(header.command_length);
-  uftp_message.argument.resize(header.argument_length);
-  uftp_message.message.resize(header.message_length);
-
-  std::vector<ReceiveDataBuffer> recv_buffers{
-      ReceiveDataBuffer((void*)uftp_message.command.data(),
-                        header.command_length, "command"),
-      ReceiveDataBuffer((void*)uftp_message.argument.data(),
-                        header.argument_length, "argument"),
-      ReceiveDataBuffer(uftp_message.message.data(), header.message_length,
-                        "message")};
-
-  for (auto& recv_buff : recv_buffers) {
-    if (!UdpRecvFrom(sock_handle, recv_buff)) {
-      return false;
-    }
-  }
-
+  uftp_message.message_sink->Finish();
   return true;
 }
 
@@ -320,30 +504,78 @@ UftpSocketHandle UftpUtils::GetSocketHandle(const std::string& ip_addr,
     addr.sin_addr.s_addr = inet_addr(ip_addr.c_str());
   }
 
-  // Set send timeout.
-  timeval send_tv;
-  send_tv.tv_sec = 3;
-  send_tv.tv_usec = 0;
-  CheckErr(setsockopt(sock_handle.sockfd, SOL_SOCKET, SO_SNDTIMEO, &send_tv,
-                      sizeof(send_tv)),
-           "Failed to set send timeout");
+  sock_handle.batch_io = std::make_shared<UftpBatchIo>(sock_handle.sockfd);
+  sock_handle.congestion =
+      UftpCongestionControl::Create(UftpDefaultCongestionControl);
+  sock_handle.rtt = std::make_shared<UftpRttEstimator>();
+
+  // Start transfer ids somewhere random so a restarted peer isn't mistaken
+  // for a retransmit of the previous one.
+  std::random_device random_device;
+  sock_handle.next_transfer_id = random_device();
+
+  // A full window has to fit in the socket buffers. The kernel clamps these to
+  // net.core.[rw]mem_max.
+  const int buff_size = 4 * UftpWindowSize * UftpChunkSize;
+  CheckErr(setsockopt(sock_handle.sockfd, SOL_SOCKET, SO_SNDBUF, &buff_size,
+                      sizeof(buff_size)),
+           "Failed to set send buffer size");
+  CheckErr(setsockopt(sock_handle.sockfd, SOL_SOCKET, SO_RCVBUF, &buff_size,
+                      sizeof(buff_size)),
+           "Failed to set receive buffer size");
 
   return sock_handle;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-bool UftpUtils::RecvAck(UftpSocketHandle& sock_handle) {
-  UftpAckType ack;
-  socklen_t socklen = sizeof(sock_handle.addr);
-  return recvfrom(sock_handle.sockfd, &ack, sizeof(ack), 0,
-                  (struct sockaddr*)&sock_handle.addr,
-                  &socklen) == sizeof(UftpAckType);
+void UftpUtils::QueueAck(UftpSocketHandle& sock_handle,
+                         UftpReceiveWindow& recv_window) {
+  // Still pending, so it goes with the next call.
+  UftpBatchIo::SendSlot slot;
+  if (!sock_handle.batch_io->NextSendSlot(slot)) {
+    return;
+  }
+  slot.iov[0].iov_base = slot.header;
+  slot.iov[0].iov_len = recv_window.BuildAck(slot.header);
+  recv_window.OnAckSent();
+  sock_handle.batch_io->CommitSend(sock_handle.addr, 1);
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-bool UftpUtils::SendAck(UftpSocketHandle& sock_handle) {
-  UftpAckType ack;
-  return sendto(sock_handle.sockfd, &ack, sizeof(ack), 0,
-                (struct sockaddr*)&sock_handle.addr,
-                sizeof(sock_handle.addr)) == sizeof(UftpAckType);
+void UftpUtils::QueueCompleteAck(UftpSocketHandle& sock_handle,
+                                 uint32_t timestamp_echo) {
+  UftpAckHeader ack;
+  ack.transfer_id = sock_handle.last_rx_transfer_id;
+  ack.cumulative_ack = sock_handle.last_rx_num_chunks;
+  ack.timestamp_echo = timestamp_echo;
+  ack.checksum = UftpCrc32c(0, &ack, sizeof(ack));
+
+  // The sender asks again if this is lost.
+  UftpBatchIo::SendSlot slot;
+  if (!sock_handle.batch_io->NextSendSlot(slot)) {
+    return;
+  }
+  std::memcpy(slot.header, &ack, sizeof(ack));
+  slot.iov[0].iov_base = slot.header;
+  slot.iov[0].iov_len = sizeof(ack);
+  sock_handle.batch_io->CommitSend(sock_handle.addr, 1);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void UftpUtils::CompleteReceive(UftpSocketHandle& sock_handle,
+                                const UftpReceiveWindow& recv_window) {
+  sock_handle.has_last_rx = true;
+  sock_handle.last_rx_transfer_id = recv_window.TransferId();
+  sock_handle.last_rx_num_chunks = recv_window.NumChunks();
+
+  // The sender can't finish until it hears about the last chunk, so make the
+  // completion ack hard to lose.
+  UftpBatchIo::SendSlot slot;
+  for (int copy = 0;
+       copy < UftpFinalAckCopies && sock_handle.batch_io->NextSendSlot(slot);
+       ++copy) {
+    slot.iov[0].iov_base = slot.header;
+    slot.iov[0].iov_len = recv_window.BuildAck(slot.header);
+    sock_handle.batch_io->CommitSend(sock_handle.addr, 1);
+  }
 }
@@ -1,10 +1,14 @@
 #pragma once
 
+#include <time.h>
 #include <iostream>
 #include <map>
 #include <string>
 
+#include <uftp_buffer_pool.h>
 #include <uftp_defs.h>
+#include <uftp_payload.h>
+#include <uftp_window.h>
 
 #ifdef __DEBUG__
 #define DEBUG_LOG(...) \
@@ -37,35 +41,74 @@ class UftpUtils {
   static UftpStatusCode WriteFile(const std::string& filename,
                                   const std::vector<uint8_t>& buffer);
 
+  ///
+  /// \brief SendMessage sends uftp_message. The message is streamed from
+  /// uftp_message.message_source if set, otherwise from uftp_message.message.
+  ///
   static bool SendMessage(UftpSocketHandle& sock_handle,
                           UftpMessage& uftp_message);
+
+  ///
+  /// \brief ReceiveMessage receives the next message. select_sink decides
+  /// where its message goes once the header is in, by default it's buffered
+  /// in message.message up to UftpMaxBufferedMessageSize.
+  ///
   static bool ReceiveMessage(UftpSocketHandle& sock_handle,
-                             UftpMessage& message);
+                             UftpMessage& message,
+                             const UftpSinkSelector& select_sink = nullptr);
 
   static UftpStatusCode ErrnoToStatusCode(int errno_val);
 
- private:
-  template <typename T>
-  struct DataBuffer {
-    DataBuffer() {}
-    DataBuffer(T buff_in, uint64_t buff_len_in,
-               const std::string&& buff_name_in)
-        : buff(buff_in), buff_len(buff_len_in), buff_name(buff_name_in) {}
-    T buff = T();
-    uint64_t buff_len = 0;
-    const std::string buff_name;
-  };
-
-  using SendDataBuffer = DataBuffer<const void*>;
-  using ReceiveDataBuffer = DataBuffer<void*>;
+  /// Time left until deadline, for ppoll() and friends. Zero if it's passed.
+  static timespec TimeUntil(UftpClock::time_point deadline,
+                            UftpClock::time_point now);
+
+  // The pieces SendMessage and ReceiveMessage are built from, for callers
+  // that drive the windows from their own event loop.
+
+  ///
+  /// \brief BuildMeta fills in uftp_message.header and serialises the header,
+  /// command and argument, the leading bytes of every transfer, into meta in
+  /// uftp_message.version's format, see UftpMeta.
+  ///
+  static void BuildMeta(UftpMessage& uftp_message, UftpPooledBuffer& meta);
+
+  ///
+  /// \brief QueueChunks queues up to max_chunks chunks of send_window on
+  /// sock_handle's batch. The caller flushes.
+  /// \return the number of chunks queued, or -1 if the message couldn't be
+  /// read.
+  ///
+  static int QueueChunks(UftpSocketHandle& sock_handle,
+                         UftpSendWindow& send_window, std::size_t max_chunks);
+
+  static void QueueAck(UftpSocketHandle& sock_handle,
+                       UftpReceiveWindow& recv_window);
+  static void QueueCompleteAck(UftpSocketHandle& sock_handle,
+                               uint32_t timestamp_echo);
+
+  ///
+  /// \brief CompleteReceive queues the final acks for a finished transfer and
+  /// remembers it, so a sender that missed them gets told again.
+  ///
+  static void CompleteReceive(UftpSocketHandle& sock_handle,
+                              const UftpReceiveWindow& recv_window);
+
+  ///
+  /// \brief HandleDatagram feeds one datagram to whichever window it belongs
+  /// to.
+  /// \return false for data of a new transfer when nobody is receiving.
+  ///
+  static bool HandleDatagram(UftpSocketHandle& sock_handle,
+                             const uint8_t* datagram, std::size_t length,
+                             UftpSendWindow* send_window,
+                             UftpReceiveWindow* recv_window);
 
+ private:
   static bool UdpSendTo(UftpSocketHandle& sock_handle,
-                        const SendDataBuffer& send_buff);
+                        UftpSendWindow& send_window);
   static bool UdpRecvFrom(UftpSocketHandle& sock_handle,
-                          ReceiveDataBuffer& recv_buff);
-
-  static bool SendAck(UftpSocketHandle& sock_handle);
-  static bool RecvAck(UftpSocketHandle& sock_handle);
+                          UftpReceiveWindow& recv_window);
 
   static void ConstructUftpHeader(UftpMessage& uftp_message);
   static const std::string GetLogPrefix(const std::string& file,
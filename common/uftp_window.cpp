@@ -0,0 +1,1005 @@
+#include <uftp_window.h>
+
+#include <setjmp.h>
+#include <algorithm>
+#include <cstring>
+#include <limits>
+
+#include <uftp_crc32c.h>
+#include <uftp_defs.h>
+#include <uftp_meta.h>
+#include <uftp_metrics.h>
+#include <uftp_trace.h>
+#include <uftp_utils.h>
+
+namespace {
+
+constexpr uint8_t kFastRetransmitThreshold = 3;
+// Chunks the receiver holds on to while the meta bytes are still missing.
+constexpr std::size_t kMaxHeldChunks = UftpAckInterval;
+// Parity groups the receiver holds on to while waiting for their chunks.
+constexpr std::size_t kMaxPendingParities =
+    UftpWindowSize / UftpFecMinGroupSize;
+
+uint32_t NumChunksFor(uint64_t transfer_length) {
+  return (transfer_length + UftpChunkSize - 1) / UftpChunkSize;
+}
+
+uint16_t ChunkLength(uint32_t chunk_num, uint64_t transfer_length) {
+  const uint64_t offset = (uint64_t)chunk_num * UftpChunkSize;
+  return std::min((uint64_t)UftpChunkSize, transfer_length - offset);
+}
+
+}  // namespace
+
+///////////////////////////////////////////////////////////////////////////////
+UftpSendWindow::UftpSendWindow(uint32_t transfer_id, const uint8_t* meta,
+                               uint32_t meta_length,
+                               UftpPayloadSource& message,
+                               UftpCongestionControl& congestion,
+                               UftpRttEstimator& rtt,
+                               UftpFecController* fec)
+    : transfer_id_(transfer_id),
+      meta_(meta),
+      meta_length_(meta_length),
+      message_(message),
+      congestion_(congestion),
+      rtt_(rtt),
+      fec_(fec),
+      transfer_length_(meta_length + message.Length()),
+      num_chunks_(NumChunksFor(meta_length + message.Length())),
+      delivered_time_(UftpClock::now()),
+      chunks_(UftpWindowSize),
+      last_progress_(UftpClock::now()) {}
+
+///////////////////////////////////////////////////////////////////////////////
+void UftpSendWindow::EnableCompression(UftpCodec codec,
+                                       UftpWorkerPool& workers,
+                                       int wake_fd) {
+  compressor_.reset(new UftpChunkCompressor(
+      codec, message_, meta_length_, transfer_length_, workers, wake_fd));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void UftpSendWindow::ExpireTimeouts(UftpClock::time_point now) {
+  const auto rto = rtt_.Rto();
+  bool timed_out = false;
+  while (!in_flight_.empty()) {
+    const InFlight& oldest = in_flight_.front();
+    if (oldest.chunk_num < base_) {
+      in_flight_.pop_front();
+      continue;
+    }
+
+    ChunkState& state = State(oldest.chunk_num);
+    if (state.acked || state.tx_seq != oldest.tx_seq) {
+      // Stale entry, the chunk has been acked or sent again since.
+      in_flight_.pop_front();
+      continue;
+    }
+
+    if (now - oldest.sent_time < rto) {
+      break;
+    }
+
+    UFTP_TRACE("Retransmit timeout, transfer: {}, chunk: {}, rto us: {}",
+               transfer_id_, oldest.chunk_num,
+               std::chrono::duration_cast<std::chrono::microseconds>(rto)
+                   .count());
+    const uint32_t chunk_num = oldest.chunk_num;
+    in_flight_.pop_front();
+    MarkLost(chunk_num, now);
+    timed_out = true;
+  }
+
+  if (timed_out) {
+    rtt_.OnTimeout();
+    ++timeout_count_;
+    UftpMetrics::Add(COUNTER_RETRANSMIT_TIMEOUTS);
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void UftpSendWindow::CheckSpuriousLoss(const UftpAckHeader& ack,
+                                       uint32_t base_before) {
+  if (!undo_pending_ ||
+      (undo_chunk_ >= base_ && !State(undo_chunk_).acked)) {
+    return;
+  }
+  undo_pending_ = false;
+
+  // Eifel detection, RFC 3522. When the chunk was the hole holding up the
+  // cumulative ack, the ack that moves past it echoes the send that filled
+  // it. From before the chunk was given up on, that can only be its first
+  // send, which got there after all, late or overtaken, and the window was
+  // cut for nothing. Filled behind another hole, there's no telling.
+  if (base_before != undo_chunk_ || ack.timestamp_echo == 0 ||
+      (int32_t)(ack.timestamp_echo - undo_timestamp_) >= 0) {
+    return;
+  }
+  UFTP_TRACE("Spurious loss, transfer: {}, chunk: {}", transfer_id_,
+             undo_chunk_);
+  congestion_.UndoLoss();
+  recovery_tx_seq_ = undo_recovery_tx_seq_;
+  UftpMetrics::Add(COUNTER_SPURIOUS_LOSSES);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void UftpSendWindow::MarkLost(uint32_t chunk_num, UftpClock::time_point now) {
+  ChunkState& state = State(chunk_num);
+  if (state.queued) {
+    return;
+  }
+  state.queued = true;
+  retransmit_queue_.push_back(chunk_num);
+  if (state.in_flight) {
+    state.in_flight = false;
+    --in_flight_count_;
+  }
+
+  ++chunks_lost_;
+  // One window cut per loss event, however many chunks it took with it.
+  if (state.tx_seq >= recovery_tx_seq_) {
+    undo_pending_ = true;
+    undo_chunk_ = chunk_num;
+    undo_timestamp_ = UftpTimestamp(now);
+    undo_recovery_tx_seq_ = recovery_tx_seq_;
+    recovery_tx_seq_ = next_tx_seq_;
+    congestion_.OnLoss(in_flight_count_, now);
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bool UftpSendWindow::HasChunkToSend() const {
+  return !retransmit_queue_.empty() ||
+         (next_new_ < num_chunks_ && next_new_ - base_ < UftpWindowSize &&
+          !waiting_for_data_);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bool UftpSendWindow::NextChunk(UftpClock::time_point now,
+                               uint32_t& chunk_num) {
+  ExpireTimeouts(now);
+
+  if (in_flight_count_ >= congestion_.CongestionWindow() ||
+      now + std::chrono::microseconds(UftpPacingBurstUs) < next_send_time_) {
+    return false;
+  }
+
+  while (!retransmit_queue_.empty()) {
+    const uint32_t candidate = retransmit_queue_.front();
+    retransmit_queue_.pop_front();
+    if (candidate < base_) {
+      continue;
+    }
+    ChunkState& state = State(candidate);
+    state.queued = false;
+    if (state.acked) {
+      continue;
+    }
+    chunk_num = candidate;
+    ++retransmit_count_;
+    UftpMetrics::Add(COUNTER_RETRANSMITS);
+    return true;
+  }
+
+  if (next_new_ < num_chunks_ && next_new_ - base_ < UftpWindowSize) {
+    // Rather than wait on the workers or the disk, go round the loop again
+    // once they're done.
+    waiting_for_data_ = !ChunkReady(next_new_);
+    if (waiting_for_data_) {
+      return false;
+    }
+    State(next_new_) = ChunkState();
+    chunk_num = next_new_++;
+    return true;
+  }
+
+  return false;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bool UftpSendWindow::ChunkReady(uint32_t chunk_num) {
+  if (compressor_ != nullptr && chunk_num >= compressor_->FirstChunk()) {
+    return compressor_->Ready(chunk_num);
+  }
+  const uint64_t offset = (uint64_t)chunk_num * UftpChunkSize;
+  const uint64_t end = offset + ChunkLength(chunk_num, transfer_length_);
+  if (end <= meta_length_) {
+    return true;
+  }
+  const uint64_t message_offset =
+      std::max(offset, (uint64_t)meta_length_) - meta_length_;
+  return message_.Ready(message_offset, end - meta_length_ - message_offset);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int UftpSendWindow::BuildChunk(uint32_t chunk_num, UftpChunkHeader& header,
+                               iovec* iov, uint8_t* scratch) {
+  const uint64_t offset = (uint64_t)chunk_num * UftpChunkSize;
+  const uint16_t length = ChunkLength(chunk_num, transfer_length_);
+  const uint64_t end = offset + length;
+
+  header = UftpChunkHeader();
+  header.payload_length = length;
+  header.transfer_id = transfer_id_;
+  header.chunk_num = chunk_num;
+  header.meta_length = meta_length_;
+  header.transfer_length = transfer_length_;
+  header.timestamp = UftpTimestamp(UftpClock::now());
+
+  int iovcnt = 0;
+  iov[iovcnt].iov_base = &header;
+  iov[iovcnt++].iov_len = sizeof(header);
+
+  // Retransmits go raw, the compressor only works ahead of new chunks.
+  ChunkState& state = State(chunk_num);
+  const UftpChunkCompressor::Chunk* compressed = nullptr;
+  if (compressor_ != nullptr && !state.checksummed &&
+      chunk_num >= compressor_->FirstChunk()) {
+    compressed = compressor_->Take(chunk_num);
+    if (compressed == nullptr) {
+      UFTP_TRACE("Couldn't read message, transfer: {}, chunk: {}",
+                 transfer_id_, chunk_num);
+      return -1;
+    }
+    iov[iovcnt].iov_base = (void*)compressed->raw;
+    iov[iovcnt++].iov_len = compressed->raw_length;
+  } else if (offset < meta_length_) {
+    const uint64_t meta_end = std::min(end, (uint64_t)meta_length_);
+    iov[iovcnt].iov_base = (void*)(meta_ + offset);
+    iov[iovcnt++].iov_len = meta_end - offset;
+  }
+  if (compressed == nullptr && end > meta_length_) {
+    const uint64_t message_offset =
+        std::max(offset, (uint64_t)meta_length_) - meta_length_;
+    const std::size_t message_length = end - meta_length_ - message_offset;
+    const uint8_t* data = message_.Read(message_offset, message_length, scratch);
+    if (data == nullptr) {
+      UFTP_TRACE("Couldn't read message, transfer: {}, offset: {}",
+                 transfer_id_, message_offset);
+      return -1;
+    }
+    iov[iovcnt].iov_base = (void*)data;
+    iov[iovcnt++].iov_len = message_length;
+  }
+
+  // This is the first pass over the message bytes, which may be a mapping
+  // of a file someone has since truncated. No signal mask to save, it's the
+  // same once the handler jumps back.
+  sigjmp_buf jump;
+  if (sigsetjmp(jump, 0) != 0) {
+    message_.Faulted();
+    UFTP_TRACE("Message truncated, transfer: {}, chunk: {}", transfer_id_,
+               chunk_num);
+    return -1;
+  }
+  UftpMappedFileSource::CatchFaults(&jump);
+  uint32_t payload_checksum = compressed ? compressed->raw_checksum : 0;
+  for (int index = 1; compressed == nullptr && index < iovcnt; ++index) {
+    payload_checksum = UftpCrc32c(payload_checksum, iov[index].iov_base,
+                                  iov[index].iov_len);
+  }
+  // Only the first send of a chunk goes into parity, a retransmit is covered
+  // by the group it was first sent in.
+  if (!state.checksummed) {
+    state.fec = AddToParity(chunk_num, iov + 1, iovcnt - 1);
+  }
+  UftpMappedFileSource::CatchFaults(nullptr);
+  if (state.fec) {
+    header.flags |= CHUNK_FLAG_FEC;
+  }
+  AddToTransferChecksum(chunk_num, payload_checksum);
+  if (checksummed_chunks_ == num_chunks_) {
+    header.flags |= CHUNK_FLAG_TRANSFER_CHECKSUM;
+    header.transfer_checksum = transfer_checksum_;
+  }
+
+  uint32_t wire_checksum = payload_checksum;
+  state.wire_length = length;
+  if (compressed != nullptr) {
+    // The compressor reuses its buffers before the batch goes out.
+    if (compressed->compressed_length > 0) {
+      state.wire_length = compressed->compressed_length;
+      std::memcpy(scratch, compressed->compressed, state.wire_length);
+      wire_checksum = UftpCrc32c(0, scratch, state.wire_length);
+      header.flags |= CHUNK_FLAG_DEFLATE;
+      header.payload_length = state.wire_length;
+    } else {
+      std::memcpy(scratch, compressed->raw, length);
+    }
+    iov[1].iov_base = scratch;
+    iov[1].iov_len = state.wire_length;
+  }
+  header.checksum = UftpCrc32c(wire_checksum, &header, sizeof(header));
+
+  return iovcnt;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bool UftpSendWindow::AddToParity(uint32_t chunk_num, const iovec* payload,
+                                 int iovcnt) {
+  if (fec_ == nullptr) {
+    return false;
+  }
+  if (parity_count_ == 0) {
+    parity_group_size_ = fec_->GroupSize();
+    if (parity_group_size_ == 0) {
+      return false;
+    }
+    parity_.assign(UftpChunkSize, 0);
+    parity_first_ = chunk_num;
+    parity_length_ = 0;
+  }
+
+  std::size_t offset = 0;
+  for (int index = 0; index < iovcnt; ++index) {
+    UftpXorInto(parity_.data() + offset,
+                static_cast<const uint8_t*>(payload[index].iov_base),
+                payload[index].iov_len);
+    offset += payload[index].iov_len;
+  }
+  parity_length_ = std::max(parity_length_, (uint16_t)offset);
+  ++parity_count_;
+  State(chunk_num).parity_tx_seq = std::numeric_limits<uint64_t>::max();
+
+  if (parity_count_ == parity_group_size_ || chunk_num + 1 == num_chunks_) {
+    parity_ready_ = true;
+  }
+  return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int UftpSendWindow::BuildParity(UftpParityHeader& header, iovec* iov,
+                                uint8_t* scratch) {
+  header = UftpParityHeader();
+  header.payload_length = parity_length_;
+  header.transfer_id = transfer_id_;
+  header.first_chunk = parity_first_;
+  header.num_chunks = parity_count_;
+  std::memcpy(scratch, parity_.data(), parity_length_);
+  header.checksum = UftpCrc32c(UftpCrc32c(0, scratch, parity_length_),
+                               &header, sizeof(header));
+
+  iov[0].iov_base = &header;
+  iov[0].iov_len = sizeof(header);
+  iov[1].iov_base = scratch;
+  iov[1].iov_len = parity_length_;
+
+  // The group's last chunk has just been sent.
+  for (uint32_t chunk_num = parity_first_;
+       chunk_num < parity_first_ + parity_count_; ++chunk_num) {
+    State(chunk_num).parity_tx_seq = next_tx_seq_ - 1;
+  }
+  parity_count_ = 0;
+  parity_ready_ = false;
+  return 2;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void UftpSendWindow::OnParitySent(UftpClock::time_point now) {
+  AdvanceSendTime(sizeof(UftpParityHeader) + UftpChunkSize, now);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void UftpSendWindow::AdvanceSendTime(std::size_t length,
+                                     UftpClock::time_point now) {
+  const double pacing_rate = congestion_.PacingRate();
+  if (pacing_rate > 0.0) {
+    const auto interval =
+        std::chrono::nanoseconds((int64_t)(1e9 * length / pacing_rate));
+    next_send_time_ = std::max(next_send_time_, now) + interval;
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void UftpSendWindow::AddToTransferChecksum(uint32_t chunk_num,
+                                           uint32_t payload_checksum) {
+  ChunkState& state = State(chunk_num);
+  state.payload_checksum = payload_checksum;
+  state.checksummed = true;
+
+  // New chunks are built in order, so this only waits on a chunk that's
+  // being built right now.
+  while (checksummed_chunks_ < next_new_ &&
+         State(checksummed_chunks_).checksummed) {
+    transfer_checksum_ = UftpCrc32cCombine(
+        transfer_checksum_, State(checksummed_chunks_).payload_checksum,
+        ChunkLength(checksummed_chunks_, transfer_length_));
+    ++checksummed_chunks_;
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void UftpSendWindow::OnChunkSent(uint32_t chunk_num,
+                                 UftpClock::time_point now) {
+  if (in_flight_count_ == 0) {
+    // Nothing was in flight, so the time spent idle says nothing about the
+    // delivery rate.
+    delivered_time_ = now;
+  }
+
+  ChunkState& state = State(chunk_num);
+  state.tx_seq = next_tx_seq_++;
+  state.sent_time = now;
+  state.delivered = delivered_;
+  state.delivered_time = delivered_time_;
+  state.nacks = 0;
+  if (!state.in_flight) {
+    state.in_flight = true;
+    ++in_flight_count_;
+  }
+  ++chunks_sent_;
+  in_flight_.push_back(InFlight{chunk_num, state.tx_seq, now});
+
+  AdvanceSendTime(sizeof(UftpChunkHeader) + state.wire_length, now);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void UftpSendWindow::MarkAcked(uint32_t chunk_num, AckProgress& progress) {
+  if (chunk_num < base_ || chunk_num >= next_new_) {
+    return;
+  }
+  ChunkState& state = State(chunk_num);
+  if (state.acked) {
+    return;
+  }
+  state.acked = true;
+  if (state.in_flight) {
+    state.in_flight = false;
+    --in_flight_count_;
+  }
+  ++progress.acked_chunks;
+  if (state.tx_seq > progress.max_acked_tx_seq) {
+    progress.max_acked_tx_seq = state.tx_seq;
+    progress.newest_chunk = chunk_num;
+    progress.newest_sent_time = state.sent_time;
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void UftpSendWindow::OnAck(const UftpAckHeader& ack, const uint8_t* bitmap,
+                           UftpClock::time_point now) {
+  if (ack.transfer_id != transfer_id_ || Done()) {
+    return;
+  }
+
+  const uint32_t base_before = base_;
+  AckProgress progress;
+
+  // Acks sent while the receiver waits on a hole repeat the echo from
+  // before it, and would only measure how long the hole has been open.
+  UftpClock::duration rtt = UftpClock::duration::zero();
+  if (ack.timestamp_echo != 0 && ack.timestamp_echo != last_timestamp_echo_) {
+    last_timestamp_echo_ = ack.timestamp_echo;
+    // Unsigned subtraction copes with the timestamp wrapping.
+    rtt = std::chrono::microseconds(UftpTimestamp(now) - ack.timestamp_echo);
+    rtt_.OnSample(rtt);
+    UftpMetrics::Observe(
+        HISTOGRAM_RTT_US,
+        std::chrono::duration_cast<std::chrono::microseconds>(rtt).count());
+  }
+
+  const uint32_t cumulative = std::min(ack.cumulative_ack, next_new_);
+  for (uint32_t chunk_num = base_; chunk_num < cumulative; ++chunk_num) {
+    MarkAcked(chunk_num, progress);
+  }
+  for (uint32_t bit = 0; bit < 8u * ack.bitmap_length; ++bit) {
+    if (bitmap[bit / 8] & (1 << (bit % 8))) {
+      MarkAcked(ack.cumulative_ack + 1 + bit, progress);
+    }
+  }
+
+  if (progress.acked_chunks > 0) {
+    delivered_ += progress.acked_chunks;
+    delivered_time_ = now;
+
+    // Sample the delivery rate through the most recently sent chunk this
+    // ack covers.
+    const ChunkState& newest = State(progress.newest_chunk);
+    UftpCongestionControl::AckSample sample;
+    sample.acked_chunks = progress.acked_chunks;
+    sample.in_flight = in_flight_count_;
+    sample.rtt = rtt;
+    const double elapsed =
+        std::chrono::duration<double>(now - newest.delivered_time).count();
+    if (elapsed > 0.0) {
+      sample.delivery_rate = (delivered_ - newest.delivered) / elapsed;
+    }
+    congestion_.OnAck(sample, now);
+  }
+
+  const uint64_t max_acked_tx_seq = progress.max_acked_tx_seq;
+  while (base_ < next_new_ && State(base_).acked) {
+    ++base_;
+  }
+  CheckSpuriousLoss(ack, base_before);
+
+  // Selective repeat: anything still missing that went out before a chunk
+  // the receiver already has is probably lost. Jitter lets chunks overtake
+  // those sent just before them, so as in RACK, RFC 8985, it takes a chunk
+  // sent a quarter of an RTT later to say so.
+  if (max_acked_tx_seq != 0) {
+    const auto reorder_window = rtt_.Srtt() / 4;
+    for (uint32_t chunk_num = base_; chunk_num < next_new_; ++chunk_num) {
+      ChunkState& state = State(chunk_num);
+      if (state.acked || state.queued ||
+          std::max(state.tx_seq, state.parity_tx_seq) > max_acked_tx_seq) {
+        continue;
+      }
+      if (++state.nacks >= kFastRetransmitThreshold &&
+          progress.newest_sent_time - state.sent_time >= reorder_window) {
+        UFTP_TRACE("Fast retransmit, transfer: {}, chunk: {}", transfer_id_,
+                   chunk_num);
+        MarkLost(chunk_num, now);
+      }
+    }
+  }
+
+  if (fec_ != nullptr) {
+    // Chunks rebuilt from parity were lost all the same, the controller
+    // needs them to see the loss rate parity is hiding.
+    const uint32_t recovered =
+        std::max(ack.recovered_chunks, recovered_reported_) -
+        recovered_reported_;
+    fec_->OnAck(progress.acked_chunks, recovered,
+                chunks_lost_ - lost_reported_);
+    recovered_reported_ += recovered;
+    lost_reported_ = chunks_lost_;
+  }
+
+  if (base_ != base_before || max_acked_tx_seq != 0) {
+    last_progress_ = now;
+  }
+  UFTP_TRACE("Ack, transfer: {}, cumulative: {}, acked: {}, base: {}, "
+             "in flight: {}, rtt us: {}",
+             transfer_id_, ack.cumulative_ack, progress.acked_chunks, base_,
+             in_flight_count_,
+             std::chrono::duration_cast<std::chrono::microseconds>(rtt)
+                 .count());
+}
+
+///////////////////////////////////////////////////////////////////////////////
+UftpClock::time_point UftpSendWindow::NextTimeout() const {
+  UftpClock::time_point timeout = UftpClock::time_point::max();
+  if (!in_flight_.empty()) {
+    timeout = in_flight_.front().sent_time + rtt_.Rto();
+  }
+  if (HasChunkToSend() &&
+      in_flight_count_ < congestion_.CongestionWindow()) {
+    timeout = std::min(timeout, next_send_time_ - std::chrono::microseconds(
+                                                      UftpPacingBurstUs));
+  }
+  return timeout;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bool UftpReceiveWindow::Start(const UftpChunkHeader& header) {
+  if (header.meta_length < UftpMeta::kMinLength ||
+      header.meta_length > UftpMeta::kMaxLength ||
+      header.transfer_length < header.meta_length ||
+      header.transfer_length >
+          (uint64_t)std::numeric_limits<uint32_t>::max() * UftpChunkSize) {
+    UFTP_TRACE("Rejecting transfer with bad lengths, id: {}, meta: {}, "
+               "transfer: {}",
+               header.transfer_id, header.meta_length,
+               header.transfer_length);
+    return false;
+  }
+
+  transfer_id_ = header.transfer_id;
+  meta_length_ = header.meta_length;
+  transfer_length_ = header.transfer_length;
+  num_chunks_ = NumChunksFor(transfer_length_);
+  meta_chunks_ = NumChunksFor(meta_length_);
+
+  meta_.resize(meta_length_);
+  received_.assign(UftpWindowSize, false);
+  payload_checksums_.assign(UftpWindowSize, 0);
+
+  started_ = true;
+  return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bool UftpReceiveWindow::OnMetaComplete() {
+  // Split the meta bytes back into header, command and argument.
+  if (!UftpMeta::Parse(meta_.data(), meta_length_,
+                       transfer_length_ - meta_length_, message_)) {
+    UFTP_TRACE("Received malformed header, transfer: {}", transfer_id_);
+    return false;
+  }
+  const UftpHeader& header = message_.header;
+
+  UFTP_TRACE("Received header, transfer: {}, opcode: {}, status: {}, "
+             "sequence: {}, message length: {}",
+             transfer_id_, message_.opcode, header.status_code,
+             header.sequence_num, header.message_length);
+
+  message_.message_sink = select_sink_ ? select_sink_(message_) : nullptr;
+  if (message_.message_sink == nullptr) {
+    // The length came off the wire, don't let it size a buffer unchecked.
+    if (header.message_length > UftpMaxBufferedMessageSize) {
+      UFTP_TRACE("Message too big to buffer, transfer: {}, length: {}",
+                 transfer_id_, header.message_length);
+      return false;
+    }
+    const uint64_t message_length = header.message_length;
+    message_.message_sink = std::allocate_shared<UftpBufferSink>(
+        UftpPoolAllocator<UftpBufferSink>(), message_.message, message_length);
+  }
+  sink_ = message_.message_sink.get();
+
+  return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bool UftpReceiveWindow::OnChunk(const UftpChunkHeader& header,
+                                const uint8_t* payload) {
+  if (failed_) {
+    return false;
+  }
+
+  // Check before trusting anything in the header.
+  UftpChunkHeader unchecked_header = header;
+  unchecked_header.checksum = 0;
+  uint32_t payload_checksum = UftpCrc32c(0, payload, header.payload_length);
+  if (UftpCrc32c(payload_checksum, &unchecked_header,
+                 sizeof(unchecked_header)) != header.checksum) {
+    UFTP_TRACE("Dropping corrupt chunk, transfer: {}, chunk: {}",
+               header.transfer_id, header.chunk_num);
+    ++corrupt_chunks_;
+    // Let the sender see the hole soon.
+    if (started_) {
+      ack_now_ = true;
+    }
+    return false;
+  }
+
+  if (!started_) {
+    if (!Start(header)) {
+      return false;
+    }
+  } else if (header.transfer_id != transfer_id_ ||
+             header.meta_length != meta_length_ ||
+             header.transfer_length != transfer_length_) {
+    return false;
+  }
+
+  const uint32_t chunk_num = header.chunk_num;
+  if (chunk_num >= num_chunks_) {
+    return false;
+  }
+  const uint16_t length = ChunkLength(chunk_num, transfer_length_);
+  const bool compressed = header.flags & CHUNK_FLAG_DEFLATE;
+  if (compressed ? header.payload_length >= length
+                 : header.payload_length != length) {
+    return false;
+  }
+
+  if (chunk_num >= base_ + UftpWindowSize) {
+    return false;
+  }
+
+  if (chunk_num < base_ || received_[chunk_num % UftpWindowSize]) {
+    // Duplicate, our last ack probably got lost.
+    ack_now_ = true;
+    return true;
+  }
+
+  if (compressed) {
+    if (!Inflate(header, payload, length)) {
+      return false;
+    }
+    payload = inflate_buff_.data();
+    payload_checksum = UftpCrc32c(0, payload, length);
+  }
+
+  // Before Accept, which may hold the chunk until the meta bytes are in.
+  if (header.flags & CHUNK_FLAG_TRANSFER_CHECKSUM) {
+    expected_transfer_checksum_ = header.transfer_checksum;
+    has_expected_transfer_checksum_ = true;
+  }
+  const uint32_t base_before = base_;
+  if (!Accept(chunk_num, payload, length, payload_checksum)) {
+    return false;
+  }
+  if (header.flags & CHUNK_FLAG_FEC) {
+    EnableFec();
+  }
+  if (fec_) {
+    KeepCopy(chunk_num, payload, length);
+    TryRecover(chunk_num);
+    PruneParities();
+  }
+  // As RFC 7323 has it, only a chunk that moves the cumulative ack is
+  // echoed. Chunks past a hole leave the echo alone, so the one that fills
+  // it tells the sender which send got through, see CheckSpuriousLoss.
+  if (base_ != base_before) {
+    timestamp_echo_ = header.timestamp;
+  }
+
+  return CheckTransferChecksum();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bool UftpReceiveWindow::Inflate(const UftpChunkHeader& header,
+                                const uint8_t* payload, uint16_t length) {
+  inflate_buff_.resize(UftpChunkSize);
+  if (!inflater_.Inflate(payload, header.payload_length,
+                         inflate_buff_.data(), length)) {
+    // It passed its checksum, so the sender compressed it wrong.
+    UFTP_TRACE("Dropping chunk that didn't inflate, transfer: {}, chunk: {}",
+               transfer_id_, header.chunk_num);
+    ++corrupt_chunks_;
+    return false;
+  }
+  return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bool UftpReceiveWindow::Accept(uint32_t chunk_num, const uint8_t* payload,
+                               uint16_t length, uint32_t payload_checksum) {
+  const uint64_t offset = (uint64_t)chunk_num * UftpChunkSize;
+  const uint64_t end = offset + length;
+  const bool is_meta_chunk = chunk_num < meta_chunks_;
+  const bool completes_meta =
+      is_meta_chunk && meta_chunks_received_ + 1 == meta_chunks_;
+  if (end > meta_length_ && sink_ == nullptr && !completes_meta) {
+    // Nowhere to put the message bytes yet. A few chunks that overtook the
+    // meta bytes are kept, rather than cost the sender a loss.
+    if (!is_meta_chunk) {
+      Hold(chunk_num, payload, length, payload_checksum);
+    }
+    return false;
+  }
+
+  if (is_meta_chunk) {
+    const uint64_t meta_end = std::min(end, (uint64_t)meta_length_);
+    std::memcpy(meta_.data() + offset, payload, meta_end - offset);
+    if (++meta_chunks_received_ == meta_chunks_ && !OnMetaComplete()) {
+      failed_ = true;
+      return false;
+    }
+  }
+  if (end > meta_length_) {
+    const uint64_t start = std::max(offset, (uint64_t)meta_length_);
+    sink_->Write(start - meta_length_, payload + (start - offset),
+                 end - start);
+  }
+
+  received_[chunk_num % UftpWindowSize] = true;
+  payload_checksums_[chunk_num % UftpWindowSize] = payload_checksum;
+  highest_received_ = std::max(highest_received_, chunk_num);
+  if (chunk_num != base_) {
+    ack_now_ = true;
+  }
+
+  while (base_ < num_chunks_ && received_[base_ % UftpWindowSize]) {
+    received_[base_ % UftpWindowSize] = false;
+    transfer_checksum_ = UftpCrc32cCombine(
+        transfer_checksum_, payload_checksums_[base_ % UftpWindowSize],
+        ChunkLength(base_, transfer_length_));
+    ++base_;
+  }
+
+  if (++unacked_chunks_ >= UftpAckInterval || base_ >= num_chunks_) {
+    ack_now_ = true;
+  }
+
+  if (completes_meta) {
+    AcceptHeld();
+  }
+  return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void UftpReceiveWindow::Hold(uint32_t chunk_num, const uint8_t* payload,
+                             uint16_t length, uint32_t payload_checksum) {
+  if (held_chunks_.size() >= kMaxHeldChunks ||
+      held_chunks_.count(chunk_num) != 0) {
+    return;
+  }
+  HeldChunk& held = held_chunks_[chunk_num];
+  held.payload_checksum = payload_checksum;
+  held.payload.assign(payload, payload + length);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void UftpReceiveWindow::AcceptHeld() {
+  UftpPooledMap<uint32_t, HeldChunk> held_chunks;
+  held_chunks.swap(held_chunks_);
+  for (const auto& held : held_chunks) {
+    if (held.first < base_ || received_[held.first % UftpWindowSize]) {
+      continue;
+    }
+    Accept(held.first, held.second.payload.data(),
+           held.second.payload.size(), held.second.payload_checksum);
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bool UftpReceiveWindow::CheckTransferChecksum() {
+  if (base_ >= num_chunks_ && has_expected_transfer_checksum_ &&
+      transfer_checksum_ != expected_transfer_checksum_) {
+    UFTP_TRACE("Transfer checksum mismatch, id: {}", transfer_id_);
+    failed_ = true;
+    return false;
+  }
+  return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bool UftpReceiveWindow::OnParity(const UftpParityHeader& header,
+                                 const uint8_t* payload) {
+  if (failed_) {
+    return false;
+  }
+
+  UftpParityHeader unchecked_header = header;
+  unchecked_header.checksum = 0;
+  if (UftpCrc32c(UftpCrc32c(0, payload, header.payload_length),
+                 &unchecked_header,
+                 sizeof(unchecked_header)) != header.checksum) {
+    UFTP_TRACE("Dropping corrupt parity, transfer: {}, first chunk: {}",
+               header.transfer_id, header.first_chunk);
+    ++corrupt_chunks_;
+    return false;
+  }
+
+  // Until the first chunk arrives there's nothing to check the group
+  // against.
+  if (!started_ || header.transfer_id != transfer_id_ ||
+      header.num_chunks == 0 || header.num_chunks > UftpFecMaxGroupSize ||
+      header.first_chunk >= num_chunks_ ||
+      header.num_chunks > num_chunks_ - header.first_chunk ||
+      header.payload_length > UftpChunkSize) {
+    return false;
+  }
+  if (header.first_chunk + header.num_chunks <= base_) {
+    return true;
+  }
+  if (header.first_chunk >= base_ + UftpWindowSize ||
+      parities_.size() >= kMaxPendingParities) {
+    return false;
+  }
+
+  EnableFec();
+  PendingParity& parity = parities_[header.first_chunk];
+  parity.num_chunks = header.num_chunks;
+  parity.payload.assign(payload, payload + header.payload_length);
+  TryRecover(header.first_chunk);
+  PruneParities();
+
+  return CheckTransferChecksum();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void UftpReceiveWindow::EnableFec() {
+  if (fec_) {
+    return;
+  }
+  fec_ = true;
+  copies_.resize((std::size_t)UftpWindowSize * UftpChunkSize);
+  copy_chunks_.assign(UftpWindowSize, std::numeric_limits<uint32_t>::max());
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void UftpReceiveWindow::KeepCopy(uint32_t chunk_num, const uint8_t* payload,
+                                 uint16_t length) {
+  const uint32_t slot = chunk_num % UftpWindowSize;
+  std::memcpy(copies_.data() + (std::size_t)slot * UftpChunkSize, payload,
+              length);
+  copy_chunks_[slot] = chunk_num;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void UftpReceiveWindow::TryRecover(uint32_t chunk_num) {
+  auto ite = parities_.upper_bound(chunk_num);
+  if (ite == parities_.begin()) {
+    return;
+  }
+  --ite;
+  const uint32_t first_chunk = ite->first;
+  const PendingParity& parity = ite->second;
+  if (chunk_num >= first_chunk + parity.num_chunks) {
+    return;
+  }
+
+  // XOR parity only ever rebuilds one chunk, wait for a retransmit to
+  // bring the group down to that.
+  uint32_t missing = 0;
+  uint32_t num_missing = 0;
+  for (uint32_t member = first_chunk;
+       member < first_chunk + parity.num_chunks; ++member) {
+    if (member >= base_ && !received_[member % UftpWindowSize]) {
+      missing = member;
+      if (++num_missing > 1) {
+        return;
+      }
+    }
+  }
+  if (num_missing == 0) {
+    parities_.erase(ite);
+    return;
+  }
+
+  const uint16_t length = ChunkLength(missing, transfer_length_);
+  if (missing >= base_ + UftpWindowSize || length > parity.payload.size()) {
+    parities_.erase(ite);
+    return;
+  }
+
+  recover_buff_.assign(parity.payload.begin(), parity.payload.end());
+  for (uint32_t member = first_chunk;
+       member < first_chunk + parity.num_chunks; ++member) {
+    if (member == missing) {
+      continue;
+    }
+    const uint32_t slot = member % UftpWindowSize;
+    const uint16_t member_length = ChunkLength(member, transfer_length_);
+    if (copy_chunks_[slot] != member ||
+        member_length > recover_buff_.size()) {
+      // Received before we knew to keep a copy, or already overwritten.
+      parities_.erase(ite);
+      return;
+    }
+    UftpXorInto(recover_buff_.data(),
+                copies_.data() + (std::size_t)slot * UftpChunkSize,
+                member_length);
+  }
+
+  const uint32_t payload_checksum =
+      UftpCrc32c(0, recover_buff_.data(), length);
+  if (!Accept(missing, recover_buff_.data(), length, payload_checksum)) {
+    // Keep the parity, it may work once the meta bytes are in.
+    return;
+  }
+  UFTP_TRACE("Recovered chunk from parity, transfer: {}, chunk: {}",
+             transfer_id_, missing);
+  ++recovered_chunks_;
+  KeepCopy(missing, recover_buff_.data(), length);
+  parities_.erase(first_chunk);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void UftpReceiveWindow::PruneParities() {
+  while (!parities_.empty() &&
+         parities_.begin()->first + parities_.begin()->second.num_chunks <=
+             base_) {
+    parities_.erase(parities_.begin());
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+std::size_t UftpReceiveWindow::BuildAck(uint8_t* buff) const {
+  UftpAckHeader ack;
+  ack.transfer_id = transfer_id_;
+  ack.cumulative_ack = base_;
+  ack.timestamp_echo = timestamp_echo_;
+  ack.recovered_chunks = recovered_chunks_;
+
+  const uint32_t bits =
+      (highest_received_ > base_) ? highest_received_ - base_ : 0;
+  ack.bitmap_length = (bits + 7) / 8;
+
+  uint8_t* bitmap = buff + sizeof(ack);
+  std::memset(bitmap, 0, ack.bitmap_length);
+  for (uint32_t bit = 0; bit < bits; ++bit) {
+    if (received_[(base_ + 1 + bit) % UftpWindowSize]) {
+      bitmap[bit / 8] |= (1 << (bit % 8));
+    }
+  }
+
+  ack.checksum = UftpCrc32c(UftpCrc32c(0, &ack, sizeof(ack)), bitmap,
+                            ack.bitmap_length);
+  std::memcpy(buff, &ack, sizeof(ack));
+
+  return sizeof(ack) + ack.bitmap_length;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void UftpReceiveWindow::OnAckSent() {
+  ack_now_ = false;
+  unacked_chunks_ = 0;
+}
@@ -0,0 +1,337 @@
+#pragma once
+
+#include <sys/uio.h>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <vector>
+
+#include <uftp_buffer_pool.h>
+#include <uftp_compression.h>
+#include <uftp_congestion.h>
+#include <uftp_defs.h>
+#include <uftp_fec.h>
+#include <uftp_payload.h>
+#include <uftp_rtt.h>
+
+///////////////////////////////////////////////////////////////////////////////
+/// Sending half of the selective-repeat transport. Keeps up to UftpWindowSize
+/// chunks in flight and retransmits only the chunks the receiver reports as
+/// missing or that time out. Within that, the congestion controller decides
+/// how many chunks may be in flight and how fast they're paced out.
+///
+/// With a UftpFecController, new chunks are also xored together into parity
+/// datagrams, so the receiver can rebuild a lost chunk on its own.
+class UftpSendWindow : public UftpPooled {
+ public:
+  UftpSendWindow(uint32_t transfer_id, const uint8_t* meta,
+                 uint32_t meta_length, UftpPayloadSource& message,
+                 UftpCongestionControl& congestion, UftpRttEstimator& rtt,
+                 UftpFecController* fec = nullptr);
+
+  ///
+  /// \brief EnableCompression compresses message chunks with codec on
+  /// workers from here on. Call before the first chunk is built.
+  /// \param wake_fd written when a chunk NextChunk() held back for the
+  /// workers is ready, see UftpChunkCompressor.
+  ///
+  void EnableCompression(UftpCodec codec, UftpWorkerPool& workers,
+                         int wake_fd);
+
+  bool Done() const { return base_ >= num_chunks_; }
+
+  ///
+  /// \brief NextChunk picks the next chunk to put on the wire. Retransmits
+  /// take priority over new chunks.
+  /// \return false if nothing may be sent right now, because there's nothing
+  /// to send, the congestion window is full, pacing says wait or the next
+  /// new chunk is still being compressed.
+  ///
+  bool NextChunk(UftpClock::time_point now, uint32_t& chunk_num);
+
+  ///
+  /// \brief BuildChunk fills in the datagram header and the iovecs making up
+  /// chunk_num. iov must have room for 3 entries, scratch for UftpChunkSize
+  /// bytes in case the message source needs somewhere to read into.
+  /// \return the number of iovecs used, or -1 if the message couldn't be read.
+  ///
+  int BuildChunk(uint32_t chunk_num, UftpChunkHeader& header, iovec* iov,
+                 uint8_t* scratch);
+
+  void OnChunkSent(uint32_t chunk_num, UftpClock::time_point now);
+
+  /// True once a parity group is complete and should follow its last chunk.
+  bool ParityReady() const { return parity_ready_; }
+
+  ///
+  /// \brief BuildParity fills in the parity datagram for the finished group
+  /// and starts the next one. iov must have room for 2 entries, scratch for
+  /// UftpChunkSize bytes.
+  /// \return the number of iovecs used.
+  ///
+  int BuildParity(UftpParityHeader& header, iovec* iov, uint8_t* scratch);
+  void OnParitySent(UftpClock::time_point now);
+
+  void OnAck(const UftpAckHeader& ack, const uint8_t* bitmap,
+             UftpClock::time_point now);
+
+  /// The next retransmit timeout, or the time pacing lets the next chunk
+  /// out, whichever is sooner.
+  UftpClock::time_point NextTimeout() const;
+  UftpClock::time_point LastProgress() const { return last_progress_; }
+
+  uint32_t TransferId() const { return transfer_id_; }
+  uint32_t NumChunks() const { return num_chunks_; }
+  uint64_t RetransmitCount() const { return retransmit_count_; }
+  uint64_t TimeoutCount() const { return timeout_count_; }
+
+  uint32_t CongestionWindow() const { return congestion_.CongestionWindow(); }
+  /// Bytes per second, 0 when unpaced.
+  double PacingRate() const { return congestion_.PacingRate(); }
+  /// Bytes of message per byte sent, 1 when uncompressed.
+  double CompressionRatio() const {
+    return compressor_ && compressor_->CompressedBytes()
+               ? (double)compressor_->RawBytes() /
+                     compressor_->CompressedBytes()
+               : 1.0;
+  }
+  /// Fraction of the chunks sent that were lost.
+  double LossRate() const {
+    return chunks_sent_ ? (double)chunks_lost_ / chunks_sent_ : 0.0;
+  }
+
+ private:
+  struct ChunkState {
+    uint64_t tx_seq = 0;
+    UftpClock::time_point sent_time;
+    // Delivery progress when the chunk was sent, for rate samples.
+    uint64_t delivered = 0;
+    UftpClock::time_point delivered_time;
+    uint8_t nacks = 0;
+    bool acked = false;
+    bool queued = false;
+    bool in_flight = false;
+    // CRC32C of the payload, once the chunk has been built.
+    uint32_t payload_checksum = 0;
+    bool checksummed = false;
+    // Covered by a parity group. Such a chunk isn't given up on until acks
+    // for chunks sent after the group's parity show it's still missing, the
+    // parity may yet rebuild it.
+    bool fec = false;
+    uint64_t parity_tx_seq = 0;
+    // Payload bytes on the wire, less than the chunk length if compressed.
+    uint16_t wire_length = 0;
+  };
+
+  // What one ack newly acknowledged.
+  struct AckProgress {
+    uint32_t acked_chunks = 0;
+    uint64_t max_acked_tx_seq = 0;
+    uint32_t newest_chunk = 0;
+    UftpClock::time_point newest_sent_time;
+  };
+
+  struct InFlight {
+    uint32_t chunk_num;
+    uint64_t tx_seq;
+    UftpClock::time_point sent_time;
+  };
+
+  ChunkState& State(uint32_t chunk_num) {
+    return chunks_[chunk_num % UftpWindowSize];
+  }
+
+  void ExpireTimeouts(UftpClock::time_point now);
+  void CheckSpuriousLoss(const UftpAckHeader& ack, uint32_t base_before);
+  void AddToTransferChecksum(uint32_t chunk_num, uint32_t payload_checksum);
+  bool AddToParity(uint32_t chunk_num, const iovec* payload, int iovcnt);
+  void AdvanceSendTime(std::size_t length, UftpClock::time_point now);
+  void MarkAcked(uint32_t chunk_num, AckProgress& progress);
+  void MarkLost(uint32_t chunk_num, UftpClock::time_point now);
+  bool HasChunkToSend() const;
+  bool ChunkReady(uint32_t chunk_num);
+
+  const uint32_t transfer_id_;
+  const uint8_t* meta_;
+  const uint32_t meta_length_;
+  UftpPayloadSource& message_;
+  UftpCongestionControl& congestion_;
+  UftpRttEstimator& rtt_;
+  UftpFecController* fec_;
+  const uint64_t transfer_length_;
+  const uint32_t num_chunks_;
+
+  uint32_t base_ = 0;
+  uint32_t next_new_ = 0;
+  uint64_t next_tx_seq_ = 1;
+  uint64_t retransmit_count_ = 0;
+  uint64_t timeout_count_ = 0;
+
+  uint32_t in_flight_count_ = 0;
+  uint64_t chunks_sent_ = 0;
+  uint64_t chunks_lost_ = 0;
+  // Losses of chunks sent before this tx_seq belong to a loss event the
+  // congestion controller already knows about.
+  uint64_t recovery_tx_seq_ = 0;
+  // Set while the last window cut may yet be undone, see
+  // CheckSpuriousLoss. undo_chunk_ is the chunk that started the loss event,
+  // undo_timestamp_ when it was given up on.
+  bool undo_pending_ = false;
+  uint32_t undo_chunk_ = 0;
+  uint32_t undo_timestamp_ = 0;
+  uint64_t undo_recovery_tx_seq_ = 0;
+  uint32_t last_timestamp_echo_ = 0;
+  UftpClock::time_point next_send_time_;
+
+  uint64_t delivered_ = 0;
+  UftpClock::time_point delivered_time_;
+
+  // CRC32C of chunks [0, checksummed_chunks_), folded in as they're built.
+  uint32_t transfer_checksum_ = 0;
+  uint32_t checksummed_chunks_ = 0;
+
+  // The parity group being built, chunks [parity_first_, parity_first_ +
+  // parity_count_). Its size is fixed when it starts.
+  UftpPooledBuffer parity_;
+  uint32_t parity_first_ = 0;
+  uint32_t parity_count_ = 0;
+  uint32_t parity_group_size_ = 0;
+  uint16_t parity_length_ = 0;
+  bool parity_ready_ = false;
+  // What the FEC controller has been told so far.
+  uint32_t recovered_reported_ = 0;
+  uint64_t lost_reported_ = 0;
+
+  std::unique_ptr<UftpChunkCompressor> compressor_;
+  // next_new_ is still being compressed or read off the disk. The
+  // compressor's wake_fd, or the disk engine's, says when it's done.
+  bool waiting_for_data_ = false;
+
+  UftpPooledVector<ChunkState> chunks_;
+  UftpPooledDeque<uint32_t> retransmit_queue_;
+  UftpPooledDeque<InFlight> in_flight_;
+  UftpClock::time_point last_progress_;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+/// Receiving half of the selective-repeat transport. Chunks go straight to
+/// the meta buffer or the message sink in whatever order they arrive. Message
+/// bytes are only accepted once the meta bytes are complete and a sink has
+/// been chosen. The first few that arrive earlier are held until then, any
+/// more are dropped and left to the sender to repeat.
+///
+/// Once the sender starts sending parity, a copy of every chunk is kept for
+/// the length of the window, so a group missing one chunk can rebuild it.
+class UftpReceiveWindow : public UftpPooled {
+ public:
+  UftpReceiveWindow(UftpMessage& message, const UftpSinkSelector& select_sink)
+      : message_(message), select_sink_(select_sink) {}
+
+  ///
+  /// \brief OnChunk
+  /// \return false if the chunk doesn't belong to this transfer, is
+  /// malformed or fails its checksum.
+  ///
+  bool OnChunk(const UftpChunkHeader& header, const uint8_t* payload);
+
+  ///
+  /// \brief OnParity rebuilds the one missing chunk of a parity group, now
+  /// or once the rest of the group is in.
+  /// \return false if the parity doesn't belong to this transfer, is
+  /// malformed or fails its checksum.
+  ///
+  bool OnParity(const UftpParityHeader& header, const uint8_t* payload);
+
+  bool Started() const { return started_; }
+  bool Done() const { return started_ && !failed_ && base_ >= num_chunks_; }
+  /// The transfer can't complete, either its meta bytes were malformed or
+  /// the chunks didn't add up to the transfer checksum.
+  bool Failed() const { return failed_; }
+  uint64_t CorruptChunks() const { return corrupt_chunks_; }
+  uint32_t RecoveredChunks() const { return recovered_chunks_; }
+
+  /// True when the sender should hear from us right away (gap, duplicate,
+  /// completion or UftpAckInterval chunks since the last ack).
+  bool AckNow() const { return ack_now_; }
+  bool AckPending() const { return ack_now_ || unacked_chunks_ > 0; }
+
+  /// Serialises the current ack into buff, which needs room for
+  /// sizeof(UftpAckHeader) + UftpWindowSize / 8 bytes. Returns the datagram
+  /// length.
+  std::size_t BuildAck(uint8_t* buff) const;
+  void OnAckSent();
+
+  uint32_t TransferId() const { return transfer_id_; }
+  uint32_t NumChunks() const { return num_chunks_; }
+
+ private:
+  struct PendingParity {
+    uint32_t num_chunks = 0;
+    UftpPooledBuffer payload;
+  };
+
+  // A chunk that overtook the meta bytes, kept until there's a sink for it.
+  struct HeldChunk {
+    uint32_t payload_checksum = 0;
+    UftpPooledBuffer payload;
+  };
+
+  bool Start(const UftpChunkHeader& header);
+  bool OnMetaComplete();
+  bool Inflate(const UftpChunkHeader& header, const uint8_t* payload,
+               uint16_t length);
+  bool Accept(uint32_t chunk_num, const uint8_t* payload, uint16_t length,
+              uint32_t payload_checksum);
+  void Hold(uint32_t chunk_num, const uint8_t* payload, uint16_t length,
+            uint32_t payload_checksum);
+  void AcceptHeld();
+  bool CheckTransferChecksum();
+  void EnableFec();
+  void KeepCopy(uint32_t chunk_num, const uint8_t* payload, uint16_t length);
+  void TryRecover(uint32_t chunk_num);
+  void PruneParities();
+
+  UftpPooledBuffer meta_;
+  UftpMessage& message_;
+  const UftpSinkSelector& select_sink_;
+  UftpPayloadSink* sink_ = nullptr;
+  UftpPooledVector<bool> received_;
+  UftpPooledVector<uint32_t> payload_checksums_;
+
+  bool started_ = false;
+  bool failed_ = false;
+  uint32_t transfer_id_ = 0;
+  uint32_t meta_length_ = 0;
+  uint64_t transfer_length_ = 0;
+  uint32_t num_chunks_ = 0;
+  uint32_t meta_chunks_ = 0;
+  uint32_t meta_chunks_received_ = 0;
+  UftpPooledMap<uint32_t, HeldChunk> held_chunks_;
+
+  uint32_t base_ = 0;
+  uint32_t highest_received_ = 0;
+  uint32_t unacked_chunks_ = 0;
+  uint32_t timestamp_echo_ = 0;
+  bool ack_now_ = false;
+
+  // CRC32C of chunks [0, base_), and what the sender says it should be.
+  uint32_t transfer_checksum_ = 0;
+  uint32_t expected_transfer_checksum_ = 0;
+  bool has_expected_transfer_checksum_ = false;
+  uint64_t corrupt_chunks_ = 0;
+
+  // Parity state, unused until the sender sends some. copies_ holds one
+  // chunk per window slot, copy_chunks_ which chunk that is.
+  bool fec_ = false;
+  UftpPooledBuffer copies_;
+  UftpPooledVector<uint32_t> copy_chunks_;
+  UftpPooledMap<uint32_t, PendingParity> parities_;
+  UftpPooledBuffer recover_buff_;
+  uint32_t recovered_chunks_ = 0;
+
+  // Compressed chunks are inflated here before anything else sees them.
+  UftpInflater inflater_;
+  UftpPooledBuffer inflate_buff_;
+};
@@ -0,0 +1,51 @@
+#include <uftp_worker_pool.h>
+
+#include <algorithm>
+
+///////////////////////////////////////////////////////////////////////////////
+UftpWorkerPool::UftpWorkerPool(unsigned num_threads) {
+  if (num_threads == 0) {
+    num_threads = std::max(2u, std::thread::hardware_concurrency()) - 1;
+  }
+  for (unsigned thread = 0; thread < num_threads; ++thread) {
+    threads_.emplace_back([this] { Run(); });
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+UftpWorkerPool::~UftpWorkerPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  work_ready_.notify_all();
+  for (auto& thread : threads_) {
+    thread.join();
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void UftpWorkerPool::Submit(std::function<void()> work) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    queue_.push_back(std::move(work));
+  }
+  work_ready_.notify_one();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void UftpWorkerPool::Run() {
+  while (true) {
+    std::function<void()> work;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      work_ready_.wait(lock, [this] { return stopping_ || !queue_.empty(); });
+      if (queue_.empty()) {
+        return;
+      }
+      work = std::move(queue_.front());
+      queue_.pop_front();
+    }
+    work();
+  }
+}
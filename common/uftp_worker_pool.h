@@ -0,0 +1,37 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+///////////////////////////////////////////////////////////////////////////////
+/// A fixed set of threads running whatever work is submitted, in order.
+/// Work that has been submitted is finished before the pool is destroyed.
+class UftpWorkerPool {
+ public:
+  ///
+  /// \param num_threads 0 for one fewer than the number of cores, leaving
+  /// one for the network loop, but at least 1.
+  ///
+  explicit UftpWorkerPool(unsigned num_threads = 0);
+  ~UftpWorkerPool();
+
+  UftpWorkerPool(const UftpWorkerPool&) = delete;
+  UftpWorkerPool& operator=(const UftpWorkerPool&) = delete;
+
+  void Submit(std::function<void()> work);
+
+  std::size_t NumThreads() const { return threads_.size(); }
+
+ private:
+  void Run();
+
+  std::mutex mutex_;
+  std::condition_variable work_ready_;
+  std::deque<std::function<void()>> queue_;
+  bool stopping_ = false;
+  std::vector<std::thread> threads_;
+};
@@ -0,0 +1,262 @@
+#include "uftp_dir_index.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <iterator>
+#include <set>
+
+#include <uftp_defs.h>
+#include <uftp_utils.h>
+
+// Everything that can change a name, size, mtime or type.
+static constexpr uint32_t kWatchedEvents =
+    IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_MODIFY |
+    IN_CLOSE_WRITE | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF;
+
+///////////////////////////////////////////////////////////////////////////////
+UftpDirIndex::UftpDirIndex(const std::string& path) : path_(path) {
+  inotify_fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (inotify_fd_ >= 0 &&
+      inotify_add_watch(inotify_fd_, path_.c_str(), kWatchedEvents) < 0) {
+    close(inotify_fd_);
+    inotify_fd_ = -1;
+  }
+  if (inotify_fd_ < 0) {
+    DEBUG_LOG("No inotify for ", path_, ", reading it for every listing");
+    return;
+  }
+
+  // The watch is in place before the scan starts, so nothing that changes
+  // while it runs is missed.
+  scan_requested_ = true;
+  scanner_ = std::thread(&UftpDirIndex::RunScanner, this);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+UftpDirIndex::~UftpDirIndex() {
+  if (scanner_.joinable()) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+    }
+    scan_requested_cv_.notify_one();
+    scanner_.join();
+  }
+  if (inotify_fd_ >= 0) {
+    close(inotify_fd_);
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bool UftpDirIndex::List(const std::string& prefix, const std::string& cursor,
+                        uint32_t max_entries,
+                        std::vector<UftpListEntry>& entries, bool& more) {
+  if (inotify_fd_ < 0) {
+    return ListUnindexed(prefix, cursor, max_entries, entries, more);
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!Refresh()) {
+      RequestScan();
+    }
+    if (scanned_) {
+      entries.clear();
+      more = false;
+      auto entry_it = cursor < prefix ? entries_.lower_bound(prefix)
+                                      : entries_.upper_bound(cursor);
+      for (; entry_it != entries_.end() &&
+             entry_it->first.compare(0, prefix.size(), prefix) == 0;
+           ++entry_it) {
+        if (entries.size() == max_entries) {
+          more = true;
+          break;
+        }
+        UftpListEntry entry;
+        entry.name = entry_it->first;
+        entry.size = entry_it->second.size;
+        entry.mtime_ns = entry_it->second.mtime_ns;
+        entry.type = entry_it->second.type;
+        entries.push_back(std::move(entry));
+      }
+      return true;
+    }
+    // A scan that failed is tried again, this listing can't wait for it.
+    RequestScan();
+  }
+  return ListUnindexed(prefix, cursor, max_entries, entries, more);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bool UftpDirIndex::ListUnindexed(const std::string& prefix,
+                                 const std::string& cursor,
+                                 uint32_t max_entries,
+                                 std::vector<UftpListEntry>& entries,
+                                 bool& more) const {
+  DIR* dir = opendir(path_.c_str());
+  if (dir == nullptr) {
+    return false;
+  }
+
+  // The first max_entries + 1 names of the page, the extra one only to
+  // tell whether there's more.
+  std::set<std::string> names;
+  dirent* dir_entry = nullptr;
+  while ((dir_entry = readdir(dir)) != nullptr) {
+    const std::string name = dir_entry->d_name;
+    if (name == "." || name == ".." || name <= cursor ||
+        name.compare(0, prefix.size(), prefix) != 0) {
+      continue;
+    }
+    names.insert(name);
+    if (names.size() > (std::size_t)max_entries + 1) {
+      names.erase(std::prev(names.end()));
+    }
+  }
+  closedir(dir);
+
+  entries.clear();
+  more = names.size() > max_entries;
+  for (const auto& name : names) {
+    Entry stat_entry;
+    if (entries.size() == max_entries || !Stat(name, stat_entry)) {
+      continue;
+    }
+    UftpListEntry entry;
+    entry.name = name;
+    entry.size = stat_entry.size;
+    entry.mtime_ns = stat_entry.mtime_ns;
+    entry.type = stat_entry.type;
+    entries.push_back(std::move(entry));
+  }
+  return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bool UftpDirIndex::Refresh() {
+  // Collect the names first, a file being written changes many times
+  // between listings but only needs statting once.
+  std::set<std::string> changed;
+  alignas(inotify_event) char buffer[64 * 1024];
+  ssize_t length = 0;
+  bool lost_events = false;
+  while ((length = read(inotify_fd_, buffer, sizeof(buffer))) > 0) {
+    for (char* next = buffer; next < buffer + length;) {
+      const inotify_event* event = reinterpret_cast<inotify_event*>(next);
+      next += sizeof(inotify_event) + event->len;
+      if (event->mask & (IN_Q_OVERFLOW | IN_DELETE_SELF | IN_MOVE_SELF)) {
+        lost_events = true;
+      } else if (event->len > 0) {
+        changed.insert(event->name);
+      }
+    }
+  }
+
+  if (lost_events) {
+    DEBUG_LOG("Lost track of ", path_, ", rescanning");
+    return false;
+  }
+  if (scanning_) {
+    changed_while_scanning_.insert(changed.begin(), changed.end());
+  }
+  if (scanned_) {
+    for (const auto& name : changed) {
+      Update(name);
+    }
+  }
+  return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void UftpDirIndex::RequestScan() {
+  if (!scan_requested_) {
+    scan_requested_ = true;
+    scan_requested_cv_.notify_one();
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void UftpDirIndex::RunScanner() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    scan_requested_cv_.wait(lock,
+                            [this] { return scan_requested_ || stopping_; });
+    if (stopping_) {
+      return;
+    }
+    scan_requested_ = false;
+    scanning_ = true;
+    changed_while_scanning_.clear();
+
+    // The listings go on from the old index while this one is built.
+    lock.unlock();
+    std::map<std::string, Entry> entries;
+    const bool scanned = Scan(entries);
+    lock.lock();
+
+    scanning_ = false;
+    if (scanned) {
+      entries_.swap(entries);
+      for (const auto& name : changed_while_scanning_) {
+        Update(name);
+      }
+      scanned_ = true;
+    }
+    changed_while_scanning_.clear();
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bool UftpDirIndex::Scan(std::map<std::string, Entry>& entries) const {
+  DIR* dir = opendir(path_.c_str());
+  if (dir == nullptr) {
+    return false;
+  }
+
+  dirent* dir_entry = nullptr;
+  while ((dir_entry = readdir(dir)) != nullptr) {
+    const std::string name = dir_entry->d_name;
+    Entry entry;
+    if (name != "." && name != ".." && Stat(name, entry)) {
+      entries[name] = entry;
+    }
+  }
+  closedir(dir);
+  DEBUG_LOG("Indexed ", entries.size(), " entries of ", path_);
+  return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bool UftpDirIndex::Stat(const std::string& name, Entry& entry) const {
+  struct stat file_stat;
+  if (lstat((path_ + "/" + name).c_str(), &file_stat) != 0) {
+    return false;
+  }
+
+  entry.size = file_stat.st_size;
+  entry.mtime_ns = (uint64_t)file_stat.st_mtim.tv_sec * 1000000000 +
+                   file_stat.st_mtim.tv_nsec;
+  if (S_ISREG(file_stat.st_mode)) {
+    entry.type = FILE_TYPE_REGULAR;
+  } else if (S_ISDIR(file_stat.st_mode)) {
+    entry.type = FILE_TYPE_DIRECTORY;
+  } else if (S_ISLNK(file_stat.st_mode)) {
+    entry.type = FILE_TYPE_SYMLINK;
+  } else {
+    entry.type = FILE_TYPE_OTHER;
+  }
+  return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void UftpDirIndex::Update(const std::string& name) {
+  Entry entry;
+  if (Stat(name, entry)) {
+    entries_[name] = entry;
+  } else {
+    entries_.erase(name);
+  }
+}
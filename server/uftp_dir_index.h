@@ -0,0 +1,78 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <uftp_listing.h>
+
+///////////////////////////////////////////////////////////////////////////////
+/// The entries of the server's directory, sorted by name, so that "ls" can
+/// serve a page from anywhere in a huge directory without reading all of it.
+/// Built by a scan on a thread of its own, started with the server, then
+/// kept up to date from inotify: each listing first applies whatever changed
+/// since the last one, restatting only the names that changed. If the
+/// kernel's event queue overflows, the thread scans again and the new index
+/// is swapped in when it's done, listings in the meantime are served from
+/// the old one. Shared by every worker of the server, which never wait on a
+/// scan: until the first one is done, or without inotify, a listing reads
+/// the directory's names and stats only the page it returns.
+class UftpDirIndex {
+ public:
+  explicit UftpDirIndex(const std::string& path = ".");
+  ~UftpDirIndex();
+
+  UftpDirIndex(const UftpDirIndex&) = delete;
+  UftpDirIndex& operator=(const UftpDirIndex&) = delete;
+
+  ///
+  /// \brief List fills entries with up to max_entries entries whose names
+  /// start with prefix and sort after cursor.
+  /// \return false if the directory couldn't be read.
+  ///
+  bool List(const std::string& prefix, const std::string& cursor,
+            uint32_t max_entries, std::vector<UftpListEntry>& entries,
+            bool& more);
+
+ private:
+  struct Entry {
+    uint64_t size;
+    uint64_t mtime_ns;
+    UftpFileType type;
+  };
+
+  /// Applies what inotify says changed. False if events were lost.
+  bool Refresh();
+  void RequestScan();
+  void RunScanner();
+  bool Scan(std::map<std::string, Entry>& entries) const;
+  bool ListUnindexed(const std::string& prefix, const std::string& cursor,
+                     uint32_t max_entries,
+                     std::vector<UftpListEntry>& entries, bool& more) const;
+  /// Stats name into entry. False if it's gone.
+  bool Stat(const std::string& name, Entry& entry) const;
+  /// Restats name, dropping it if it's gone.
+  void Update(const std::string& name);
+
+  const std::string path_;
+  int inotify_fd_ = -1;
+
+  std::mutex mutex_;
+  std::map<std::string, Entry> entries_;
+  bool scanned_ = false;
+
+  // The scanner thread's state, all under mutex_. Names inotify reports
+  // while a scan runs are restatted once its index is swapped in, the scan
+  // may have read them before they changed.
+  std::condition_variable scan_requested_cv_;
+  bool scan_requested_ = false;
+  bool scanning_ = false;
+  bool stopping_ = false;
+  std::set<std::string> changed_while_scanning_;
+  std::thread scanner_;
+};
@@ -0,0 +1,118 @@
+#include "uftp_file_cache.h"
+
+#include <sys/stat.h>
+
+#include <uftp_defs.h>
+#include <uftp_metrics.h>
+#include <uftp_utils.h>
+
+///////////////////////////////////////////////////////////////////////////////
+bool UftpFileCache::Matches(const Entry& entry, const struct stat& file_stat) {
+  return !entry.source->Truncated() && entry.device == file_stat.st_dev &&
+         entry.inode == file_stat.st_ino && entry.length == file_stat.st_size &&
+         entry.mtime.tv_sec == file_stat.st_mtim.tv_sec &&
+         entry.mtime.tv_nsec == file_stat.st_mtim.tv_nsec;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+UftpStatusCode UftpFileCache::Open(
+    const std::string& filename, const struct stat& file_stat,
+    std::shared_ptr<UftpPayloadSource>& source) {
+  if (Find(filename, file_stat, source)) {
+    return UftpStatusCode::NO_ERR;
+  }
+  std::shared_ptr<UftpMappedFileSource> mapped_source;
+  const UftpStatusCode status = Map(filename, file_stat, mapped_source);
+  if (status == UftpStatusCode::NO_ERR) {
+    source = mapped_source;
+  }
+  return status;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bool UftpFileCache::Find(const std::string& filename,
+                         const struct stat& file_stat,
+                         std::shared_ptr<UftpPayloadSource>& source) {
+  auto entry_it = entries_.find(filename);
+  if (entry_it != entries_.end()) {
+    if (Matches(entry_it->second, file_stat)) {
+      ++hits_;
+      UftpMetrics::Add(COUNTER_FILE_CACHE_HITS);
+      lru_.splice(lru_.begin(), lru_, entry_it->second.lru_position);
+      source = entry_it->second.source;
+      return true;
+    }
+    DEBUG_LOG("Cached file changed: ", filename);
+    ++invalidations_;
+    UftpMetrics::Add(COUNTER_FILE_CACHE_INVALIDATIONS);
+    Erase(entry_it);
+  }
+
+  ++misses_;
+  UftpMetrics::Add(COUNTER_FILE_CACHE_MISSES);
+  return false;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void UftpFileCache::Add(const std::string& filename,
+                        const struct stat& file_stat) {
+  std::shared_ptr<UftpMappedFileSource> mapped_source;
+  Map(filename, file_stat, mapped_source);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+UftpStatusCode UftpFileCache::Map(
+    const std::string& filename, const struct stat& file_stat,
+    std::shared_ptr<UftpMappedFileSource>& mapped_source) {
+  mapped_source = std::make_shared<UftpMappedFileSource>();
+  const UftpStatusCode status = mapped_source->Open(filename);
+  if (status != UftpStatusCode::NO_ERR) {
+    return status;
+  }
+
+  // The file may have changed since the stat(), in which case the entry just
+  // won't match next time.
+  const uint64_t length = mapped_source->Length();
+  if (length > MaxEntryLength()) {
+    return status;
+  }
+  EvictDownTo(capacity_ - length);
+
+  lru_.push_front(filename);
+  Entry& entry = entries_[filename];
+  entry.source = mapped_source;
+  entry.device = file_stat.st_dev;
+  entry.inode = file_stat.st_ino;
+  entry.length = file_stat.st_size;
+  entry.mtime = file_stat.st_mtim;
+  entry.lru_position = lru_.begin();
+  cached_bytes_ += length;
+  UftpMetrics::AddGauge(GAUGE_FILE_CACHE_BYTES, length);
+  return status;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void UftpFileCache::SetCapacity(uint64_t capacity) {
+  capacity_ = capacity;
+  EvictDownTo(capacity_);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void UftpFileCache::Erase(
+    std::unordered_map<std::string, Entry>::iterator entry_it) {
+  cached_bytes_ -= entry_it->second.source->Length();
+  UftpMetrics::AddGauge(GAUGE_FILE_CACHE_BYTES,
+                        -(int64_t)entry_it->second.source->Length());
+  lru_.erase(entry_it->second.lru_position);
+  entries_.erase(entry_it);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void UftpFileCache::EvictDownTo(uint64_t capacity) {
+  while (cached_bytes_ > capacity && !lru_.empty()) {
+    DEBUG_LOG("Evicting cached file: ", lru_.back());
+    ++evictions_;
+    UftpMetrics::Add(COUNTER_FILE_CACHE_EVICTIONS);
+    Erase(entries_.find(lru_.back()));
+  }
+}
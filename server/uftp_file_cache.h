@@ -0,0 +1,94 @@
+#pragma once
+
+#include <sys/stat.h>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+#include <uftp_defs.h>
+#include <uftp_payload.h>
+
+///////////////////////////////////////////////////////////////////////////////
+/// Recently served files, kept mapped so that a burst of gets for the same
+/// file costs one stat() each instead of an open and mmap. Bounded by the
+/// total length of the files it holds, least recently used first out. An
+/// entry is only used while the file's inode, size and mtime still match and
+/// no read has found it truncated, so a put or any other change to the file
+/// is picked up on the next get.
+/// Files bigger than a quarter of the capacity are served but not cached,
+/// so one of them can't flush out everything else.
+/// With a disk engine, the server only sends from a mapping on a hit and
+/// reads a miss through the engine, so cold pages never fault on the loop.
+/// Evicting an entry doesn't disturb transfers still sending from it, the
+/// mapping lives until the last of them is done.
+class UftpFileCache {
+ public:
+  explicit UftpFileCache(uint64_t capacity = UftpDefaultFileCacheSize)
+      : capacity_(capacity) {}
+
+  ///
+  /// \brief Open finds filename in the cache, or maps it and caches it if
+  /// it fits.
+  /// \param file_stat what stat() just said about filename, a regular file.
+  /// \return NO_ERR with the file in source, or why it couldn't be opened.
+  /// ERR_UNKNOWN means it couldn't be mapped and may still be readable.
+  ///
+  UftpStatusCode Open(const std::string& filename,
+                      const struct stat& file_stat,
+                      std::shared_ptr<UftpPayloadSource>& source);
+
+  ///
+  /// \brief Find only looks filename up, counting a miss if it isn't there.
+  /// \return true with the cached file in source.
+  ///
+  bool Find(const std::string& filename, const struct stat& file_stat,
+            std::shared_ptr<UftpPayloadSource>& source);
+
+  ///
+  /// \brief Add maps filename and caches it if it fits, for the next get of
+  /// it to find. Mapping touches none of its pages.
+  ///
+  void Add(const std::string& filename, const struct stat& file_stat);
+
+  void SetCapacity(uint64_t capacity);
+  /// Files longer than this are never cached.
+  uint64_t MaxEntryLength() const { return capacity_ / 4; }
+
+  uint64_t Hits() const { return hits_; }
+  uint64_t Misses() const { return misses_; }
+  uint64_t Evictions() const { return evictions_; }
+  /// Entries dropped because their file changed.
+  uint64_t Invalidations() const { return invalidations_; }
+  uint64_t CachedBytes() const { return cached_bytes_; }
+
+ private:
+  struct Entry {
+    std::shared_ptr<UftpMappedFileSource> source;
+    dev_t device;
+    ino_t inode;
+    off_t length;
+    timespec mtime;
+    std::list<std::string>::iterator lru_position;
+  };
+
+  static bool Matches(const Entry& entry, const struct stat& file_stat);
+  /// Maps filename into source, and caches it if it fits.
+  UftpStatusCode Map(const std::string& filename,
+                     const struct stat& file_stat,
+                     std::shared_ptr<UftpMappedFileSource>& source);
+  void Erase(std::unordered_map<std::string, Entry>::iterator entry_it);
+  void EvictDownTo(uint64_t capacity);
+
+  uint64_t capacity_;
+  uint64_t cached_bytes_ = 0;
+  std::unordered_map<std::string, Entry> entries_;
+  // Most recently used at the front.
+  std::list<std::string> lru_;
+
+  uint64_t hits_ = 0;
+  uint64_t misses_ = 0;
+  uint64_t evictions_ = 0;
+  uint64_t invalidations_ = 0;
+};
@@ -1,45 +1,104 @@
 #include "uftp_server.h"
 
-#include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <algorithm>
 #include <chrono>
 #include <cstdio>
 #include <iostream>
-#include <sstream>
+#include <memory>
 #include <string>
 #include <thread>
 #include <vector>
 
+#include <uftp_batch_io.h>
+#include <uftp_checkpoint.h>
+#include <uftp_compression.h>
+#include <uftp_congestion.h>
+#include <uftp_fec.h>
 #include <uftp_defs.h>
+#include <uftp_delta.h>
+#include <uftp_listing.h>
+#include <uftp_metrics.h>
+#include <uftp_payload.h>
+#include <uftp_trace.h>
 #include <uftp_utils.h>
 
-/////////////////////////////////////////////////////////////////////////////////
-UftpServer::UftpServer() {
-  response_.header.sequence_num = std::numeric_limits<uint32_t>::max();
+// Receive batches read per wakeup before the sessions get a turn to send.
+static constexpr int kMaxReceiveBatches = 16;
+
+///////////////////////////////////////////////////////////////////////////////
+static uint64_t PeerKey(const sockaddr_in& peer) {
+  return ((uint64_t)peer.sin_addr.s_addr << 16) | peer.sin_port;
 }
 
+/////////////////////////////////////////////////////////////////////////////////
+UftpServer::UftpServer() : UftpServer(0) {}
+
 /////////////////////////////////////////////////////////////////////////////////
 UftpServer::UftpServer(uint16_t port) : server_port_(port) {
-  response_.header.sequence_num = std::numeric_limits<uint32_t>::max();
+  // Files being put are streamed straight to disk.
+  select_sink_ = [this](const UftpMessage& request)
+      -> std::shared_ptr<UftpPayloadSink> {
+    if (request.opcode != OP_PUT) {
+      return nullptr;
+    }
+    auto file_sink =
+        std::make_shared<UftpFileSink>(stream_buffer_size_, disk_engine_);
+    file_sink->Open(request.argument, request.header.file_length,
+                    request.header.range_offset,
+                    request.header.message_length, request.file_mtime_ns);
+    return file_sink;
+  };
+
+  handle_request_ = [this](const sockaddr_in& peer,
+                           const UftpMessage& request,
+                           UftpMessage& response) {
+    return HandleRequest(peer, request, response);
+  };
 }
 
 /////////////////////////////////////////////////////////////////////////////////
-UftpStatusCode UftpServer::HandleLsRequest(std::vector<uint8_t>& message) {
-  DIR* dir = opendir(".");
-  if (dir == nullptr) {
-    return UftpStatusCode::ERR_BAD_PERMISSIONS;
-  }
+UftpServer::CompletionQueue::CompletionQueue() {
+  event_fd = UftpUtils::CheckErr(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC),
+                                 "Error creating eventfd");
+}
 
-  std::ostringstream osstream;
+/////////////////////////////////////////////////////////////////////////////////
+UftpServer::CompletionQueue::~CompletionQueue() { close(event_fd); }
 
-  dirent* dir_entry = nullptr;
-  while ((dir_entry = readdir(dir)) != nullptr) {
-    osstream << dir_entry->d_name << "\n";
+/////////////////////////////////////////////////////////////////////////////////
+void UftpServer::CompletionQueue::Push(Completion completion) {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    completions.push_back(std::move(completion));
   }
+  const uint64_t one = 1;
+  (void)write(event_fd, &one, sizeof(one));
+}
 
-  const std::string& str = osstream.str();
-  message.insert(message.end(), str.begin(), str.end());
+/////////////////////////////////////////////////////////////////////////////////
+UftpStatusCode UftpServer::HandleLsRequest(const UftpMessage& request,
+                                           std::vector<uint8_t>& message) {
+  std::string cursor;
+  uint32_t max_entries = 0;
+  if (!UftpListing::DeserializeRequest(request.message, cursor,
+                                       max_entries)) {
+    return UftpStatusCode::ERR_BAD_COMMAND;
+  }
 
+  std::vector<UftpListEntry> entries;
+  bool more = false;
+  if (!dir_index_->List(request.argument, cursor, max_entries, entries,
+                        more)) {
+    return UftpStatusCode::ERR_BAD_PERMISSIONS;
+  }
+  UftpListing::SerializePage(entries, more, message);
   return UftpStatusCode::NO_ERR;
 }
 
@@ -53,20 +112,212 @@ UftpStatusCode UftpServer::HandleDeleteRequest(const std::string& filename) {
   }
 }
 
+//////////////////////////////////////////////////////////////////////////////
+UftpStatusCode UftpServer::HandleGetRequest(const UftpMessage& request,
+                                            UftpMessage& response) {
+  std::shared_ptr<UftpPayloadSource> file_source;
+  const UftpStatusCode status =
+      OpenFileSource(request.argument, file_source);
+  if (status != UftpStatusCode::NO_ERR) {
+    return status;
+  }
+
+  const uint64_t file_length = file_source->Length();
+  const uint64_t range_offset = request.header.range_offset;
+  if (range_offset > file_length) {
+    return UftpStatusCode::ERR_BAD_COMMAND;
+  }
+  // A range asked for to finish off a copy of another version of the file.
+  if (request.file_mtime_ns != 0 &&
+      request.file_mtime_ns != file_source->MtimeNs()) {
+    return UftpStatusCode::ERR_FILE_CHANGED;
+  }
+  uint64_t range_length = file_length - range_offset;
+  if (request.header.range_length != 0) {
+    range_length = std::min(range_length, request.header.range_length);
+  }
+
+  response.header.range_offset = range_offset;
+  response.header.file_length = file_length;
+  response.file_mtime_ns = file_source->MtimeNs();
+  if (range_length == file_length) {
+    response.message_source = file_source;
+  } else {
+    response.message_source = std::make_shared<UftpRangeSource>(
+        file_source, range_offset, range_length);
+  }
+  return status;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+void UftpServer::HandleDeltaRequest(const sockaddr_in& peer,
+                                    const UftpMessage& request) {
+  Completion completion;
+  completion.peer_key = PeerKey(peer);
+  completion.sequence_num = request.header.sequence_num;
+  const uint8_t opcode = request.opcode;
+  const std::string filename = request.argument;
+  const std::size_t stream_buffer_size = stream_buffer_size_;
+  auto completion_queue = completion_queue_;
+  // The request is gone by the time the work runs, it gets its own copy.
+  workers_->Submit([completion, opcode, filename, stream_buffer_size,
+                    completion_queue, message = request.message]() mutable {
+    switch (opcode) {
+      case OP_SIGNATURE:
+        completion.status =
+            UftpDelta::ComputeSignature(filename, completion.message);
+        break;
+      case OP_DIFF:
+        completion.status =
+            UftpDelta::ComputeDelta(filename, message, completion.message);
+        break;
+      default:
+        completion.status =
+            UftpDelta::ApplyDelta(filename, message, stream_buffer_size);
+        break;
+    }
+    completion_queue->Push(std::move(completion));
+  });
+}
+
+//////////////////////////////////////////////////////////////////////////////
+UftpStatusCode UftpServer::HandleCheckpointRequest(
+    const std::string& filename, std::vector<uint8_t>& message) {
+  UftpCheckpoint checkpoint;
+  if (!checkpoint.Load(filename)) {
+    return UftpStatusCode::ERR_FILE_NOT_FOUND;
+  }
+  checkpoint.Serialize(message);
+  return UftpStatusCode::NO_ERR;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+UftpStatusCode UftpServer::HandleStatRequest(const std::string& filename,
+                                             uint64_t& file_length) {
+  struct stat file_stat;
+  if (stat(filename.c_str(), &file_stat) != 0) {
+    return UftpUtils::ErrnoToStatusCode(errno);
+  }
+  if (!S_ISREG(file_stat.st_mode)) {
+    return UftpStatusCode::ERR_FILE_NOT_FOUND;
+  }
+  file_length = file_stat.st_size;
+  return UftpStatusCode::NO_ERR;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+UftpStatusCode UftpServer::OpenFileSource(
+    const std::string& filename, std::shared_ptr<UftpPayloadSource>& source) {
+  struct stat file_stat;
+  if (stat(filename.c_str(), &file_stat) != 0) {
+    return UftpUtils::ErrnoToStatusCode(errno);
+  }
+  if (!S_ISREG(file_stat.st_mode)) {
+    return UftpStatusCode::ERR_FILE_NOT_FOUND;
+  }
+
+  // Without a disk engine, prefer sending straight from the page cache and
+  // fall back to streaming through a buffer if the file can't be mapped.
+  if (!disk_engine_) {
+    const UftpStatusCode status = file_cache_.Open(filename, file_stat, source);
+    if (status != UftpStatusCode::ERR_UNKNOWN) {
+      return status;
+    }
+    auto file_source = std::make_shared<UftpFileSource>(stream_buffer_size_);
+    const UftpStatusCode read_status = file_source->Open(filename);
+    if (read_status == UftpStatusCode::NO_ERR) {
+      source = file_source;
+    }
+    return read_status;
+  }
+
+  // With one, only a cache hit is sent from its mapping. A miss is likely
+  // cold, and its page faults would stall the event loop, so it's read
+  // ahead through the engine. A file that fits is mapped for the next get,
+  // whose pages this one's reads will have brought in. Those go through the
+  // page cache for that, only bigger files use O_DIRECT.
+  if (file_cache_.Find(filename, file_stat, source)) {
+    return UftpStatusCode::NO_ERR;
+  }
+  const bool cacheable =
+      (uint64_t)file_stat.st_size <= file_cache_.MaxEntryLength();
+  if (cacheable) {
+    file_cache_.Add(filename, file_stat);
+  }
+  auto file_source = std::make_shared<UftpFileSource>(
+      stream_buffer_size_, disk_engine_, direct_io_ && !cacheable);
+  const UftpStatusCode status = file_source->Open(filename);
+  if (status == UftpStatusCode::NO_ERR) {
+    source = file_source;
+  }
+  return status;
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 void UftpServer::Open() {
   std::string ip_addr_any;
   sock_handle_ = UftpUtils::GetSocketHandle(ip_addr_any, server_port_);
+  sock_handle_.congestion = UftpCongestionControl::Create(congestion_control_);
+  if (!dir_index_) {
+    dir_index_ = std::make_shared<UftpDirIndex>();
+  }
+  if (fec_) {
+    sock_handle_.fec = std::make_shared<UftpFecController>();
+  }
+  if (!workers_) {
+    workers_ = std::make_shared<UftpWorkerPool>();
+  }
+  completion_queue_ = std::make_shared<CompletionQueue>();
+  if (codec_ != CODEC_NONE) {
+    // Compressed chunks wake the loop the same way finished requests do.
+    sock_handle_.workers = workers_;
+    sock_handle_.wake_fd = completion_queue_->event_fd;
+  }
 
   const int optval = 1;
   setsockopt(sock_handle_.sockfd, SOL_SOCKET, SO_REUSEADDR,
              (const void*)&optval, sizeof(optval));
+  if (reuse_port_) {
+    UftpUtils::CheckErr(
+        setsockopt(sock_handle_.sockfd, SOL_SOCKET, SO_REUSEPORT,
+                   (const void*)&optval, sizeof(optval)),
+        "Error setting SO_REUSEPORT");
+  }
 
   UftpUtils::CheckErr(
       bind(sock_handle_.sockfd, (struct sockaddr*)&sock_handle_.addr,
            sizeof(sock_handle_.addr)),
       "Error binding to port");
 
+  // Nothing may block the event loop, not even a full socket buffer. Chunks
+  // that don't fit wait in the batch until it drains, see ServiceSessions().
+  const int flags = fcntl(sock_handle_.sockfd, F_GETFL, 0);
+  UftpUtils::CheckErr(fcntl(sock_handle_.sockfd, F_SETFL, flags | O_NONBLOCK),
+                      "Error making socket non-blocking");
+
+  epoll_fd_ = UftpUtils::CheckErr(epoll_create1(0), "Error creating epoll");
+  epoll_event event;
+  event.events = EPOLLIN;
+  event.data.fd = sock_handle_.sockfd;
+  UftpUtils::CheckErr(
+      epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, sock_handle_.sockfd, &event),
+      "Error adding socket to epoll");
+
+  // So do requests finished on the worker pool.
+  event.data.fd = completion_queue_->event_fd;
+  UftpUtils::CheckErr(epoll_ctl(epoll_fd_, EPOLL_CTL_ADD,
+                                completion_queue_->event_fd, &event),
+                      "Error adding completion queue to epoll");
+
+  if (use_disk_engine_) {
+    // Disk completions wake the same loop as datagrams.
+    disk_engine_ = std::make_shared<UftpDiskEngine>();
+    event.data.fd = disk_engine_->EventFd();
+    UftpUtils::CheckErr(
+        epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, disk_engine_->EventFd(), &event),
+        "Error adding disk engine to epoll");
+  }
+
   DEBUG_LOG("Binded to port: ", server_port_);
   open_ = true;
 }
@@ -77,83 +328,388 @@ void UftpServer::Close() {
     return;
   }
 
+  sessions_.clear();
+  // Work still in flight finishes into a queue nobody reads.
+  completion_queue_.reset();
+  // After the sessions, whose sinks and sources may still be holding its
+  // buffers.
+  disk_engine_.reset();
+  DEBUG_LOG("File cache hits: ", file_cache_.Hits(), ", misses: ",
+            file_cache_.Misses(), ", evictions: ", file_cache_.Evictions(),
+            ", invalidations: ", file_cache_.Invalidations());
+  UftpUtils::CheckErr(close(epoll_fd_), "Error closing epoll");
   UftpUtils::CheckErr(close(sock_handle_.sockfd), "Error closing udp socket");
   DEBUG_LOG("Closed socket on port: ", server_port_);
   open_ = false;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-bool UftpServer::ReceiveCommand() {
-  UftpMessage request;
+void UftpServer::Run() {
+  std::array<epoll_event, 3> events;
+  while (open_) {
+    // Pacing needs finer timers than epoll_wait's milliseconds.
+    const auto wake_time = ServiceSessions();
+    const timespec wait = UftpUtils::TimeUntil(wake_time, UftpClock::now());
+    const int ret =
+        epoll_pwait2(epoll_fd_, events.data(), events.size(), &wait, nullptr);
+    if (ret < 0 && errno != EINTR) {
+      UftpUtils::CheckErr(ret, "epoll_wait failed");
+    }
+    for (int event = 0; event < ret; ++event) {
+      if (events[event].data.fd == sock_handle_.sockfd) {
+        ReceiveDatagrams();
+      } else if (events[event].data.fd == completion_queue_->event_fd) {
+        ReapCompletions();
+      } else {
+        disk_engine_->Reap();
+      }
+    }
+  }
+}
 
-  while (!UftpUtils::ReceiveMessage(sock_handle_, request)) {
-    std::cout << "Error receiving message" << std::endl;
+///////////////////////////////////////////////////////////////////////////////
+UftpSession* UftpServer::FindSession(const sockaddr_in& peer,
+                                     const uint8_t* datagram,
+                                     std::size_t length) {
+  const uint64_t key = PeerKey(peer);
+  auto session_it = sessions_.find(key);
+  if (session_it != sessions_.end()) {
+    return session_it->second.get();
   }
 
-  std::cout << "Received message" << std::endl;
-  HandleRequest(request);
-  while (!UftpUtils::SendMessage(sock_handle_, response_)) {
-    std::cout << "Error sending message";
-    return true;
+  // Only data can open a session, acks and noise from unknown peers are
+  // dropped.
+  uint32_t sync = 0;
+  if (length < sizeof(UftpChunkHeader)) return nullptr;
+  std::memcpy(&sync, datagram, sizeof(sync));
+  if (sync != UftpSyncWord || datagram[sizeof(sync)] != DATAGRAM_DATA) {
+    return nullptr;
   }
 
-  return (response_.command != "exit");
+  DEBUG_LOG("New session: ", inet_ntoa(peer.sin_addr), ":",
+            ntohs(peer.sin_port));
+  std::unique_ptr<UftpSession>& session = sessions_[key];
+  session.reset(
+      new UftpSession(sock_handle_, peer, select_sink_, handle_request_));
+  return session.get();
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-void UftpServer::HandleRequest(const UftpMessage& request) {
-  if (request.header.sequence_num == response_.header.sequence_num) {
-    // If the sequence numbers match then this is a re-transmit. Send the last
-    // response.
-    DEBUG_LOG("Sequence numbers match!", request.header.sequence_num);
-    return;
+void UftpServer::ReceiveDatagrams() {
+  UftpBatchIo& batch_io = *sock_handle_.batch_io;
+
+  int num_datagrams = 0;
+  for (int batch = 0; batch < kMaxReceiveBatches &&
+                      (num_datagrams = batch_io.Receive(MSG_DONTWAIT)) > 0;
+       ++batch) {
+    const auto now = UftpClock::now();
+    for (int index = 0; index < num_datagrams; ++index) {
+      UftpSession* session =
+          FindSession(batch_io.From(index), batch_io.Datagram(index),
+                      batch_io.Length(index));
+      if (session != nullptr) {
+        session->OnDatagram(batch_io.Datagram(index), batch_io.Length(index),
+                            now);
+      }
+    }
+    batch_io.FlushSends();
   }
+}
 
-  // These fields are usually the same in request/response_ pair.
-  response_ = UftpMessage();
-  response_.command = request.command;
-  response_.argument = request.argument;
-  response_.header.sequence_num = request.header.sequence_num;
+///////////////////////////////////////////////////////////////////////////////
+void UftpServer::ReapCompletions() {
+  uint64_t count = 0;
+  (void)read(completion_queue_->event_fd, &count, sizeof(count));
+
+  std::vector<Completion> completions;
+  {
+    std::lock_guard<std::mutex> lock(completion_queue_->mutex);
+    completions.swap(completion_queue_->completions);
+  }
+
+  const auto now = UftpClock::now();
+  for (Completion& completion : completions) {
+    auto session_it = sessions_.find(completion.peer_key);
+    if (session_it == sessions_.end()) {
+      continue;
+    }
+    session_it->second->CompleteResponse(completion.sequence_num,
+                                         completion.status,
+                                         completion.message, now);
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+UftpClock::time_point UftpServer::ServiceSessions() {
+  const auto now = UftpClock::now();
+  UftpBatchIo& batch_io = *sock_handle_.batch_io;
+  // What the socket pushed back on last time goes first, the sessions get
+  // nothing more in until it's out. Their timers keep until then.
+  batch_io.FlushSends();
+  if (batch_io.SendBlocked()) {
+    WatchWritable(true);
+    return now + std::chrono::microseconds(UftpSendRetryUs);
+  }
 
-  if (request.command == "exit") {
-    response_.header.status_code = UftpStatusCode::NO_ERR;
+  auto wake_time = now + std::chrono::milliseconds(UftpSessionTimeoutMs);
+  bool more_to_send = false;
+
+  for (auto session_it = sessions_.begin(); session_it != sessions_.end();) {
+    UftpSession& session = *session_it->second;
+    if (session.Expired(now)) {
+      UFTP_TRACE("Dropping session");
+      session_it = sessions_.erase(session_it);
+      continue;
+    }
+
+    // Round robin, each session gets a batch worth of chunks per turn.
+    more_to_send |= session.Service(now, UftpBatchSize);
+    wake_time = std::min(wake_time, session.NextTimeout());
+    ++session_it;
+  }
+  batch_io.FlushSends();
 
-  } else if (request.command == "ls") {
-    response_.header.status_code = HandleLsRequest(response_.message);
+  WatchWritable(batch_io.SendBlocked());
+  if (batch_io.SendBlocked()) {
+    return now + std::chrono::microseconds(UftpSendRetryUs);
+  }
+  return more_to_send ? now : wake_time;
+}
 
-  } else if (request.command == "put") {
-    response_.header.status_code =
-        UftpUtils::WriteFile(request.argument, request.message);
+///////////////////////////////////////////////////////////////////////////////
+void UftpServer::WatchWritable(bool watch) {
+  if (watch == watching_writable_) {
+    return;
+  }
+  epoll_event event;
+  event.events = watch ? (EPOLLIN | EPOLLOUT) : EPOLLIN;
+  event.data.fd = sock_handle_.sockfd;
+  UftpUtils::CheckErr(
+      epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, sock_handle_.sockfd, &event),
+      "Error watching socket for writes");
+  watching_writable_ = watch;
+}
 
-  } else if (request.command == "get") {
-    response_.header.status_code =
-        UftpUtils::ReadFile(request.argument, response_.message);
+///////////////////////////////////////////////////////////////////////////////
+bool UftpServer::HandleRequest(const sockaddr_in& peer,
+                               const UftpMessage& request,
+                               UftpMessage& response) {
+  UftpMetrics::Add(COUNTER_REQUESTS);
+  if (request.header.sequence_num == response.header.sequence_num) {
+    // If the sequence numbers match then this is a re-transmit. Send the last
+    // response.
+    UFTP_TRACE("Sequence numbers match: {}", request.header.sequence_num);
+    UftpMetrics::Add(COUNTER_DUPLICATE_REQUESTS);
+    return true;
+  }
 
-  } else if (request.command == "delete") {
-    response_.header.status_code = HandleDeleteRequest(request.argument);
+  // These fields are usually the same in request/response pair.
+  response.Reset();
+  response.command = request.command;
+  response.argument = request.argument;
+  response.opcode = request.opcode;
+  response.version = request.version;
+  response.header.sequence_num = request.header.sequence_num;
+  const uint8_t codecs = codec_ != CODEC_NONE ? 1 << codec_ : 0;
+  response.header.codecs = codecs;
+
+  switch (request.opcode) {
+    case OP_EXIT:
+      response.header.status_code = UftpStatusCode::NO_ERR;
+      break;
+
+    case OP_LS:
+      response.header.status_code =
+          HandleLsRequest(request, response.message);
+      break;
+
+    case OP_PUT:
+      response.header.status_code = request.message_sink->Status();
+      break;
+
+    case OP_GET:
+      response.header.status_code = HandleGetRequest(request, response);
+      response.codec = UftpPickCodec(codecs & request.header.codecs);
+      break;
+
+    case OP_STAT: {
+      uint64_t file_length = 0;
+      response.header.status_code =
+          HandleStatRequest(request.argument, file_length);
+      response.header.file_length = file_length;
+      break;
+    }
+
+    case OP_CHECKPOINT:
+      response.header.status_code =
+          HandleCheckpointRequest(request.argument, response.message);
+      break;
+
+    case OP_SIGNATURE:
+    case OP_DIFF:
+    case OP_PATCH:
+      HandleDeltaRequest(peer, request);
+      return false;
+
+    case OP_DELETE:
+      response.header.status_code = HandleDeleteRequest(request.argument);
+      break;
+
+    case OP_VERSION:
+      // Asked in v1, so that a v1 server can say it doesn't know the command.
+      response.header.status_code = UftpStatusCode::NO_ERR;
+      response.message.assign(1, UftpProtocolVersion);
+      break;
+
+    case OP_STATS: {
+      std::string text;
+      UftpMetrics::Format(text);
+      response.header.status_code = UftpStatusCode::NO_ERR;
+      response.message.assign(text.begin(), text.end());
+      break;
+    }
+
+    default:
+      response.header.status_code = UftpStatusCode::ERR_BAD_COMMAND;
+      break;
+  }
+  return true;
+}
 
-  } else {
-    response_.header.status_code = UftpStatusCode::ERR_BAD_COMMAND;
+///////////////////////////////////////////////////////////////////////////////
+static void PinToCore(std::thread& thread, unsigned core) {
+  cpu_set_t cpu_set;
+  CPU_ZERO(&cpu_set);
+  CPU_SET(core, &cpu_set);
+  const int ret =
+      pthread_setaffinity_np(thread.native_handle(), sizeof(cpu_set), &cpu_set);
+  if (ret != 0) {
+    DEBUG_LOG("Couldn't pin worker to core: ", core, ", error: ", ret);
   }
 }
 
+///////////////////////////////////////////////////////////////////////////////
+static void PrintUsage() {
+  std::cout << "uftp_server: missing argument\n\tUsage: uftp_server "
+               "<port_number> [--buffer-size <bytes>] [--workers <count>] "
+               "[--cc cubic|bbr] [--fec on|off] "
+               "[--compress deflate|none] [--cache-size <bytes>] "
+               "[--disk-engine uring|sync] [--direct-io on|off] "
+               "[--metrics-file <path>] [--metrics-interval <ms>] "
+               "[--trace-file <path>]\n";
+  std::exit(1);
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 int main(int argc, char** argv) {
-  if (argc != 2) {
-    std::cout << "uftp_server: missing argument\n\tUsage: uftp_server "
-                 "<port_number>\n";
-    std::exit(1);
+  if (argc < 2 || argc % 2 != 0) {
+    PrintUsage();
   }
 
   const uint16_t port_number = atoi(argv[1]);
+  std::size_t stream_buffer_size = UftpStreamBufferSize;
+  unsigned num_workers = 1;
+  std::string congestion_control = UftpDefaultCongestionControl;
+  bool fec = false;
+  UftpCodec codec = CODEC_NONE;
+  uint64_t file_cache_size = UftpDefaultFileCacheSize;
+  bool disk_engine = true;
+  bool direct_io = false;
+  std::string metrics_file;
+  unsigned metrics_interval_ms = UftpDefaultMetricsIntervalMs;
+  std::string trace_file = UftpTrace::DefaultFilename("uftp_server");
+  for (int arg = 2; arg < argc; arg += 2) {
+    const std::string option = argv[arg];
+    if (option == "--buffer-size") {
+      stream_buffer_size = std::strtoull(argv[arg + 1], nullptr, 10);
+    } else if (option == "--workers") {
+      num_workers = std::max(1ul, std::strtoul(argv[arg + 1], nullptr, 10));
+    } else if (option == "--cc" &&
+               UftpCongestionControl::Create(argv[arg + 1])) {
+      congestion_control = argv[arg + 1];
+    } else if (option == "--fec") {
+      fec = std::string(argv[arg + 1]) == "on";
+    } else if (option == "--compress") {
+      if (!UftpCodecFromName(argv[arg + 1], codec)) {
+        PrintUsage();
+      }
+    } else if (option == "--cache-size") {
+      file_cache_size = std::strtoull(argv[arg + 1], nullptr, 10);
+    } else if (option == "--disk-engine") {
+      disk_engine = std::string(argv[arg + 1]) == "uring";
+    } else if (option == "--direct-io") {
+      direct_io = std::string(argv[arg + 1]) == "on";
+    } else if (option == "--metrics-file") {
+      metrics_file = argv[arg + 1];
+    } else if (option == "--metrics-interval") {
+      metrics_interval_ms =
+          std::max(1ul, std::strtoul(argv[arg + 1], nullptr, 10));
+    } else if (option == "--trace-file") {
+      trace_file = argv[arg + 1];
+    } else {
+      PrintUsage();
+    }
+  }
+  // kill -USR1 dumps the last events of every thread, decode the dump with
+  // tools/uftp_trace_decode.
+  UftpTrace::InstallDumpHandlers(trace_file);
+
+  // Every worker gets its own socket on the port, with its own sessions and
+  // buffers. The kernel hashes each peer to one of the sockets, so a client
+  // always lands on the same worker and workers share nothing they write.
+  // All sockets are bound before any worker starts so the hash doesn't
+  // change under the first clients.
+  std::vector<std::unique_ptr<UftpServer>> servers;
+  const auto dir_index = std::make_shared<UftpDirIndex>();
+  const auto workers = std::make_shared<UftpWorkerPool>();
+  for (unsigned worker = 0; worker < num_workers; ++worker) {
+    servers.emplace_back(new UftpServer(port_number));
+    servers.back()->SetStreamBufferSize(stream_buffer_size);
+    servers.back()->SetReusePort(num_workers > 1);
+    servers.back()->SetCongestionControl(congestion_control);
+    servers.back()->SetFec(fec);
+    servers.back()->SetCompression(codec);
+    servers.back()->SetFileCacheSize(file_cache_size);
+    servers.back()->SetDiskEngine(disk_engine);
+    servers.back()->SetDirectIo(direct_io);
+    servers.back()->SetDirIndex(dir_index);
+    servers.back()->SetWorkerPool(workers);
+    servers.back()->Open();
+  }
 
-  UftpServer uftp_server(port_number);
-  uftp_server.Open();
+  // For node_exporter's textfile collector and the like. Runs for as long as
+  // the server does.
+  if (!metrics_file.empty()) {
+    std::thread metrics_writer([metrics_file, metrics_interval_ms] {
+      while (true) {
+        if (!UftpMetrics::WriteFile(metrics_file)) {
+          DEBUG_LOG("Couldn't write metrics to: ", metrics_file);
+        }
+        std::this_thread::sleep_for(
+            std::chrono::milliseconds(metrics_interval_ms));
+      }
+    });
+    metrics_writer.detach();
+  }
 
-  while (uftp_server.ReceiveCommand()) {
-    //    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  if (num_workers == 1) {
+    servers.front()->Run();
+  } else {
+    const unsigned num_cores =
+        std::max(1u, std::thread::hardware_concurrency());
+    std::vector<std::thread> worker_threads;
+    for (unsigned worker = 0; worker < num_workers; ++worker) {
+      UftpServer* server = servers[worker].get();
+      worker_threads.emplace_back([server] { server->Run(); });
+      PinToCore(worker_threads.back(), worker % num_cores);
+    }
+    for (auto& worker_thread : worker_threads) {
+      worker_thread.join();
+    }
   }
 
-  uftp_server.Close();
+  for (auto& server : servers) {
+    server->Close();
+  }
   std::exit(0);
 }
@@ -8,10 +8,20 @@
 #include <iostream>
 #include <limits>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 #include <uftp_defs.h>
+#include <uftp_disk_engine.h>
+#include <uftp_payload.h>
+#include <uftp_worker_pool.h>
+
+#include "uftp_dir_index.h"
+#include "uftp_file_cache.h"
+#include "uftp_session.h"
 
 class UftpServer {
  public:
@@ -21,17 +31,139 @@ class UftpServer {
   void Open();
   void Close();
 
-  bool ReceiveCommand();
+  /// Size of the buffer used to stream each file through, see
+  /// UftpStreamBufferSize.
+  void SetStreamBufferSize(std::size_t size) { stream_buffer_size_ = size; }
+
+  /// Lets several servers, one per worker thread, bind the same port. Must be
+  /// set before Open().
+  void SetReusePort(bool reuse_port) { reuse_port_ = reuse_port; }
+
+  /// Congestion controller for every client, see
+  /// UftpCongestionControl::Create(). Must be set before Open().
+  void SetCongestionControl(const std::string& name) {
+    congestion_control_ = name;
+  }
+
+  /// Sends parity with every response so lost chunks can be rebuilt without
+  /// a retransmit, see UftpFecController. Must be set before Open().
+  void SetFec(bool fec) { fec_ = fec; }
+
+  /// Offers codec to clients for compressing file payloads both ways, see
+  /// UftpChunkCompressor. Must be set before Open().
+  void SetCompression(UftpCodec codec) { codec_ = codec; }
+
+  /// Index "ls" is served from. Workers share one. Must be set before Open().
+  void SetDirIndex(std::shared_ptr<UftpDirIndex> dir_index) {
+    dir_index_ = std::move(dir_index);
+  }
+
+  /// Runs the requests too slow for the event loop, signatures and deltas,
+  /// and compresses responses. Workers share one. Must be set before Open().
+  void SetWorkerPool(std::shared_ptr<UftpWorkerPool> workers) {
+    workers_ = std::move(workers);
+  }
+
+  /// Total length of the files kept mapped for gets, see UftpFileCache.
+  void SetFileCacheSize(uint64_t size) { file_cache_.SetCapacity(size); }
+
+  /// Puts, and gets of files too big to cache, go through io_uring, see
+  /// UftpDiskEngine. Otherwise they're plain pwrites and mapped reads. Must
+  /// be set before Open().
+  void SetDiskEngine(bool disk_engine) { use_disk_engine_ = disk_engine; }
+
+  /// Reads files for gets with O_DIRECT when going through the disk engine,
+  /// so big files don't churn the page cache. Must be set before Open().
+  void SetDirectIo(bool direct_io) { direct_io_ = direct_io; }
+
+  ///
+  /// \brief Run serves every client from one epoll loop until the server is
+  /// closed. Each client gets its own UftpSession, so a slow transfer never
+  /// holds up anyone else's.
+  ///
+  void Run();
 
  private:
-  void HandleRequest(const UftpMessage& request);
-  UftpStatusCode HandleLsRequest(std::vector<uint8_t>& message);
+  /// The outcome of a request handled on the worker pool.
+  struct Completion {
+    uint64_t peer_key;
+    uint32_t sequence_num;
+    UftpStatusCode status;
+    std::vector<uint8_t> message;
+  };
+
+  /// Where the worker pool leaves finished requests. Writing event_fd wakes
+  /// the event loop to send them, compression writes it too once a chunk a
+  /// session waits for is ready. Shared with the work in flight, so it
+  /// outlives the server if it has to.
+  struct CompletionQueue {
+    CompletionQueue();
+    ~CompletionQueue();
+    void Push(Completion completion);
+
+    int event_fd = -1;
+    std::mutex mutex;
+    std::vector<Completion> completions;
+  };
+
+  void ReceiveDatagrams();
+  /// Hands the requests the worker pool has finished to their sessions.
+  void ReapCompletions();
+  ///
+  /// \brief ServiceSessions moves every session's transfers along and drops
+  /// the expired ones.
+  /// \return when the loop next has something to do.
+  ///
+  UftpClock::time_point ServiceSessions();
+  /// Has epoll wake the loop when the socket is writable again, or stop.
+  void WatchWritable(bool watch);
+  UftpSession* FindSession(const sockaddr_in& peer, const uint8_t* datagram,
+                           std::size_t length);
+
+  bool HandleRequest(const sockaddr_in& peer, const UftpMessage& request,
+                     UftpMessage& response);
+  ///
+  /// \brief HandleDeltaRequest queues a signature, diff or patch on the
+  /// worker pool, they read whole files.
+  ///
+  void HandleDeltaRequest(const sockaddr_in& peer,
+                          const UftpMessage& request);
+  UftpStatusCode HandleLsRequest(const UftpMessage& request,
+                                 std::vector<uint8_t>& message);
   UftpStatusCode HandleDeleteRequest(const std::string& filename);
+  UftpStatusCode HandleGetRequest(const UftpMessage& request,
+                                  UftpMessage& response);
+  UftpStatusCode HandleStatRequest(const std::string& filename,
+                                   uint64_t& file_length);
+  UftpStatusCode HandleCheckpointRequest(const std::string& filename,
+                                         std::vector<uint8_t>& message);
+  UftpStatusCode OpenFileSource(const std::string& filename,
+                                std::shared_ptr<UftpPayloadSource>& source);
 
   bool open_ = false;
+  bool reuse_port_ = false;
+
+  std::size_t stream_buffer_size_ = UftpStreamBufferSize;
+  std::string congestion_control_ = UftpDefaultCongestionControl;
+  bool fec_ = false;
+  UftpCodec codec_ = CODEC_NONE;
+  std::shared_ptr<UftpDirIndex> dir_index_;
+  UftpFileCache file_cache_;
+  bool use_disk_engine_ = true;
+  bool direct_io_ = false;
+  std::shared_ptr<UftpDiskEngine> disk_engine_;
+  std::shared_ptr<UftpWorkerPool> workers_;
+  std::shared_ptr<CompletionQueue> completion_queue_;
+  UftpSinkSelector select_sink_;
+  UftpRequestHandler handle_request_;
 
-  UftpMessage response_;
+  // Keyed by the peer's address and port, see PeerKey().
+  std::unordered_map<uint64_t, std::unique_ptr<UftpSession>> sessions_;
 
   uint16_t server_port_ = 0;
+  int epoll_fd_ = -1;
+  // Whether the socket is in epoll for EPOLLOUT too, while sends are pushed
+  // back.
+  bool watching_writable_ = false;
   UftpSocketHandle sock_handle_;
 };
@@ -0,0 +1,284 @@
+#include "uftp_session.h"
+
+#include <arpa/inet.h>
+#include <algorithm>
+#include <chrono>
+#include <limits>
+#include <random>
+
+#include <uftp_batch_io.h>
+#include <uftp_congestion.h>
+#include <uftp_fec.h>
+#include <uftp_rtt.h>
+#include <uftp_trace.h>
+#include <uftp_defs.h>
+#include <uftp_utils.h>
+
+///////////////////////////////////////////////////////////////////////////////
+UftpSession::UftpSession(const UftpSocketHandle& server_handle,
+                         const sockaddr_in& peer,
+                         const UftpSinkSelector& select_sink,
+                         const UftpRequestHandler& handle_request)
+    : sock_handle_(server_handle),
+      select_sink_(select_sink),
+      handle_request_(handle_request),
+      last_activity_(UftpClock::now()) {
+  sock_handle_.addr = peer;
+  sock_handle_.has_last_rx = false;
+  // Every path gets its own congestion state, of the server's flavour.
+  sock_handle_.congestion =
+      UftpCongestionControl::Create(server_handle.congestion->Name());
+  sock_handle_.rtt = std::make_shared<UftpRttEstimator>();
+  // Loss is a property of the path too.
+  if (server_handle.fec) {
+    sock_handle_.fec = std::make_shared<UftpFecController>();
+  }
+
+  // Each client gets its own transfer ids, started somewhere random like
+  // GetSocketHandle does.
+  std::random_device random_device;
+  sock_handle_.next_transfer_id = random_device();
+
+  response_.header.sequence_num = std::numeric_limits<uint32_t>::max();
+
+  metrics_.peer = std::string(inet_ntoa(peer.sin_addr)) + ":" +
+                  std::to_string(ntohs(peer.sin_port));
+  UftpMetrics::RegisterSession(&metrics_);
+  UftpMetrics::Add(COUNTER_SESSIONS_OPENED);
+  UftpMetrics::AddGauge(GAUGE_SESSIONS, 1);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+UftpSession::~UftpSession() {
+  UftpMetrics::UnregisterSession(&metrics_);
+  UftpMetrics::AddGauge(GAUGE_SESSIONS, -1);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+static uint64_t Microseconds(UftpClock::duration duration) {
+  return std::chrono::duration_cast<std::chrono::microseconds>(duration)
+      .count();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+static void ObserveGoodput(uint64_t num_bytes, UftpClock::duration duration) {
+  const uint64_t microseconds = Microseconds(duration);
+  if (num_bytes >= UftpMetrics::kMinGoodputBytes && microseconds > 0) {
+    UftpMetrics::Observe(HISTOGRAM_GOODPUT,
+                         num_bytes * 1000000 / microseconds);
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void UftpSession::OnDatagram(const uint8_t* datagram, std::size_t length,
+                             UftpClock::time_point now) {
+  last_activity_ = now;
+
+  if (!UftpUtils::HandleDatagram(sock_handle_, datagram, length,
+                                 send_window_.get(), recv_window_.get())) {
+    // Data for a new transfer is the client's next request. If we were still
+    // sending, the client has given up on that response.
+    StartReceive(now);
+    UftpUtils::HandleDatagram(sock_handle_, datagram, length, nullptr,
+                              recv_window_.get());
+  }
+
+  if (recv_window_) {
+    if (!recv_window_->Started() || recv_window_->Failed()) {
+      recv_window_.reset();
+      request_.message_sink.reset();
+    } else if (recv_window_->Done()) {
+      FinishReceive(now);
+    } else if (recv_window_->AckNow()) {
+      UftpUtils::QueueAck(sock_handle_, *recv_window_);
+    }
+  }
+
+  if (send_window_ && send_window_->Done()) {
+    UFTP_TRACE("Sent transfer: {}, chunks: {}, retransmits: {}, cwnd: {}, "
+               "pacing rate: {}, loss rate: {}",
+               send_window_->TransferId(), send_window_->NumChunks(),
+               send_window_->RetransmitCount(),
+               send_window_->CongestionWindow(), send_window_->PacingRate(),
+               send_window_->LossRate());
+    RecordSent(now);
+    FinishSend();
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bool UftpSession::Service(UftpClock::time_point now, std::size_t max_chunks) {
+  const auto idle_timeout = std::chrono::milliseconds(UftpIdleTimeoutMs);
+
+  if (recv_window_) {
+    if (now - last_activity_ >= idle_timeout) {
+      UFTP_TRACE("Time out receiving transfer: {}", recv_window_->TransferId());
+      UftpMetrics::Add(COUNTER_TRANSFER_TIMEOUTS);
+      recv_window_.reset();
+      request_.message_sink.reset();
+    } else if (recv_window_->AckPending()) {
+      UftpUtils::QueueAck(sock_handle_, *recv_window_);
+    }
+  }
+
+  if (draining_ && request_.message_sink->Drain()) {
+    draining_ = false;
+    HandleReceived(now);
+  }
+
+  if (!send_window_) {
+    return false;
+  }
+
+  if (now - send_window_->LastProgress() >= idle_timeout) {
+    UFTP_TRACE("Time out sending transfer: {}", send_window_->TransferId());
+    UftpMetrics::Add(COUNTER_TRANSFER_TIMEOUTS);
+    FinishSend();
+    return false;
+  }
+
+  const int num_queued =
+      UftpUtils::QueueChunks(sock_handle_, *send_window_, max_chunks);
+  if (num_queued < 0) {
+    UFTP_TRACE("Couldn't send transfer: {}", send_window_->TransferId());
+    FinishSend();
+    // Its source is broken, e.g. the file was truncated under it. Forget the
+    // response so the client's retry is handled afresh rather than resent.
+    response_.Reset();
+    response_.header.sequence_num = std::numeric_limits<uint32_t>::max();
+    return false;
+  }
+  return (std::size_t)num_queued == max_chunks;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+UftpClock::time_point UftpSession::NextTimeout() const {
+  const auto idle_timeout = std::chrono::milliseconds(UftpIdleTimeoutMs);
+
+  if (send_window_) {
+    return std::min(send_window_->NextTimeout(),
+                    send_window_->LastProgress() + idle_timeout);
+  } else if (recv_window_) {
+    return last_activity_ + idle_timeout;
+  }
+  return last_activity_ + std::chrono::milliseconds(UftpSessionTimeoutMs);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bool UftpSession::Expired(UftpClock::time_point now) const {
+  if (closed_) {
+    return true;
+  }
+  return !send_window_ && !recv_window_ && !draining_ && !response_pending_ &&
+         now - last_activity_ >=
+             std::chrono::milliseconds(UftpSessionTimeoutMs);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void UftpSession::StartReceive(UftpClock::time_point now) {
+  send_window_.reset();
+  draining_ = false;
+  request_start_ = now;
+  request_.Reset();
+  recv_window_.reset(new UftpReceiveWindow(request_, select_sink_));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void UftpSession::FinishReceive(UftpClock::time_point now) {
+  UftpUtils::CompleteReceive(sock_handle_, *recv_window_);
+  recv_window_.reset();
+
+  const uint64_t num_bytes = request_.header.message_length;
+  UftpMetrics::Add(COUNTER_TRANSFERS_RECEIVED);
+  UftpMetrics::Add(COUNTER_BYTES_RECEIVED, num_bytes);
+  ObserveGoodput(num_bytes, now - request_start_);
+  UftpSessionMetrics::Add(metrics_.requests, 1);
+  UftpSessionMetrics::Add(metrics_.bytes_received, num_bytes);
+
+  // The disk engine's completions bring us back to Service() to finish up.
+  draining_ = !request_.message_sink->Drain();
+  if (!draining_) {
+    HandleReceived(now);
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void UftpSession::HandleReceived(UftpClock::time_point now) {
+  request_.message_sink->Finish();
+  if (response_pending_ &&
+      request_.header.sequence_num == response_.header.sequence_num) {
+    // The client gave up waiting, it gets the response once it's ready.
+    UFTP_TRACE("Response still pending, sequence: {}",
+               request_.header.sequence_num);
+    request_.message_sink.reset();
+    return;
+  }
+  response_pending_ = !handle_request_(sock_handle_.addr, request_, response_);
+  request_.message_sink.reset();
+
+  if (!response_pending_) {
+    StartSend(now);
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void UftpSession::CompleteResponse(uint32_t sequence_num,
+                                   UftpStatusCode status,
+                                   std::vector<uint8_t>& message,
+                                   UftpClock::time_point now) {
+  if (!response_pending_ || response_.header.sequence_num != sequence_num) {
+    UFTP_TRACE("Dropping stale response, sequence: {}", sequence_num);
+    return;
+  }
+  response_pending_ = false;
+  response_.header.status_code = status;
+  response_.message.swap(message);
+  StartSend(now);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void UftpSession::StartSend(UftpClock::time_point now) {
+  response_start_ = now;
+  UftpUtils::BuildMeta(response_, response_meta_);
+  UftpPayloadSource& message_source =
+      response_.message_source ? *response_.message_source
+                               : response_buffer_;
+  send_window_.reset(new UftpSendWindow(sock_handle_.next_transfer_id++,
+                                        response_meta_.data(),
+                                        response_meta_.size(),
+                                        message_source,
+                                        *sock_handle_.congestion,
+                                        *sock_handle_.rtt,
+                                        sock_handle_.fec.get()));
+  if (response_.codec != CODEC_NONE && sock_handle_.workers) {
+    send_window_->EnableCompression(response_.codec, *sock_handle_.workers,
+                                    sock_handle_.wake_fd);
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void UftpSession::RecordSent(UftpClock::time_point now) {
+  const uint64_t num_bytes = response_.header.message_length;
+  UftpMetrics::Add(COUNTER_TRANSFERS_SENT);
+  UftpMetrics::Add(COUNTER_BYTES_SENT, num_bytes);
+  UftpMetrics::Add(COUNTER_CHUNKS_SENT, send_window_->NumChunks());
+  ObserveGoodput(num_bytes, now - response_start_);
+  UftpMetrics::ObserveLatency(response_.opcode,
+                              Microseconds(now - request_start_));
+
+  UftpSessionMetrics::Add(metrics_.bytes_sent, num_bytes);
+  UftpSessionMetrics::Add(metrics_.retransmits,
+                          send_window_->RetransmitCount());
+  UftpSessionMetrics::Add(metrics_.retransmit_timeouts,
+                          send_window_->TimeoutCount());
+  metrics_.srtt_us.store(Microseconds(sock_handle_.rtt->Srtt()),
+                         std::memory_order_relaxed);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void UftpSession::FinishSend() {
+  send_window_.reset();
+  if (response_.opcode == OP_EXIT) {
+    closed_ = true;
+  }
+}
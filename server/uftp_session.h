@@ -0,0 +1,98 @@
+#pragma once
+
+#include <netinet/in.h>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include <uftp_buffer_pool.h>
+#include <uftp_defs.h>
+#include <uftp_metrics.h>
+#include <uftp_payload.h>
+#include <uftp_window.h>
+
+///
+/// Fills in the response to a whole request from peer. If the request repeats
+/// the sequence number of the response already there, the response is left
+/// alone and sent again. Returns false if the response will be finished
+/// later, off the event loop, and handed to UftpSession::CompleteResponse().
+///
+using UftpRequestHandler =
+    std::function<bool(const sockaddr_in& peer, const UftpMessage& request,
+                       UftpMessage& response)>;
+
+///////////////////////////////////////////////////////////////////////////////
+/// Everything the server keeps about one client: its own transfer ids, the
+/// transfer in progress in either direction and the last response. Sessions
+/// never block, the server's event loop feeds them datagrams and calls
+/// Service() to keep their transfers moving. Each session shows up in
+/// UftpMetrics while it lives.
+class UftpSession {
+ public:
+  UftpSession(const UftpSocketHandle& server_handle, const sockaddr_in& peer,
+              const UftpSinkSelector& select_sink,
+              const UftpRequestHandler& handle_request);
+  ~UftpSession();
+
+  void OnDatagram(const uint8_t* datagram, std::size_t length,
+                  UftpClock::time_point now);
+
+  ///
+  /// \brief Service queues pending acks and up to max_chunks chunks of the
+  /// response, and gives up on transfers that stopped making progress.
+  /// \return true if more chunks could be sent right away.
+  ///
+  bool Service(UftpClock::time_point now, std::size_t max_chunks);
+
+  ///
+  /// \brief CompleteResponse sends the response the request handler left
+  /// pending, unless the client has moved on to another request since.
+  /// \param message swapped into the response.
+  ///
+  void CompleteResponse(uint32_t sequence_num, UftpStatusCode status,
+                        std::vector<uint8_t>& message,
+                        UftpClock::time_point now);
+
+  /// When Service() next has something to do.
+  UftpClock::time_point NextTimeout() const;
+
+  /// True once the session can be dropped: the client said exit or has been
+  /// quiet for UftpSessionTimeoutMs with no response pending.
+  bool Expired(UftpClock::time_point now) const;
+
+ private:
+  void StartReceive(UftpClock::time_point now);
+  void FinishReceive(UftpClock::time_point now);
+  /// Hands the request over once its sink has drained.
+  void HandleReceived(UftpClock::time_point now);
+  void StartSend(UftpClock::time_point now);
+  /// Counts a response that went all the way.
+  void RecordSent(UftpClock::time_point now);
+  void FinishSend();
+
+  UftpSocketHandle sock_handle_;
+  const UftpSinkSelector& select_sink_;
+  const UftpRequestHandler& handle_request_;
+
+  UftpMessage request_;
+  std::unique_ptr<UftpReceiveWindow> recv_window_;
+
+  UftpMessage response_;
+  UftpPooledBuffer response_meta_;
+  UftpBufferSource response_buffer_{response_.message};
+  std::unique_ptr<UftpSendWindow> send_window_;
+
+  UftpClock::time_point last_activity_;
+  bool closed_ = false;
+  // The request is in, its sink is still writing it out.
+  bool draining_ = false;
+  // The request handler is still working on response_.
+  bool response_pending_ = false;
+
+  // When the request being handled started arriving and its response
+  // started going out.
+  UftpClock::time_point request_start_;
+  UftpClock::time_point response_start_;
+  UftpSessionMetrics metrics_;
+};
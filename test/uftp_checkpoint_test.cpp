@@ -0,0 +1,247 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include <uftp_checkpoint.h>
+
+namespace {
+
+using Ranges = std::vector<UftpCheckpoint::Range>;
+
+///////////////////////////////////////////////////////////////////////////////
+void PutU64(std::vector<uint8_t>& buffer, uint64_t value) {
+  for (int byte = 0; byte < 8; ++byte) {
+    buffer.push_back(value >> (8 * byte));
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void PutU32(std::vector<uint8_t>& buffer, uint32_t value) {
+  for (int byte = 0; byte < 4; ++byte) {
+    buffer.push_back(value >> (8 * byte));
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// A sidecar in the first format, which had no source mtime.
+std::vector<uint8_t> V1Sidecar(uint64_t file_length, const Ranges& ranges) {
+  std::vector<uint8_t> buffer = {'U', 'F', 'T', 'P', 'C', 'K', 'P', '1'};
+  PutU64(buffer, file_length);
+  PutU32(buffer, ranges.size());
+  for (const auto& range : ranges) {
+    PutU64(buffer, range.first);
+    PutU64(buffer, range.second);
+  }
+  return buffer;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+UftpCheckpoint MakeCheckpoint(uint64_t file_length, const Ranges& ranges) {
+  UftpCheckpoint checkpoint;
+  checkpoint.Reset(file_length, 1234);
+  for (const auto& range : ranges) {
+    checkpoint.AddRange(range.first, range.second);
+  }
+  return checkpoint;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// A directory of its own for each test that touches the disk.
+class CheckpointFileTest : public testing::Test {
+ protected:
+  void SetUp() override {
+    char dir[] = "/tmp/uftp_checkpoint_test.XXXXXX";
+    ASSERT_NE(mkdtemp(dir), nullptr);
+    dir_ = dir;
+    filename_ = dir_ + "/file.bin";
+  }
+  void TearDown() override {
+    UftpCheckpoint::Remove(filename_);
+    rmdir(dir_.c_str());
+  }
+
+  std::string dir_;
+  std::string filename_;
+};
+
+}  // namespace
+
+///////////////////////////////////////////////////////////////////////////////
+TEST(CheckpointTest, EmptyIsMissingEverything) {
+  const UftpCheckpoint checkpoint = MakeCheckpoint(100, {});
+  EXPECT_TRUE(checkpoint.Empty());
+  EXPECT_FALSE(checkpoint.Complete());
+  EXPECT_EQ(checkpoint.MissingRanges(), (Ranges{{0, 100}}));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+TEST(CheckpointTest, EmptyFileIsComplete) {
+  const UftpCheckpoint checkpoint = MakeCheckpoint(0, {});
+  EXPECT_TRUE(checkpoint.Complete());
+  EXPECT_TRUE(checkpoint.MissingRanges().empty());
+}
+
+///////////////////////////////////////////////////////////////////////////////
+TEST(CheckpointTest, IgnoresEmptyRanges) {
+  const UftpCheckpoint checkpoint = MakeCheckpoint(100, {{50, 0}});
+  EXPECT_TRUE(checkpoint.Empty());
+  EXPECT_EQ(checkpoint.MissingRanges(), (Ranges{{0, 100}}));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+TEST(CheckpointTest, MissingRangesAreTheGaps) {
+  const UftpCheckpoint checkpoint =
+      MakeCheckpoint(100, {{10, 10}, {40, 20}, {90, 10}});
+  EXPECT_EQ(checkpoint.MissingRanges(),
+            (Ranges{{0, 10}, {20, 20}, {60, 30}}));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+TEST(CheckpointTest, MergesAdjacentRanges) {
+  const UftpCheckpoint checkpoint =
+      MakeCheckpoint(100, {{0, 10}, {10, 10}, {30, 10}, {20, 10}});
+  EXPECT_EQ(checkpoint.MissingRanges(), (Ranges{{40, 60}}));
+
+  // Down to one range.
+  std::vector<uint8_t> merged, expected;
+  checkpoint.Serialize(merged);
+  MakeCheckpoint(100, {{0, 40}}).Serialize(expected);
+  EXPECT_EQ(merged, expected);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+TEST(CheckpointTest, MergesOverlappingRanges) {
+  const UftpCheckpoint checkpoint =
+      MakeCheckpoint(100, {{0, 30}, {20, 30}, {45, 10}});
+  EXPECT_EQ(checkpoint.MissingRanges(), (Ranges{{55, 45}}));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+TEST(CheckpointTest, ContainedRangeChangesNothing) {
+  const UftpCheckpoint checkpoint = MakeCheckpoint(100, {{10, 50}, {20, 5}});
+  EXPECT_EQ(checkpoint.MissingRanges(), (Ranges{{0, 10}, {60, 40}}));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+TEST(CheckpointTest, RangeSwallowsSeveral) {
+  const UftpCheckpoint checkpoint =
+      MakeCheckpoint(100, {{10, 5}, {30, 5}, {50, 5}, {70, 5}, {12, 50}});
+  EXPECT_EQ(checkpoint.MissingRanges(),
+            (Ranges{{0, 10}, {62, 8}, {75, 25}}));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+TEST(CheckpointTest, OutOfOrderRangesComplete) {
+  const UftpCheckpoint checkpoint =
+      MakeCheckpoint(100, {{75, 25}, {0, 25}, {50, 25}, {25, 25}});
+  EXPECT_TRUE(checkpoint.Complete());
+  EXPECT_TRUE(checkpoint.MissingRanges().empty());
+}
+
+///////////////////////////////////////////////////////////////////////////////
+TEST(CheckpointTest, ResetForgetsRanges) {
+  UftpCheckpoint checkpoint = MakeCheckpoint(100, {{0, 100}});
+  checkpoint.Reset(50, 99);
+  EXPECT_TRUE(checkpoint.Empty());
+  EXPECT_EQ(checkpoint.FileLength(), 50u);
+  EXPECT_EQ(checkpoint.SourceMtimeNs(), 99u);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+TEST(CheckpointTest, RoundTrips) {
+  const UftpCheckpoint checkpoint =
+      MakeCheckpoint(1ull << 40, {{0, 4096}, {1ull << 30, 1ull << 20}});
+  std::vector<uint8_t> buffer;
+  checkpoint.Serialize(buffer);
+
+  UftpCheckpoint parsed;
+  ASSERT_TRUE(parsed.Deserialize(buffer));
+  EXPECT_EQ(parsed.FileLength(), 1ull << 40);
+  EXPECT_EQ(parsed.SourceMtimeNs(), 1234u);
+  EXPECT_EQ(parsed.MissingRanges(), checkpoint.MissingRanges());
+}
+
+///////////////////////////////////////////////////////////////////////////////
+TEST(CheckpointTest, ReadsFirstFormat) {
+  UftpCheckpoint parsed;
+  ASSERT_TRUE(parsed.Deserialize(V1Sidecar(100, {{0, 10}, {50, 50}})));
+  EXPECT_EQ(parsed.FileLength(), 100u);
+  EXPECT_EQ(parsed.SourceMtimeNs(), 0u);
+  EXPECT_EQ(parsed.MissingRanges(), (Ranges{{10, 40}}));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+TEST(CheckpointTest, MergesRangesWhenReading) {
+  UftpCheckpoint parsed;
+  ASSERT_TRUE(parsed.Deserialize(
+      V1Sidecar(100, {{50, 50}, {0, 30}, {20, 30}})));
+  EXPECT_TRUE(parsed.Complete());
+}
+
+///////////////////////////////////////////////////////////////////////////////
+TEST(CheckpointTest, RejectsCorruptSidecars) {
+  std::vector<uint8_t> good;
+  MakeCheckpoint(100, {{0, 10}, {50, 10}}).Serialize(good);
+  UftpCheckpoint parsed;
+
+  EXPECT_FALSE(parsed.Deserialize({}));
+  for (std::size_t length = 0; length < good.size(); ++length) {
+    SCOPED_TRACE(length);
+    EXPECT_FALSE(parsed.Deserialize(
+        std::vector<uint8_t>(good.begin(), good.begin() + length)));
+  }
+
+  std::vector<uint8_t> trailing = good;
+  trailing.push_back(0);
+  EXPECT_FALSE(parsed.Deserialize(trailing));
+
+  std::vector<uint8_t> bad_magic = good;
+  bad_magic[7] = '9';
+  EXPECT_FALSE(parsed.Deserialize(bad_magic));
+
+  // More ranges claimed than are there.
+  std::vector<uint8_t> num_ranges = V1Sidecar(100, {{0, 10}});
+  num_ranges[16] = 0xff;
+  EXPECT_FALSE(parsed.Deserialize(num_ranges));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+TEST(CheckpointTest, RejectsRangesPastTheEnd) {
+  UftpCheckpoint parsed;
+  EXPECT_FALSE(parsed.Deserialize(V1Sidecar(100, {{90, 11}})));
+  EXPECT_FALSE(parsed.Deserialize(V1Sidecar(100, {{101, 0}})));
+  // offset + length wraps around.
+  EXPECT_FALSE(parsed.Deserialize(V1Sidecar(100, {{50, ~0ull - 10}})));
+  EXPECT_TRUE(parsed.Deserialize(V1Sidecar(100, {{90, 10}})));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+TEST_F(CheckpointFileTest, SavesAndLoads) {
+  const UftpCheckpoint checkpoint = MakeCheckpoint(100, {{20, 30}});
+  ASSERT_TRUE(checkpoint.Save(filename_));
+
+  UftpCheckpoint loaded;
+  ASSERT_TRUE(loaded.Load(filename_));
+  EXPECT_EQ(loaded.SourceMtimeNs(), 1234u);
+  EXPECT_EQ(loaded.MissingRanges(), checkpoint.MissingRanges());
+  EXPECT_NE(access((UftpCheckpoint::PathFor(filename_) + ".tmp").c_str(),
+                   F_OK),
+            0);
+
+  UftpCheckpoint::Remove(filename_);
+  EXPECT_FALSE(loaded.Load(filename_));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+TEST_F(CheckpointFileTest, ShortSidecarDoesntLoad) {
+  ASSERT_TRUE(MakeCheckpoint(100, {{20, 30}}).Save(filename_));
+  const std::string path = UftpCheckpoint::PathFor(filename_);
+  ASSERT_EQ(truncate(path.c_str(), 30), 0);
+
+  UftpCheckpoint loaded;
+  EXPECT_FALSE(loaded.Load(filename_));
+}
@@ -0,0 +1,330 @@
+#include <dirent.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <cstdint>
+#include <fstream>
+#include <iterator>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include <uftp_defs.h>
+#include <uftp_delta.h>
+
+namespace {
+
+using Bytes = std::vector<uint8_t>;
+
+// Where the ops start in a delta, after its magic, block size, file length
+// and digest.
+constexpr std::size_t kDeltaHeaderLength = 48;
+
+///////////////////////////////////////////////////////////////////////////////
+Bytes RandomBytes(std::size_t length, uint32_t seed) {
+  std::mt19937 generator(seed);
+  Bytes bytes(length);
+  for (auto& byte : bytes) {
+    byte = generator();
+  }
+  return bytes;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+Bytes Concat(std::initializer_list<Bytes> parts) {
+  Bytes bytes;
+  for (const auto& part : parts) {
+    bytes.insert(bytes.end(), part.begin(), part.end());
+  }
+  return bytes;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+Bytes Slice(const Bytes& bytes, std::size_t offset, std::size_t length) {
+  return Bytes(bytes.begin() + offset, bytes.begin() + offset + length);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// An old and a new copy of a file in a directory of their own.
+class DeltaTest : public testing::Test {
+ protected:
+  void SetUp() override {
+    char dir[] = "/tmp/uftp_delta_test.XXXXXX";
+    ASSERT_NE(mkdtemp(dir), nullptr);
+    dir_ = dir;
+    old_filename_ = dir_ + "/old.bin";
+    new_filename_ = dir_ + "/new.bin";
+  }
+  void TearDown() override {
+    for (const auto& name : DirEntries()) {
+      unlink((dir_ + "/" + name).c_str());
+    }
+    rmdir(dir_.c_str());
+  }
+
+  static void WriteFile(const std::string& filename, const Bytes& bytes) {
+    std::ofstream file(filename, std::ios::binary | std::ios::trunc);
+    file.write(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+  }
+
+  static Bytes ReadFile(const std::string& filename) {
+    std::ifstream file(filename, std::ios::binary);
+    return Bytes(std::istreambuf_iterator<char>(file),
+                 std::istreambuf_iterator<char>());
+  }
+
+  std::vector<std::string> DirEntries() const {
+    std::vector<std::string> names;
+    DIR* dir = opendir(dir_.c_str());
+    if (dir == nullptr) {
+      return names;
+    }
+    while (const dirent* entry = readdir(dir)) {
+      const std::string name = entry->d_name;
+      if (name != "." && name != "..") {
+        names.push_back(name);
+      }
+    }
+    closedir(dir);
+    return names;
+  }
+
+  /// The delta that turns old_contents into new_contents.
+  UftpStatusCode Delta(const Bytes& old_contents, const Bytes& new_contents,
+                       Bytes& delta) {
+    WriteFile(old_filename_, old_contents);
+    WriteFile(new_filename_, new_contents);
+    Bytes signature;
+    const UftpStatusCode status =
+        UftpDelta::ComputeSignature(old_filename_, signature);
+    if (status != UftpStatusCode::NO_ERR) {
+      return status;
+    }
+    return UftpDelta::ComputeDelta(new_filename_, signature, delta);
+  }
+
+  UftpStatusCode Apply(const Bytes& delta) {
+    return UftpDelta::ApplyDelta(old_filename_, delta, UftpStreamBufferSize);
+  }
+
+  /// Rebuilds new_contents from old_contents and checks that only the old
+  /// and new copies are left behind.
+  void ExpectRoundTrip(const Bytes& old_contents, const Bytes& new_contents,
+                       Bytes& delta) {
+    ASSERT_EQ(Delta(old_contents, new_contents, delta),
+              UftpStatusCode::NO_ERR);
+    ASSERT_EQ(Apply(delta), UftpStatusCode::NO_ERR);
+    EXPECT_EQ(ReadFile(old_filename_), new_contents);
+    EXPECT_EQ(DirEntries().size(), 2u);
+  }
+
+  /// Applying delta fails and leaves the old copy as it was.
+  void ExpectRejected(const Bytes& delta, const Bytes& old_contents) {
+    EXPECT_NE(Apply(delta), UftpStatusCode::NO_ERR);
+    EXPECT_EQ(ReadFile(old_filename_), old_contents);
+    EXPECT_EQ(DirEntries().size(), 2u);
+  }
+
+  std::string dir_;
+  std::string old_filename_;
+  std::string new_filename_;
+};
+
+}  // namespace
+
+///////////////////////////////////////////////////////////////////////////////
+TEST_F(DeltaTest, IdenticalFilesNeedNoLiterals) {
+  const Bytes contents = RandomBytes(1 << 20, 1);
+  Bytes delta;
+  ExpectRoundTrip(contents, contents, delta);
+  // One copy of every block, nothing else.
+  EXPECT_EQ(delta.size(), kDeltaHeaderLength + 9);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+TEST_F(DeltaTest, Insertion) {
+  const Bytes old_contents = RandomBytes(1 << 20, 2);
+  const Bytes new_contents =
+      Concat({Slice(old_contents, 0, 300000), RandomBytes(777, 3),
+              Slice(old_contents, 300000, old_contents.size() - 300000)});
+  Bytes delta;
+  ExpectRoundTrip(old_contents, new_contents, delta);
+  EXPECT_LT(delta.size(), 8u << 10);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+TEST_F(DeltaTest, Deletion) {
+  const Bytes old_contents = RandomBytes(1 << 20, 4);
+  const Bytes new_contents =
+      Concat({Slice(old_contents, 0, 500000),
+              Slice(old_contents, 510000, old_contents.size() - 510000)});
+  Bytes delta;
+  ExpectRoundTrip(old_contents, new_contents, delta);
+  EXPECT_LT(delta.size(), 8u << 10);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+TEST_F(DeltaTest, ChangedBytes) {
+  const Bytes old_contents = RandomBytes(1 << 20, 5);
+  Bytes new_contents = old_contents;
+  for (const std::size_t offset : {0, 123456, 654321, (1 << 20) - 1}) {
+    new_contents[offset] ^= 0xff;
+  }
+  Bytes delta;
+  ExpectRoundTrip(old_contents, new_contents, delta);
+  EXPECT_LT(delta.size(), 16u << 10);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+TEST_F(DeltaTest, MovedBlocks) {
+  const Bytes old_contents = RandomBytes(1 << 20, 6);
+  const Bytes new_contents =
+      Concat({Slice(old_contents, 1 << 19, 1 << 19),
+              Slice(old_contents, 0, 1 << 19)});
+  Bytes delta;
+  ExpectRoundTrip(old_contents, new_contents, delta);
+  EXPECT_LT(delta.size(), 8u << 10);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+TEST_F(DeltaTest, AppendedAndTruncated) {
+  // Neither length is a whole number of blocks.
+  const Bytes old_contents = RandomBytes(1000003, 7);
+  const Bytes appended = Concat({old_contents, RandomBytes(5000, 8)});
+  Bytes delta;
+  ExpectRoundTrip(old_contents, appended, delta);
+  EXPECT_LT(delta.size(), 8u << 10);
+
+  const Bytes truncated = Slice(old_contents, 0, 600001);
+  ExpectRoundTrip(old_contents, truncated, delta);
+  EXPECT_LT(delta.size(), 8u << 10);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+TEST_F(DeltaTest, EmptyOldCopy) {
+  // Nothing to match, so the whole file is cheaper.
+  const Bytes new_contents = RandomBytes(100000, 9);
+  Bytes delta;
+  EXPECT_EQ(Delta({}, new_contents, delta),
+            UftpStatusCode::ERR_DELTA_TOO_LARGE);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+TEST_F(DeltaTest, DifferentFileIsTooLarge) {
+  Bytes delta;
+  EXPECT_EQ(Delta(RandomBytes(1 << 20, 10), RandomBytes(1 << 20, 11), delta),
+            UftpStatusCode::ERR_DELTA_TOO_LARGE);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+TEST_F(DeltaTest, MissingFiles) {
+  Bytes signature;
+  EXPECT_NE(UftpDelta::ComputeSignature(old_filename_, signature),
+            UftpStatusCode::NO_ERR);
+
+  Bytes delta;
+  ASSERT_EQ(Delta(RandomBytes(1 << 16, 12), RandomBytes(1 << 16, 12), delta),
+            UftpStatusCode::NO_ERR);
+  ASSERT_EQ(unlink(old_filename_.c_str()), 0);
+  EXPECT_NE(Apply(delta), UftpStatusCode::NO_ERR);
+  EXPECT_EQ(DirEntries().size(), 1u);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+TEST_F(DeltaTest, RejectsCorruptSignatures) {
+  const Bytes contents = RandomBytes(1 << 16, 13);
+  WriteFile(old_filename_, contents);
+  WriteFile(new_filename_, contents);
+  Bytes good;
+  ASSERT_EQ(UftpDelta::ComputeSignature(old_filename_, good),
+            UftpStatusCode::NO_ERR);
+  Bytes delta;
+
+  EXPECT_EQ(UftpDelta::ComputeDelta(new_filename_, {}, delta),
+            UftpStatusCode::ERR_BAD_COMMAND);
+
+  Bytes bad_magic = good;
+  bad_magic[0] ^= 0xff;
+  EXPECT_EQ(UftpDelta::ComputeDelta(new_filename_, bad_magic, delta),
+            UftpStatusCode::ERR_BAD_COMMAND);
+
+  Bytes no_block_size = good;
+  std::fill(no_block_size.begin() + 4, no_block_size.begin() + 8, 0);
+  EXPECT_EQ(UftpDelta::ComputeDelta(new_filename_, no_block_size, delta),
+            UftpStatusCode::ERR_BAD_COMMAND);
+
+  // More or fewer blocks than the header claims.
+  Bytes short_signature(good.begin(), good.end() - 1);
+  EXPECT_EQ(UftpDelta::ComputeDelta(new_filename_, short_signature, delta),
+            UftpStatusCode::ERR_BAD_COMMAND);
+  Bytes trailing = good;
+  trailing.push_back(0);
+  EXPECT_EQ(UftpDelta::ComputeDelta(new_filename_, trailing, delta),
+            UftpStatusCode::ERR_BAD_COMMAND);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+TEST_F(DeltaTest, RejectsCorruptDeltas) {
+  const Bytes old_contents = RandomBytes(1 << 17, 14);
+  Bytes new_contents = old_contents;
+  new_contents[1000] ^= 0xff;
+  Bytes good;
+  ASSERT_EQ(Delta(old_contents, new_contents, good), UftpStatusCode::NO_ERR);
+
+  // Every cut through the header and first ops, then a sample of the rest.
+  for (std::size_t length = 0; length < good.size();
+       length += length < kDeltaHeaderLength + 32 ? 1 : 37) {
+    SCOPED_TRACE(length);
+    ExpectRejected(Bytes(good.begin(), good.begin() + length), old_contents);
+  }
+
+  Bytes bad_magic = good;
+  bad_magic[0] ^= 0xff;
+  EXPECT_EQ(Apply(bad_magic), UftpStatusCode::ERR_BAD_COMMAND);
+
+  Bytes bad_digest = good;
+  bad_digest[16] ^= 0xff;
+  ExpectRejected(bad_digest, old_contents);
+
+  Bytes bad_op = good;
+  bad_op[kDeltaHeaderLength] = 0xee;
+  ExpectRejected(bad_op, old_contents);
+
+  Bytes trailing = good;
+  trailing.push_back(1);
+  ExpectRejected(trailing, old_contents);
+
+  // Still untouched, so the good one applies.
+  ASSERT_EQ(Apply(good), UftpStatusCode::NO_ERR);
+  EXPECT_EQ(ReadFile(old_filename_), new_contents);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+TEST_F(DeltaTest, RejectsCopiesPastTheOldCopy) {
+  // A whole number of the smallest blocks.
+  const Bytes old_contents = RandomBytes(700 * 100, 15);
+  Bytes delta;
+  ASSERT_EQ(Delta(old_contents, old_contents, delta), UftpStatusCode::NO_ERR);
+  ASSERT_EQ(delta.size(), kDeltaHeaderLength + 9);
+
+  // The file shrank after its signature was taken.
+  const Bytes shrunk = Slice(old_contents, 0, 700 * 50);
+  WriteFile(old_filename_, shrunk);
+  ExpectRejected(delta, shrunk);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+TEST_F(DeltaTest, RejectsChangedOldCopy) {
+  const Bytes old_contents = RandomBytes(1 << 20, 16);
+  Bytes new_contents = old_contents;
+  new_contents[0] ^= 0xff;
+  Bytes delta;
+  ASSERT_EQ(Delta(old_contents, new_contents, delta), UftpStatusCode::NO_ERR);
+
+  // Same length, different blocks, so only the digest catches it.
+  Bytes changed = old_contents;
+  changed[700000] ^= 0xff;
+  WriteFile(old_filename_, changed);
+  ExpectRejected(delta, changed);
+}
@@ -0,0 +1,237 @@
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include <uftp_buffer_pool.h>
+#include <uftp_defs.h>
+#include <uftp_meta.h>
+#include <uftp_utils.h>
+
+namespace {
+
+// The v2 wire format, as uftp_meta.cpp lays it out. Spelt out again here so
+// that a change to it shows up as a failing test.
+const std::vector<uint8_t> kV2Magic = {'U', 'F', 'T', '2'};
+enum Fields {
+  kStatus = 1 << 0,
+  kRange = 1 << 1,
+  kFileLength = 1 << 2,
+  kCommand = 1 << 3,
+  kArgument = 1 << 4,
+  kFileMtime = 1 << 5,
+};
+
+///////////////////////////////////////////////////////////////////////////////
+/// The fixed v2 header, sequence number 7, with fields to follow.
+std::vector<uint8_t> V2Header(uint8_t version, uint8_t opcode,
+                              uint8_t fields) {
+  std::vector<uint8_t> meta = kV2Magic;
+  meta.insert(meta.end(), {version, opcode, fields, 0, 7, 0, 0, 0});
+  return meta;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+UftpMessage MakeRequest(uint8_t version) {
+  UftpMessage message;
+  message.command = "get";
+  message.argument = "some_directory/some_file.bin";
+  message.version = version;
+  message.header.sequence_num = 42;
+  message.header.codecs = 1 << CODEC_DEFLATE;
+  message.header.range_offset = 1 << 20;
+  message.header.range_length = 300;
+  message.header.file_length = 1ull << 40;
+  message.file_mtime_ns = 1700000000123456789ull;
+  return message;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+std::vector<uint8_t> Serialize(UftpMessage message) {
+  UftpPooledBuffer meta;
+  UftpUtils::BuildMeta(message, meta);
+  return std::vector<uint8_t>(meta.begin(), meta.end());
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bool Parse(const std::vector<uint8_t>& meta, UftpMessage& message,
+           uint64_t message_length = 0) {
+  return UftpMeta::Parse(meta.data(), meta.size(), message_length, message);
+}
+
+}  // namespace
+
+///////////////////////////////////////////////////////////////////////////////
+TEST(MetaTest, RoundTripsEveryVersion) {
+  for (uint8_t version = UftpProtocolV1; version <= UftpProtocolV3;
+       ++version) {
+    SCOPED_TRACE(version);
+    const UftpMessage request = MakeRequest(version);
+    UftpMessage parsed;
+    ASSERT_TRUE(Parse(Serialize(request), parsed));
+
+    EXPECT_EQ(parsed.version, version);
+    EXPECT_EQ(parsed.command, "get");
+    EXPECT_EQ(parsed.opcode, OP_GET);
+    EXPECT_EQ(parsed.argument, request.argument);
+    EXPECT_EQ(parsed.header.sequence_num, 42u);
+    EXPECT_EQ(parsed.header.codecs, request.header.codecs);
+    EXPECT_EQ(parsed.header.range_offset, request.header.range_offset);
+    EXPECT_EQ(parsed.header.range_length, request.header.range_length);
+    EXPECT_EQ(parsed.header.file_length, request.header.file_length);
+    EXPECT_EQ(parsed.header.command_length, 3u);
+    EXPECT_EQ(parsed.header.argument_length, request.argument.size());
+    // Only v3 carries the mtime.
+    EXPECT_EQ(parsed.file_mtime_ns,
+              version >= UftpProtocolV3 ? request.file_mtime_ns : 0u);
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+TEST(MetaTest, RoundTripsStatusAndUnknownCommand) {
+  UftpMessage response;
+  response.command = "frobnicate";
+  response.version = UftpProtocolV2;
+  response.header.status_code = ERR_BAD_COMMAND;
+  UftpMessage parsed;
+  ASSERT_TRUE(Parse(Serialize(response), parsed));
+
+  EXPECT_EQ(parsed.command, "frobnicate");
+  EXPECT_EQ(parsed.opcode, OP_UNKNOWN);
+  EXPECT_EQ(parsed.argument, "");
+  EXPECT_EQ(parsed.header.status_code, (uint32_t)ERR_BAD_COMMAND);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+TEST(MetaTest, RoundTripsLongestStrings) {
+  UftpMessage request = MakeRequest(UftpProtocolV2);
+  request.argument.assign(0xffff, 'a');
+  UftpMessage parsed;
+  ASSERT_TRUE(Parse(Serialize(request), parsed));
+  EXPECT_EQ(parsed.argument, request.argument);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+TEST(MetaTest, LeavesZeroFieldsOut) {
+  UftpMessage request;
+  request.command = "ls";
+  request.version = UftpProtocolV2;
+  request.header.sequence_num = 7;
+  EXPECT_EQ(Serialize(request), V2Header(UftpProtocolV2, OP_LS, 0));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+TEST(MetaTest, RejectsEveryTruncation) {
+  for (uint8_t version = UftpProtocolV1; version <= UftpProtocolV3;
+       ++version) {
+    const std::vector<uint8_t> meta = Serialize(MakeRequest(version));
+    for (std::size_t length = 0; length < meta.size(); ++length) {
+      SCOPED_TRACE(testing::Message() << "version " << (int)version
+                                      << ", length " << length);
+      UftpMessage parsed;
+      EXPECT_FALSE(UftpMeta::Parse(meta.data(), length, 0, parsed));
+    }
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+TEST(MetaTest, RejectsTruncatedVarint) {
+  std::vector<uint8_t> meta = V2Header(UftpProtocolV2, OP_GET, kFileLength);
+  meta.insert(meta.end(), {0x80, 0x80});
+  UftpMessage parsed;
+  EXPECT_FALSE(Parse(meta, parsed));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+TEST(MetaTest, RejectsOverlongVarint) {
+  std::vector<uint8_t> meta = V2Header(UftpProtocolV2, OP_GET, kFileLength);
+  meta.insert(meta.end(), 10, 0x80);
+  meta.push_back(0x01);
+  UftpMessage parsed;
+  EXPECT_FALSE(Parse(meta, parsed));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+TEST(MetaTest, RejectsLengthPastTheEnd) {
+  std::vector<uint8_t> meta = V2Header(UftpProtocolV2, OP_GET, kArgument);
+  meta.insert(meta.end(), {5, 'a', 'b', 'c', 'd'});
+  UftpMessage parsed;
+  EXPECT_FALSE(Parse(meta, parsed));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+TEST(MetaTest, RejectsOversizedString) {
+  // 0x10000, one past the longest argument, with that many bytes following.
+  std::vector<uint8_t> meta = V2Header(UftpProtocolV2, OP_GET, kArgument);
+  meta.insert(meta.end(), {0x80, 0x80, 0x04});
+  meta.insert(meta.end(), 0x10000, 'a');
+  UftpMessage parsed;
+  EXPECT_FALSE(Parse(meta, parsed));
+
+  meta = V2Header(UftpProtocolV2, OP_UNKNOWN, kCommand);
+  meta.insert(meta.end(), {0x80, 0x80, 0x04});
+  meta.insert(meta.end(), 0x10000, 'a');
+  EXPECT_FALSE(Parse(meta, parsed));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+TEST(MetaTest, RejectsBadVersions) {
+  UftpMessage parsed;
+  for (const uint8_t version : {0, 1, 4, 0xff}) {
+    SCOPED_TRACE(version);
+    EXPECT_FALSE(Parse(V2Header(version, OP_LS, 0), parsed));
+  }
+  // The mtime is v3 only.
+  std::vector<uint8_t> meta = V2Header(UftpProtocolV2, OP_GET, kFileMtime);
+  meta.push_back(1);
+  EXPECT_FALSE(Parse(meta, parsed));
+  meta[4] = UftpProtocolV3;
+  EXPECT_TRUE(Parse(meta, parsed));
+  EXPECT_EQ(parsed.file_mtime_ns, 1u);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+TEST(MetaTest, RejectsTrailingBytes) {
+  UftpMessage parsed;
+  for (uint8_t version = UftpProtocolV1; version <= UftpProtocolV3;
+       ++version) {
+    SCOPED_TRACE(version);
+    std::vector<uint8_t> meta = Serialize(MakeRequest(version));
+    meta.push_back(0);
+    EXPECT_FALSE(Parse(meta, parsed));
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+TEST(MetaTest, RejectsUnknownMagic) {
+  std::vector<uint8_t> meta = Serialize(MakeRequest(UftpProtocolV2));
+  meta[0] ^= 0xff;
+  UftpMessage parsed;
+  EXPECT_FALSE(Parse(meta, parsed));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+TEST(MetaTest, V1MessageLengthMustMatch) {
+  UftpMessage request = MakeRequest(UftpProtocolV1);
+  request.message.assign(100, 0);
+  const std::vector<uint8_t> meta = Serialize(request);
+  UftpMessage parsed;
+  EXPECT_TRUE(Parse(meta, parsed, 100));
+  EXPECT_FALSE(Parse(meta, parsed, 99));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+TEST(MetaTest, V2TakesMessageLengthFromTransfer) {
+  UftpMessage parsed;
+  ASSERT_TRUE(Parse(Serialize(MakeRequest(UftpProtocolV2)), parsed, 1234));
+  EXPECT_EQ(parsed.header.message_length, 1234u);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+TEST(MetaTest, UnknownOpcodeHasNoCommand) {
+  UftpMessage parsed;
+  ASSERT_TRUE(Parse(V2Header(UftpProtocolV2, 0xee, 0), parsed));
+  EXPECT_EQ(parsed.opcode, OP_UNKNOWN);
+  EXPECT_EQ(parsed.command, "");
+}
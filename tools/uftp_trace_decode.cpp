@@ -0,0 +1,195 @@
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <uftp_trace.h>
+
+namespace {
+
+struct Site {
+  std::string file;
+  std::string func;
+  uint32_t line;
+  std::string format;
+  std::string types;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+/// Reads the dump in order, failing once it runs short.
+class DumpReader {
+ public:
+  explicit DumpReader(const std::vector<char>& dump) : dump_(dump) {}
+
+  bool Read(void* to, std::size_t length) {
+    if (dump_.size() - offset_ < length) {
+      return false;
+    }
+    std::memcpy(to, dump_.data() + offset_, length);
+    offset_ += length;
+    return true;
+  }
+
+  bool Read(std::string& to, std::size_t length) {
+    to.resize(length);
+    return Read(&to[0], length);
+  }
+
+ private:
+  const std::vector<char>& dump_;
+  std::size_t offset_ = 0;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+void FormatArg(std::string& line, char type, uint64_t raw) {
+  char text[32];
+  switch (type) {
+    case 'i':
+      std::snprintf(text, sizeof(text), "%" PRId64, (int64_t)raw);
+      break;
+    case 'f': {
+      double value;
+      std::memcpy(&value, &raw, sizeof(value));
+      std::snprintf(text, sizeof(text), "%g", value);
+      break;
+    }
+    case 'b':
+      std::snprintf(text, sizeof(text), "%s", raw ? "true" : "false");
+      break;
+    default:
+      std::snprintf(text, sizeof(text), "%" PRIu64, raw);
+      break;
+  }
+  line += text;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+std::string FormatEvent(const Site& site, const UftpTraceEvent& event) {
+  std::string line;
+  std::size_t arg = 0;
+  for (std::size_t pos = 0; pos < site.format.size(); ++pos) {
+    if (site.format.compare(pos, 2, "{}") == 0 && arg < site.types.size()) {
+      FormatArg(line, site.types[arg], event.args[arg]);
+      ++arg;
+      ++pos;
+    } else {
+      line += site.format[pos];
+    }
+  }
+  return line;
+}
+
+}  // namespace
+
+///////////////////////////////////////////////////////////////////////////////
+static void PrintUsage() {
+  std::cout << "uftp_trace_decode: missing argument\n\tUsage: "
+               "uftp_trace_decode <trace_file> [--last <count>]\n";
+  std::exit(1);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int main(int argc, char** argv) {
+  if (argc < 2 || argc % 2 != 0) {
+    PrintUsage();
+  }
+
+  const std::string trace_file = argv[1];
+  std::size_t last = 0;
+  for (int arg = 2; arg < argc; arg += 2) {
+    const std::string option = argv[arg];
+    if (option == "--last") {
+      last = std::strtoull(argv[arg + 1], nullptr, 10);
+    } else {
+      PrintUsage();
+    }
+  }
+
+  std::ifstream file(trace_file, std::ios::binary);
+  if (!file) {
+    std::cerr << "Couldn't open " << trace_file << std::endl;
+    std::exit(1);
+  }
+  const std::vector<char> dump((std::istreambuf_iterator<char>(file)),
+                               std::istreambuf_iterator<char>());
+  DumpReader reader(dump);
+
+  UftpTraceFileHeader file_header;
+  if (!reader.Read(&file_header, sizeof(file_header)) ||
+      std::memcmp(file_header.magic, UftpTraceMagic,
+                  sizeof(file_header.magic)) != 0) {
+    std::cerr << trace_file << " isn't a trace dump" << std::endl;
+    std::exit(1);
+  }
+
+  std::map<uint32_t, Site> sites;
+  for (uint32_t index = 0; index < file_header.num_sites; ++index) {
+    UftpTraceSiteHeader site_header;
+    Site site;
+    if (!reader.Read(&site_header, sizeof(site_header)) ||
+        !reader.Read(site.file, site_header.file_length) ||
+        !reader.Read(site.func, site_header.func_length) ||
+        !reader.Read(site.format, site_header.format_length) ||
+        !reader.Read(site.types, site_header.types_length)) {
+      std::cerr << trace_file << " is truncated" << std::endl;
+      std::exit(1);
+    }
+    site.line = site_header.line;
+    sites[site_header.id] = site;
+  }
+
+  // Every thread's events, merged into one timeline. A crash can cut the
+  // last ring short, what's there is still worth showing.
+  std::vector<UftpTraceEvent> events;
+  for (uint32_t index = 0; index < file_header.num_rings; ++index) {
+    UftpTraceRingHeader ring_header;
+    if (!reader.Read(&ring_header, sizeof(ring_header))) {
+      break;
+    }
+    UftpTraceEvent event;
+    for (uint64_t num_read = 0; num_read < ring_header.num_events &&
+                                reader.Read(&event, sizeof(event));
+         ++num_read) {
+      events.push_back(event);
+    }
+  }
+  std::stable_sort(events.begin(), events.end(),
+                   [](const UftpTraceEvent& a, const UftpTraceEvent& b) {
+                     return a.timestamp < b.timestamp;
+                   });
+  if (last != 0 && events.size() > last) {
+    events.erase(events.begin(), events.end() - last);
+  }
+
+  // Timestamp counter ticks to milliseconds since the process started.
+  const double ms_per_tick =
+      file_header.dump_timestamp > file_header.start_timestamp
+          ? (file_header.dump_ns - file_header.start_ns) / 1e6 /
+                (file_header.dump_timestamp - file_header.start_timestamp)
+          : 1e-6;
+  const auto to_ms = [&file_header, ms_per_tick](uint64_t timestamp) {
+    return (int64_t)(timestamp - file_header.start_timestamp) * ms_per_tick;
+  };
+
+  for (const UftpTraceEvent& event : events) {
+    const auto site_it = sites.find(event.site);
+    std::printf("%.3f %u ", to_ms(event.timestamp), event.tid);
+    if (site_it == sites.end()) {
+      std::printf("[unknown site %u]\n", event.site);
+      continue;
+    }
+    const Site& site = site_it->second;
+    std::printf("[%s::%s.%u] %s\n", site.file.c_str(), site.func.c_str(),
+                site.line, FormatEvent(site, event).c_str());
+  }
+  std::printf("%zu events, dumped at %.3f\n", events.size(),
+              to_ms(file_header.dump_timestamp));
+  std::exit(0);
+}